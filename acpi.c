@@ -0,0 +1,231 @@
+// Stub-side ACPI table discovery. Everything the kernel needs is copied into
+// BootInfo before ExitBootServices, so the kernel never parses ACPI itself.
+
+#include "efi.h"
+#include "acpi.h"
+#include "boot_info.h"
+
+#define LAPIC_DEFAULT_BASE 0xFEE00000
+
+bool acpi_checksum_ok(void *table, size_t length) {
+	uint8_t sum = 0;
+	for (size_t i = 0; i < length; i++) {
+		sum += ((uint8_t *)table)[i];
+	}
+	return sum == 0;
+}
+
+bool guid_equal(EFI_GUID *a, EFI_GUID *b) {
+	return memcmp(a, b, sizeof(EFI_GUID)) == 0;
+}
+
+// Prefers the ACPI 2.0 entry, which carries the XSDT
+AcpiRsdp *acpi_find_rsdp(EFI_SYSTEM_TABLE *st) {
+	EFI_GUID acpi20_guid = EFI_ACPI_20_TABLE_GUID;
+	EFI_GUID acpi10_guid = EFI_ACPI_10_TABLE_GUID;
+
+	AcpiRsdp *rsdp = NULL;
+	for (size_t i = 0; i < st->NumberOfTableEntries; i++) {
+		EFI_CONFIGURATION_TABLE *table = &st->ConfigurationTable[i];
+		if (guid_equal(&table->VendorGuid, &acpi20_guid)) {
+			return (AcpiRsdp *)table->VendorTable;
+		}
+		if (guid_equal(&table->VendorGuid, &acpi10_guid)) {
+			rsdp = (AcpiRsdp *)table->VendorTable;
+		}
+	}
+	return rsdp;
+}
+
+AcpiSdtHeader *acpi_find_table(AcpiRsdp *rsdp, char *signature) {
+	if (!rsdp || !acpi_checksum_ok(rsdp, 20)) {
+		return NULL;
+	}
+
+	bool xsdt = rsdp->revision >= 2 && rsdp->xsdt_addr;
+	AcpiSdtHeader *root = (AcpiSdtHeader *)(xsdt ? rsdp->xsdt_addr : (uint64_t)rsdp->rsdt_addr);
+	size_t entry_size = xsdt ? sizeof(uint64_t) : sizeof(uint32_t);
+	size_t count = (root->length - sizeof(AcpiSdtHeader)) / entry_size;
+
+	char *entries = (char *)(root + 1);
+	for (size_t i = 0; i < count; i++) {
+		uint64_t addr = 0;
+		memcpy(&addr, entries + i * entry_size, entry_size);
+
+		AcpiSdtHeader *table = (AcpiSdtHeader *)addr;
+		if (table && memcmp(table->signature, signature, 4) == 0 && acpi_checksum_ok(table, table->length)) {
+			return table;
+		}
+	}
+	return NULL;
+}
+
+void acpi_add_cpu(BootInfo *info, uint32_t apic_id) {
+	if (info->cpu_count < MAX_CPUS) {
+		info->cpu_apic_ids[info->cpu_count++] = apic_id;
+	}
+}
+
+// Collects every enabled local APIC from the MADT. Without one the kernel
+// still gets a single CPU and the architectural LAPIC base
+void acpi_parse_madt(AcpiRsdp *rsdp, BootInfo *info) {
+	info->lapic_base = LAPIC_DEFAULT_BASE;
+	info->cpu_count = 0;
+
+	AcpiMadt *madt = (AcpiMadt *)acpi_find_table(rsdp, "APIC");
+	if (!madt) {
+		acpi_add_cpu(info, 0);
+		return;
+	}
+	info->lapic_base = madt->lapic_addr;
+
+	char *cur = (char *)(madt + 1);
+	char *end = (char *)madt + madt->header.length;
+	while (cur + sizeof(AcpiSubtable) <= end) {
+		AcpiSubtable *sub = (AcpiSubtable *)cur;
+		if (sub->length < sizeof(AcpiSubtable) || cur + sub->length > end) {
+			break;
+		}
+
+		switch (sub->type) {
+			case MADT_LAPIC: {
+				MadtLapic *lapic = (MadtLapic *)sub;
+				if (lapic->flags & MADT_CPU_ENABLED) {
+					acpi_add_cpu(info, lapic->apic_id);
+				}
+			} break;
+			case MADT_X2APIC: {
+				MadtX2apic *x2apic = (MadtX2apic *)sub;
+				if (x2apic->flags & MADT_CPU_ENABLED) {
+					acpi_add_cpu(info, x2apic->x2apic_id);
+				}
+			} break;
+			case MADT_LAPIC_OVERRIDE: {
+				info->lapic_base = ((MadtLapicOverride *)sub)->lapic_addr;
+			} break;
+		}
+		cur += sub->length;
+	}
+
+	if (info->cpu_count == 0) {
+		acpi_add_cpu(info, 0);
+	}
+}
+
+#define MAX_NUMA_RANGES 64
+
+// Page aligned [base, limit) with its dense node id
+typedef struct {
+	uint64_t base, limit;
+	uint32_t node;
+} NumaRange;
+
+// SRAT memory ranges sorted by base. They stay in the stub, mem_regions_build
+// splits the final memory map along them after ExitBootServices
+NumaRange numa_ranges[MAX_NUMA_RANGES];
+size_t numa_range_count;
+
+// Dense node id for a proximity domain, handing out a new one on first sight.
+// Domains past MAX_NUMA_NODES are folded into node 0
+uint32_t acpi_numa_node(BootInfo *info, uint32_t domain) {
+	for (uint32_t i = 0; i < info->numa_node_count; i++) {
+		if (info->numa_domains[i] == domain) {
+			return i;
+		}
+	}
+	if (info->numa_node_count == MAX_NUMA_NODES) {
+		return 0;
+	}
+	info->numa_domains[info->numa_node_count] = domain;
+	return info->numa_node_count++;
+}
+
+void acpi_numa_cpu(BootInfo *info, uint32_t apic_id, uint32_t domain) {
+	uint32_t node = acpi_numa_node(info, domain);
+	for (uint32_t i = 0; i < info->cpu_count; i++) {
+		if (info->cpu_apic_ids[i] == apic_id) {
+			info->cpu_nodes[i] = node;
+		}
+	}
+}
+
+void acpi_numa_range(BootInfo *info, uint64_t base, uint64_t length, uint32_t domain) {
+	uint32_t node = acpi_numa_node(info, domain);
+	uint64_t limit = (base + length) & ~(uint64_t)(EFI_PAGE_SIZE - 1);
+	base &= ~(uint64_t)(EFI_PAGE_SIZE - 1);
+	if (base >= limit || numa_range_count == MAX_NUMA_RANGES) {
+		return;
+	}
+
+	size_t i = numa_range_count++;
+	for (; i > 0 && numa_ranges[i - 1].base > base; i--) {
+		numa_ranges[i] = numa_ranges[i - 1];
+	}
+	numa_ranges[i] = (NumaRange){ .base = base, .limit = limit, .node = node };
+}
+
+// Fills the node tables in BootInfo from the SRAT and SLIT. Runs after
+// acpi_parse_madt, CPUs are matched to nodes by APIC id. Pairs the SLIT
+// doesn't cover get the usual local and remote defaults
+void acpi_parse_numa(AcpiRsdp *rsdp, BootInfo *info) {
+	info->numa_node_count = 0;
+	numa_range_count = 0;
+	memset(info->cpu_nodes, 0, sizeof(info->cpu_nodes));
+
+	AcpiSrat *srat = (AcpiSrat *)acpi_find_table(rsdp, "SRAT");
+	if (srat) {
+		char *cur = (char *)(srat + 1);
+		char *end = (char *)srat + srat->header.length;
+		while (cur + sizeof(AcpiSubtable) <= end) {
+			AcpiSubtable *sub = (AcpiSubtable *)cur;
+			if (sub->length < sizeof(AcpiSubtable) || cur + sub->length > end) {
+				break;
+			}
+
+			switch (sub->type) {
+				case SRAT_LAPIC_AFFINITY: {
+					SratLapicAffinity *cpu = (SratLapicAffinity *)sub;
+					if (cpu->flags & SRAT_ENABLED) {
+						uint32_t domain = cpu->domain_lo | (cpu->domain_hi[0] << 8) | (cpu->domain_hi[1] << 16) | ((uint32_t)cpu->domain_hi[2] << 24);
+						acpi_numa_cpu(info, cpu->apic_id, domain);
+					}
+				} break;
+				case SRAT_X2APIC_AFFINITY: {
+					SratX2apicAffinity *cpu = (SratX2apicAffinity *)sub;
+					if (cpu->flags & SRAT_ENABLED) {
+						acpi_numa_cpu(info, cpu->x2apic_id, cpu->domain);
+					}
+				} break;
+				case SRAT_MEMORY_AFFINITY: {
+					SratMemoryAffinity *mem = (SratMemoryAffinity *)sub;
+					if ((mem->flags & SRAT_ENABLED) && mem->length) {
+						acpi_numa_range(info, mem->base, mem->length, mem->domain);
+					}
+				} break;
+			}
+			cur += sub->length;
+		}
+	}
+
+	if (info->numa_node_count == 0) {
+		info->numa_node_count = 1;
+		info->numa_domains[0] = 0;
+	}
+
+	AcpiSlit *slit = (AcpiSlit *)acpi_find_table(rsdp, "SLIT");
+	uint64_t n = slit ? slit->locality_count : 0;
+	if (slit && sizeof(AcpiSlit) + n * n > slit->header.length) {
+		n = 0;
+	}
+	uint8_t *matrix = (uint8_t *)(slit + 1);
+	for (uint32_t i = 0; i < info->numa_node_count; i++) {
+		for (uint32_t j = 0; j < info->numa_node_count; j++) {
+			uint32_t di = info->numa_domains[i], dj = info->numa_domains[j];
+			uint8_t distance = i == j ? NUMA_LOCAL_DISTANCE : NUMA_REMOTE_DISTANCE;
+			if (di < n && dj < n) {
+				distance = matrix[di * n + dj];
+			}
+			info->numa_distance[i][j] = distance;
+		}
+	}
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <stdint.h>
+
+typedef struct __attribute__((packed)) {
+	char signature[8];
+	uint8_t checksum;
+	char oem_id[6];
+	uint8_t revision;
+	uint32_t rsdt_addr;
+
+	// Revision 2+
+	uint32_t length;
+	uint64_t xsdt_addr;
+	uint8_t ext_checksum;
+	uint8_t reserved[3];
+} AcpiRsdp;
+
+typedef struct __attribute__((packed)) {
+	char signature[4];
+	uint32_t length;
+	uint8_t revision;
+	uint8_t checksum;
+	char oem_id[6];
+	char oem_table_id[8];
+	uint32_t oem_revision;
+	uint32_t creator_id;
+	uint32_t creator_revision;
+} AcpiSdtHeader;
+
+typedef struct __attribute__((packed)) {
+	uint8_t type;
+	uint8_t length;
+} AcpiSubtable;
+
+typedef struct __attribute__((packed)) {
+	AcpiSdtHeader header;
+	uint32_t lapic_addr;
+	uint32_t flags;
+} AcpiMadt;
+
+#define MADT_LAPIC 0
+#define MADT_LAPIC_OVERRIDE 5
+#define MADT_X2APIC 9
+
+#define MADT_CPU_ENABLED (1 << 0)
+
+typedef struct __attribute__((packed)) {
+	AcpiSubtable sub;
+	uint8_t processor_id;
+	uint8_t apic_id;
+	uint32_t flags;
+} MadtLapic;
+
+typedef struct __attribute__((packed)) {
+	AcpiSubtable sub;
+	uint16_t reserved;
+	uint64_t lapic_addr;
+} MadtLapicOverride;
+
+typedef struct __attribute__((packed)) {
+	AcpiSubtable sub;
+	uint16_t reserved;
+	uint32_t x2apic_id;
+	uint32_t flags;
+	uint32_t processor_uid;
+} MadtX2apic;
+
+typedef struct __attribute__((packed)) {
+	AcpiSdtHeader header;
+	uint32_t table_revision;
+	uint64_t reserved;
+} AcpiSrat;
+
+#define SRAT_LAPIC_AFFINITY 0
+#define SRAT_MEMORY_AFFINITY 1
+#define SRAT_X2APIC_AFFINITY 2
+
+// Same bit for all three entry types
+#define SRAT_ENABLED (1 << 0)
+
+typedef struct __attribute__((packed)) {
+	AcpiSubtable sub;
+	uint8_t domain_lo;
+	uint8_t apic_id;
+	uint32_t flags;
+	uint8_t sapic_eid;
+	uint8_t domain_hi[3];
+	uint32_t clock_domain;
+} SratLapicAffinity;
+
+typedef struct __attribute__((packed)) {
+	AcpiSubtable sub;
+	uint32_t domain;
+	uint16_t reserved0;
+	uint64_t base;
+	uint64_t length;
+	uint32_t reserved1;
+	uint32_t flags;
+	uint64_t reserved2;
+} SratMemoryAffinity;
+
+typedef struct __attribute__((packed)) {
+	AcpiSubtable sub;
+	uint16_t reserved0;
+	uint32_t domain;
+	uint32_t x2apic_id;
+	uint32_t flags;
+	uint32_t clock_domain;
+	uint32_t reserved1;
+} SratX2apicAffinity;
+
+// Followed by a locality_count x locality_count byte matrix indexed by proximity domain
+typedef struct __attribute__((packed)) {
+	AcpiSdtHeader header;
+	uint64_t locality_count;
+} AcpiSlit;
+
+#define NUMA_LOCAL_DISTANCE 10
+#define NUMA_REMOTE_DISTANCE 20
@@ -0,0 +1,55 @@
+set -o pipefail
+
+# Boots $ISO (bin/cdimage.iso by default) headless `runs` times and reports p50/p99 per boot phase,
+# taken from the trace dump the kernel writes to the serial port.
+# Usage: ./bench_boot.sh [runs] [cpus]
+runs=${1:-20}
+cpus=${2:-1}
+OVMF=${OVMF:-/usr/share/ovmf/OVMF.fd}
+TIMEOUT=${TIMEOUT:-60}
+ISO=${ISO:-bin/cdimage.iso}
+
+out=$(mktemp -d)
+trap 'rm -rf "$out"' EXIT
+
+for i in $(seq 1 "$runs"); do
+	log="$out/run$i.log"
+	: > "$log"
+	qemu-system-x86_64 -bios "$OVMF" -cdrom "$ISO" -m 512M -smp "$cpus" -net none \
+		-display none -monitor none -serial file:"$log" &
+	pid=$!
+
+	for _ in $(seq 1 $(( TIMEOUT * 10 ))); do
+		grep -q '^trace end' "$log" && break
+		sleep 0.1
+	done
+	kill "$pid" 2>/dev/null
+	wait "$pid" 2>/dev/null
+
+	if ! grep -q '^trace end' "$log"; then
+		echo "run $i: no trace within ${TIMEOUT}s" >&2
+		continue
+	fi
+
+	# "order phase ns" per event, plus the whole boot as one more phase
+	tr -d '\r' < "$log" | awk '
+		$1 == "trace" && $2 != "end" { n++; print n, $2 "[" $3 "]", $5; total = $4 }
+		END { print n + 1, "total", total }
+	'
+done > "$out/samples"
+
+# Nearest-rank percentiles per phase, listed in boot order
+sort -k2,2 -k3,3n "$out/samples" | awk '
+	function flush() {
+		if (n == 0) return
+		p50 = int(n * 0.50 + 0.999999) - 1
+		p99 = int(n * 0.99 + 0.999999) - 1
+		printf "%d %s %.1f %.1f %d\n", order, phase, vals[p50] / 1000, vals[p99] / 1000, n
+	}
+	$2 != phase { flush(); phase = $2; n = 0; order = $1 }
+	{ vals[n++] = $3; if ($1 < order) order = $1 }
+	END { flush() }
+' | sort -n | awk '
+	BEGIN { printf "%-28s %12s %12s %6s\n", "phase", "p50 us", "p99 us", "runs" }
+	{ printf "%-28s %12s %12s %6s\n", $2, $3, $4, $5 }
+'
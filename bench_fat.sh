@@ -0,0 +1,29 @@
+set -e -o pipefail
+
+# Compares boot file reads through the firmware's SimpleFS driver against the
+# stub's direct FAT reader, on a kernel padded out to `pad_mb` MiB. Both images
+# ship raw files so the read itself is what's measured, not LZ4 decoding.
+# Usage: ./bench_fat.sh [runs] [pad_mb]
+runs=${1:-10}
+pad_mb=${2:-16}
+
+isos=$(mktemp -d)
+trap 'rm -rf "$isos"' EXIT
+
+export KERNEL_CFLAGS="-DKERNEL_PAD_BYTES=$(( pad_mb * 1024 * 1024 ))"
+for mode in fat simplefs; do
+	if [ "$mode" = simplefs ]; then
+		export STUB_CFLAGS=-DLUNK_FORCE_SIMPLEFS
+	else
+		export STUB_CFLAGS=
+	fi
+	./build.sh > "$isos/build-$mode.log" 2>&1
+	RAW=1 ./make_iso.sh > "$isos/iso-$mode.log" 2>&1
+	cp bin/cdimage.iso "$isos/$mode.iso"
+done
+
+# volume_open's arg says which path the stub actually took, 1 for FAT
+for mode in fat simplefs; do
+	echo "== $mode, $(( pad_mb )) MiB kernel, $runs runs"
+	ISO="$isos/$mode.iso" ./bench_boot.sh "$runs" | grep -E 'phase|volume_open|file_read|total'
+done
@@ -0,0 +1,84 @@
+set -o pipefail
+
+# Builds a kernel with -DKEXEC_BENCH and an initrd carrying a copy of it, boots
+# it headless and lets it warm reboot into itself KEXEC_BENCH_ROUNDS times.
+# Each reboot's trace starts at kexec_load in the old kernel. This prints
+# p50/p99 per phase across the rounds, with the cold boot's total for scale,
+# and fails unless every boot, warm ones included, brought all the APs back.
+# Usage: ./bench_kexec.sh [cpus] [qemu args...]
+cpus=${1:-4}
+[ $# -gt 0 ] && shift
+OVMF=${OVMF:-/usr/share/ovmf/OVMF.fd}
+TIMEOUT=${TIMEOUT:-120}
+
+command -v qemu-system-x86_64 > /dev/null || { echo "qemu-system-x86_64 not found" >&2; exit 1; }
+[ -f "$OVMF" ] || { echo "no OVMF at $OVMF, set OVMF=" >&2; exit 1; }
+
+KERNEL_CFLAGS="$KERNEL_CFLAGS -DKEXEC_BENCH" ./build.sh > /dev/null 2>&1 || { echo "build failed" >&2; exit 1; }
+
+out=$(mktemp -d)
+trap 'rm -rf "$out"' EXIT
+
+# The kernel reboots into the initrd's kernel.elf, next to whatever initrd/ holds
+mkdir "$out/initrd"
+[ -d initrd ] && cp -r initrd/. "$out/initrd"
+cp bin/kernel.elf "$out/initrd"
+tar --format=ustar -C "$out/initrd" -cf bin/initrd.img . || exit 1
+bin/lz4pack bin/initrd.img bin/initrd.img.lz4 || exit 1
+./make_iso.sh > /dev/null 2>&1 || { echo "make_iso failed" >&2; exit 1; }
+
+log="$out/serial.log"
+qemu-system-x86_64 -bios "$OVMF" -cdrom bin/cdimage.iso -m 512M -smp "$cpus" -net none \
+	-display none -monitor none -serial file:"$log" "$@" &
+pid=$!
+
+for _ in $(seq 1 $(( TIMEOUT * 10 ))); do
+	grep -q '^kexec_bench end' "$log" && break
+	sleep 0.1
+done
+kill "$pid" 2>/dev/null
+wait "$pid" 2>/dev/null
+
+if ! grep -q '^kexec_bench end' "$log"; then
+	echo "no result within ${TIMEOUT}s" >&2
+	tr -d '\r' < "$log" | grep '^kexec_bench' >&2
+	exit 1
+fi
+
+# kernel_main prints "lunk: N of M CPUs online" on every boot, the cold one first
+tr -d '\r' < "$log" | awk -v cpus="$cpus" '
+	$1 == "lunk:" && $3 == "of" && $5 == "CPUs" {
+		boots++
+		if ($2 != $4) { printf "boot %d: %d of %d CPUs online\n", boots - 1, $2, $4; bad++ }
+		online = $4
+	}
+	END {
+		if (!bad) printf "%d boots (%d warm) with -smp %d, all %d CPUs online each time\n", boots, boots - 1, cpus, online
+		exit bad > 0 || boots < 2
+	}
+' || { echo "not every boot brought all CPUs online" >&2; exit 1; }
+
+# "order phase ns" per event of every warm boot, and the cold boot's total
+tr -d '\r' < "$log" | awk '
+	$1 == "trace" && $2 == "kexec_load" { warm = 1; n = 0 }
+	# kexec_load carries the round number, the rest line up across rounds
+	$1 == "trace" && $2 != "end" { n++; total = $4; if (warm) print n, ($2 == "kexec_load" ? $2 : $2 "[" $3 "]"), $5 }
+	$1 == "trace" && $2 == "end" { if (warm) print n + 1, "total", total; else cold = total; warm = 0 }
+	END { if (cold) print 0, "cold_boot_total", cold }
+' > "$out/samples"
+
+# Nearest-rank percentiles per phase, listed in boot order
+sort -k2,2 -k3,3n "$out/samples" | awk '
+	function flush() {
+		if (n == 0) return
+		p50 = int(n * 0.50 + 0.999999) - 1
+		p99 = int(n * 0.99 + 0.999999) - 1
+		printf "%d %s %.1f %.1f %d\n", order, phase, vals[p50] / 1000, vals[p99] / 1000, n
+	}
+	$2 != phase { flush(); phase = $2; n = 0; order = $1 }
+	{ vals[n++] = $3; if ($1 < order) order = $1 }
+	END { flush() }
+' | sort -n | awk '
+	BEGIN { printf "%-28s %12s %12s %6s\n", "phase", "p50 us", "p99 us", "runs" }
+	{ printf "%-28s %12s %12s %6s\n", $2, $3, $4, $5 }
+'
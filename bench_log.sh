@@ -0,0 +1,50 @@
+set -o pipefail
+
+# Builds a kernel with -DLOG_BENCH, boots it headless with the serial port
+# captured to a file and prints the writer-side cost of a log record and the
+# time to drain a ringful over serial. The capture is run through logdecode,
+# every record the kernel wrote has to come back out of it.
+# Usage: ./bench_log.sh [cpus] [qemu args...]
+cpus=${1:-4}
+[ $# -gt 0 ] && shift
+OVMF=${OVMF:-/usr/share/ovmf/OVMF.fd}
+TIMEOUT=${TIMEOUT:-120}
+
+KERNEL_CFLAGS="$KERNEL_CFLAGS -DLOG_BENCH" ./build.sh > /dev/null 2>&1 || { echo "build failed" >&2; exit 1; }
+./make_iso.sh > /dev/null 2>&1 || { echo "make_iso failed" >&2; exit 1; }
+
+out=$(mktemp -d)
+trap 'rm -rf "$out"' EXIT
+
+log="$out/serial.log"
+qemu-system-x86_64 -bios "$OVMF" -cdrom bin/cdimage.iso -m 512M -smp "$cpus" -net none \
+	-display none -monitor none -serial file:"$log" "$@" &
+pid=$!
+
+for _ in $(seq 1 $(( TIMEOUT * 10 ))); do
+	grep -aq '^log_bench end' "$log" && break
+	sleep 0.1
+done
+kill "$pid" 2>/dev/null
+wait "$pid" 2>/dev/null
+
+if ! grep -aq '^log_bench end' "$log"; then
+	echo "no result within ${TIMEOUT}s" >&2
+	exit 1
+fi
+
+bin/logdecode "$log" | tr -d '\r' > "$out/decoded" || exit 1
+grep '^log_bench' "$out/decoded"
+grep ' cpu[0-9]* \(stub\|loader\|smp\):' "$out/decoded"
+
+awk '
+	$1 == "log_bench" && $2 == "round" { written += $4; write_ns += $6; flush_ns += $9; rounds++ }
+	/\] cpu[0-9]+ log_bench: / { decoded++ }
+	/\] cpu[0-9]+ log: [0-9]+ records dropped/ { sub(/.* log: /, ""); dropped += $1 }
+	END {
+		if (rounds == 0) exit 1
+		printf "write %.1f ns/record, drain %.1f us/record over %d rounds\n", write_ns / written, flush_ns / written / 1000, rounds
+		printf "decoded %d of %d records, %d reported dropped\n", decoded, written, dropped
+		exit decoded != written
+	}
+' "$out/decoded"
@@ -0,0 +1,36 @@
+set -o pipefail
+
+# Builds a kernel with -DSCHED_BENCH, boots it headless on `cpus` CPUs and prints
+# the fork-join scaling table (parallel page zeroing with 1..cpus workers).
+# Usage: ./bench_sched.sh [cpus]
+cpus=${1:-4}
+OVMF=${OVMF:-/usr/share/ovmf/OVMF.fd}
+TIMEOUT=${TIMEOUT:-120}
+
+KERNEL_CFLAGS="$KERNEL_CFLAGS -DSCHED_BENCH" ./build.sh > /dev/null 2>&1 || { echo "build failed" >&2; exit 1; }
+./make_iso.sh > /dev/null 2>&1 || { echo "make_iso failed" >&2; exit 1; }
+
+log=$(mktemp)
+trap 'rm -f "$log"' EXIT
+
+qemu-system-x86_64 -bios "$OVMF" -cdrom bin/cdimage.iso -m 512M -smp "$cpus" -net none \
+	-display none -monitor none -serial file:"$log" &
+pid=$!
+
+for _ in $(seq 1 $(( TIMEOUT * 10 ))); do
+	grep -q '^sched_bench end' "$log" && break
+	sleep 0.1
+done
+kill "$pid" 2>/dev/null
+wait "$pid" 2>/dev/null
+
+if ! grep -q '^sched_bench end' "$log"; then
+	echo "no result within ${TIMEOUT}s" >&2
+	exit 1
+fi
+
+tr -d '\r' < "$log" | awk '
+	$1 == "sched_bench" && $2 == "cpus" { printf "%4s cpus %12.1f us %8sx\n", $3, $5 / 1000, $7 }
+	$1 == "sched_bench" && $2 == "cpu" { print "  " substr($0, 13) }
+	$1 == "sched_bench" && $2 == "end" { print "  idle " substr($4, 2) }
+'
@@ -0,0 +1,37 @@
+set -o pipefail
+
+# Builds a kernel with -DTIMER_BENCH, boots it headless and prints the timer
+# wakeup latency (deadline to callback) and its histogram. Extra arguments go
+# to qemu, e.g. ./bench_timer.sh -enable-kvm -cpu host for TSC-deadline mode.
+# Usage: ./bench_timer.sh [qemu args...]
+OVMF=${OVMF:-/usr/share/ovmf/OVMF.fd}
+TIMEOUT=${TIMEOUT:-120}
+
+KERNEL_CFLAGS="$KERNEL_CFLAGS -DTIMER_BENCH" ./build.sh > /dev/null 2>&1 || { echo "build failed" >&2; exit 1; }
+./make_iso.sh > /dev/null 2>&1 || { echo "make_iso failed" >&2; exit 1; }
+
+log=$(mktemp)
+trap 'rm -f "$log"' EXIT
+
+qemu-system-x86_64 -bios "$OVMF" -cdrom bin/cdimage.iso -m 512M -smp 1 -net none \
+	-display none -monitor none -serial file:"$log" "$@" &
+pid=$!
+
+for _ in $(seq 1 $(( TIMEOUT * 10 ))); do
+	grep -q '^timer_bench end' "$log" && break
+	sleep 0.1
+done
+kill "$pid" 2>/dev/null
+wait "$pid" 2>/dev/null
+
+if ! grep -q '^timer_bench end' "$log"; then
+	echo "no result within ${TIMEOUT}s" >&2
+	exit 1
+fi
+
+tr -d '\r' < "$log" | awk '
+	$1 == "timer_bench" && $2 == "fired" { print "fired " $3 ", " $5 " interrupts, " $7 " cascaded" }
+	$1 == "timer_bench" && $2 == "latency" { printf "latency us  min %.3f  mean %.3f  max %.3f  stddev %.3f\n", $4 / 1000, $6 / 1000, $8 / 1000, $10 / 1000 }
+	$1 == "timer_bench" && $2 == "hist" { printf "  >= %10.3f us %8s\n", $3 / 1000, $4 }
+	$1 == "timer_bench" && $2 == "end" { print "mode " substr($0, 18) }
+'
@@ -0,0 +1,47 @@
+set -o pipefail
+
+# Builds a kernel with -DVM_BENCH, boots it headless on `cpus` CPUs and prints
+# the address space switch cost with PCID tags kept and with a flush on every
+# switch, then the unmap cost with the other CPUs on the same space, flushed as
+# one batch per 64 pages and page by page. Extra arguments go to qemu, the
+# default -cpu max gives TCG guests PCID and INVPCID.
+# Usage: ./bench_vm.sh [cpus] [qemu args...]
+cpus=${1:-4}
+[ $# -gt 0 ] && shift
+[ $# -eq 0 ] && set -- -cpu max
+OVMF=${OVMF:-/usr/share/ovmf/OVMF.fd}
+TIMEOUT=${TIMEOUT:-120}
+
+KERNEL_CFLAGS="$KERNEL_CFLAGS -DVM_BENCH" ./build.sh > /dev/null 2>&1 || { echo "build failed" >&2; exit 1; }
+./make_iso.sh > /dev/null 2>&1 || { echo "make_iso failed" >&2; exit 1; }
+
+log=$(mktemp)
+trap 'rm -f "$log"' EXIT
+
+qemu-system-x86_64 -bios "$OVMF" -cdrom bin/cdimage.iso -m 512M -smp "$cpus" -net none \
+	-display none -monitor none -serial file:"$log" "$@" &
+pid=$!
+
+for _ in $(seq 1 $(( TIMEOUT * 10 ))); do
+	grep -q '^vm_bench end' "$log" && break
+	sleep 0.1
+done
+kill "$pid" 2>/dev/null
+wait "$pid" 2>/dev/null
+
+if ! grep -q '^vm_bench end' "$log"; then
+	echo "no result within ${TIMEOUT}s" >&2
+	tr -d '\r' < "$log" | grep '^vm_bench' >&2
+	exit 1
+fi
+
+tr -d '\r' < "$log" | awk '
+	$1 == "vm_bench" && $2 == "switch" {
+		printf "switch + %s page reads  %8s ns tagged %8s ns flushed\n", $8, $4, $6
+	}
+	$1 == "vm_bench" && $2 == "unmap" {
+		printf "unmap %-8s  %8s ns/page %8.2f IPIs/page\n", $3, $5, $9 ? $7 / $9 : 0
+	}
+	$1 == "vm_bench" && $2 == "switches" { print "  " substr($0, 10) }
+	$1 == "vm_bench" && $2 == "end" { s = substr($0, 15); sub(/\)$/, "", s); print "  " s }
+'
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "trace.h"
+#include "log.h"
+
+typedef enum {
+	MemRegionUsable,
+	// Firmware boot services and stub memory, free once the kernel has started
+	MemRegionReclaimable,
+	// Kernel image, loader, BootInfo and anything else the stub built for the kernel
+	MemRegionBoot,
+	MemRegionAcpiReclaim,
+	MemRegionAcpiNvs,
+	MemRegionRuntime,
+	MemRegionReserved,
+} MemRegionType;
+
+typedef struct {
+	uint64_t base, pages;
+	uint32_t type;
+	uint32_t flags;
+	// NUMA node, indexes BootInfo's node tables
+	uint32_t node;
+	uint32_t reserved;
+} MemRegion;
+
+// loader.bin is loaded here, must match the org in loader.s
+#define LOADER_BASE 0x18000
+
+// Real-mode entry for application processors, the second page of loader.bin.
+// The SIPI vector is its page number
+#define AP_TRAMPOLINE (LOADER_BASE + 0x1000)
+
+// Written by the kernel before each SIPI, sits right after the trampoline's first jmp.
+// Mirrors ApParams in loader.s
+#define AP_PARAMS (AP_TRAMPOLINE + 8)
+typedef struct {
+	uint64_t cr3;
+	uint64_t stack_top;
+	uint64_t entry;
+	uint64_t arg;
+	uint32_t ready;
+} ApParams;
+
+#define MAX_CPUS 256
+#define MAX_NUMA_NODES 32
+
+typedef enum {
+	// Byte order in memory, the fourth byte is ignored
+	FbFormatRgbx,
+	FbFormatBgrx,
+} FbFormat;
+
+// All addresses are physical unless noted otherwise.
+// Handed from the stub through loader.s to kernel_main.
+// loader.s reads the leading fields by offset, keep them in sync with its BootInfo struc
+typedef struct {
+	// Virtual, in the address space rooted at page_table_root
+	uint64_t kernel_entry;
+	uint64_t stack_top;
+	uint64_t page_table_root;
+
+	// loader.s records its own trace points here by offset too
+	TraceRing trace;
+	// And its log records. The kernel drains what the stub and loader wrote
+	LogRing log;
+
+	uint64_t kernel_phys_base;
+	uint64_t kernel_virt_base;
+	uint64_t kernel_size;
+
+	// Physical memory is mapped at PHYS_MAP_BASE for this many bytes
+	uint64_t phys_map_size;
+
+	// Sorted by base, adjacent regions of the same type are merged
+	uint64_t mem_regions;
+	uint64_t mem_region_count;
+
+	uint64_t acpi_rsdp;
+	uint64_t lapic_base;
+
+	// Enabled processors from the MADT, in table order
+	uint32_t cpu_count;
+	uint32_t cpu_apic_ids[MAX_CPUS];
+
+	// From the SRAT and SLIT. Nodes are numbered densely in table order and
+	// numa_domains maps them back to ACPI proximity domains. Without an SRAT
+	// everything is on node 0 of 1
+	uint32_t numa_node_count;
+	uint32_t numa_domains[MAX_NUMA_NODES];
+	// Parallel to cpu_apic_ids
+	uint32_t cpu_nodes[MAX_CPUS];
+	// Relative memory latency, 10 is local
+	uint8_t numa_distance[MAX_NUMA_NODES][MAX_NUMA_NODES];
+
+	// 32-bpp linear framebuffer from GOP, fb_base is 0 when there isn't one
+	uint64_t fb_base;
+	uint64_t fb_size;
+	uint32_t fb_width;
+	uint32_t fb_height;
+	// In pixels
+	uint32_t fb_pitch;
+	uint32_t fb_format;
+
+	// cpio (newc) or tar archive, page aligned. initrd_size is 0 without one
+	uint64_t initrd_base;
+	uint64_t initrd_size;
+
+	// Warm reboots since the stub handed over, see kexec.c
+	uint32_t kexec_count;
+} BootInfo;
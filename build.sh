@@ -3,10 +3,50 @@ set -x
 rm -rf bin
 mkdir bin
 
+# STUB_CFLAGS and KERNEL_CFLAGS pass build knobs through, e.g. -DLUNK_FORCE_SIMPLEFS
+# for the stub or -DKERNEL_PAD_BYTES=N for a bulked-up benchmark kernel
+
 # build efi stub
-clang -I efi -target x86_64-pc-win32-coff -fno-stack-protector -nostdlib -fshort-wchar -mno-red-zone -c efi_stub.c -o bin/uefi.o
+clang -I efi -target x86_64-pc-win32-coff -fno-stack-protector -nostdlib -fshort-wchar -mno-red-zone $STUB_CFLAGS -c efi_stub.c -o bin/uefi.o
 lld-link -subsystem:efi_application -nodefaultlib -dll -entry:efi_main bin/uefi.o -out:bin/BOOTX64.EFI
 
-# build kernel
-clang -o bin/kernel.o -fno-stack-protector -fpic -mno-red-zone -nostdlib -c kernel.c
+# build kernel, a static PIE the stub relocates wherever it lands. No SIMD in
+# compiled code, only in the vector routines that bracket themselves (simd.c)
+clang -target x86_64-unknown-none-elf -ffreestanding -fno-stack-protector -fpie -mno-red-zone -mno-mmx -mno-sse -mno-80387 -nostdlib $KERNEL_CFLAGS -c kernel.c -o bin/kernel.o
+ld.lld -pie --no-dynamic-linker -nostdlib -z max-page-size=0x1000 -e kernel_main bin/kernel.o -o bin/kernel.elf
 nasm -f bin -o bin/loader.bin loader.s
+
+# pack boot files as LZ4 frames, the stub prefers these over the raw files
+cc -O2 -o bin/lz4pack lz4pack.c
+bin/lz4pack bin/kernel.elf bin/kernel.elf.lz4
+bin/lz4pack bin/loader.bin bin/loader.bin.lz4
+
+# digests of the boot files for the stub to check, make_iso.sh writes manifest.txt with it
+cc -O2 -o bin/manifest manifest.c
+
+# turns the binary log frames in a serial capture back into text, bin/logdecode [capture]
+cc -O2 -o bin/logdecode logdecode.c
+
+# host microbenchmark for the kernel heap, bin/slab_bench [threads] [ops]
+cc -O2 -pthread -o bin/slab_bench slab_bench.c
+
+# host stress test and benchmark for the frame allocator, replays random
+# alloc/free traces over fake region tables: bin/pmm_bench [runs] [ops] [MiB] [nodes]
+cc -O2 -o bin/pmm_bench pmm_bench.c
+
+# the stub as a Linux program against a mock firmware: bin/stub_bench times
+# boots off bin/ and the memory map and mem.c paths, bin/fuzz_memmap checks the
+# map parser (clang -DFUZZ_LIBFUZZER -fsanitize=fuzzer,address for libFuzzer)
+HOST_STUB_CFLAGS="-O2 -fshort-wchar -fno-builtin -U_FORTIFY_SOURCE -DLUNK_HOST"
+cc $HOST_STUB_CFLAGS -o bin/stub_bench stub_bench.c
+cc $HOST_STUB_CFLAGS -o bin/fuzz_memmap fuzz_memmap.c
+
+# checks every mem.c copy/set path against the byte loop and times them from
+# 16 B to 256 MiB, bin/mem_bench [-m max MiB] [-t verify,bench]
+cc $HOST_STUB_CFLAGS -o bin/mem_bench mem_bench.c
+
+# initrd/ becomes the boot-time archive when it exists
+if [ -d initrd ]; then
+	tar --format=ustar -C initrd -cf bin/initrd.img .
+	bin/lz4pack bin/initrd.img bin/initrd.img.lz4
+fi
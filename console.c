@@ -0,0 +1,301 @@
+// Text console on the GOP framebuffer. Glyphs are drawn into a shadow buffer in
+// ordinary cacheable memory, and only the rectangles that changed are copied out
+// to VRAM row by row with memcpy's wide stores. VRAM is never read back, so
+// scrolling is a memmove of the shadow plus one full flush.
+
+#include <stdarg.h>
+
+#include "kernel.h"
+#include "boot_info.h"
+
+#define CONSOLE_MAX_DIRTY 8
+#define CONSOLE_TAB_WIDTH 4
+
+typedef struct {
+	uint32_t x0, y0, x1, y1;
+} ConsoleRect;
+
+typedef struct {
+	uint32_t *fb;
+	// Same size as the screen, packed with no padding between rows
+	uint32_t *shadow;
+	uint32_t width, height;
+	// Framebuffer row stride in pixels
+	uint32_t pitch;
+	FbFormat format;
+
+	// Glyphs are scaled up by a whole factor so text stays readable at high resolutions
+	uint32_t scale;
+	uint32_t cell_w, cell_h;
+	uint32_t cols, rows;
+	uint32_t col, row;
+	uint32_t fg, bg;
+
+	ConsoleRect dirty[CONSOLE_MAX_DIRTY];
+	uint32_t dirty_count;
+
+	Spinlock lock;
+} Console;
+
+Console console;
+
+uint32_t console_color(Console *c, uint8_t r, uint8_t g, uint8_t b) {
+	if (c->format == FbFormatRgbx) {
+		return ((uint32_t)b << 16) | ((uint32_t)g << 8) | r;
+	}
+	return ((uint32_t)r << 16) | ((uint32_t)g << 8) | b;
+}
+
+static bool rect_touches(ConsoleRect *a, ConsoleRect *b) {
+	return a->x0 <= b->x1 && b->x0 <= a->x1 && a->y0 <= b->y1 && b->y0 <= a->y1;
+}
+
+static void rect_union(ConsoleRect *a, ConsoleRect *b) {
+	if (b->x0 < a->x0) a->x0 = b->x0;
+	if (b->y0 < a->y0) a->y0 = b->y0;
+	if (b->x1 > a->x1) a->x1 = b->x1;
+	if (b->y1 > a->y1) a->y1 = b->y1;
+}
+
+// Merges into an overlapping or adjacent rect when possible, a full list folds into its last entry
+static void console_mark_dirty(Console *c, uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1) {
+	ConsoleRect r = { x0, y0, x1, y1 };
+	for (uint32_t i = 0; i < c->dirty_count; i++) {
+		if (rect_touches(&c->dirty[i], &r)) {
+			rect_union(&c->dirty[i], &r);
+			return;
+		}
+	}
+
+	if (c->dirty_count == CONSOLE_MAX_DIRTY) {
+		rect_union(&c->dirty[CONSOLE_MAX_DIRTY - 1], &r);
+		return;
+	}
+	c->dirty[c->dirty_count++] = r;
+}
+
+static void console_flush(Console *c) {
+	for (uint32_t i = 0; i < c->dirty_count; i++) {
+		ConsoleRect *r = &c->dirty[i];
+		size_t bytes = (r->x1 - r->x0) * sizeof(uint32_t);
+		for (uint32_t y = r->y0; y < r->y1; y++) {
+			memcpy(c->fb + (size_t)y * c->pitch + r->x0, c->shadow + (size_t)y * c->width + r->x0, bytes);
+		}
+	}
+	c->dirty_count = 0;
+}
+
+static void console_fill(Console *c, uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1, uint32_t color) {
+	for (uint32_t y = y0; y < y1; y++) {
+		uint32_t *row = c->shadow + (size_t)y * c->width;
+		for (uint32_t x = x0; x < x1; x++) {
+			row[x] = color;
+		}
+	}
+	console_mark_dirty(c, x0, y0, x1, y1);
+}
+
+static void console_draw_glyph(Console *c, uint32_t col, uint32_t row, char ch) {
+	if (ch < FONT_FIRST || ch > FONT_LAST) {
+		ch = '?';
+	}
+	const uint8_t *glyph = font_glyphs[ch - FONT_FIRST];
+
+	uint32_t x0 = col * c->cell_w, y0 = row * c->cell_h;
+	for (uint32_t gy = 0; gy < FONT_HEIGHT; gy++) {
+		for (uint32_t sy = 0; sy < c->scale; sy++) {
+			uint32_t *dst = c->shadow + (size_t)(y0 + gy * c->scale + sy) * c->width + x0;
+			for (uint32_t gx = 0; gx < FONT_WIDTH; gx++) {
+				uint32_t color = (glyph[gy] & (0x80 >> gx)) ? c->fg : c->bg;
+				for (uint32_t sx = 0; sx < c->scale; sx++) {
+					*dst++ = color;
+				}
+			}
+		}
+	}
+	console_mark_dirty(c, x0, y0, x0 + c->cell_w, y0 + c->cell_h);
+}
+
+static void console_scroll(Console *c) {
+	size_t line = (size_t)c->cell_h * c->width;
+	size_t text_rows = (size_t)c->rows * c->cell_h;
+	memmove(c->shadow, c->shadow + line, (text_rows - c->cell_h) * c->width * sizeof(uint32_t));
+	console_fill(c, 0, text_rows - c->cell_h, c->width, text_rows, c->bg);
+
+	// Everything moved, one rect covering the text area replaces whatever was queued
+	c->dirty_count = 0;
+	console_mark_dirty(c, 0, 0, c->width, text_rows);
+}
+
+static void console_newline(Console *c) {
+	c->col = 0;
+	if (++c->row == c->rows) {
+		console_scroll(c);
+		c->row = c->rows - 1;
+	}
+}
+
+static void console_putc(Console *c, char ch) {
+	switch (ch) {
+		case '\n': {
+			console_newline(c);
+		} break;
+		case '\r': {
+			c->col = 0;
+		} break;
+		case '\t': {
+			do {
+				console_putc(c, ' ');
+			} while (c->col % CONSOLE_TAB_WIDTH && c->col < c->cols);
+		} break;
+		default: {
+			// Wrap lazily so a line that exactly fills the row doesn't leave a blank one after its newline
+			if (c->col == c->cols) {
+				console_newline(c);
+			}
+			console_draw_glyph(c, c->col++, c->row, ch);
+		} break;
+	}
+}
+
+bool console_init(BootInfo *info) {
+	Console *c = &console;
+	if (!info->fb_base) {
+		return false;
+	}
+
+	c->width = info->fb_width;
+	c->height = info->fb_height;
+	c->pitch = info->fb_pitch;
+	c->format = info->fb_format;
+	c->fb = (uint32_t *)phys_to_virt(info->fb_base);
+
+	size_t shadow_size = (size_t)c->width * c->height * sizeof(uint32_t);
+	uint64_t shadow = pmm_alloc(pmm_order_for(shadow_size));
+	if (!shadow) {
+		return false;
+	}
+	c->shadow = (uint32_t *)phys_to_virt(shadow);
+
+	// Aim for at least 100 columns
+	c->scale = c->width / (FONT_WIDTH * 100);
+	if (c->scale == 0) {
+		c->scale = 1;
+	}
+	c->cell_w = FONT_WIDTH * c->scale;
+	c->cell_h = FONT_HEIGHT * c->scale;
+	c->cols = c->width / c->cell_w;
+	c->rows = c->height / c->cell_h;
+	c->col = c->row = 0;
+	c->fg = console_color(c, 0xCC, 0xCC, 0xCC);
+	c->bg = console_color(c, 0x00, 0x00, 0x00);
+
+	c->dirty_count = 0;
+	console_fill(c, 0, 0, c->width, c->height, c->bg);
+	console_flush(c);
+	return true;
+}
+
+void console_write(const char *str, size_t len) {
+	Console *c = &console;
+	if (!c->shadow) {
+		return;
+	}
+
+	spin_lock(&c->lock);
+	for (size_t i = 0; i < len; i++) {
+		console_putc(c, str[i]);
+	}
+	console_flush(c);
+	spin_unlock(&c->lock);
+}
+
+void console_puts(const char *str) {
+	console_write(str, strlen(str));
+}
+
+// Formats into a small stack buffer, enough for the kernel's status lines, and
+// writes it to both the console and the serial port.
+// Supports %s %c %d %u %x %p and %%, with an optional l on the integer forms
+void kprintf(const char *fmt, ...) {
+	char buf[256];
+	size_t len = 0;
+
+	va_list args;
+	va_start(args, fmt);
+	for (const char *p = fmt; *p && len < sizeof(buf) - 1; p++) {
+		if (*p != '%') {
+			buf[len++] = *p;
+			continue;
+		}
+
+		p++;
+		bool is_long = false;
+		if (*p == 'l') {
+			is_long = true;
+			p++;
+		}
+
+		char num[24];
+		size_t num_len = 0;
+		const char *out = num;
+		switch (*p) {
+			case 's': {
+				out = va_arg(args, const char *);
+				num_len = strlen(out);
+			} break;
+			case 'c': {
+				num[num_len++] = (char)va_arg(args, int);
+			} break;
+			case 'd':
+			case 'u':
+			case 'x':
+			case 'p': {
+				uint64_t value;
+				bool negative = false;
+				if (*p == 'p') {
+					value = (uint64_t)va_arg(args, void *);
+				} else if (*p == 'd') {
+					int64_t v = is_long ? va_arg(args, int64_t) : va_arg(args, int32_t);
+					negative = v < 0;
+					value = negative ? -(uint64_t)v : (uint64_t)v;
+				} else {
+					value = is_long ? va_arg(args, uint64_t) : va_arg(args, uint32_t);
+				}
+
+				uint32_t base = (*p == 'x' || *p == 'p') ? 16 : 10;
+				char digits[24];
+				size_t n = 0;
+				do {
+					digits[n++] = "0123456789abcdef"[value % base];
+					value /= base;
+				} while (value);
+
+				if (negative) num[num_len++] = '-';
+				if (*p == 'p') {
+					num[num_len++] = '0';
+					num[num_len++] = 'x';
+				}
+				while (n) {
+					num[num_len++] = digits[--n];
+				}
+			} break;
+			case '%': {
+				num[num_len++] = '%';
+			} break;
+			default: {
+				// Unknown or truncated conversion, drop it
+				if (!*p) p--;
+				continue;
+			}
+		}
+
+		for (size_t i = 0; i < num_len && len < sizeof(buf) - 1; i++) {
+			buf[len++] = out[i];
+		}
+	}
+	va_end(args);
+
+	console_write(buf, len);
+	serial_write(buf, len);
+}
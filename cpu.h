@@ -0,0 +1,121 @@
+#pragma once
+
+#include <stdint.h>
+
+typedef struct {
+	uint32_t eax, ebx, ecx, edx;
+} CpuidRegs;
+
+static inline CpuidRegs cpuid(uint32_t leaf, uint32_t subleaf) {
+	CpuidRegs r;
+	__asm__ volatile ("cpuid" : "=a"(r.eax), "=b"(r.ebx), "=c"(r.ecx), "=d"(r.edx) : "a"(leaf), "c"(subleaf));
+	return r;
+}
+
+static inline uint64_t xgetbv(uint32_t index) {
+	uint32_t lo, hi;
+	__asm__ volatile ("xgetbv" : "=a"(lo), "=d"(hi) : "c"(index));
+	return ((uint64_t)hi << 32) | lo;
+}
+
+static inline uint64_t rdtsc(void) {
+	uint32_t lo, hi;
+	__asm__ volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+	return ((uint64_t)hi << 32) | lo;
+}
+
+static inline uint64_t rdmsr(uint32_t msr) {
+	uint32_t lo, hi;
+	__asm__ volatile ("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+	return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+	__asm__ volatile ("wrmsr" :: "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+static inline void cpu_pause(void) {
+	__asm__ volatile ("pause");
+}
+
+static inline void outb(uint16_t port, uint8_t value) {
+	__asm__ volatile ("outb %0, %1" :: "a"(value), "Nd"(port));
+}
+
+static inline uint8_t inb(uint16_t port) {
+	uint8_t value;
+	__asm__ volatile ("inb %1, %0" : "=a"(value) : "Nd"(port));
+	return value;
+}
+
+#define MSR_GS_BASE 0xC0000101
+
+#define CR4_PCIDE (1ULL << 17)
+// Bits 11:0 of CR3 are the PCID once CR4.PCIDE is set, and bit 63 keeps the
+// new PCID's TLB entries across the load
+#define CR3_NOFLUSH (1ULL << 63)
+
+static inline uint64_t read_cr3(void) {
+	uint64_t value;
+	__asm__ volatile ("mov %%cr3, %0" : "=r"(value));
+	return value;
+}
+
+static inline void write_cr3(uint64_t value) {
+	__asm__ volatile ("mov %0, %%cr3" :: "r"(value) : "memory");
+}
+
+static inline uint64_t read_cr4(void) {
+	uint64_t value;
+	__asm__ volatile ("mov %%cr4, %0" : "=r"(value));
+	return value;
+}
+
+static inline void write_cr4(uint64_t value) {
+	__asm__ volatile ("mov %0, %%cr4" :: "r"(value) : "memory");
+}
+
+static inline void invlpg(uint64_t virt) {
+	__asm__ volatile ("invlpg (%0)" :: "r"(virt) : "memory");
+}
+
+#define INVPCID_ADDRESS 0
+#define INVPCID_CONTEXT 1
+
+static inline void invpcid(uint64_t type, uint64_t pcid, uint64_t virt) {
+	struct { uint64_t pcid, virt; } desc = { pcid, virt };
+	__asm__ volatile ("invpcid %0, %1" :: "m"(desc), "r"(type) : "memory");
+}
+
+static inline void cpu_halt(void) {
+	__asm__ volatile ("hlt");
+}
+
+#define RFLAGS_IF (1ULL << 9)
+
+// Interrupts off, returns the flags to hand back to irq_restore
+static inline uint64_t irq_save(void) {
+	uint64_t flags;
+	__asm__ volatile ("pushfq; pop %0; cli" : "=r"(flags) :: "memory");
+	return flags;
+}
+
+static inline void irq_restore(uint64_t flags) {
+	if (flags & RFLAGS_IF) {
+		__asm__ volatile ("sti" ::: "memory");
+	}
+}
+
+static inline void cpu_monitor(const volatile void *addr) {
+	__asm__ volatile ("monitor" :: "a"(addr), "c"(0), "d"(0));
+}
+
+// Interrupts are enabled for exactly the mwait or hlt, the sti shadow means
+// one arriving in between still ends the wait instead of being taken early
+static inline void cpu_sti_mwait(uint32_t hint) {
+	__asm__ volatile ("sti; mwait; cli" :: "a"(hint), "c"(0) : "memory");
+}
+
+static inline void cpu_sti_halt(void) {
+	__asm__ volatile ("sti; hlt; cli" ::: "memory");
+}
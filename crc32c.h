@@ -0,0 +1,140 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <immintrin.h>
+
+#include "cpu.h"
+
+// CRC32C (Castagnoli), shared by the stub (verifying boot files as they land)
+// and the host tools that write the manifest. SSE4.2 crc32 when CPUID has it,
+// slicing-by-8 tables otherwise. crc32c_init() must run before anything else.
+// CRCs are combinable, so pieces of a file checked out of order still add up
+// to the digest of the whole file.
+
+// Reflected polynomial
+#define CRC32C_POLY 0x82F63B78U
+
+// The hardware path runs three independent streams of this many bytes to
+// cover crc32's 3 cycle latency, then shifts them together
+#define CRC32C_LANE 8192
+
+typedef uint32_t (*Crc32cFn)(uint32_t crc, const void *data, size_t len);
+
+static uint32_t crc32c_table[8][256];
+// x^(2^n) mod P, for shifting a CRC past runs of zeros
+static uint32_t crc32c_x2n[32];
+static uint32_t crc32c_lane_shift;
+static bool crc32c_has_sse42;
+
+// a * b mod P, both as reflected polynomials
+static uint32_t crc32c_multmodp(uint32_t a, uint32_t b) {
+	uint32_t m = 1U << 31, p = 0;
+	for (;;) {
+		if (a & m) {
+			p ^= b;
+			if ((a & (m - 1)) == 0) {
+				break;
+			}
+		}
+		m >>= 1;
+		b = (b & 1) ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+	}
+	return p;
+}
+
+// x^(n * 2^k) mod P
+static uint32_t crc32c_x2nmodp(uint64_t n, uint32_t k) {
+	uint32_t p = 1U << 31;
+	for (; n; n >>= 1, k++) {
+		if (n & 1) {
+			p = crc32c_multmodp(crc32c_x2n[k & 31], p);
+		}
+	}
+	return p;
+}
+
+// CRC of a || b from crc(a), crc(b) and b's length
+static uint32_t crc32c_combine(uint32_t crc_a, uint32_t crc_b, uint64_t len_b) {
+	return crc32c_multmodp(crc32c_x2nmodp(len_b, 3), crc_a) ^ crc_b;
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const void *data, size_t len) {
+	const uint8_t *p = (const uint8_t *)data;
+	uint32_t c = ~crc;
+	for (; len && ((uintptr_t)p & 7); len--) {
+		c = crc32c_table[0][(c ^ *p++) & 0xFF] ^ (c >> 8);
+	}
+	for (; len >= 8; len -= 8, p += 8) {
+		uint32_t lo = *(const uint32_t *)p ^ c;
+		uint32_t hi = *(const uint32_t *)(p + 4);
+		c = crc32c_table[7][lo & 0xFF] ^ crc32c_table[6][(lo >> 8) & 0xFF] ^
+			crc32c_table[5][(lo >> 16) & 0xFF] ^ crc32c_table[4][lo >> 24] ^
+			crc32c_table[3][hi & 0xFF] ^ crc32c_table[2][(hi >> 8) & 0xFF] ^
+			crc32c_table[1][(hi >> 16) & 0xFF] ^ crc32c_table[0][hi >> 24];
+	}
+	for (; len; len--) {
+		c = crc32c_table[0][(c ^ *p++) & 0xFF] ^ (c >> 8);
+	}
+	return ~c;
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const void *data, size_t len) {
+	const uint8_t *p = (const uint8_t *)data;
+	uint64_t c = (uint32_t)~crc;
+	for (; len && ((uintptr_t)p & 7); len--) {
+		c = _mm_crc32_u8((uint32_t)c, *p++);
+	}
+
+	for (; len >= 3 * CRC32C_LANE; len -= 3 * CRC32C_LANE, p += 3 * CRC32C_LANE) {
+		uint64_t a = c, b = 0, d = 0;
+		for (size_t i = 0; i < CRC32C_LANE; i += 8) {
+			a = _mm_crc32_u64(a, *(const uint64_t *)(p + i));
+			b = _mm_crc32_u64(b, *(const uint64_t *)(p + CRC32C_LANE + i));
+			d = _mm_crc32_u64(d, *(const uint64_t *)(p + 2 * CRC32C_LANE + i));
+		}
+		a = crc32c_multmodp(crc32c_lane_shift, (uint32_t)a) ^ (uint32_t)b;
+		c = crc32c_multmodp(crc32c_lane_shift, (uint32_t)a) ^ (uint32_t)d;
+	}
+
+	for (; len >= 8; len -= 8, p += 8) {
+		c = _mm_crc32_u64(c, *(const uint64_t *)p);
+	}
+	for (; len; len--) {
+		c = _mm_crc32_u8((uint32_t)c, *p++);
+	}
+	return ~(uint32_t)c;
+}
+
+static Crc32cFn crc32c_impl = crc32c_sw;
+
+static uint32_t crc32c_update(uint32_t crc, const void *data, size_t len) {
+	return crc32c_impl(crc, data, len);
+}
+
+static void crc32c_init(void) {
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t c = i;
+		for (int k = 0; k < 8; k++) {
+			c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+		}
+		crc32c_table[0][i] = c;
+	}
+	for (uint32_t i = 0; i < 256; i++) {
+		for (int t = 1; t < 8; t++) {
+			uint32_t prev = crc32c_table[t - 1][i];
+			crc32c_table[t][i] = crc32c_table[0][prev & 0xFF] ^ (prev >> 8);
+		}
+	}
+
+	crc32c_x2n[0] = 1U << 30;
+	for (int n = 1; n < 32; n++) {
+		crc32c_x2n[n] = crc32c_multmodp(crc32c_x2n[n - 1], crc32c_x2n[n - 1]);
+	}
+	crc32c_lane_shift = crc32c_x2nmodp(CRC32C_LANE, 3);
+
+	crc32c_has_sse42 = (cpuid(1, 0).ecx >> 20) & 1;
+	crc32c_impl = crc32c_has_sse42 ? crc32c_hw : crc32c_sw;
+}
@@ -1,3 +1,5 @@
+#pragma once
+
 #include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
@@ -10,6 +12,25 @@
 #define EFI_FILE_MODE_READ 0x0000000000000001
 #define EFI_OPEN_PROTOCOL_GET_PROTOCOL 0x00000002
 
+#define EFI_PAGE_SIZE 0x1000
+#define EFI_SIZE_TO_PAGES(x) (((x) + EFI_PAGE_SIZE - 1) / EFI_PAGE_SIZE)
+#define EFI_FILE_PROTOCOL_REVISION2 0x00020000
+
+#define TPL_APPLICATION 4
+#define TPL_CALLBACK 8
+
+#define EFI_SUCCESS 0
+#define EFI_ERROR_BIT 0x8000000000000000ULL
+#define EFI_ERROR(x) (((x) & EFI_ERROR_BIT) != 0)
+#define EFI_LOAD_ERROR (EFI_ERROR_BIT | 1)
+#define EFI_INVALID_PARAMETER (EFI_ERROR_BIT | 2)
+#define EFI_UNSUPPORTED (EFI_ERROR_BIT | 3)
+#define EFI_BUFFER_TOO_SMALL (EFI_ERROR_BIT | 5)
+#define EFI_NOT_READY (EFI_ERROR_BIT | 6)
+#define EFI_DEVICE_ERROR (EFI_ERROR_BIT | 7)
+#define EFI_OUT_OF_RESOURCES (EFI_ERROR_BIT | 9)
+#define EFI_NOT_FOUND (EFI_ERROR_BIT | 14)
+
 typedef void *EFI_HANDLE;
 typedef void *EFI_EVENT;
 typedef size_t EFI_STATUS;
@@ -29,6 +50,9 @@ typedef struct {
 	void 	*VendorTable;
 } EFI_CONFIGURATION_TABLE;
 
+#define EFI_ACPI_20_TABLE_GUID {0x8868e871,0xe4f1,0x11d3, {0xbc,0x22,0x00,0x80,0xc7,0x3c,0x88,0x81}}
+#define EFI_ACPI_10_TABLE_GUID {0xeb9d2d30,0x2d88,0x11d3, {0x9a,0x16,0x00,0x90,0x27,0x3f,0xc1,0x4d}}
+
 typedef struct {
 	EFI_EVENT Event;
 	EFI_STATUS Status;
@@ -428,8 +452,8 @@ typedef EFI_STATUS (EFIAPI *EFI_FILE_DELETE) (IN struct _EFI_FILE_HANDLE *File);
 typedef EFI_STATUS (EFIAPI *EFI_FILE_READ) (IN struct _EFI_FILE_HANDLE *File, IN OUT size_t *BufferSize, OUT void *Buffer);
 typedef EFI_STATUS (EFIAPI *EFI_FILE_WRITE) (IN struct _EFI_FILE_HANDLE *File, IN OUT size_t *BufferSize, IN void *Buffer);
 typedef EFI_STATUS (EFIAPI *EFI_FILE_GET_POSITION) (IN struct _EFI_FILE_HANDLE *File, OUT uint64_t *Position);
-typedef EFI_STATUS (EFIAPI *EFI_FILE_SET_POSITION) (IN struct _EFI_FILE_HANDLE *File, IN uint64_t *Position);
-typedef EFI_STATUS (EFIAPI *EFI_FILE_GET_INFO) (IN struct _EFI_FILE_HANDLE *File, IN EFI_GUID *InformationType, IN size_t BufferSize, IN void *Buffer);
+typedef EFI_STATUS (EFIAPI *EFI_FILE_SET_POSITION) (IN struct _EFI_FILE_HANDLE *File, IN uint64_t Position);
+typedef EFI_STATUS (EFIAPI *EFI_FILE_GET_INFO) (IN struct _EFI_FILE_HANDLE *File, IN EFI_GUID *InformationType, IN OUT size_t *BufferSize, OUT void *Buffer);
 typedef EFI_STATUS (EFIAPI *EFI_FILE_SET_INFO) (IN struct _EFI_FILE_HANDLE *File, IN EFI_GUID *InformationType, IN size_t BufferSize, IN void *Buffer);
 typedef EFI_STATUS (EFIAPI *EFI_FILE_FLUSH) (IN struct _EFI_FILE_HANDLE *File);
 typedef EFI_STATUS (EFIAPI *EFI_FILE_OPEN_EX) (IN struct _EFI_FILE_HANDLE *File, OUT struct _EFI_FILE_HANDLE **NewHandle, IN int16_t *FileName, IN uint64_t OpenMode, IN uint64_t Attributes, IN OUT EFI_FILE_IO_TOKEN *Token);
@@ -457,6 +481,18 @@ typedef struct _EFI_FILE_HANDLE {
 
 typedef EFI_FILE_PROTOCOL EFI_FILE;
 
+#define EFI_FILE_INFO_ID {0x09576e92,0x6d3f,0x11d2, {0x8e,0x39,0x00,0xa0,0xc9,0x69,0x72,0x3b}}
+typedef struct {
+	uint64_t Size;
+	uint64_t FileSize;
+	uint64_t PhysicalSize;
+	EFI_TIME CreateTime;
+	EFI_TIME LastAccessTime;
+	EFI_TIME ModificationTime;
+	uint64_t Attribute;
+	int16_t FileName[];
+} EFI_FILE_INFO;
+
 #define EFI_SIMPLE_FILE_SYSTEM_PROTOCOL_GUID {0x0964e5b22,0x6459,0x11d2, {0x8e,0x39,0x00,0xa0,0xc9,0x69,0x72,0x3b}}
 struct _EFI_FS_HANDLE;
 
@@ -466,3 +502,51 @@ typedef struct _EFI_FS_HANDLE {
 	uint64_t Revision;
 	EFI_SIMPLE_FILE_SYSTEM_PROTOCOL_OPEN_VOLUME OpenVolume;
 } EFI_SIMPLE_FILE_SYSTEM_PROTOCOL;
+
+typedef uint64_t EFI_LBA;
+
+#define EFI_BLOCK_IO_PROTOCOL_GUID {0x964e5b21,0x6459,0x11d2, {0x8e,0x39,0x00,0xa0,0xc9,0x69,0x72,0x3b}}
+struct _EFI_BLOCK_IO_PROTOCOL;
+
+typedef struct {
+	uint32_t MediaId;
+	bool RemovableMedia;
+	bool MediaPresent;
+	bool LogicalPartition;
+	bool ReadOnly;
+	bool WriteCaching;
+	uint32_t BlockSize;
+	uint32_t IoAlign;
+	EFI_LBA LastBlock;
+	// Revision 2 and up
+	EFI_LBA LowestAlignedLba;
+	uint32_t LogicalBlocksPerPhysicalBlock;
+	// Revision 3 and up
+	uint32_t OptimalTransferLengthGranularity;
+} EFI_BLOCK_IO_MEDIA;
+
+typedef EFI_STATUS (EFIAPI *EFI_BLOCK_RESET) (IN struct _EFI_BLOCK_IO_PROTOCOL *This, IN bool ExtendedVerification);
+typedef EFI_STATUS (EFIAPI *EFI_BLOCK_READ) (IN struct _EFI_BLOCK_IO_PROTOCOL *This, IN uint32_t MediaId, IN EFI_LBA Lba, IN size_t BufferSize, OUT void *Buffer);
+typedef EFI_STATUS (EFIAPI *EFI_BLOCK_WRITE) (IN struct _EFI_BLOCK_IO_PROTOCOL *This, IN uint32_t MediaId, IN EFI_LBA Lba, IN size_t BufferSize, IN void *Buffer);
+typedef EFI_STATUS (EFIAPI *EFI_BLOCK_FLUSH) (IN struct _EFI_BLOCK_IO_PROTOCOL *This);
+
+typedef struct _EFI_BLOCK_IO_PROTOCOL {
+	uint64_t Revision;
+	EFI_BLOCK_IO_MEDIA *Media;
+	EFI_BLOCK_RESET Reset;
+	EFI_BLOCK_READ ReadBlocks;
+	EFI_BLOCK_WRITE WriteBlocks;
+	EFI_BLOCK_FLUSH FlushBlocks;
+} EFI_BLOCK_IO_PROTOCOL;
+
+#define EFI_DISK_IO_PROTOCOL_GUID {0xce345171,0xba0b,0x11d2, {0x8e,0x4f,0x00,0xa0,0xc9,0x69,0x72,0x3b}}
+struct _EFI_DISK_IO_PROTOCOL;
+
+typedef EFI_STATUS (EFIAPI *EFI_DISK_READ) (IN struct _EFI_DISK_IO_PROTOCOL *This, IN uint32_t MediaId, IN uint64_t Offset, IN size_t BufferSize, OUT void *Buffer);
+typedef EFI_STATUS (EFIAPI *EFI_DISK_WRITE) (IN struct _EFI_DISK_IO_PROTOCOL *This, IN uint32_t MediaId, IN uint64_t Offset, IN size_t BufferSize, IN void *Buffer);
+
+typedef struct _EFI_DISK_IO_PROTOCOL {
+	uint64_t Revision;
+	EFI_DISK_READ ReadDisk;
+	EFI_DISK_WRITE WriteDisk;
+} EFI_DISK_IO_PROTOCOL;
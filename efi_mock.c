@@ -0,0 +1,1024 @@
+// Host-side stand-in for the firmware, enough of EFI_SYSTEM_TABLE for efi_main
+// to run as an ordinary Linux process. Physical addresses are host addresses:
+// RAM banks are mapped at fixed spots below 4 GiB, so everything the stub
+// dereferences (LOADER_BASE, page table pools, the kernel image) is real memory.
+//
+// Boot files come from a host directory through SimpleFS (ReadEx included),
+// and optionally a FAT image behind BlockIO/DiskIO for the stub's own reader.
+// Every read goes through one device model with a fixed request latency and a
+// transfer bandwidth, so overlapping reads can actually overlap. The memory
+// map can be padded with thousands of synthetic descriptors above 4 GiB, and
+// reads, page allocations and ExitBootServices can be made to fail.
+//
+// Included after efi_stub.c by host tools built with -DLUNK_HOST.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MOCK_LOW_BASE 0x10000ULL
+#define MOCK_LOW_END 0xA0000ULL
+#define MOCK_HIGH_BASE 0x40000000ULL
+
+// Carved off the top of the high bank, the firmware's own footprint
+#define MOCK_ACPI_PAGES 4
+#define MOCK_RUNTIME_PAGES 64
+#define MOCK_BS_PAGES 512
+
+#define MOCK_MAX_BANKS 2
+#define MOCK_MAX_FILES 64
+#define MOCK_FAT_BLOCK_SIZE 512
+
+typedef struct {
+	// Directory served through SimpleFS
+	const char *dir;
+	// Optional FAT image behind BlockIO and DiskIO, NULL leaves them out
+	const char *fat_image;
+	uint64_t mem_size;
+
+	uint32_t cpus;
+	uint32_t numa_nodes;
+
+	// Extra descriptors past 4 GiB and whether GetMemoryMap hands them out shuffled
+	size_t extra_descs;
+	bool shuffle;
+	size_t desc_size;
+	// Small boot services allocations scattered over the high bank, each one
+	// cuts conventional memory into more descriptors
+	size_t fragments;
+
+	// Per request, plus bytes / bandwidth for the transfer. Zero bandwidth is infinitely fast
+	uint64_t latency_ns;
+	uint64_t bandwidth_mbs;
+	// Revision 1 file protocol, no ReadEx
+	bool sync_only;
+
+	// 1-based index of the read or AllocatePages call that fails, 0 for none
+	uint64_t fail_read;
+	uint64_t fail_alloc;
+	// ExitBootServices calls rejected as if the map changed underneath them
+	uint32_t stale_exits;
+
+	bool verbose;
+	uint64_t seed;
+} MockConfig;
+
+typedef struct {
+	uint64_t reads;
+	uint64_t read_bytes;
+	uint64_t allocs;
+	uint64_t pool_allocs;
+	uint64_t map_calls;
+	uint64_t exit_calls;
+	// Boot services used after a successful ExitBootServices, always a stub bug
+	uint64_t calls_after_exit;
+	// Longest a ReadEx was left outstanding, and peak queue depth
+	uint64_t max_inflight;
+	uint64_t wait_ns;
+} MockStats;
+
+typedef struct {
+	uint64_t base;
+	uint64_t pages;
+	uint32_t *types;
+	uint32_t *initial;
+} MockBank;
+
+typedef struct {
+	EFI_FILE file;
+	int fd;
+	uint64_t pos;
+	uint64_t size;
+	bool root;
+	bool open;
+} MockFile;
+
+typedef struct {
+	bool signaled;
+	bool pending;
+	uint64_t due;
+	MockFile *file;
+	EFI_FILE_IO_TOKEN *token;
+	uint64_t offset;
+	size_t size;
+	bool fail;
+} MockEvent;
+
+typedef struct MockPool {
+	struct MockPool *next;
+	struct MockPool *prev;
+} MockPool;
+
+MockConfig mock_config;
+MockStats mock_stats;
+
+MockBank mock_banks[MOCK_MAX_BANKS];
+size_t mock_bank_count;
+
+MockFile mock_files[MOCK_MAX_FILES];
+MockPool mock_pools = { &mock_pools, &mock_pools };
+size_t mock_inflight;
+
+uint64_t mock_map_key;
+uint32_t mock_stale_left;
+bool mock_exited;
+uint64_t mock_device_free;
+uint64_t mock_read_index;
+uint64_t mock_alloc_index;
+
+int mock_fat_fd = -1;
+uint64_t mock_fat_size;
+
+EFI_SYSTEM_TABLE mock_st;
+EFI_BOOT_SERVICES mock_bs;
+EFI_RUNTIME_SERVICES mock_rt;
+EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL mock_con_out;
+EFI_CONFIGURATION_TABLE mock_config_tables[1];
+EFI_LOADED_IMAGE_PROTOCOL mock_loaded_image;
+EFI_SIMPLE_FILE_SYSTEM_PROTOCOL mock_simple_fs;
+EFI_BLOCK_IO_MEDIA mock_block_media;
+EFI_BLOCK_IO_PROTOCOL mock_block_io;
+EFI_DISK_IO_PROTOCOL mock_disk_io;
+
+// Handles are just distinct addresses
+char mock_image_handle_tag, mock_device_handle_tag;
+
+static uint64_t mock_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void mock_sleep_until(uint64_t deadline) {
+	uint64_t now = mock_now();
+	if (deadline > now + 100000) {
+		struct timespec ts = { .tv_sec = (deadline - now - 50000) / 1000000000ULL, .tv_nsec = (deadline - now - 50000) % 1000000000ULL };
+		nanosleep(&ts, NULL);
+	}
+	while (mock_now() < deadline) {
+		cpu_pause();
+	}
+}
+
+static inline uint64_t mock_rand(uint64_t *s) {
+	*s ^= *s << 13;
+	*s ^= *s >> 7;
+	*s ^= *s << 17;
+	return *s;
+}
+
+static void mock_enter(void) {
+	if (mock_exited) {
+		mock_stats.calls_after_exit++;
+	}
+}
+
+// Completion time of a `bytes` request issued now. Requests share one device:
+// latencies overlap, transfers queue behind each other
+static uint64_t mock_device_schedule(uint64_t bytes) {
+	uint64_t start = mock_now() + mock_config.latency_ns;
+	if (start < mock_device_free) {
+		start = mock_device_free;
+	}
+	uint64_t transfer = mock_config.bandwidth_mbs ? bytes * 1000 / mock_config.bandwidth_mbs : 0;
+	mock_device_free = start + transfer;
+	return mock_device_free;
+}
+
+static bool mock_read_fails(void) {
+	mock_stats.reads++;
+	return ++mock_read_index == mock_config.fail_read;
+}
+
+static void mock_log(const char *fmt, const char *arg) {
+	if (mock_config.verbose) {
+		fprintf(stderr, fmt, arg);
+	}
+}
+
+// ---- memory ----
+
+static MockBank *mock_bank_of(uint64_t addr, uint64_t pages) {
+	for (size_t i = 0; i < mock_bank_count; i++) {
+		MockBank *b = &mock_banks[i];
+		if (addr >= b->base && addr + pages * EFI_PAGE_SIZE <= b->base + b->pages * EFI_PAGE_SIZE) {
+			return b;
+		}
+	}
+	return NULL;
+}
+
+static bool mock_range_is(MockBank *b, uint64_t first, uint64_t pages, uint32_t type) {
+	for (uint64_t i = 0; i < pages; i++) {
+		if (b->types[first + i] != type) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static void mock_range_set(uint32_t *types, uint64_t first, uint64_t pages, uint32_t type) {
+	for (uint64_t i = 0; i < pages; i++) {
+		types[first + i] = type;
+	}
+}
+
+// Highest free run of `pages` ending at or below `limit`, top-down like most firmware
+static bool mock_find_free(uint64_t pages, uint64_t limit, uint64_t *addr) {
+	for (size_t i = mock_bank_count; i-- > 0;) {
+		MockBank *b = &mock_banks[i];
+		uint64_t end = b->pages;
+		if (limit < b->base + b->pages * EFI_PAGE_SIZE) {
+			if (limit < b->base + pages * EFI_PAGE_SIZE) {
+				continue;
+			}
+			end = (limit - b->base) / EFI_PAGE_SIZE;
+		}
+
+		uint64_t run = 0;
+		for (uint64_t p = end; p-- > 0;) {
+			run = b->types[p] == EfiConventionalMemory ? run + 1 : 0;
+			if (run == pages) {
+				*addr = b->base + p * EFI_PAGE_SIZE;
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+EFI_STATUS EFIAPI mock_allocate_pages(EFI_ALLOCATE_TYPE type, EFI_MEMORY_TYPE mem_type, size_t pages, EFI_PHYSICAL_ADDRESS *memory) {
+	mock_enter();
+	mock_stats.allocs++;
+	if (++mock_alloc_index == mock_config.fail_alloc) {
+		return EFI_OUT_OF_RESOURCES;
+	}
+	if (pages == 0 || mem_type == EfiConventionalMemory) {
+		return EFI_INVALID_PARAMETER;
+	}
+
+	uint64_t addr;
+	switch (type) {
+		case AllocateAnyPages:
+			if (!mock_find_free(pages, UINT64_MAX, &addr)) {
+				return EFI_OUT_OF_RESOURCES;
+			}
+			break;
+		case AllocateMaxAddress:
+			if (!mock_find_free(pages, *memory + 1, &addr)) {
+				return EFI_OUT_OF_RESOURCES;
+			}
+			break;
+		case AllocateAddress: {
+			addr = *memory;
+			if (addr & (EFI_PAGE_SIZE - 1)) {
+				return EFI_INVALID_PARAMETER;
+			}
+			MockBank *b = mock_bank_of(addr, pages);
+			if (!b || !mock_range_is(b, (addr - b->base) / EFI_PAGE_SIZE, pages, EfiConventionalMemory)) {
+				return EFI_NOT_FOUND;
+			}
+		} break;
+		default:
+			return EFI_INVALID_PARAMETER;
+	}
+
+	MockBank *b = mock_bank_of(addr, pages);
+	mock_range_set(b->types, (addr - b->base) / EFI_PAGE_SIZE, pages, mem_type);
+	mock_map_key++;
+	*memory = addr;
+	return 0;
+}
+
+EFI_STATUS EFIAPI mock_free_pages(EFI_PHYSICAL_ADDRESS memory, size_t pages) {
+	mock_enter();
+	MockBank *b = mock_bank_of(memory, pages);
+	if (!b || (memory & (EFI_PAGE_SIZE - 1))) {
+		return EFI_NOT_FOUND;
+	}
+
+	uint64_t first = (memory - b->base) / EFI_PAGE_SIZE;
+	for (uint64_t i = 0; i < pages; i++) {
+		if (b->types[first + i] == EfiConventionalMemory || b->initial[first + i] != EfiConventionalMemory) {
+			return EFI_NOT_FOUND;
+		}
+	}
+	mock_range_set(b->types, first, pages, EfiConventionalMemory);
+	mock_map_key++;
+	return 0;
+}
+
+EFI_STATUS EFIAPI mock_allocate_pool(EFI_MEMORY_TYPE type, size_t size, void **buffer) {
+	mock_enter();
+	mock_stats.pool_allocs++;
+	MockPool *pool = malloc(sizeof(MockPool) + size);
+	if (!pool) {
+		return EFI_OUT_OF_RESOURCES;
+	}
+	pool->next = mock_pools.next;
+	pool->prev = &mock_pools;
+	pool->next->prev = pool;
+	mock_pools.next = pool;
+
+	// Pool growth changes the map on real firmware too
+	mock_map_key++;
+	*buffer = pool + 1;
+	return 0;
+}
+
+EFI_STATUS EFIAPI mock_free_pool(void *buffer) {
+	mock_enter();
+	MockPool *pool = (MockPool *)buffer - 1;
+	pool->prev->next = pool->next;
+	pool->next->prev = pool->prev;
+	free(pool);
+	return 0;
+}
+
+// Stable order first: banks run-length encoded, then the synthetic tail
+static size_t mock_map_count(void) {
+	size_t count = mock_config.extra_descs;
+	for (size_t i = 0; i < mock_bank_count; i++) {
+		MockBank *b = &mock_banks[i];
+		for (uint64_t p = 0; p < b->pages; p++) {
+			if (p == 0 || b->types[p] != b->types[p - 1]) {
+				count++;
+			}
+		}
+	}
+	return count;
+}
+
+static void mock_map_fill(char *map, size_t desc_size) {
+	size_t n = 0;
+	for (size_t i = 0; i < mock_bank_count; i++) {
+		MockBank *b = &mock_banks[i];
+		for (uint64_t p = 0; p < b->pages;) {
+			uint64_t q = p + 1;
+			while (q < b->pages && b->types[q] == b->types[p]) {
+				q++;
+			}
+			EFI_MEMORY_DESCRIPTOR *d = (EFI_MEMORY_DESCRIPTOR *)(map + n++ * desc_size);
+			*d = (EFI_MEMORY_DESCRIPTOR){ .Type = b->types[p], .PhysicalStart = b->base + p * EFI_PAGE_SIZE, .NumberOfPages = q - p };
+			p = q;
+		}
+	}
+
+	// Alternating usable and reserved 2 MiB chunks past 4 GiB, never handed out
+	// by AllocatePages since nothing backs them
+	static const uint32_t extra_types[] = { EfiConventionalMemory, EfiReservedMemoryType, EfiConventionalMemory, EfiACPIMemoryNVS, EfiBootServicesData, EfiRuntimeServicesData };
+	for (size_t i = 0; i < mock_config.extra_descs; i++) {
+		EFI_MEMORY_DESCRIPTOR *d = (EFI_MEMORY_DESCRIPTOR *)(map + n++ * desc_size);
+		*d = (EFI_MEMORY_DESCRIPTOR){
+			.Type = extra_types[i % (sizeof(extra_types) / sizeof(extra_types[0]))],
+			.PhysicalStart = 0x100000000ULL + i * 0x200000ULL,
+			.NumberOfPages = 0x200,
+		};
+	}
+
+	if (mock_config.shuffle) {
+		uint64_t rng = mock_config.seed | 1;
+		char tmp[256];
+		for (size_t i = n; i > 1; i--) {
+			size_t j = mock_rand(&rng) % i;
+			memcpy(tmp, map + (i - 1) * desc_size, desc_size);
+			memcpy(map + (i - 1) * desc_size, map + j * desc_size, desc_size);
+			memcpy(map + j * desc_size, tmp, desc_size);
+		}
+	}
+}
+
+EFI_STATUS EFIAPI mock_get_memory_map(size_t *map_size, EFI_MEMORY_DESCRIPTOR *map, size_t *map_key, size_t *desc_size, uint32_t *desc_version) {
+	mock_enter();
+	mock_stats.map_calls++;
+	size_t need = mock_map_count() * mock_config.desc_size;
+	*desc_size = mock_config.desc_size;
+	*desc_version = 1;
+	if (*map_size < need || !map) {
+		*map_size = need;
+		return EFI_BUFFER_TOO_SMALL;
+	}
+
+	memset(map, 0, need);
+	mock_map_fill((char *)map, mock_config.desc_size);
+	*map_size = need;
+	*map_key = mock_map_key;
+	return 0;
+}
+
+EFI_STATUS EFIAPI mock_exit_boot_services(EFI_HANDLE image, size_t map_key) {
+	mock_enter();
+	mock_stats.exit_calls++;
+	if (map_key != mock_map_key) {
+		return EFI_INVALID_PARAMETER;
+	}
+	if (mock_stale_left) {
+		// Something else allocated between the two calls
+		mock_stale_left--;
+		mock_map_key++;
+		return EFI_INVALID_PARAMETER;
+	}
+	mock_exited = true;
+	return 0;
+}
+
+// ---- events and files ----
+
+static void mock_event_complete(MockEvent *ev) {
+	EFI_FILE_IO_TOKEN *token = ev->token;
+	ev->pending = false;
+	ev->signaled = true;
+	mock_inflight--;
+
+	if (ev->fail) {
+		token->Status = EFI_DEVICE_ERROR;
+		return;
+	}
+	ssize_t got = pread(ev->file->fd, token->Buffer, ev->size, ev->offset);
+	token->Status = got < 0 ? EFI_DEVICE_ERROR : 0;
+	token->BufferSize = got < 0 ? 0 : (size_t)got;
+	mock_stats.read_bytes += token->BufferSize;
+}
+
+EFI_STATUS EFIAPI mock_create_event(uint32_t type, EFI_TPL tpl, EFI_EVENT_NOTIFY fn, void *ctx, EFI_EVENT *event) {
+	mock_enter();
+	MockEvent *ev = calloc(1, sizeof(MockEvent));
+	if (!ev) {
+		return EFI_OUT_OF_RESOURCES;
+	}
+	*event = ev;
+	return 0;
+}
+
+EFI_STATUS EFIAPI mock_close_event(EFI_EVENT event) {
+	mock_enter();
+	MockEvent *ev = event;
+	// A pending read would land in a buffer the caller thinks is idle
+	if (ev->pending) {
+		fprintf(stderr, "mock: event closed with a read in flight\n");
+		mock_event_complete(ev);
+	}
+	free(ev);
+	return 0;
+}
+
+EFI_STATUS EFIAPI mock_wait_for_event(size_t count, EFI_EVENT *events, size_t *index) {
+	mock_enter();
+	uint64_t start = mock_now();
+	for (;;) {
+		uint64_t now = mock_now();
+		uint64_t next = UINT64_MAX;
+		for (size_t i = 0; i < count; i++) {
+			MockEvent *ev = events[i];
+			if (ev->pending && ev->due <= now) {
+				mock_event_complete(ev);
+			}
+			if (ev->signaled) {
+				ev->signaled = false;
+				*index = i;
+				mock_stats.wait_ns += mock_now() - start;
+				return 0;
+			}
+			if (ev->pending && ev->due < next) {
+				next = ev->due;
+			}
+		}
+		// Nothing would ever signal, real firmware would hang here
+		if (next == UINT64_MAX) {
+			return EFI_INVALID_PARAMETER;
+		}
+		mock_sleep_until(next);
+	}
+}
+
+EFI_STATUS EFIAPI mock_check_event(EFI_EVENT event) {
+	mock_enter();
+	MockEvent *ev = event;
+	if (ev->pending && ev->due <= mock_now()) {
+		mock_event_complete(ev);
+	}
+	if (ev->signaled) {
+		ev->signaled = false;
+		return 0;
+	}
+	return EFI_NOT_READY;
+}
+
+static MockFile *mock_file_alloc(void) {
+	for (size_t i = 0; i < MOCK_MAX_FILES; i++) {
+		if (!mock_files[i].open) {
+			mock_files[i] = (MockFile){ .open = true, .fd = -1 };
+			return &mock_files[i];
+		}
+	}
+	return NULL;
+}
+
+EFI_STATUS EFIAPI mock_file_open(EFI_FILE *self, EFI_FILE **out, int16_t *name, uint64_t mode, uint64_t attributes);
+EFI_STATUS EFIAPI mock_file_close(EFI_FILE *self);
+EFI_STATUS EFIAPI mock_file_read(EFI_FILE *self, size_t *size, void *buffer);
+EFI_STATUS EFIAPI mock_file_read_ex(EFI_FILE *self, EFI_FILE_IO_TOKEN *token);
+EFI_STATUS EFIAPI mock_file_get_position(EFI_FILE *self, uint64_t *pos);
+EFI_STATUS EFIAPI mock_file_set_position(EFI_FILE *self, uint64_t pos);
+EFI_STATUS EFIAPI mock_file_get_info(EFI_FILE *self, EFI_GUID *type, size_t *size, void *buffer);
+
+static void mock_file_init(MockFile *f) {
+	f->file = (EFI_FILE){
+		.Revision = mock_config.sync_only ? 0x00010000 : EFI_FILE_PROTOCOL_REVISION2,
+		.Open = mock_file_open,
+		.Close = mock_file_close,
+		.Read = mock_file_read,
+		.GetPosition = mock_file_get_position,
+		.SetPosition = mock_file_set_position,
+		.GetInfo = mock_file_get_info,
+		.ReadEx = mock_config.sync_only ? NULL : mock_file_read_ex,
+	};
+}
+
+EFI_STATUS EFIAPI mock_file_open(EFI_FILE *self, EFI_FILE **out, int16_t *name, uint64_t mode, uint64_t attributes) {
+	mock_enter();
+	if (mode != EFI_FILE_MODE_READ) {
+		return EFI_UNSUPPORTED;
+	}
+
+	// UCS-2 to a host path, backslashes are the separator on the ESP
+	char path[1024];
+	size_t n = snprintf(path, sizeof(path), "%s/", mock_config.dir);
+	for (size_t i = 0; name[i] && n + 1 < sizeof(path); i++) {
+		path[n++] = name[i] == '\\' ? '/' : (char)name[i];
+	}
+	path[n] = 0;
+	mock_log("mock: open %s\n", path);
+
+	MockFile *f = mock_file_alloc();
+	if (!f) {
+		return EFI_OUT_OF_RESOURCES;
+	}
+	f->fd = open(path, O_RDONLY);
+	struct stat st;
+	if (f->fd < 0 || fstat(f->fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+		if (f->fd >= 0) {
+			close(f->fd);
+		}
+		f->open = false;
+		return EFI_NOT_FOUND;
+	}
+	f->size = st.st_size;
+	mock_file_init(f);
+	*out = &f->file;
+	return 0;
+}
+
+EFI_STATUS EFIAPI mock_file_close(EFI_FILE *self) {
+	mock_enter();
+	MockFile *f = (MockFile *)self;
+	if (f->fd >= 0) {
+		close(f->fd);
+	}
+	f->open = false;
+	return 0;
+}
+
+EFI_STATUS EFIAPI mock_file_read(EFI_FILE *self, size_t *size, void *buffer) {
+	mock_enter();
+	MockFile *f = (MockFile *)self;
+	if (f->root) {
+		return EFI_UNSUPPORTED;
+	}
+	if (f->pos >= f->size) {
+		*size = 0;
+		return 0;
+	}
+	if (*size > f->size - f->pos) {
+		*size = f->size - f->pos;
+	}
+
+	bool fail = mock_read_fails();
+	mock_sleep_until(mock_device_schedule(*size));
+	if (fail) {
+		return EFI_DEVICE_ERROR;
+	}
+
+	ssize_t got = pread(f->fd, buffer, *size, f->pos);
+	if (got < 0) {
+		return EFI_DEVICE_ERROR;
+	}
+	*size = got;
+	f->pos += got;
+	mock_stats.read_bytes += got;
+	return 0;
+}
+
+// The read happens when the event is reaped, so a buffer touched before its
+// token completes shows up as missing data rather than silently working
+EFI_STATUS EFIAPI mock_file_read_ex(EFI_FILE *self, EFI_FILE_IO_TOKEN *token) {
+	mock_enter();
+	MockFile *f = (MockFile *)self;
+	MockEvent *ev = token->Event;
+	if (f->root || !ev || ev->pending) {
+		return EFI_INVALID_PARAMETER;
+	}
+
+	size_t size = token->BufferSize;
+	if (f->pos >= f->size) {
+		size = 0;
+	} else if (size > f->size - f->pos) {
+		size = f->size - f->pos;
+	}
+
+	*ev = (MockEvent){
+		.pending = true,
+		.due = mock_device_schedule(size),
+		.file = f,
+		.token = token,
+		.offset = f->pos,
+		.size = size,
+		.fail = mock_read_fails(),
+	};
+	f->pos += size;
+
+	mock_inflight++;
+	if (mock_inflight > mock_stats.max_inflight) {
+		mock_stats.max_inflight = mock_inflight;
+	}
+	return 0;
+}
+
+EFI_STATUS EFIAPI mock_file_get_position(EFI_FILE *self, uint64_t *pos) {
+	mock_enter();
+	*pos = ((MockFile *)self)->pos;
+	return 0;
+}
+
+EFI_STATUS EFIAPI mock_file_set_position(EFI_FILE *self, uint64_t pos) {
+	mock_enter();
+	MockFile *f = (MockFile *)self;
+	f->pos = pos == UINT64_MAX ? f->size : pos;
+	return 0;
+}
+
+EFI_STATUS EFIAPI mock_file_get_info(EFI_FILE *self, EFI_GUID *type, size_t *size, void *buffer) {
+	mock_enter();
+	EFI_GUID file_info_guid = EFI_FILE_INFO_ID;
+	if (!guid_equal(type, &file_info_guid)) {
+		return EFI_UNSUPPORTED;
+	}
+
+	// Names aren't tracked, an empty one is still a valid EFI_FILE_INFO
+	size_t need = sizeof(EFI_FILE_INFO) + sizeof(int16_t);
+	if (*size < need) {
+		*size = need;
+		return EFI_BUFFER_TOO_SMALL;
+	}
+
+	MockFile *f = (MockFile *)self;
+	EFI_FILE_INFO *info = buffer;
+	memset(info, 0, need);
+	info->Size = need;
+	info->FileSize = f->size;
+	info->PhysicalSize = (f->size + 4095) & ~4095ULL;
+	info->Attribute = f->root ? 0x10 : 0;
+	*size = need;
+	return 0;
+}
+
+EFI_STATUS EFIAPI mock_open_volume(EFI_SIMPLE_FILE_SYSTEM_PROTOCOL *self, EFI_FILE **root) {
+	mock_enter();
+	MockFile *f = mock_file_alloc();
+	if (!f) {
+		return EFI_OUT_OF_RESOURCES;
+	}
+	mock_file_init(f);
+	f->root = true;
+	*root = &f->file;
+	return 0;
+}
+
+// ---- block devices ----
+
+static EFI_STATUS mock_disk_read(uint64_t offset, size_t size, void *buffer) {
+	if (offset > mock_fat_size || size > mock_fat_size - offset) {
+		return EFI_INVALID_PARAMETER;
+	}
+
+	bool fail = mock_read_fails();
+	mock_sleep_until(mock_device_schedule(size));
+	if (fail || pread(mock_fat_fd, buffer, size, offset) != (ssize_t)size) {
+		return EFI_DEVICE_ERROR;
+	}
+	mock_stats.read_bytes += size;
+	return 0;
+}
+
+EFI_STATUS EFIAPI mock_read_blocks(EFI_BLOCK_IO_PROTOCOL *self, uint32_t media_id, EFI_LBA lba, size_t size, void *buffer) {
+	mock_enter();
+	if (size % MOCK_FAT_BLOCK_SIZE) {
+		return EFI_INVALID_PARAMETER;
+	}
+	return mock_disk_read(lba * MOCK_FAT_BLOCK_SIZE, size, buffer);
+}
+
+EFI_STATUS EFIAPI mock_read_disk(EFI_DISK_IO_PROTOCOL *self, uint32_t media_id, uint64_t offset, size_t size, void *buffer) {
+	mock_enter();
+	return mock_disk_read(offset, size, buffer);
+}
+
+// ---- protocols and console ----
+
+EFI_STATUS EFIAPI mock_open_protocol(EFI_HANDLE handle, EFI_GUID *protocol, void **interface, EFI_HANDLE agent, EFI_HANDLE controller, uint32_t attributes) {
+	mock_enter();
+	EFI_GUID loaded_image_guid = EFI_LOADED_IMAGE_PROTOCOL_GUID;
+	EFI_GUID simple_fs_guid = EFI_SIMPLE_FILE_SYSTEM_PROTOCOL_GUID;
+	EFI_GUID block_io_guid = EFI_BLOCK_IO_PROTOCOL_GUID;
+	EFI_GUID disk_io_guid = EFI_DISK_IO_PROTOCOL_GUID;
+
+	if (handle == &mock_image_handle_tag && guid_equal(protocol, &loaded_image_guid)) {
+		*interface = &mock_loaded_image;
+		return 0;
+	}
+	if (handle == &mock_device_handle_tag) {
+		if (guid_equal(protocol, &simple_fs_guid)) {
+			*interface = &mock_simple_fs;
+			return 0;
+		}
+		if (mock_fat_fd >= 0 && guid_equal(protocol, &block_io_guid)) {
+			*interface = &mock_block_io;
+			return 0;
+		}
+		if (mock_fat_fd >= 0 && guid_equal(protocol, &disk_io_guid)) {
+			*interface = &mock_disk_io;
+			return 0;
+		}
+	}
+	return EFI_UNSUPPORTED;
+}
+
+// No GOP, the stub carries on headless
+EFI_STATUS EFIAPI mock_locate_protocol(EFI_GUID *protocol, void *registration, void **interface) {
+	mock_enter();
+	return EFI_NOT_FOUND;
+}
+
+EFI_STATUS EFIAPI mock_output_string(EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL *self, int16_t *str) {
+	if (mock_config.verbose) {
+		for (size_t i = 0; str[i]; i++) {
+			if (str[i] != '\r') {
+				fputc((char)str[i], stderr);
+			}
+		}
+	}
+	return 0;
+}
+
+EFI_STATUS EFIAPI mock_clear_screen(EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL *self) {
+	return 0;
+}
+
+// ---- ACPI ----
+
+static void mock_acpi_header(AcpiSdtHeader *h, const char *signature, uint32_t length) {
+	memcpy(h->signature, signature, 4);
+	h->length = length;
+	h->revision = 1;
+	memcpy(h->oem_id, "LUNK  ", 6);
+	memcpy(h->oem_table_id, "LUNKMOCK", 8);
+}
+
+static void mock_acpi_checksum(void *table, size_t length, uint8_t *field) {
+	*field = 0;
+	uint8_t sum = 0;
+	for (size_t i = 0; i < length; i++) {
+		sum += ((uint8_t *)table)[i];
+	}
+	*field = -sum;
+}
+
+// RSDP, XSDT and an MADT with one LAPIC per CPU. With more than one node, an
+// SRAT splits the high bank evenly and deals CPUs out round robin, and a SLIT
+// says remote is twice as far
+static void mock_acpi_build(char *at) {
+	uint32_t cpus = mock_config.cpus ? mock_config.cpus : 1;
+	uint32_t nodes = mock_config.numa_nodes;
+
+	AcpiRsdp *rsdp = (AcpiRsdp *)at;
+	AcpiSdtHeader *xsdt = (AcpiSdtHeader *)(at + 64);
+	uint64_t *xsdt_entries = (uint64_t *)(xsdt + 1);
+	char *next = at + 256;
+	size_t table_count = 0;
+
+	AcpiMadt *madt = (AcpiMadt *)next;
+	uint32_t madt_len = sizeof(AcpiMadt) + cpus * sizeof(MadtLapic);
+	mock_acpi_header(&madt->header, "APIC", madt_len);
+	madt->lapic_addr = 0xFEE00000;
+	for (uint32_t i = 0; i < cpus; i++) {
+		MadtLapic *l = (MadtLapic *)((char *)(madt + 1) + i * sizeof(MadtLapic));
+		*l = (MadtLapic){ .sub = { MADT_LAPIC, sizeof(MadtLapic) }, .processor_id = i, .apic_id = i, .flags = MADT_CPU_ENABLED };
+	}
+	mock_acpi_checksum(madt, madt_len, &madt->header.checksum);
+	xsdt_entries[table_count++] = (uint64_t)madt;
+	next += (madt_len + 15) & ~15;
+
+	if (nodes > 1) {
+		AcpiSrat *srat = (AcpiSrat *)next;
+		uint32_t srat_len = sizeof(AcpiSrat) + cpus * sizeof(SratLapicAffinity) + (nodes + 1) * sizeof(SratMemoryAffinity);
+		mock_acpi_header(&srat->header, "SRAT", srat_len);
+		srat->table_revision = 1;
+
+		char *cur = (char *)(srat + 1);
+		for (uint32_t i = 0; i < cpus; i++) {
+			SratLapicAffinity *c = (SratLapicAffinity *)cur;
+			*c = (SratLapicAffinity){ .sub = { SRAT_LAPIC_AFFINITY, sizeof(SratLapicAffinity) }, .domain_lo = i % nodes, .apic_id = i, .flags = SRAT_ENABLED };
+			cur += sizeof(SratLapicAffinity);
+		}
+
+		// Low memory goes with node 0, the high bank is cut into equal page-aligned slices
+		MockBank *low = &mock_banks[0], *high = &mock_banks[1];
+		SratMemoryAffinity *m = (SratMemoryAffinity *)cur;
+		*m = (SratMemoryAffinity){ .sub = { SRAT_MEMORY_AFFINITY, sizeof(SratMemoryAffinity) }, .domain = 0, .base = 0, .length = low->base + low->pages * EFI_PAGE_SIZE, .flags = SRAT_ENABLED };
+		cur += sizeof(SratMemoryAffinity);
+
+		uint64_t slice = (high->pages / nodes) * EFI_PAGE_SIZE;
+		for (uint32_t i = 0; i < nodes; i++) {
+			uint64_t base = high->base + i * slice;
+			uint64_t length = i + 1 == nodes ? high->base + high->pages * EFI_PAGE_SIZE - base : slice;
+			m = (SratMemoryAffinity *)cur;
+			*m = (SratMemoryAffinity){ .sub = { SRAT_MEMORY_AFFINITY, sizeof(SratMemoryAffinity) }, .domain = i, .base = base, .length = length, .flags = SRAT_ENABLED };
+			cur += sizeof(SratMemoryAffinity);
+		}
+		mock_acpi_checksum(srat, srat_len, &srat->header.checksum);
+		xsdt_entries[table_count++] = (uint64_t)srat;
+		next += (srat_len + 15) & ~15;
+
+		AcpiSlit *slit = (AcpiSlit *)next;
+		uint32_t slit_len = sizeof(AcpiSlit) + nodes * nodes;
+		mock_acpi_header(&slit->header, "SLIT", slit_len);
+		slit->locality_count = nodes;
+		uint8_t *matrix = (uint8_t *)(slit + 1);
+		for (uint32_t i = 0; i < nodes; i++) {
+			for (uint32_t j = 0; j < nodes; j++) {
+				matrix[i * nodes + j] = i == j ? NUMA_LOCAL_DISTANCE : NUMA_REMOTE_DISTANCE;
+			}
+		}
+		mock_acpi_checksum(slit, slit_len, &slit->header.checksum);
+		xsdt_entries[table_count++] = (uint64_t)slit;
+	}
+
+	uint32_t xsdt_len = sizeof(AcpiSdtHeader) + table_count * sizeof(uint64_t);
+	mock_acpi_header(xsdt, "XSDT", xsdt_len);
+	mock_acpi_checksum(xsdt, xsdt_len, &xsdt->checksum);
+
+	memcpy(rsdp->signature, "RSD PTR ", 8);
+	memcpy(rsdp->oem_id, "LUNK  ", 6);
+	rsdp->revision = 2;
+	rsdp->length = sizeof(AcpiRsdp);
+	rsdp->xsdt_addr = (uint64_t)xsdt;
+	mock_acpi_checksum(rsdp, 20, &rsdp->checksum);
+	mock_acpi_checksum(rsdp, sizeof(AcpiRsdp), &rsdp->ext_checksum);
+}
+
+// ---- setup ----
+
+static bool mock_bank_map(MockBank *b, uint64_t base, uint64_t size) {
+	void *p = mmap((void *)base, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE | MAP_NORESERVE, -1, 0);
+	if (p == MAP_FAILED || p != (void *)base) {
+		fprintf(stderr, "mock: can't map %#lx bytes at %#lx: %s\n", size, base, strerror(errno));
+		return false;
+	}
+
+	b->base = base;
+	b->pages = size / EFI_PAGE_SIZE;
+	b->types = malloc(b->pages * sizeof(uint32_t));
+	b->initial = malloc(b->pages * sizeof(uint32_t));
+	for (uint64_t i = 0; i < b->pages; i++) {
+		b->initial[i] = EfiConventionalMemory;
+	}
+	return true;
+}
+
+// Puts the whole mock back to its just-booted state, with the same memory
+// layout every time so runs are comparable
+void mock_reset(void) {
+	for (size_t i = 0; i < mock_bank_count; i++) {
+		memcpy(mock_banks[i].types, mock_banks[i].initial, mock_banks[i].pages * sizeof(uint32_t));
+	}
+	for (size_t i = 0; i < MOCK_MAX_FILES; i++) {
+		if (mock_files[i].open) {
+			mock_file_close(&mock_files[i].file);
+		}
+	}
+	while (mock_pools.next != &mock_pools) {
+		mock_free_pool(mock_pools.next + 1);
+	}
+
+	mock_stats = (MockStats){0};
+	mock_inflight = 0;
+	mock_map_key = 1;
+	mock_stale_left = mock_config.stale_exits;
+	mock_exited = false;
+	mock_device_free = 0;
+	mock_read_index = 0;
+	mock_alloc_index = 0;
+}
+
+bool mock_init(MockConfig *config) {
+	mock_config = *config;
+	if (!mock_config.desc_size) {
+		mock_config.desc_size = 48;
+	}
+	if (mock_config.desc_size < sizeof(EFI_MEMORY_DESCRIPTOR) || mock_config.desc_size > 256) {
+		fprintf(stderr, "mock: bad descriptor size %zu\n", mock_config.desc_size);
+		return false;
+	}
+	if (!mock_config.mem_size) {
+		mock_config.mem_size = 256ULL << 20;
+	}
+	mock_config.mem_size &= ~(uint64_t)(2 * 1024 * 1024 - 1);
+	if (mock_config.mem_size < 32ULL << 20 || MOCK_HIGH_BASE + mock_config.mem_size > 0x100000000ULL) {
+		fprintf(stderr, "mock: memory size must be between 32 MiB and 3 GiB\n");
+		return false;
+	}
+	if (mock_config.numa_nodes > MAX_NUMA_NODES) {
+		mock_config.numa_nodes = MAX_NUMA_NODES;
+	}
+
+	if (!mock_bank_map(&mock_banks[0], MOCK_LOW_BASE, MOCK_LOW_END - MOCK_LOW_BASE) ||
+		!mock_bank_map(&mock_banks[1], MOCK_HIGH_BASE, mock_config.mem_size)) {
+		return false;
+	}
+	mock_bank_count = 2;
+
+	// Top of the high bank: ACPI tables, runtime services, then the firmware's
+	// own boot services memory
+	MockBank *high = &mock_banks[1];
+	uint64_t top = high->pages;
+	top -= MOCK_ACPI_PAGES;
+	mock_range_set(high->initial, top, MOCK_ACPI_PAGES, EfiACPIReclaimMemory);
+	top -= MOCK_RUNTIME_PAGES;
+	mock_range_set(high->initial, top, MOCK_RUNTIME_PAGES, EfiRuntimeServicesData);
+	top -= MOCK_BS_PAGES;
+	mock_range_set(high->initial, top, MOCK_BS_PAGES, EfiBootServicesCode);
+
+	uint64_t rng = mock_config.seed | 1;
+	for (size_t i = 0; i < mock_config.fragments; i++) {
+		uint64_t page = mock_rand(&rng) % top;
+		high->initial[page] = (i & 1) ? EfiBootServicesData : EfiLoaderData;
+	}
+	mock_acpi_build((char *)(high->base + (high->pages - MOCK_ACPI_PAGES) * EFI_PAGE_SIZE));
+
+	if (mock_config.fat_image) {
+		mock_fat_fd = open(mock_config.fat_image, O_RDONLY);
+		struct stat st;
+		if (mock_fat_fd < 0 || fstat(mock_fat_fd, &st) != 0) {
+			fprintf(stderr, "mock: can't open %s: %s\n", mock_config.fat_image, strerror(errno));
+			return false;
+		}
+		mock_fat_size = st.st_size & ~(uint64_t)(MOCK_FAT_BLOCK_SIZE - 1);
+		mock_block_media = (EFI_BLOCK_IO_MEDIA){ .MediaPresent = true, .LogicalPartition = true, .ReadOnly = true, .BlockSize = MOCK_FAT_BLOCK_SIZE, .LastBlock = mock_fat_size / MOCK_FAT_BLOCK_SIZE - 1 };
+		mock_block_io = (EFI_BLOCK_IO_PROTOCOL){ .Revision = 0x00010000, .Media = &mock_block_media, .ReadBlocks = mock_read_blocks };
+		mock_disk_io = (EFI_DISK_IO_PROTOCOL){ .Revision = 0x00010000, .ReadDisk = mock_read_disk };
+	}
+
+	mock_con_out = (EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL){ .OutputString = mock_output_string, .ClearScreen = mock_clear_screen };
+	mock_bs = (EFI_BOOT_SERVICES){
+		.AllocatePages = mock_allocate_pages,
+		.FreePages = mock_free_pages,
+		.GetMemoryMap = mock_get_memory_map,
+		.AllocatePool = mock_allocate_pool,
+		.FreePool = mock_free_pool,
+		.CreateEvent = mock_create_event,
+		.WaitForEvent = mock_wait_for_event,
+		.CloseEvent = mock_close_event,
+		.CheckEvent = mock_check_event,
+		.ExitBootServices = mock_exit_boot_services,
+		.OpenProtocol = mock_open_protocol,
+		.LocateProtocol = mock_locate_protocol,
+	};
+
+	EFI_GUID acpi20_guid = EFI_ACPI_20_TABLE_GUID;
+	mock_config_tables[0] = (EFI_CONFIGURATION_TABLE){ .VendorGuid = acpi20_guid, .VendorTable = (void *)(high->base + (high->pages - MOCK_ACPI_PAGES) * EFI_PAGE_SIZE) };
+
+	mock_st = (EFI_SYSTEM_TABLE){
+		.ConOut = &mock_con_out,
+		.StdErr = &mock_con_out,
+		.RuntimeServices = &mock_rt,
+		.BootServices = &mock_bs,
+		.NumberOfTableEntries = 1,
+		.ConfigurationTable = mock_config_tables,
+	};
+	mock_loaded_image = (EFI_LOADED_IMAGE_PROTOCOL){ .Revision = 0x1000, .SystemTable = &mock_st, .DeviceHandle = &mock_device_handle_tag };
+	mock_simple_fs = (EFI_SIMPLE_FILE_SYSTEM_PROTOCOL){ .Revision = 0x00010000, .OpenVolume = mock_open_volume };
+
+	mock_reset();
+	return true;
+}
+
+EFI_SYSTEM_TABLE *mock_system_table(void) {
+	return &mock_st;
+}
+
+EFI_HANDLE mock_image_handle(void) {
+	return &mock_image_handle_tag;
+}
@@ -3,56 +3,1264 @@
 #include <stdbool.h>
 
 #include "efi.h"
+#include "elf.h"
+#include "boot_info.h"
+#include "paging.h"
+#include "cpu.h"
+#include "trace.h"
+#include "log.h"
+#include "mem.c"
+#include "acpi.c"
+#include "lz4.h"
+#include "crc32c.h"
+#include "fat.c"
 
 void println(EFI_SYSTEM_TABLE *st, uint16_t *str) {
 	st->ConOut->OutputString(st->ConOut, (int16_t *)str);
 	st->ConOut->OutputString(st->ConOut, (int16_t *)L"\n\r");
 }
 
+TraceRing *boot_trace;
+LogRing *boot_log;
+
+// Only efi_main's own flow logs. Read completions run as event callbacks and
+// could land in the middle of a record
+void log_write(uint32_t id, uint32_t argc, const uint64_t *args) {
+	if (boot_log) {
+		log_record(boot_log, rdtsc(), id, argc, args);
+	}
+}
+
+#ifdef LUNK_HOST
+// Stands in for loader.bin when the stub runs as a Linux process against efi_mock.c
+EFI_STATUS host_loader_entry(BootInfo *info);
+#endif
+
 #define panic(x, y) do { println((x), (y)); return 1; } while (false);
 
-#define LOADER_BUFFER_SIZE (1 * 1024 * 1024)
-#define KERNEL_BUFFER_SIZE (1 * 1024 * 1024)
+#define KERNEL_STACK_SIZE (64 * 1024)
+
+// Lets the kernel cover its own image with 2 MiB pages
+#define KERNEL_ALIGN (2 * 1024 * 1024)
+
+// Everything the kernel keeps from the stub is allocated with this OS-defined
+// type, so it reads back out of the final memory map as MemRegionBoot
+#define EfiLunkBootData ((EFI_MEMORY_TYPE)0x80000000)
+
+// Slack for descriptors split by the map and region table allocations themselves
+#define MEM_MAP_SLACK_DESCS (8)
+#define EXIT_BOOT_RETRIES (8)
+
+// Files are pulled in LOAD_CHUNK_SIZE pieces, with up to LOAD_MAX_INFLIGHT
+// ReadEx tokens outstanding across all files at once
+#define LOAD_CHUNK_SIZE (256 * 1024)
+#define LOAD_MAX_INFLIGHT (8)
+
+typedef struct {
+	EFI_FILE *file;
+	char *dest;
+	size_t capacity;
+
+	size_t queued;
+	size_t landed;
+	size_t inflight;
+	bool eof;
+	bool sync;
+	// `file` was opened for this job alone, load_files closes it when done
+	bool own_file;
+	// Trace arg for the file_read point
+	uint32_t index;
+
+	// Set for .lz4 files: dest is only a staging buffer for the frame, which is
+	// decoded block by block into the stream's output as the reads land
+	Lz4Stream *lz;
+
+	// Set when the file was found on the raw FAT volume, reads then bypass
+	// `file` entirely and start at byte `offset` of it
+	FatFile *fat;
+	uint64_t offset;
+
+	// CRC32C of the file bytes landed so far, from `offset` on. Always the
+	// bytes as stored, so compressed jobs check the frame, not its output
+	uint32_t crc;
+} LoadJob;
+
+typedef struct {
+	EFI_FILE_IO_TOKEN token;
+	LoadJob *job;
+	size_t requested;
+} LoadSlot;
+
+LoadSlot load_slots[LOAD_MAX_INFLIGHT];
+
+EFI_STATUS load_sync(LoadJob *job) {
+	while (!job->eof && job->landed < job->capacity) {
+		size_t size = job->capacity - job->landed;
+		EFI_STATUS status = job->file->Read(job->file, &size, job->dest + job->landed);
+		if (status != 0) {
+			return status;
+		}
+
+		if (size < job->capacity - job->landed) {
+			job->eof = true;
+		}
+		job->crc = crc32c_update(job->crc, job->dest + job->landed, size);
+		job->landed += size;
+	}
+	if (job->lz && !lz4_stream_feed(job->lz, job->dest, job->landed)) {
+		return EFI_LOAD_ERROR;
+	}
+	trace_point(TraceFileRead, job->index);
+	return 0;
+}
+
+// Direct volume reads, one request per contiguous run of clusters. Compressed
+// frames decode after each run, so the decoder only waits on the runs it needs
+EFI_STATUS load_fat(EFI_SYSTEM_TABLE *st, LoadJob *job) {
+	FatFile *fat = job->fat;
+	if (job->offset > fat->size) {
+		return EFI_LOAD_ERROR;
+	}
+	uint64_t size = job->capacity;
+	if (size > fat->size - job->offset) {
+		size = fat->size - job->offset;
+		job->eof = true;
+	}
+
+	FatRun *runs;
+	size_t run_count;
+	EFI_STATUS status = fat_resolve(st, fat, job->offset, size, &runs, &run_count);
+	for (size_t i = 0; i < run_count && status == 0; i++) {
+		status = fat_read_disk(fat->vol, runs[i].disk_offset, runs[i].bytes, job->dest + job->landed);
+		if (status != 0) {
+			break;
+		}
+		job->crc = crc32c_update(job->crc, job->dest + job->landed, runs[i].bytes);
+		job->landed += runs[i].bytes;
+		if (job->lz && !lz4_stream_feed(job->lz, job->dest, job->landed)) {
+			status = EFI_LOAD_ERROR;
+		}
+	}
+	if (runs) {
+		st->BootServices->FreePool(runs);
+	}
+	if (status != 0) {
+		return status;
+	}
+	trace_point(TraceFileRead, job->index);
+	return 0;
+}
+
+// Points `jobs` at `name` on the FAT volume. Jobs keep their SimpleFS handles
+// and stay on that path if the FAT reader can't find the file
+void load_attach_fat(EFI_SYSTEM_TABLE *st, FatVolume *vol, int16_t *name, FatFile *file, LoadJob *jobs, size_t job_count) {
+	if (fat_find(st, vol, name, file) != 0) {
+		return;
+	}
+	for (size_t i = 0; i < job_count; i++) {
+		jobs[i].fat = file;
+	}
+}
+
+LoadJob *load_next_job(LoadJob *jobs, size_t job_count, size_t *cursor) {
+	for (size_t i = 0; i < job_count; i++) {
+		LoadJob *job = &jobs[(*cursor + i) % job_count];
+		if (!job->eof && !job->sync && job->queued < job->capacity) {
+			*cursor = (*cursor + i + 1) % job_count;
+			return job;
+		}
+	}
+	return NULL;
+}
+
+EFI_STATUS load_submit(LoadSlot *slot, LoadJob *job) {
+	size_t size = job->capacity - job->queued;
+	if (size > LOAD_CHUNK_SIZE) {
+		size = LOAD_CHUNK_SIZE;
+	}
+
+	slot->token.Status = 0;
+	slot->token.BufferSize = size;
+	slot->token.Buffer = job->dest + job->queued;
+
+	EFI_STATUS status = job->file->ReadEx(job->file, &slot->token);
+	if (status != 0) {
+		return status;
+	}
+
+	slot->job = job;
+	slot->requested = size;
+	job->queued += size;
+	job->inflight++;
+	return 0;
+}
+
+// Reaps one finished slot, returns the token's completion status
+EFI_STATUS load_complete(LoadSlot *slot) {
+	LoadJob *job = slot->job;
+	slot->job = NULL;
+	job->inflight--;
+
+	if (slot->token.Status != 0) {
+		return slot->token.Status;
+	}
+
+	// Requests on a single handle complete in submission order, so a short read
+	// means every later token for this file will come back empty. The same
+	// ordering lets the CRC run over each chunk while later ones are in flight
+	job->crc = crc32c_update(job->crc, job->dest + job->landed, slot->token.BufferSize);
+	job->landed += slot->token.BufferSize;
+	if (slot->token.BufferSize < slot->requested) {
+		job->eof = true;
+	}
+
+	// Later chunks are still being read while this one decompresses
+	if (job->lz && !lz4_stream_feed(job->lz, job->dest, job->landed)) {
+		return EFI_LOAD_ERROR;
+	}
+	if (job->inflight == 0 && (job->eof || job->landed == job->capacity)) {
+		trace_point(TraceFileRead, job->index);
+	}
+	return 0;
+}
+
+size_t load_wait_list(size_t slot_count, EFI_EVENT *events, size_t *owners) {
+	size_t count = 0;
+	for (size_t i = 0; i < slot_count; i++) {
+		if (load_slots[i].job) {
+			events[count] = load_slots[i].token.Event;
+			owners[count] = i;
+			count++;
+		}
+	}
+	return count;
+}
+
+// Tokens point into the image buffers, so nothing may be abandoned mid-flight
+void load_drain(EFI_SYSTEM_TABLE *st, size_t slot_count) {
+	EFI_EVENT events[LOAD_MAX_INFLIGHT];
+	size_t owners[LOAD_MAX_INFLIGHT];
+
+	size_t count;
+	while ((count = load_wait_list(slot_count, events, owners)) > 0) {
+		size_t index;
+		if (st->BootServices->WaitForEvent(count, events, &index) != 0) {
+			return;
+		}
+		load_complete(&load_slots[owners[index]]);
+	}
+}
+
+EFI_STATUS load_files(EFI_SYSTEM_TABLE *st, LoadJob *jobs, size_t job_count) {
+	EFI_STATUS status;
+
+	// Revision 1 file protocols have no ReadEx, stick to the blocking path
+	size_t slot_count = 0;
+	bool async = false;
+	for (size_t i = 0; i < job_count; i++) {
+		jobs[i].index = i;
+		if (jobs[i].fat) {
+			jobs[i].sync = true;
+		} else if (jobs[i].file->Revision < EFI_FILE_PROTOCOL_REVISION2 || jobs[i].file->ReadEx == NULL) {
+			jobs[i].sync = true;
+		} else {
+			async = true;
+		}
+	}
+
+	if (async) {
+		for (; slot_count < LOAD_MAX_INFLIGHT; slot_count++) {
+			LoadSlot *slot = &load_slots[slot_count];
+			slot->job = NULL;
+			status = st->BootServices->CreateEvent(0, TPL_CALLBACK, NULL, NULL, &slot->token.Event);
+			if (status != 0) {
+				break;
+			}
+		}
+	}
+
+	if (slot_count == 0) {
+		for (size_t i = 0; i < job_count; i++) {
+			jobs[i].sync = true;
+		}
+	}
+
+	size_t cursor = 0;
+	for (;;) {
+		for (size_t i = 0; i < slot_count; i++) {
+			if (load_slots[i].job) {
+				continue;
+			}
+
+			LoadJob *job;
+			while ((job = load_next_job(jobs, job_count, &cursor)) != NULL) {
+				status = load_submit(&load_slots[i], job);
+				if (status == 0) {
+					break;
+				}
+
+				// Some drivers advertise Revision 2 but don't implement it,
+				// that's only recoverable before the first chunk went out
+				if (status == EFI_UNSUPPORTED && job->queued == 0) {
+					job->sync = true;
+					continue;
+				}
+
+				load_drain(st, slot_count);
+				goto done;
+			}
+			if (!job) {
+				break;
+			}
+		}
+
+		EFI_EVENT events[LOAD_MAX_INFLIGHT];
+		size_t owners[LOAD_MAX_INFLIGHT];
+		size_t count = load_wait_list(slot_count, events, owners);
+		if (count == 0) {
+			break;
+		}
+
+		size_t index;
+		status = st->BootServices->WaitForEvent(count, events, &index);
+		if (status != 0) {
+			load_drain(st, slot_count);
+			goto done;
+		}
+
+		status = load_complete(&load_slots[owners[index]]);
+		if (status != 0) {
+			load_drain(st, slot_count);
+			goto done;
+		}
+	}
+
+	status = 0;
+	for (size_t i = 0; i < job_count && status == 0; i++) {
+		if (jobs[i].sync) {
+			status = jobs[i].fat ? load_fat(st, &jobs[i]) : load_sync(&jobs[i]);
+		}
+	}
+
+done:
+	for (size_t i = 0; i < slot_count; i++) {
+		st->BootServices->CloseEvent(load_slots[i].token.Event);
+	}
+	// Nothing is in flight any more, on success or failure
+	for (size_t i = 0; i < job_count; i++) {
+		if (jobs[i].own_file) {
+			jobs[i].file->Close(jobs[i].file);
+			jobs[i].own_file = false;
+		}
+	}
+	return status;
+}
+
+// Everything read, and for compressed files everything decoded
+bool load_job_done(LoadJob *job) {
+	if (job->landed != job->capacity) {
+		return false;
+	}
+	return !job->lz || lz4_stream_complete(job->lz);
+}
+
+EFI_STATUS file_size(EFI_SYSTEM_TABLE *st, EFI_FILE *file, uint64_t *size) {
+	EFI_GUID file_info_guid = EFI_FILE_INFO_ID;
+
+	// Enough for any 8.3 or reasonably long name, retried from the pool otherwise
+	uint64_t info_buffer[(sizeof(EFI_FILE_INFO) + 256 * sizeof(int16_t)) / sizeof(uint64_t)];
+	EFI_FILE_INFO *info = (EFI_FILE_INFO *)info_buffer;
+	size_t info_size = sizeof(info_buffer);
+
+	EFI_STATUS status = file->GetInfo(file, &file_info_guid, &info_size, info);
+	if (status == EFI_BUFFER_TOO_SMALL) {
+		status = st->BootServices->AllocatePool(EfiLoaderData, info_size, (void **)&info);
+		if (status != 0) {
+			return status;
+		}
+
+		status = file->GetInfo(file, &file_info_guid, &info_size, info);
+		if (status == 0) {
+			*size = info->FileSize;
+		}
+		st->BootServices->FreePool(info);
+		return status;
+	}
+	if (status != 0) {
+		return status;
+	}
+
+	*size = info->FileSize;
+	return 0;
+}
+
+// Allocates exactly enough pages for `size` bytes, starting on an `align` boundary.
+// Over-allocates by the alignment and gives the unused head and tail back
+EFI_STATUS alloc_pages(EFI_SYSTEM_TABLE *st, EFI_MEMORY_TYPE type, uint64_t size, uint64_t align, EFI_PHYSICAL_ADDRESS *addr) {
+	size_t pages = EFI_SIZE_TO_PAGES(size);
+	if (align <= EFI_PAGE_SIZE) {
+		return st->BootServices->AllocatePages(AllocateAnyPages, type, pages, addr);
+	}
+
+	size_t slack = EFI_SIZE_TO_PAGES(align) - 1;
+	EFI_PHYSICAL_ADDRESS base;
+	EFI_STATUS status = st->BootServices->AllocatePages(AllocateAnyPages, type, pages + slack, &base);
+	if (status != 0) {
+		return status;
+	}
+
+	EFI_PHYSICAL_ADDRESS aligned = (base + align - 1) & ~(align - 1);
+	size_t head = (aligned - base) / EFI_PAGE_SIZE;
+	size_t tail = slack - head;
+	if (head) {
+		st->BootServices->FreePages(base, head);
+	}
+	if (tail) {
+		st->BootServices->FreePages(aligned + pages * EFI_PAGE_SIZE, tail);
+	}
+
+	*addr = aligned;
+	return 0;
+}
+
+typedef struct {
+	Elf64_Ehdr ehdr;
+	Elf64_Phdr phdrs[ELF_MAX_PHDRS];
+	uint64_t min_vaddr;
+	uint64_t span;
+	char *image;
+} KernelImage;
+
+KernelImage kernel_image;
+
+// The ESP itself, for reading boot files underneath SimpleFS
+FatVolume boot_volume;
+
+EFI_STATUS read_at(EFI_FILE *file, uint64_t offset, size_t size, void *buffer) {
+	EFI_STATUS status = file->SetPosition(file, offset);
+	if (status != 0) {
+		return status;
+	}
+
+	size_t got = size;
+	status = file->Read(file, &got, buffer);
+	if (status != 0) {
+		return status;
+	}
+	return (got == size) ? 0 : EFI_LOAD_ERROR;
+}
+
+// Opens `name`.lz4 when it's there, the plain file otherwise
+EFI_STATUS open_boot_file(EFI_FILE *fs_root, int16_t *name, int16_t *lz_name, EFI_FILE **file, bool *compressed) {
+	EFI_STATUS status = fs_root->Open(fs_root, file, lz_name, EFI_FILE_MODE_READ, 0);
+	if (status == 0) {
+		*compressed = true;
+		return 0;
+	}
+
+	*compressed = false;
+	return fs_root->Open(fs_root, file, name, EFI_FILE_MODE_READ, 0);
+}
+
+// Decompressed size from the frame header, leaves the file at offset 0
+EFI_STATUS lz4_file_content_size(EFI_FILE *file, uint64_t *size) {
+	uint8_t header[LZ4_HEADER_SIZE];
+	EFI_STATUS status = read_at(file, 0, sizeof(header), header);
+	if (status != 0) {
+		return status;
+	}
+
+	Lz4FrameHeader frame;
+	if (lz4_parse_header(header, sizeof(header), &frame) <= 0) {
+		return EFI_LOAD_ERROR;
+	}
+	*size = frame.content_size;
+	return file->SetPosition(file, 0);
+}
+
+// manifest.txt on the ESP lists every boot file as "crc32c size name", one per
+// line, written by make_iso.sh. Without it boot goes ahead unverified
+#define MANIFEST_MAX_ENTRIES 16
+#define MANIFEST_MAX_NAME 32
+#define MANIFEST_MAX_SIZE 4096
+// Gaps between a kernel's segments are read back in pieces this big
+#define VERIFY_CHUNK_SIZE (64 * 1024)
+
+typedef struct {
+	char name[MANIFEST_MAX_NAME];
+	uint32_t crc;
+	uint64_t size;
+} ManifestEntry;
+
+typedef struct {
+	bool present;
+	size_t count;
+	ManifestEntry entries[MANIFEST_MAX_ENTRIES];
+} Manifest;
+
+Manifest boot_manifest;
+
+bool manifest_parse(Manifest *m, char *text, size_t len) {
+	char *p = text, *end = text + len;
+	while (p < end) {
+		if (*p == '\r' || *p == '\n') {
+			p++;
+			continue;
+		}
+		if (m->count == MANIFEST_MAX_ENTRIES) {
+			return false;
+		}
+		ManifestEntry *e = &m->entries[m->count];
+		*e = (ManifestEntry){0};
+
+		int digits = 0;
+		for (; p < end && digits < 8; p++, digits++) {
+			char c = *p;
+			uint32_t v = (c >= '0' && c <= '9') ? c - '0' : (c >= 'a' && c <= 'f') ? c - 'a' + 10 : (c >= 'A' && c <= 'F') ? c - 'A' + 10 : 16;
+			if (v == 16) {
+				break;
+			}
+			e->crc = (e->crc << 4) | v;
+		}
+		if (digits != 8 || p == end || *p != ' ') {
+			return false;
+		}
+		for (; p < end && *p == ' '; p++) {
+		}
+
+		digits = 0;
+		for (; p < end && *p >= '0' && *p <= '9'; p++, digits++) {
+			e->size = e->size * 10 + (*p - '0');
+		}
+		if (digits == 0 || p == end || *p != ' ') {
+			return false;
+		}
+		for (; p < end && *p == ' '; p++) {
+		}
+
+		size_t n = 0;
+		for (; p < end && *p != '\r' && *p != '\n' && *p != ' '; p++) {
+			if (n + 1 == MANIFEST_MAX_NAME) {
+				return false;
+			}
+			e->name[n++] = *p;
+		}
+		if (n == 0) {
+			return false;
+		}
+		m->count++;
+	}
+	return true;
+}
+
+EFI_STATUS manifest_load(EFI_SYSTEM_TABLE *st, EFI_FILE *fs_root, Manifest *m) {
+	*m = (Manifest){0};
+
+	EFI_FILE *file;
+	if (fs_root->Open(fs_root, &file, (int16_t *)L"manifest.txt", EFI_FILE_MODE_READ, 0) != 0) {
+		return 0;
+	}
+
+	uint64_t size;
+	EFI_STATUS status = file_size(st, file, &size);
+	if (status == 0 && size > MANIFEST_MAX_SIZE) {
+		status = EFI_LOAD_ERROR;
+	}
+
+	char text[MANIFEST_MAX_SIZE];
+	if (status == 0) {
+		status = read_at(file, 0, size, text);
+	}
+	if (status == 0 && !manifest_parse(m, text, size)) {
+		status = EFI_LOAD_ERROR;
+	}
+	file->Close(file);
+
+	m->present = status == 0;
+	return status;
+}
+
+ManifestEntry *manifest_find(Manifest *m, int16_t *name) {
+	for (size_t i = 0; i < m->count; i++) {
+		char *a = m->entries[i].name;
+		size_t k = 0;
+		for (; a[k] && name[k] && a[k] == name[k]; k++) {
+		}
+		if (a[k] == 0 && name[k] == 0) {
+			return &m->entries[i];
+		}
+	}
+	return NULL;
+}
+
+// CRC32C of [offset, offset + size) of `file`, for the bytes no LoadJob covered
+EFI_STATUS verify_read_range(EFI_SYSTEM_TABLE *st, EFI_FILE *file, uint64_t offset, uint64_t size, uint32_t *crc) {
+	char *buffer;
+	EFI_STATUS status = st->BootServices->AllocatePool(EfiLoaderData, VERIFY_CHUNK_SIZE, (void **)&buffer);
+	if (status != 0) {
+		return status;
+	}
+
+	*crc = 0;
+	while (size && status == 0) {
+		size_t n = size < VERIFY_CHUNK_SIZE ? size : VERIFY_CHUNK_SIZE;
+		status = read_at(file, offset, n, buffer);
+		*crc = crc32c_update(*crc, buffer, n);
+		offset += n;
+		size -= n;
+	}
+	st->BootServices->FreePool(buffer);
+	return status;
+}
+
+size_t ucs2_append(uint16_t *out, size_t n, const char *s) {
+	for (; *s; s++) {
+		out[n++] = *s;
+	}
+	return n;
+}
+
+size_t ucs2_append_hex(uint16_t *out, size_t n, uint32_t v) {
+	for (int shift = 28; shift >= 0; shift -= 4) {
+		out[n++] = "0123456789abcdef"[(v >> shift) & 0xF];
+	}
+	return n;
+}
+
+// "Integrity check failed for <name><detail>", plus both digests when they differ
+void verify_report(EFI_SYSTEM_TABLE *st, int16_t *name, const char *detail, uint32_t expected, uint32_t got) {
+	uint16_t msg[160];
+	size_t n = ucs2_append(msg, 0, "Integrity check failed for ");
+	for (size_t i = 0; name[i] && i < MANIFEST_MAX_NAME; i++) {
+		msg[n++] = name[i];
+	}
+	n = ucs2_append(msg, n, detail);
+	if (expected != got) {
+		n = ucs2_append(msg, n, " expected ");
+		n = ucs2_append_hex(msg, n, expected);
+		n = ucs2_append(msg, n, ", read ");
+		n = ucs2_append_hex(msg, n, got);
+	}
+	msg[n] = 0;
+	println(st, msg);
+}
+
+// Checks one boot file against the manifest. Its jobs' CRCs were taken as the
+// chunks landed; only bytes no job read (ELF headers, padding between
+// segments, the section table) are read again here, then it's all combined
+// in file order
+EFI_STATUS verify_file(EFI_SYSTEM_TABLE *st, int16_t *name, EFI_FILE *file, LoadJob *jobs, size_t job_count) {
+	ManifestEntry *entry = manifest_find(&boot_manifest, name);
+	if (!entry) {
+		verify_report(st, name, ": not in manifest.txt", 0, 0);
+		return EFI_LOAD_ERROR;
+	}
+
+	uint64_t size;
+	EFI_STATUS status = file_size(st, file, &size);
+	if (status != 0) {
+		return status;
+	}
+	if (size != entry->size) {
+		verify_report(st, name, ": size differs from manifest.txt", 0, 0);
+		return EFI_LOAD_ERROR;
+	}
+
+	LoadJob *order[2 + ELF_MAX_PHDRS];
+	for (size_t i = 0; i < job_count; i++) {
+		size_t k = i;
+		for (; k > 0 && order[k - 1]->offset > jobs[i].offset; k--) {
+			order[k] = order[k - 1];
+		}
+		order[k] = &jobs[i];
+	}
+
+	uint32_t crc = 0;
+	uint64_t cursor = 0;
+	for (size_t i = 0; i <= job_count && status == 0; i++) {
+		uint64_t next = i < job_count ? order[i]->offset : size;
+		if (next < cursor) {
+			// Segments sharing file bytes, the streamed CRCs can't be stitched together
+			status = verify_read_range(st, file, 0, size, &crc);
+			cursor = size;
+			break;
+		}
+		if (next > cursor) {
+			uint32_t gap;
+			status = verify_read_range(st, file, cursor, next - cursor, &gap);
+			crc = crc32c_combine(crc, gap, next - cursor);
+			cursor = next;
+		}
+		if (i < job_count) {
+			crc = crc32c_combine(crc, order[i]->crc, order[i]->landed);
+			cursor += order[i]->landed;
+		}
+	}
+	if (status != 0) {
+		return status;
+	}
+
+	if (crc != entry->crc) {
+		verify_report(st, name, ":", entry->crc, crc);
+		return EFI_LOAD_ERROR;
+	}
+	return 0;
+}
+
+// Queues a whole .lz4 file into a reclaimable staging buffer, decoding into `out`
+EFI_STATUS load_job_lz4(EFI_SYSTEM_TABLE *st, EFI_FILE *file, void *out, uint64_t out_size, Lz4Stream *stream, LoadJob *job) {
+	uint64_t size;
+	EFI_STATUS status = file_size(st, file, &size);
+	if (status != 0) {
+		return status;
+	}
+
+	EFI_PHYSICAL_ADDRESS staging;
+	status = st->BootServices->AllocatePages(AllocateAnyPages, EfiLoaderData, EFI_SIZE_TO_PAGES(size), &staging);
+	if (status != 0) {
+		return status;
+	}
+
+	lz4_stream_init(stream, out, out_size);
+	*job = (LoadJob){ .file = file, .dest = (char *)staging, .capacity = size, .lz = stream };
+	return 0;
+}
+
+// Page-aligned home for the initrd that the kernel keeps, queued like any other boot file
+EFI_STATUS initrd_prepare(EFI_SYSTEM_TABLE *st, EFI_FILE *file, bool compressed, Lz4Stream *stream, LoadJob *job, BootInfo *info) {
+	uint64_t size;
+	EFI_STATUS status = compressed ? lz4_file_content_size(file, &size) : file_size(st, file, &size);
+	if (status != 0) {
+		return status;
+	}
+
+	EFI_PHYSICAL_ADDRESS addr;
+	status = st->BootServices->AllocatePages(AllocateAnyPages, EfiLunkBootData, EFI_SIZE_TO_PAGES(size), &addr);
+	if (status != 0) {
+		return status;
+	}
+	info->initrd_base = addr;
+	info->initrd_size = size;
+
+	if (compressed) {
+		return load_job_lz4(st, file, (void *)addr, size, stream, job);
+	}
+	*job = (LoadJob){ .file = file, .dest = (char *)addr, .capacity = size };
+	return 0;
+}
+
+bool kernel_check_header(KernelImage *k) {
+	// The kernel always runs at KERNEL_VIRT_BASE, so it has to be relocatable
+	return elf_check_header(&k->ehdr) && k->ehdr.e_type == ET_DYN;
+}
+
+// Validates the program headers against a `file_size` byte ELF and reserves the kernel's final home
+EFI_STATUS kernel_layout(EFI_SYSTEM_TABLE *st, uint64_t file_size) {
+	KernelImage *k = &kernel_image;
+
+	uint64_t max_vaddr;
+	if (!elf_image_span(k->phdrs, k->ehdr.e_phnum, &k->min_vaddr, &max_vaddr)) {
+		return EFI_LOAD_ERROR;
+	}
+	k->span = max_vaddr - k->min_vaddr;
+
+	for (size_t i = 0; i < k->ehdr.e_phnum; i++) {
+		Elf64_Phdr *ph = &k->phdrs[i];
+		if (ph->p_type == PT_LOAD && (ph->p_offset > file_size || ph->p_filesz > file_size - ph->p_offset)) {
+			return EFI_LOAD_ERROR;
+		}
+	}
 
-#define MEM_MAP_BUFFER_SIZE (16 * 1024)
-char mem_map_buffer[MEM_MAP_BUFFER_SIZE];
+	EFI_PHYSICAL_ADDRESS image_addr;
+	EFI_STATUS status = alloc_pages(st, EfiLunkBootData, k->span, KERNEL_ALIGN, &image_addr);
+	if (status != 0) {
+		return status;
+	}
+	k->image = (char *)image_addr;
+	return 0;
+}
+
+// Parses the kernel's ELF headers, reserves its final home, and queues one
+// LoadJob per PT_LOAD so file bytes land directly where they'll execute
+EFI_STATUS kernel_prepare(EFI_SYSTEM_TABLE *st, EFI_FILE *fs_root, EFI_FILE *kernel_file, int16_t *name, LoadJob *jobs, size_t *job_count) {
+	KernelImage *k = &kernel_image;
+
+	EFI_STATUS status = read_at(kernel_file, 0, sizeof(k->ehdr), &k->ehdr);
+	if (status != 0) {
+		return status;
+	}
+	if (!kernel_check_header(k)) {
+		return EFI_LOAD_ERROR;
+	}
+
+	status = read_at(kernel_file, k->ehdr.e_phoff, k->ehdr.e_phnum * sizeof(Elf64_Phdr), k->phdrs);
+	if (status != 0) {
+		return status;
+	}
+
+	uint64_t kernel_file_size;
+	status = file_size(st, kernel_file, &kernel_file_size);
+	if (status != 0) {
+		return status;
+	}
+	status = kernel_layout(st, kernel_file_size);
+	if (status != 0) {
+		return status;
+	}
+
+	for (size_t i = 0; i < k->ehdr.e_phnum; i++) {
+		Elf64_Phdr *ph = &k->phdrs[i];
+		if (ph->p_type != PT_LOAD || ph->p_filesz == 0) {
+			continue;
+		}
+
+		// Every segment gets its own handle so their reads can be in flight together
+		EFI_FILE *segment_file;
+		status = fs_root->Open(fs_root, &segment_file, name, EFI_FILE_MODE_READ, 0);
+		if (status != 0) {
+			return status;
+		}
+		status = segment_file->SetPosition(segment_file, ph->p_offset);
+		if (status != 0) {
+			segment_file->Close(segment_file);
+			return status;
+		}
+
+		jobs[*job_count] = (LoadJob){
+			.file = segment_file,
+			.own_file = true,
+			.dest = k->image + (ph->p_vaddr - k->min_vaddr),
+			.capacity = ph->p_filesz,
+			.offset = ph->p_offset,
+		};
+		*job_count += 1;
+	}
+
+	return 0;
+}
+
+// A compressed kernel can't be read segment by segment, so the whole ELF is
+// decoded into a scratch buffer first and its segments copied out of it
+EFI_STATUS kernel_unpack(EFI_SYSTEM_TABLE *st, char *elf, uint64_t elf_size) {
+	KernelImage *k = &kernel_image;
+
+	if (elf_size < sizeof(k->ehdr)) {
+		return EFI_LOAD_ERROR;
+	}
+	memcpy(&k->ehdr, elf, sizeof(k->ehdr));
+	if (!kernel_check_header(k)) {
+		return EFI_LOAD_ERROR;
+	}
+
+	size_t phdrs_size = k->ehdr.e_phnum * sizeof(Elf64_Phdr);
+	if (k->ehdr.e_phoff > elf_size || phdrs_size > elf_size - k->ehdr.e_phoff) {
+		return EFI_LOAD_ERROR;
+	}
+	memcpy(k->phdrs, elf + k->ehdr.e_phoff, phdrs_size);
+
+	EFI_STATUS status = kernel_layout(st, elf_size);
+	if (status != 0) {
+		return status;
+	}
+
+	for (size_t i = 0; i < k->ehdr.e_phnum; i++) {
+		Elf64_Phdr *ph = &k->phdrs[i];
+		if (ph->p_type == PT_LOAD && ph->p_filesz) {
+			memcpy(k->image + (ph->p_vaddr - k->min_vaddr), elf + ph->p_offset, ph->p_filesz);
+		}
+	}
+	return 0;
+}
+
+EFI_STATUS kernel_finish(BootInfo *info) {
+	KernelImage *k = &kernel_image;
+
+	for (size_t i = 0; i < k->ehdr.e_phnum; i++) {
+		Elf64_Phdr *ph = &k->phdrs[i];
+		if (ph->p_type == PT_LOAD && ph->p_memsz > ph->p_filesz) {
+			memset(k->image + (ph->p_vaddr - k->min_vaddr) + ph->p_filesz, 0, ph->p_memsz - ph->p_filesz);
+		}
+	}
+
+	uint64_t virt_base = KERNEL_VIRT_BASE;
+	if (!elf_relocate(k->phdrs, k->ehdr.e_phnum, k->min_vaddr, k->span, k->image, virt_base)) {
+		return EFI_LOAD_ERROR;
+	}
+
+	info->kernel_entry = virt_base + (k->ehdr.e_entry - k->min_vaddr);
+	info->kernel_phys_base = (uint64_t)k->image;
+	info->kernel_virt_base = virt_base;
+	info->kernel_size = k->span;
+	return 0;
+}
 
 typedef struct {
-	uintptr_t base, pages;
-} MemRegion;
+	EFI_PHYSICAL_ADDRESS next, end;
+} PageTablePool;
+
+uint64_t page_table_alloc(void *ctx) {
+	PageTablePool *pool = (PageTablePool *)ctx;
+	if (pool->next >= pool->end) {
+		return 0;
+	}
+
+	uint64_t page = pool->next;
+	pool->next += EFI_PAGE_SIZE;
+	memset((void *)page, 0, EFI_PAGE_SIZE);
+	return page;
+}
+
+// End of the highest RAM-like descriptor, the direct map has to reach it.
+// MMIO descriptors are skipped, 64-bit BARs would blow the map up for nothing
+EFI_STATUS phys_map_extent(EFI_SYSTEM_TABLE *st, uint64_t *top) {
+	size_t map_size = 0, map_key, desc_size;
+	uint32_t desc_version;
+
+	EFI_STATUS status = st->BootServices->GetMemoryMap(&map_size, NULL, &map_key, &desc_size, &desc_version);
+	if (status != EFI_BUFFER_TOO_SMALL) {
+		return (status == 0) ? EFI_LOAD_ERROR : status;
+	}
+
+	char *map;
+	map_size += MEM_MAP_SLACK_DESCS * desc_size;
+	status = st->BootServices->AllocatePool(EfiLoaderData, map_size, (void **)&map);
+	if (status != 0) {
+		return status;
+	}
 
-#define MAX_MEM_REGIONS (1024)
-MemRegion mem_regions[MAX_MEM_REGIONS];
+	status = st->BootServices->GetMemoryMap(&map_size, (EFI_MEMORY_DESCRIPTOR *)map, &map_key, &desc_size, &desc_version);
+	if (status == 0) {
+		*top = IDENTITY_MAP_SIZE;
+		for (size_t off = 0; off + desc_size <= map_size; off += desc_size) {
+			EFI_MEMORY_DESCRIPTOR *desc = (EFI_MEMORY_DESCRIPTOR *)(map + off);
+			if (desc->Type == EfiMemoryMappedIO || desc->Type == EfiMemoryMappedIOPortSpace) {
+				continue;
+			}
 
-void *memset(void *buffer, int c, size_t n) {
-	uint8_t *buf = (uint8_t *)buffer;
-	for (size_t i = 0; i < n; i++) {
-		buf[i] = c;
+			uint64_t end = desc->PhysicalStart + desc->NumberOfPages * EFI_PAGE_SIZE;
+			if (end > *top) {
+				*top = end;
+			}
+		}
 	}
-	return (void *)buf;
+
+	st->BootServices->FreePool(map);
+	return status;
 }
-void *memcpy(void *dest, const void *src, size_t n) {
-	uint8_t *d = (uint8_t *)dest;
-	uint8_t *s = (uint8_t *)src;
-	for (size_t i = 0; i < n; i++) {
-		d[i] = s[i];
+
+// Builds the kernel's address space (see paging.h for the layout). Tables come
+// from one pool below 4 GiB so APs can load CR3 before they reach long mode
+EFI_STATUS build_page_tables(EFI_SYSTEM_TABLE *st, BootInfo *info) {
+	KernelImage *k = &kernel_image;
+
+	bool huge_1g;
+	uint64_t nx;
+	pt_boot_features(&huge_1g, &nx);
+
+	uint64_t top;
+	EFI_STATUS status = phys_map_extent(st, &top);
+	if (status != 0) {
+		return status;
 	}
-	return (void *)dest;
+	// Framebuffers usually sit in a hole the memory map doesn't describe
+	if (info->fb_base && info->fb_base + info->fb_size > top) {
+		top = info->fb_base + info->fb_size;
+	}
+	top = (top + PAGE_SIZE_1G - 1) & ~(PAGE_SIZE_1G - 1);
+
+	size_t pool_pages = pt_boot_table_count(top, k->span, huge_1g);
+	EFI_PHYSICAL_ADDRESS pool_base = 0xFFFFFFFF;
+	status = st->BootServices->AllocatePages(AllocateMaxAddress, EfiLunkBootData, pool_pages, &pool_base);
+	if (status != 0) {
+		return status;
+	}
+
+	PageTablePool pool = { .next = pool_base, .end = pool_base + pool_pages * EFI_PAGE_SIZE };
+	PageMapper m = { .table_offset = 0, .alloc = page_table_alloc, .ctx = &pool };
+	m.root = page_table_alloc(&pool);
+
+	if (!pt_build_boot(&m, top, huge_1g, nx, k->phdrs, k->ehdr.e_phnum, k->min_vaddr, (uint64_t)k->image)) {
+		return EFI_LOAD_ERROR;
+	}
+
+	info->page_table_root = m.root;
+	info->phys_map_size = top;
+	return 0;
+}
+
+// Switches GOP to its largest 32-bpp linear mode and describes it in BootInfo.
+// No GOP or no usable mode just leaves the kernel without a console
+EFI_STATUS gop_init(EFI_SYSTEM_TABLE *st, BootInfo *info) {
+	EFI_GUID gop_guid = EFI_GRAPHICS_OUTPUT_PROTOCOL_GUID;
+	EFI_GRAPHICS_OUTPUT_PROTOCOL *gop;
+	EFI_STATUS status = st->BootServices->LocateProtocol(&gop_guid, NULL, (void **)&gop);
+	if (status != 0) {
+		return status;
+	}
+
+	uint32_t best_mode = gop->Mode->Mode;
+	uint64_t best_pixels = 0;
+	for (uint32_t i = 0; i < gop->Mode->MaxMode; i++) {
+		EFI_GRAPHICS_OUTPUT_MODE_INFORMATION *mode;
+		size_t info_size;
+		if (gop->QueryMode(gop, i, &info_size, &mode) != 0) {
+			continue;
+		}
+
+		bool linear = mode->PixelFormat == PixelRedGreenBlueReserved8BitPerColor ||
+			mode->PixelFormat == PixelBlueGreenRedReserved8BitPerColor;
+		uint64_t pixels = (uint64_t)mode->HorizontalResolution * mode->VerticalResolution;
+		if (linear && pixels > best_pixels) {
+			best_mode = i;
+			best_pixels = pixels;
+		}
+		st->BootServices->FreePool(mode);
+	}
+	if (best_pixels == 0) {
+		return EFI_UNSUPPORTED;
+	}
+
+	if (best_mode != gop->Mode->Mode) {
+		status = gop->SetMode(gop, best_mode);
+		if (status != 0) {
+			return status;
+		}
+	}
+
+	EFI_GRAPHICS_OUTPUT_MODE_INFORMATION *mode = gop->Mode->Info;
+	info->fb_base = gop->Mode->FrameBufferBase;
+	info->fb_size = gop->Mode->FrameBufferSize;
+	info->fb_width = mode->HorizontalResolution;
+	info->fb_height = mode->VerticalResolution;
+	info->fb_pitch = mode->PixelsPerScanline;
+	info->fb_format = mode->PixelFormat == PixelRedGreenBlueReserved8BitPerColor ? FbFormatRgbx : FbFormatBgrx;
+	return 0;
+}
+
+uint32_t mem_region_type(uint32_t efi_type) {
+	switch (efi_type) {
+		case EfiConventionalMemory:
+		case EfiPersistentMemory:
+			return MemRegionUsable;
+		case EfiLoaderCode:
+		case EfiLoaderData:
+		case EfiBootServicesCode:
+		case EfiBootServicesData:
+			return MemRegionReclaimable;
+		case EfiLunkBootData:
+			return MemRegionBoot;
+		case EfiACPIReclaimMemory:
+			return MemRegionAcpiReclaim;
+		case EfiACPIMemoryNVS:
+			return MemRegionAcpiNvs;
+		case EfiRuntimeServicesCode:
+		case EfiRuntimeServicesData:
+			return MemRegionRuntime;
+		default:
+			return MemRegionReserved;
+	}
+}
+
+// First NUMA range boundary past addr, UINT64_MAX when there is none
+uint64_t numa_next_boundary(NumaRange *ranges, size_t range_count, uint64_t addr) {
+	for (size_t i = 0; i < range_count; i++) {
+		if (ranges[i].base > addr) {
+			return ranges[i].base;
+		}
+		if (ranges[i].limit > addr) {
+			return ranges[i].limit;
+		}
+	}
+	return UINT64_MAX;
+}
+
+// Memory outside every SRAT range counts as node 0
+uint32_t numa_node_at(NumaRange *ranges, size_t range_count, uint64_t addr) {
+	for (size_t i = 0; i < range_count && ranges[i].base <= addr; i++) {
+		if (addr < ranges[i].limit) {
+			return ranges[i].node;
+		}
+	}
+	return 0;
+}
+
+// Cuts regions wherever a NUMA range starts or ends and tags each piece with its
+// node. Pieces are counted first so the table can grow in place from the back.
+// Without room for every piece, regions are only tagged by where they start
+size_t mem_regions_split_numa(MemRegion *regions, size_t count, size_t capacity, NumaRange *ranges, size_t range_count) {
+	size_t total = 0;
+	for (size_t i = 0; i < count; i++) {
+		uint64_t end = regions[i].base + regions[i].pages * EFI_PAGE_SIZE;
+		for (uint64_t at = regions[i].base; at < end; at = numa_next_boundary(ranges, range_count, at)) {
+			total++;
+		}
+	}
+	if (total > capacity) {
+		for (size_t i = 0; i < count; i++) {
+			regions[i].node = numa_node_at(ranges, range_count, regions[i].base);
+		}
+		return count;
+	}
+
+	size_t out = total;
+	for (size_t i = count; i-- > 0;) {
+		MemRegion region = regions[i];
+		uint64_t end = region.base + region.pages * EFI_PAGE_SIZE;
+
+		size_t pieces = 0;
+		for (uint64_t at = region.base; at < end; at = numa_next_boundary(ranges, range_count, at)) {
+			pieces++;
+		}
+
+		out -= pieces;
+		size_t k = out;
+		for (uint64_t at = region.base; at < end;) {
+			uint64_t next = numa_next_boundary(ranges, range_count, at);
+			if (next > end) {
+				next = end;
+			}
+			regions[k] = region;
+			regions[k].base = at;
+			regions[k].pages = (next - at) / EFI_PAGE_SIZE;
+			regions[k].node = numa_node_at(ranges, range_count, at);
+			k++;
+			at = next;
+		}
+	}
+	return total;
+}
+
+// Runs after ExitBootServices, so it can only touch memory it was handed.
+// capacity leaves room past the descriptors for NUMA splits
+size_t mem_regions_build(char *map, size_t map_size, size_t desc_size, MemRegion *regions, size_t capacity) {
+	size_t count = 0;
+	for (size_t off = 0; off + desc_size <= map_size && count < capacity; off += desc_size) {
+		EFI_MEMORY_DESCRIPTOR *desc = (EFI_MEMORY_DESCRIPTOR *)(map + off);
+		if (desc->NumberOfPages == 0) {
+			continue;
+		}
+
+		// Firmware maps are nearly always sorted already, so insertion is ~linear
+		MemRegion region = {
+			.base = desc->PhysicalStart,
+			.pages = desc->NumberOfPages,
+			.type = mem_region_type(desc->Type),
+		};
+		size_t i = count;
+		for (; i > 0 && regions[i - 1].base > region.base; i--) {
+			regions[i] = regions[i - 1];
+		}
+		regions[i] = region;
+		count++;
+	}
+
+	size_t merged = 0;
+	for (size_t i = 0; i < count; i++) {
+		MemRegion *prev = merged ? &regions[merged - 1] : NULL;
+		if (prev && prev->type == regions[i].type && prev->base + prev->pages * EFI_PAGE_SIZE == regions[i].base) {
+			prev->pages += regions[i].pages;
+		} else {
+			regions[merged++] = regions[i];
+		}
+	}
+	return mem_regions_split_numa(regions, merged, capacity, numa_ranges, numa_range_count);
+}
+
+// Sizes buffers from a probe call, then retries GetMemoryMap + ExitBootServices
+// until the map key sticks. Only memory allocation services are used between tries
+EFI_STATUS exit_boot_services(EFI_HANDLE img_handle, EFI_SYSTEM_TABLE *st, BootInfo *info) {
+	size_t map_size = 0, map_key, desc_size;
+	uint32_t desc_version;
+
+	EFI_STATUS status = st->BootServices->GetMemoryMap(&map_size, NULL, &map_key, &desc_size, &desc_version);
+	if (status != EFI_BUFFER_TOO_SMALL) {
+		return (status == 0) ? EFI_LOAD_ERROR : status;
+	}
+
+	char *map = NULL;
+	size_t map_capacity = 0;
+	EFI_PHYSICAL_ADDRESS regions_addr = 0;
+	size_t regions_pages = 0;
+	size_t regions_capacity = 0;
+
+	for (size_t attempt = 0; attempt < EXIT_BOOT_RETRIES; attempt++) {
+		if (map_size > map_capacity) {
+			if (map) {
+				st->BootServices->FreePool(map);
+				st->BootServices->FreePages(regions_addr, regions_pages);
+			}
+
+			map_capacity = map_size + MEM_MAP_SLACK_DESCS * desc_size;
+			status = st->BootServices->AllocatePool(EfiLoaderData, map_capacity, (void **)&map);
+			if (status != 0) {
+				return status;
+			}
+
+			// Every NUMA range can split at most two regions
+			regions_capacity = map_capacity / desc_size + 2 * numa_range_count;
+			regions_pages = EFI_SIZE_TO_PAGES(regions_capacity * sizeof(MemRegion));
+			status = st->BootServices->AllocatePages(AllocateAnyPages, EfiLunkBootData, regions_pages, &regions_addr);
+			if (status != 0) {
+				return status;
+			}
+		}
+
+		map_size = map_capacity;
+		status = st->BootServices->GetMemoryMap(&map_size, (EFI_MEMORY_DESCRIPTOR *)map, &map_key, &desc_size, &desc_version);
+		if (status == EFI_BUFFER_TOO_SMALL) {
+			continue;
+		}
+		if (status != 0) {
+			return status;
+		}
+		trace_point(TraceMemoryMap, attempt);
+
+		status = st->BootServices->ExitBootServices(img_handle, map_key);
+		if (status == 0) {
+			trace_point(TraceExitBootServices, attempt);
+			info->mem_regions = regions_addr;
+			info->mem_region_count = mem_regions_build(map, map_size, desc_size, (MemRegion *)regions_addr, regions_capacity);
+			LOG(LogStubMemoryMap, info->mem_region_count, attempt);
+			return 0;
+		}
+
+		// A stale map key means something allocated between the two calls, try again
+		if (status != EFI_INVALID_PARAMETER) {
+			return status;
+		}
+	}
+	return status;
 }
 
 EFI_STATUS efi_main(EFI_HANDLE img_handle, EFI_SYSTEM_TABLE *st) {
 	EFI_STATUS status;
+	uint64_t entry_tsc = rdtsc();
+
+	mem_init();
+	crc32c_init();
 
 	status = st->ConOut->ClearScreen(st->ConOut);
 	println(st, L"Beginning EFI Boot...");
 
 	EFI_PHYSICAL_ADDRESS loader_addr = 0;
+	EFI_PHYSICAL_ADDRESS boot_info_addr = 0;
+	EFI_PHYSICAL_ADDRESS stack_addr = 0;
 	// Load the kernel and loader from disk
 	{
-		status = st->BootServices->AllocatePages(AllocateAnyPages, EfiLoaderData, 0x200, &loader_addr);
+		status = st->BootServices->AllocatePages(AllocateAnyPages, EfiLunkBootData, EFI_SIZE_TO_PAGES(sizeof(BootInfo)), &boot_info_addr);
 		if (status != 0) {
-			panic(st, L"Failed to allocate space for loader + kernel!");
+			panic(st, L"Failed to allocate boot info!");
 		}
+		memset((void *)boot_info_addr, 0, sizeof(BootInfo));
+		boot_trace = &((BootInfo *)boot_info_addr)->trace;
+		trace_record(boot_trace, entry_tsc, TraceEfiEntry, 0);
+		boot_log = &((BootInfo *)boot_info_addr)->log;
+
+		status = st->BootServices->AllocatePages(AllocateAnyPages, EfiLunkBootData, EFI_SIZE_TO_PAGES(KERNEL_STACK_SIZE), &stack_addr);
+		if (status != 0) {
+			panic(st, L"Failed to allocate kernel stack!");
+		}
+		trace_point(TraceBootAlloc, 0);
 
 		EFI_GUID loaded_img_proto_guid = EFI_LOADED_IMAGE_PROTOCOL_GUID;
 		EFI_LOADED_IMAGE_PROTOCOL *loaded_img_proto;
@@ -68,6 +1276,7 @@ EFI_STATUS efi_main(EFI_HANDLE img_handle, EFI_SYSTEM_TABLE *st) {
 		if (status != 0) {
 			panic(st, L"Failed to load fs protocol!");
 		}
+		trace_point(TraceProtocolOpen, 0);
 
 		EFI_FILE *fs_root;
 		status = simple_fs_proto->OpenVolume(simple_fs_proto, &fs_root);
@@ -75,70 +1284,199 @@ EFI_STATUS efi_main(EFI_HANDLE img_handle, EFI_SYSTEM_TABLE *st) {
 			panic(st, L"Failed to open fs root!");
 		}
 
-		size_t size = LOADER_BUFFER_SIZE;
+		status = manifest_load(st, fs_root, &boot_manifest);
+		if (status != 0) {
+			panic(st, L"Failed to read manifest.txt!");
+		}
+		if (!boot_manifest.present) {
+			println(st, L"No manifest.txt, boot files won't be verified");
+		}
+
+		// Boot files are read off the raw volume when it's FAT, SimpleFS stays as the fallback
+#ifdef LUNK_FORCE_SIMPLEFS
+		bool use_fat = false;
+#else
+		bool use_fat = fat_open(st, img_handle, dev_handle, &boot_volume) == 0;
+#endif
+		trace_point(TraceVolumeOpen, use_fat);
+
 		EFI_FILE *loader_file;
-		status = fs_root->Open(fs_root, &loader_file, (int16_t *)L"loader.bin", EFI_FILE_MODE_READ, 0);
+		bool loader_lz;
+		status = open_boot_file(fs_root, (int16_t *)L"loader.bin", (int16_t *)L"loader.bin.lz4", &loader_file, &loader_lz);
 		if (status != 0) {
 			panic(st, L"Failed to open loader.bin!");
 		}
+		trace_point(TraceFileOpen, 0);
 
-		char *loader_buffer = (char *)loader_addr;
-		loader_file->Read(loader_file, &size, loader_buffer);
-		if (size == LOADER_BUFFER_SIZE) {
-			panic(st, L"Loader too large to fit into buffer!");
+		int16_t *loader_path = loader_lz ? (int16_t *)L"loader.bin.lz4" : (int16_t *)L"loader.bin";
+
+		uint64_t loader_size;
+		status = loader_lz ? lz4_file_content_size(loader_file, &loader_size) : file_size(st, loader_file, &loader_size);
+		if (status != 0) {
+			panic(st, L"Failed to get loader.bin size!");
+		}
+
+		// loader.bin isn't position independent, and its AP trampoline has to sit in low memory
+		loader_addr = LOADER_BASE;
+		status = st->BootServices->AllocatePages(AllocateAddress, EfiLunkBootData, EFI_SIZE_TO_PAGES(loader_size), &loader_addr);
+		if (status != 0) {
+			panic(st, L"Failed to allocate space for loader!");
 		}
 
 		EFI_FILE *kernel_file;
-		status = fs_root->Open(fs_root, &kernel_file, (int16_t *)L"kernel.o", EFI_FILE_MODE_READ, 0);
+		bool kernel_lz;
+		int16_t *kernel_name = (int16_t *)L"kernel.elf";
+		status = open_boot_file(fs_root, kernel_name, (int16_t *)L"kernel.elf.lz4", &kernel_file, &kernel_lz);
 		if (status != 0) {
-			panic(st, L"Failed to open kernel.o!");
+			panic(st, L"Failed to open kernel.elf!");
 		}
+		trace_point(TraceFileOpen, 1);
+		int16_t *kernel_path = kernel_lz ? (int16_t *)L"kernel.elf.lz4" : kernel_name;
 
-		size = KERNEL_BUFFER_SIZE;
-		char *kernel_buffer = (char *)loader_addr + LOADER_BUFFER_SIZE;
-		kernel_file->Read(kernel_file, &size, kernel_buffer);
-		if (size == KERNEL_BUFFER_SIZE) {
-			panic(st, L"Kernel too large to fit into buffer!");
+		LoadJob jobs[2 + ELF_MAX_PHDRS];
+		size_t job_count = 0;
+		Lz4Stream loader_stream, kernel_stream, initrd_stream;
+		if (loader_lz) {
+			status = load_job_lz4(st, loader_file, (void *)loader_addr, loader_size, &loader_stream, &jobs[job_count++]);
+			if (status != 0) {
+				panic(st, L"Failed to stage loader.bin.lz4!");
+			}
+		} else {
+			jobs[job_count++] = (LoadJob){ .file = loader_file, .dest = (char *)loader_addr, .capacity = loader_size };
 		}
 
-		println(st, L"Loaded the loader and kernel!");
-	}
+		EFI_PHYSICAL_ADDRESS kernel_elf = 0;
+		uint64_t kernel_elf_size = 0;
+		if (kernel_lz) {
+			status = lz4_file_content_size(kernel_file, &kernel_elf_size);
+			if (status == 0) {
+				status = st->BootServices->AllocatePages(AllocateAnyPages, EfiLoaderData, EFI_SIZE_TO_PAGES(kernel_elf_size), &kernel_elf);
+			}
+			if (status == 0) {
+				status = load_job_lz4(st, kernel_file, (void *)kernel_elf, kernel_elf_size, &kernel_stream, &jobs[job_count++]);
+			}
+		} else {
+			status = kernel_prepare(st, fs_root, kernel_file, kernel_name, jobs, &job_count);
+		}
+		if (status != 0) {
+			panic(st, L"Failed to parse kernel.elf!");
+		}
 
-	// This block kicks off the kernel, not fully tested!
-	// Memory map loading must be followed immediately with ExitBootServices
+		// The initrd is optional, it rides along in the same batch of reads
+		EFI_FILE *initrd_file;
+		bool initrd_lz;
+		int16_t *initrd_path = NULL;
+		size_t initrd_job = job_count;
+		status = open_boot_file(fs_root, (int16_t *)L"initrd.img", (int16_t *)L"initrd.img.lz4", &initrd_file, &initrd_lz);
+		if (status == 0) {
+			trace_point(TraceFileOpen, 2);
+			initrd_path = initrd_lz ? (int16_t *)L"initrd.img.lz4" : (int16_t *)L"initrd.img";
+			status = initrd_prepare(st, initrd_file, initrd_lz, &initrd_stream, &jobs[job_count], (BootInfo *)boot_info_addr);
+			if (status != 0) {
+				panic(st, L"Failed to allocate space for initrd.img!");
+			}
+			job_count++;
+		}
 
-	size_t map_key;
-	// Load latest memory map
-	{
-		size_t desc_size, size = MEM_MAP_BUFFER_SIZE;
-		uint32_t desc_version;
-		status = st->BootServices->GetMemoryMap(&size, (EFI_MEMORY_DESCRIPTOR *)mem_map_buffer, &map_key, &desc_size, &desc_version);
+		FatFile fat_files[3];
+		if (use_fat) {
+			load_attach_fat(st, &boot_volume, loader_path, &fat_files[0], jobs, 1);
+			load_attach_fat(st, &boot_volume, kernel_path, &fat_files[1], jobs + 1, initrd_job - 1);
+			if (job_count > initrd_job) {
+				load_attach_fat(st, &boot_volume, initrd_path, &fat_files[2], jobs + initrd_job, 1);
+			}
+		}
+
+		status = load_files(st, jobs, job_count);
 		if (status != 0) {
-			panic(st, L"Failed to get memory map!");
+			panic(st, L"Failed to read loader + kernel!");
+		}
+		if (!load_job_done(&jobs[0])) {
+			panic(st, L"Loader truncated!");
+		}
+		for (size_t i = 1; i < job_count; i++) {
+			if (!load_job_done(&jobs[i])) {
+				panic(st, i == initrd_job ? L"Initrd truncated!" : L"Kernel segment truncated!");
+			}
 		}
 
-		size_t desc_count = size / desc_size;
-		size_t mem_region_count = 0;
-		for (int i = 0; i < desc_count && mem_region_count < MAX_MEM_REGIONS; i++) {
-			EFI_MEMORY_DESCRIPTOR *desc = (EFI_MEMORY_DESCRIPTOR *)(mem_map_buffer + (i * desc_size));
+		// Digests were taken as the reads landed, this mostly just compares them
+		if (boot_manifest.present) {
+			status = verify_file(st, loader_path, loader_file, jobs, 1);
+			if (status == 0) {
+				status = verify_file(st, kernel_path, kernel_file, jobs + 1, initrd_job - 1);
+			}
+			if (status == 0 && initrd_path) {
+				status = verify_file(st, initrd_path, initrd_file, jobs + initrd_job, 1);
+			}
+			if (status != 0) {
+				panic(st, L"Refusing to boot unverified files!");
+			}
+			trace_point(TraceVerify, job_count);
+		}
 
-			if (desc->Type == EfiConventionalMemory && desc->PhysicalStart >= 0x300000) {
-				mem_regions[mem_region_count].base = desc->PhysicalStart;
-				mem_regions[mem_region_count].pages = desc->NumberOfPages;
-				mem_region_count++;
+		// Compressed frames are fully decoded, their staging buffers can go
+		for (size_t i = 0; i < job_count; i++) {
+			if (jobs[i].lz) {
+				st->BootServices->FreePages((EFI_PHYSICAL_ADDRESS)jobs[i].dest, EFI_SIZE_TO_PAGES(jobs[i].capacity));
 			}
 		}
-		mem_regions[mem_region_count].base = 0;
+
+		if (kernel_lz) {
+			status = kernel_unpack(st, (char *)kernel_elf, kernel_elf_size);
+			if (status != 0) {
+				panic(st, L"Failed to parse kernel.elf!");
+			}
+			st->BootServices->FreePages(kernel_elf, EFI_SIZE_TO_PAGES(kernel_elf_size));
+		}
+
+		BootInfo *boot_info = (BootInfo *)boot_info_addr;
+		status = kernel_finish(boot_info);
+		if (status != 0) {
+			panic(st, L"Failed to relocate kernel!");
+		}
+		trace_point(TraceKernelReloc, 0);
+		LOG(LogStubKernel, boot_info->kernel_size, boot_info->kernel_phys_base, job_count);
+		boot_info->stack_top = PHYS_MAP_BASE + stack_addr + KERNEL_STACK_SIZE;
+
+		AcpiRsdp *rsdp = acpi_find_rsdp(st);
+		boot_info->acpi_rsdp = (uint64_t)rsdp;
+		acpi_parse_madt(rsdp, boot_info);
+		acpi_parse_numa(rsdp, boot_info);
+		trace_point(TraceAcpi, boot_info->cpu_count);
+		LOG(LogStubAcpi, boot_info->cpu_count, boot_info->numa_node_count, boot_info->acpi_rsdp);
+
+		status = gop_init(st, boot_info);
+		if (status != 0) {
+			println(st, L"No usable GOP mode, the kernel will run headless");
+		} else {
+			LOG(LogStubGop, boot_info->fb_width, boot_info->fb_height, boot_info->fb_base);
+		}
+		trace_point(TraceGop, 0);
+
+		status = build_page_tables(st, boot_info);
+		if (status != 0) {
+			panic(st, L"Failed to build page tables!");
+		}
+		trace_point(TracePageTables, 0);
+
+		println(st, L"Loaded the loader and kernel!");
 	}
 
-	status = st->BootServices->ExitBootServices(img_handle, map_key);
+	// Memory map loading must be followed immediately with ExitBootServices
+	status = exit_boot_services(img_handle, st, (BootInfo *)boot_info_addr);
 	if (status != 0) {
 		panic(st, L"Failed to exit EFI");
 	}
 
-	println(st, L"Starting the loader");
+	// ConOut is gone along with boot services, the kernel brings up its own console
+#ifdef LUNK_HOST
+	// Host builds (stub_bench.c) stop here and look at what was handed over
+	return host_loader_entry((BootInfo *)boot_info_addr);
+#else
 	// Boot the loader
-	((void (*)()) loader_addr)();
+	((void (*)(BootInfo *)) loader_addr)((BootInfo *)boot_info_addr);
 
 	return 0;
+#endif
 }
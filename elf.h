@@ -0,0 +1,154 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define ELF_MAGIC 0x464C457F
+
+#define ELFCLASS64 2
+#define ELFDATA2LSB 1
+#define EM_X86_64 62
+
+#define ET_EXEC 2
+#define ET_DYN 3
+
+#define PT_LOAD 1
+#define PT_DYNAMIC 2
+
+#define PF_X 0x1
+#define PF_W 0x2
+#define PF_R 0x4
+
+#define DT_NULL 0
+#define DT_RELA 7
+#define DT_RELASZ 8
+#define DT_RELAENT 9
+
+#define R_X86_64_NONE 0
+#define R_X86_64_RELATIVE 8
+
+#define ELF64_R_TYPE(i) ((uint32_t)(i))
+
+typedef struct {
+	uint32_t e_magic;
+	uint8_t e_class;
+	uint8_t e_data;
+	uint8_t e_version_ident;
+	uint8_t e_osabi;
+	uint8_t e_pad[8];
+	uint16_t e_type;
+	uint16_t e_machine;
+	uint32_t e_version;
+	uint64_t e_entry;
+	uint64_t e_phoff;
+	uint64_t e_shoff;
+	uint32_t e_flags;
+	uint16_t e_ehsize;
+	uint16_t e_phentsize;
+	uint16_t e_phnum;
+	uint16_t e_shentsize;
+	uint16_t e_shnum;
+	uint16_t e_shstrndx;
+} Elf64_Ehdr;
+
+typedef struct {
+	uint32_t p_type;
+	uint32_t p_flags;
+	uint64_t p_offset;
+	uint64_t p_vaddr;
+	uint64_t p_paddr;
+	uint64_t p_filesz;
+	uint64_t p_memsz;
+	uint64_t p_align;
+} Elf64_Phdr;
+
+typedef struct {
+	int64_t d_tag;
+	uint64_t d_val;
+} Elf64_Dyn;
+
+typedef struct {
+	uint64_t r_offset;
+	uint64_t r_info;
+	int64_t r_addend;
+} Elf64_Rela;
+
+#define ELF_PAGE_SIZE 0x1000
+#define ELF_MAX_PHDRS 32
+
+static bool elf_check_header(Elf64_Ehdr *ehdr) {
+	return ehdr->e_magic == ELF_MAGIC && ehdr->e_class == ELFCLASS64 && ehdr->e_data == ELFDATA2LSB &&
+		ehdr->e_machine == EM_X86_64 && (ehdr->e_type == ET_DYN || ehdr->e_type == ET_EXEC) &&
+		ehdr->e_phentsize == sizeof(Elf64_Phdr) && ehdr->e_phnum > 0 && ehdr->e_phnum <= ELF_MAX_PHDRS;
+}
+
+// Page-aligned virtual extents covered by every PT_LOAD segment
+static bool elf_image_span(Elf64_Phdr *phdrs, size_t phnum, uint64_t *min_vaddr, uint64_t *max_vaddr) {
+	uint64_t lo = UINT64_MAX, hi = 0;
+	for (size_t i = 0; i < phnum; i++) {
+		Elf64_Phdr *ph = &phdrs[i];
+		if (ph->p_type != PT_LOAD || ph->p_memsz == 0) {
+			continue;
+		}
+		if (ph->p_filesz > ph->p_memsz) {
+			return false;
+		}
+
+		if (ph->p_vaddr < lo) lo = ph->p_vaddr;
+		if (ph->p_vaddr + ph->p_memsz > hi) hi = ph->p_vaddr + ph->p_memsz;
+	}
+	if (lo >= hi) {
+		return false;
+	}
+
+	*min_vaddr = lo & ~(uint64_t)(ELF_PAGE_SIZE - 1);
+	*max_vaddr = (hi + ELF_PAGE_SIZE - 1) & ~(uint64_t)(ELF_PAGE_SIZE - 1);
+	return true;
+}
+
+// Applies R_X86_64_RELATIVE fixups to an image whose segments have already
+// been placed at `image`, to be run at `virt_base` (both standing in for min_vaddr)
+static bool elf_relocate(Elf64_Phdr *phdrs, size_t phnum, uint64_t min_vaddr, uint64_t span, char *image, uint64_t virt_base) {
+	Elf64_Dyn *dyn = NULL;
+	for (size_t i = 0; i < phnum; i++) {
+		if (phdrs[i].p_type == PT_DYNAMIC) {
+			dyn = (Elf64_Dyn *)(image + (phdrs[i].p_vaddr - min_vaddr));
+		}
+	}
+	if (!dyn) {
+		return true;
+	}
+
+	uint64_t rela = 0, rela_size = 0, rela_ent = sizeof(Elf64_Rela);
+	for (; dyn->d_tag != DT_NULL; dyn++) {
+		switch (dyn->d_tag) {
+			case DT_RELA:    rela = dyn->d_val; break;
+			case DT_RELASZ:  rela_size = dyn->d_val; break;
+			case DT_RELAENT: rela_ent = dyn->d_val; break;
+		}
+	}
+	if (rela_size == 0) {
+		return true;
+	}
+	if (rela < min_vaddr || rela - min_vaddr + rela_size > span || rela_ent != sizeof(Elf64_Rela)) {
+		return false;
+	}
+
+	uint64_t bias = virt_base - min_vaddr;
+	Elf64_Rela *rels = (Elf64_Rela *)(image + (rela - min_vaddr));
+	for (size_t i = 0; i < rela_size / rela_ent; i++) {
+		Elf64_Rela *r = &rels[i];
+		switch (ELF64_R_TYPE(r->r_info)) {
+			case R_X86_64_NONE: break;
+			case R_X86_64_RELATIVE: {
+				if (r->r_offset < min_vaddr || r->r_offset - min_vaddr + sizeof(uint64_t) > span) {
+					return false;
+				}
+				*(uint64_t *)(image + (r->r_offset - min_vaddr)) = bias + r->r_addend;
+			} break;
+			default: return false;
+		}
+	}
+	return true;
+}
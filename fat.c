@@ -0,0 +1,461 @@
+// Read-only FAT12/16/32 reader for the boot volume, used instead of the
+// firmware's SimpleFS driver, which tends to split reads into sector-sized
+// requests. Metadata goes through Disk IO. File data is resolved up front into
+// runs of contiguous clusters, and each run is a single Block IO read straight
+// into its destination.
+
+#include "efi.h"
+
+#define FAT_DIRENT_SIZE 32
+#define FAT_ATTR_VOLUME_ID 0x08
+#define FAT_ATTR_DIRECTORY 0x10
+#define FAT_ATTR_LFN 0x0F
+#define FAT_LFN_LAST 0x40
+#define FAT_LFN_CHARS 13
+#define FAT_MAX_NAME 255
+
+#define FAT_ENTRY_FREE 0xE5
+#define FAT_ENTRY_END 0x00
+
+typedef enum {
+	Fat12,
+	Fat16,
+	Fat32,
+} FatType;
+
+typedef struct {
+	EFI_BLOCK_IO_PROTOCOL *block_io;
+	EFI_DISK_IO_PROTOCOL *disk_io;
+	uint32_t media_id;
+	uint32_t block_size;
+	uint32_t io_align;
+
+	FatType type;
+	uint32_t cluster_size;
+	uint32_t cluster_count;
+	// Byte offsets into the volume
+	uint64_t root_offset;
+	uint64_t data_offset;
+	// FAT12/16 have a fixed root directory, FAT32 chains it from root_cluster
+	uint32_t root_entries;
+	uint32_t root_cluster;
+
+	// The whole first FAT, so chains resolve without touching the disk
+	uint8_t *fat;
+	uint64_t fat_size;
+} FatVolume;
+
+typedef struct {
+	FatVolume *vol;
+	uint32_t first_cluster;
+	uint64_t size;
+} FatFile;
+
+// One contiguous stretch of a file on disk
+typedef struct {
+	uint64_t disk_offset;
+	uint64_t bytes;
+} FatRun;
+
+static inline uint16_t fat_read16(uint8_t *p) {
+	return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t fat_read32(uint8_t *p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Next cluster in a chain, 0 at the end of the chain or on anything malformed
+uint32_t fat_next(FatVolume *vol, uint32_t cluster) {
+	uint32_t next;
+	switch (vol->type) {
+		case Fat12: {
+			uint64_t off = cluster + cluster / 2;
+			if (off + 1 >= vol->fat_size) return 0;
+			uint16_t v = fat_read16(vol->fat + off);
+			next = (cluster & 1) ? (v >> 4) : (v & 0xFFF);
+		} break;
+		case Fat16: {
+			if ((uint64_t)cluster * 2 + 1 >= vol->fat_size) return 0;
+			next = fat_read16(vol->fat + cluster * 2);
+		} break;
+		default: {
+			if ((uint64_t)cluster * 4 + 3 >= vol->fat_size) return 0;
+			next = fat_read32(vol->fat + cluster * 4) & 0x0FFFFFFF;
+		} break;
+	}
+
+	if (next < 2 || next >= vol->cluster_count + 2) {
+		return 0;
+	}
+	return next;
+}
+
+EFI_STATUS fat_open(EFI_SYSTEM_TABLE *st, EFI_HANDLE img_handle, EFI_HANDLE device, FatVolume *vol) {
+	EFI_GUID block_io_guid = EFI_BLOCK_IO_PROTOCOL_GUID;
+	EFI_GUID disk_io_guid = EFI_DISK_IO_PROTOCOL_GUID;
+
+	EFI_STATUS status = st->BootServices->OpenProtocol(device, &block_io_guid, (void **)&vol->block_io, img_handle, NULL, EFI_OPEN_PROTOCOL_GET_PROTOCOL);
+	if (status != 0) {
+		return status;
+	}
+	status = st->BootServices->OpenProtocol(device, &disk_io_guid, (void **)&vol->disk_io, img_handle, NULL, EFI_OPEN_PROTOCOL_GET_PROTOCOL);
+	if (status != 0) {
+		return status;
+	}
+
+	EFI_BLOCK_IO_MEDIA *media = vol->block_io->Media;
+	vol->media_id = media->MediaId;
+	vol->block_size = media->BlockSize;
+	vol->io_align = media->IoAlign ? media->IoAlign : 1;
+
+	uint8_t bs[512];
+	status = vol->disk_io->ReadDisk(vol->disk_io, vol->media_id, 0, sizeof(bs), bs);
+	if (status != 0) {
+		return status;
+	}
+	if (bs[510] != 0x55 || bs[511] != 0xAA) {
+		return EFI_UNSUPPORTED;
+	}
+
+	uint32_t bytes_per_sector = fat_read16(bs + 0x0B);
+	uint32_t sectors_per_cluster = bs[0x0D];
+	uint32_t reserved_sectors = fat_read16(bs + 0x0E);
+	uint32_t fat_count = bs[0x10];
+	uint32_t root_entries = fat_read16(bs + 0x11);
+	uint32_t total_sectors = fat_read16(bs + 0x13) ? fat_read16(bs + 0x13) : fat_read32(bs + 0x20);
+	uint32_t fat_sectors = fat_read16(bs + 0x16) ? fat_read16(bs + 0x16) : fat_read32(bs + 0x24);
+
+	if (bytes_per_sector < 512 || bytes_per_sector > 4096 || (bytes_per_sector & (bytes_per_sector - 1)) ||
+		sectors_per_cluster == 0 || (sectors_per_cluster & (sectors_per_cluster - 1)) ||
+		reserved_sectors == 0 || fat_count == 0 || fat_sectors == 0) {
+		return EFI_UNSUPPORTED;
+	}
+
+	uint32_t root_sectors = (root_entries * FAT_DIRENT_SIZE + bytes_per_sector - 1) / bytes_per_sector;
+	uint32_t meta_sectors = reserved_sectors + fat_count * fat_sectors + root_sectors;
+	if (total_sectors <= meta_sectors) {
+		return EFI_UNSUPPORTED;
+	}
+
+	// The FAT type is decided by cluster count alone, per the spec
+	vol->cluster_count = (total_sectors - meta_sectors) / sectors_per_cluster;
+	if (vol->cluster_count < 4085) {
+		vol->type = Fat12;
+	} else if (vol->cluster_count < 65525) {
+		vol->type = Fat16;
+	} else {
+		vol->type = Fat32;
+	}
+
+	vol->cluster_size = bytes_per_sector * sectors_per_cluster;
+	vol->root_offset = (uint64_t)(reserved_sectors + fat_count * fat_sectors) * bytes_per_sector;
+	vol->data_offset = (uint64_t)meta_sectors * bytes_per_sector;
+	vol->root_entries = root_entries;
+	vol->root_cluster = vol->type == Fat32 ? fat_read32(bs + 0x2C) : 0;
+
+	vol->fat_size = (uint64_t)fat_sectors * bytes_per_sector;
+	status = st->BootServices->AllocatePool(EfiLoaderData, vol->fat_size, (void **)&vol->fat);
+	if (status != 0) {
+		return status;
+	}
+	return vol->disk_io->ReadDisk(vol->disk_io, vol->media_id, (uint64_t)reserved_sectors * bytes_per_sector, vol->fat_size, vol->fat);
+}
+
+// Whole blocks go through Block IO in one request when the buffer suits the
+// device, Disk IO picks up any unaligned head and tail
+EFI_STATUS fat_read_disk(FatVolume *vol, uint64_t offset, uint64_t bytes, char *dest) {
+	EFI_STATUS status;
+	uint64_t bs = vol->block_size;
+
+	uint64_t head = (bs - offset % bs) % bs;
+	if (head > bytes) {
+		head = bytes;
+	}
+	if (head) {
+		status = vol->disk_io->ReadDisk(vol->disk_io, vol->media_id, offset, head, dest);
+		if (status != 0) {
+			return status;
+		}
+		offset += head;
+		dest += head;
+		bytes -= head;
+	}
+
+	uint64_t whole = bytes - bytes % bs;
+	if (whole) {
+		if ((uint64_t)dest % vol->io_align == 0) {
+			status = vol->block_io->ReadBlocks(vol->block_io, vol->media_id, offset / bs, whole, dest);
+		} else {
+			status = vol->disk_io->ReadDisk(vol->disk_io, vol->media_id, offset, whole, dest);
+		}
+		if (status != 0) {
+			return status;
+		}
+		offset += whole;
+		dest += whole;
+		bytes -= whole;
+	}
+
+	if (bytes) {
+		return vol->disk_io->ReadDisk(vol->disk_io, vol->media_id, offset, bytes, dest);
+	}
+	return 0;
+}
+
+// Resolves [offset, offset + size) of a file to disk runs, merging clusters that
+// follow each other. The run list comes from the pool and belongs to the caller
+EFI_STATUS fat_resolve(EFI_SYSTEM_TABLE *st, FatFile *file, uint64_t offset, uint64_t size, FatRun **runs, size_t *run_count) {
+	FatVolume *vol = file->vol;
+	uint64_t cs = vol->cluster_size;
+
+	*runs = NULL;
+	*run_count = 0;
+	if (size == 0) {
+		return 0;
+	}
+
+	size_t max_runs = size / cs + 2;
+	EFI_STATUS status = st->BootServices->AllocatePool(EfiLoaderData, max_runs * sizeof(FatRun), (void **)runs);
+	if (status != 0) {
+		return status;
+	}
+
+	uint32_t cluster = file->first_cluster;
+	for (uint64_t skip = offset / cs; skip; skip--) {
+		cluster = fat_next(vol, cluster);
+		if (!cluster) {
+			return EFI_LOAD_ERROR;
+		}
+	}
+
+	uint64_t in_cluster = offset % cs;
+	while (size) {
+		if (cluster < 2 || *run_count == max_runs) {
+			return EFI_LOAD_ERROR;
+		}
+
+		uint32_t start = cluster;
+		uint64_t bytes = cs - in_cluster;
+		uint32_t next = fat_next(vol, cluster);
+		while (bytes < size && next == cluster + 1) {
+			cluster = next;
+			bytes += cs;
+			next = fat_next(vol, cluster);
+		}
+		if (bytes > size) {
+			bytes = size;
+		}
+
+		(*runs)[(*run_count)++] = (FatRun){
+			.disk_offset = vol->data_offset + (uint64_t)(start - 2) * cs + in_cluster,
+			.bytes = bytes,
+		};
+		size -= bytes;
+		in_cluster = 0;
+		cluster = next;
+	}
+	return 0;
+}
+
+EFI_STATUS fat_read(EFI_SYSTEM_TABLE *st, FatFile *file, uint64_t offset, uint64_t size, void *dest) {
+	FatRun *runs;
+	size_t run_count;
+	EFI_STATUS status = fat_resolve(st, file, offset, size, &runs, &run_count);
+	if (status == 0) {
+		char *out = (char *)dest;
+		for (size_t i = 0; i < run_count && status == 0; i++) {
+			status = fat_read_disk(file->vol, runs[i].disk_offset, runs[i].bytes, out);
+			out += runs[i].bytes;
+		}
+	}
+	if (runs) {
+		st->BootServices->FreePool(runs);
+	}
+	return status;
+}
+
+static inline uint16_t fat_fold(uint16_t c) {
+	return (c >= 'a' && c <= 'z') ? c - 'a' + 'A' : c;
+}
+
+static uint8_t fat_short_checksum(uint8_t *name) {
+	uint8_t sum = 0;
+	for (size_t i = 0; i < 11; i++) {
+		sum = ((sum & 1) << 7) + (sum >> 1) + name[i];
+	}
+	return sum;
+}
+
+// "NAME    EXT" as "NAME.EXT"
+static size_t fat_short_name(uint8_t *entry, uint16_t *out) {
+	size_t len = 0;
+	for (size_t i = 0; i < 8 && entry[i] != ' '; i++) {
+		out[len++] = (i == 0 && entry[0] == 0x05) ? 0xE5 : entry[i];
+	}
+	if (entry[8] != ' ') {
+		out[len++] = '.';
+		for (size_t i = 8; i < 11 && entry[i] != ' '; i++) {
+			out[len++] = entry[i];
+		}
+	}
+	return len;
+}
+
+static bool fat_name_equal(uint16_t *a, size_t a_len, int16_t *b, size_t b_len) {
+	if (a_len != b_len) {
+		return false;
+	}
+	for (size_t i = 0; i < a_len; i++) {
+		if (fat_fold(a[i]) != fat_fold((uint16_t)b[i])) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Scans a directory image for `name`, compared case-insensitively
+bool fat_dir_lookup(uint8_t *dir, size_t dir_size, int16_t *name, size_t name_len, uint8_t **found) {
+	uint16_t lfn[FAT_MAX_NAME + FAT_LFN_CHARS];
+	size_t lfn_len = 0;
+	uint8_t lfn_sum = 0;
+	bool lfn_valid = false;
+
+	static const uint8_t lfn_offsets[FAT_LFN_CHARS] = { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
+
+	for (size_t off = 0; off + FAT_DIRENT_SIZE <= dir_size; off += FAT_DIRENT_SIZE) {
+		uint8_t *e = dir + off;
+		if (e[0] == FAT_ENTRY_END) {
+			break;
+		}
+		if (e[0] == FAT_ENTRY_FREE) {
+			lfn_valid = false;
+			continue;
+		}
+
+		if ((e[11] & 0x3F) == FAT_ATTR_LFN) {
+			uint32_t ord = e[0] & 0x3F;
+			if (e[0] & FAT_LFN_LAST) {
+				lfn_valid = ord > 0 && ord * FAT_LFN_CHARS <= FAT_MAX_NAME + FAT_LFN_CHARS;
+				lfn_len = ord * FAT_LFN_CHARS;
+				lfn_sum = e[13];
+			} else if (e[13] != lfn_sum || ord == 0 || ord * FAT_LFN_CHARS > lfn_len) {
+				lfn_valid = false;
+			}
+
+			if (lfn_valid) {
+				for (size_t i = 0; i < FAT_LFN_CHARS; i++) {
+					uint16_t c = fat_read16(e + lfn_offsets[i]);
+					size_t pos = (ord - 1) * FAT_LFN_CHARS + i;
+					lfn[pos] = c;
+					// The name ends at a NUL, padding after it is 0xFFFF
+					if (c == 0 && pos < lfn_len) {
+						lfn_len = pos;
+					}
+				}
+			}
+			continue;
+		}
+
+		if (e[11] & FAT_ATTR_VOLUME_ID) {
+			lfn_valid = false;
+			continue;
+		}
+
+		// A file answers to both its long name and its 8.3 alias
+		uint16_t short_name[12];
+		size_t short_len = fat_short_name(e, short_name);
+		bool match = fat_name_equal(short_name, short_len, name, name_len);
+		if (!match && lfn_valid && lfn_sum == fat_short_checksum(e)) {
+			match = fat_name_equal(lfn, lfn_len, name, name_len);
+		}
+		lfn_valid = false;
+
+		if (match) {
+			*found = e;
+			return true;
+		}
+	}
+	return false;
+}
+
+static uint32_t fat_entry_cluster(FatVolume *vol, uint8_t *entry) {
+	uint32_t hi = vol->type == Fat32 ? fat_read16(entry + 20) : 0;
+	return (hi << 16) | fat_read16(entry + 26);
+}
+
+// Looks up a path of '\' or '/' separated names from the root directory
+EFI_STATUS fat_find(EFI_SYSTEM_TABLE *st, FatVolume *vol, int16_t *path, FatFile *file) {
+	// The FAT12/16 root isn't a cluster chain, it's read straight out of its region
+	bool fixed_root = vol->type != Fat32;
+	FatFile dir = { .vol = vol, .first_cluster = vol->root_cluster };
+
+	for (;;) {
+		while (*path == '\\' || *path == '/') {
+			path++;
+		}
+		size_t len = 0;
+		while (path[len] && path[len] != '\\' && path[len] != '/') {
+			len++;
+		}
+		if (len == 0) {
+			return EFI_NOT_FOUND;
+		}
+
+		uint64_t dir_size;
+		if (fixed_root) {
+			dir_size = (uint64_t)vol->root_entries * FAT_DIRENT_SIZE;
+		} else {
+			uint64_t clusters = 1;
+			for (uint32_t c = dir.first_cluster; (c = fat_next(vol, c)) != 0 && clusters <= vol->cluster_count; ) {
+				clusters++;
+			}
+			dir_size = clusters * vol->cluster_size;
+		}
+
+		uint8_t *buffer;
+		EFI_STATUS status = st->BootServices->AllocatePool(EfiLoaderData, dir_size, (void **)&buffer);
+		if (status != 0) {
+			return status;
+		}
+		if (fixed_root) {
+			status = vol->disk_io->ReadDisk(vol->disk_io, vol->media_id, vol->root_offset, dir_size, buffer);
+		} else {
+			status = fat_read(st, &dir, 0, dir_size, buffer);
+		}
+
+		uint8_t *entry = NULL;
+		if (status == 0 && !fat_dir_lookup(buffer, dir_size, path, len, &entry)) {
+			status = EFI_NOT_FOUND;
+		}
+
+		FatFile found = { .vol = vol };
+		bool is_dir = false;
+		if (status == 0) {
+			found.first_cluster = fat_entry_cluster(vol, entry);
+			found.size = fat_read32(entry + 28);
+			is_dir = (entry[11] & FAT_ATTR_DIRECTORY) != 0;
+		}
+		st->BootServices->FreePool(buffer);
+		if (status != 0) {
+			return status;
+		}
+
+		path += len;
+		while (*path == '\\' || *path == '/') {
+			path++;
+		}
+		if (*path == 0) {
+			if (is_dir || (found.size && found.first_cluster < 2)) {
+				return EFI_NOT_FOUND;
+			}
+			*file = found;
+			return 0;
+		}
+		if (!is_dir || found.first_cluster < 2) {
+			return EFI_NOT_FOUND;
+		}
+		dir = found;
+		fixed_root = false;
+	}
+}
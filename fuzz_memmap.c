@@ -0,0 +1,242 @@
+// Fuzz target for the stub's memory map parser: mem_regions_build and the NUMA
+// split behind it, fed firmware maps that are shuffled, oddly sized and cut
+// along arbitrary SRAT ranges. Checked after every input:
+//   - regions come out sorted and non-overlapping
+//   - every page that went in comes out, nothing else does
+//   - the table never grows past its capacity
+//   - every region carries its base's node and none straddles a range boundary
+//   - without NUMA ranges, no two neighbours could still be merged
+//
+// Input, little endian: desc_size selector (1 byte), range count (1), ranges
+// as (gap pages u16, length pages u16, node u8), then descriptors as (type u8,
+// gap pages u16, pages u16, shuffle index u16) until the input runs out.
+//
+// Built plainly it runs seeded random inputs, or replays files given on the
+// command line. With -DFUZZ_LIBFUZZER -fsanitize=fuzzer libFuzzer drives it.
+//
+// Usage: fuzz_memmap [-n iterations] [-s seed] [input files...]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include "efi_stub.c"
+
+#define FUZZ_MAX_DESCS 4096
+#define FUZZ_MAX_INPUT (2 + MAX_NUMA_RANGES * 5 + FUZZ_MAX_DESCS * 7)
+
+// The map never reaches ExitBootServices here
+EFI_STATUS host_loader_entry(BootInfo *info) {
+	return 0;
+}
+
+typedef struct {
+	const uint8_t *data;
+	size_t size;
+	size_t at;
+} FuzzInput;
+
+static bool take(FuzzInput *in, void *out, size_t n) {
+	if (in->size - in->at < n) {
+		return false;
+	}
+	memcpy(out, in->data + in->at, n);
+	in->at += n;
+	return true;
+}
+
+static void fail(const char *what, size_t index) {
+	fprintf(stderr, "fuzz_memmap: %s (region %zu)\n", what, index);
+	abort();
+}
+
+static const uint32_t fuzz_types[] = {
+	EfiReservedMemoryType, EfiLoaderCode, EfiLoaderData, EfiBootServicesCode,
+	EfiBootServicesData, EfiRuntimeServicesCode, EfiRuntimeServicesData, EfiConventionalMemory,
+	EfiUnusableMemory, EfiACPIReclaimMemory, EfiACPIMemoryNVS, EfiMemoryMappedIO,
+	EfiPersistentMemory, EfiLunkBootData, 0x70000000, 0xFFFFFFFF,
+};
+
+// Reference versions of the stub's range lookups, written the slow obvious way
+static uint32_t ref_node_at(uint64_t addr) {
+	for (size_t i = 0; i < numa_range_count; i++) {
+		if (numa_ranges[i].base <= addr && addr < numa_ranges[i].limit) {
+			return numa_ranges[i].node;
+		}
+	}
+	return 0;
+}
+
+static bool ref_straddles(uint64_t base, uint64_t end) {
+	for (size_t i = 0; i < numa_range_count; i++) {
+		if ((numa_ranges[i].base > base && numa_ranges[i].base < end) ||
+			(numa_ranges[i].limit > base && numa_ranges[i].limit < end)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+char fuzz_map[FUZZ_MAX_DESCS * 256];
+MemRegion fuzz_regions[FUZZ_MAX_DESCS + 2 * MAX_NUMA_RANGES];
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+	FuzzInput in = { data, size, 0 };
+	uint8_t selector, range_count;
+	if (!take(&in, &selector, 1) || !take(&in, &range_count, 1)) {
+		return 0;
+	}
+	// The spec only promises desc_size >= sizeof(EFI_MEMORY_DESCRIPTOR)
+	size_t desc_size = sizeof(EFI_MEMORY_DESCRIPTOR) + (selector & 7) * 8;
+
+	// Ranges are generated sorted and disjoint like a sane SRAT, then handed
+	// to acpi_numa_range backwards so its insertion sort has work to do
+	BootInfo info = {0};
+	NumaRange ranges[MAX_NUMA_RANGES];
+	size_t count = 0;
+	uint64_t cursor = 0;
+	for (size_t i = 0; i < range_count % (MAX_NUMA_RANGES + 1); i++) {
+		uint16_t gap, length;
+		uint8_t node;
+		if (!take(&in, &gap, 2) || !take(&in, &length, 2) || !take(&in, &node, 1)) {
+			break;
+		}
+		cursor += (uint64_t)gap * EFI_PAGE_SIZE;
+		ranges[count] = (NumaRange){ .base = cursor, .limit = cursor + ((uint64_t)length + 1) * EFI_PAGE_SIZE, .node = node % 8 };
+		cursor = ranges[count++].limit;
+	}
+	numa_range_count = 0;
+	for (size_t i = count; i-- > 0;) {
+		acpi_numa_range(&info, ranges[i].base, ranges[i].limit - ranges[i].base, ranges[i].node);
+	}
+
+	// Descriptors are laid out disjoint, then shuffled in place
+	size_t descs = 0;
+	uint64_t in_pages = 0;
+	cursor = 0;
+	for (; descs < FUZZ_MAX_DESCS; descs++) {
+		uint8_t type;
+		uint16_t gap, pages, swap;
+		if (!take(&in, &type, 1) || !take(&in, &gap, 2) || !take(&in, &pages, 2) || !take(&in, &swap, 2)) {
+			break;
+		}
+		cursor += (uint64_t)gap * EFI_PAGE_SIZE;
+		EFI_MEMORY_DESCRIPTOR *d = (EFI_MEMORY_DESCRIPTOR *)(fuzz_map + descs * desc_size);
+		memset(d, 0xA5, desc_size);
+		*d = (EFI_MEMORY_DESCRIPTOR){ .Type = fuzz_types[type % 16], .PhysicalStart = cursor, .NumberOfPages = pages };
+		cursor += (uint64_t)pages * EFI_PAGE_SIZE;
+		in_pages += pages;
+
+		size_t j = swap % (descs + 1);
+		char tmp[256];
+		memcpy(tmp, fuzz_map + descs * desc_size, desc_size);
+		memcpy(fuzz_map + descs * desc_size, fuzz_map + j * desc_size, desc_size);
+		memcpy(fuzz_map + j * desc_size, tmp, desc_size);
+	}
+
+	// Same sizing as exit_boot_services
+	size_t capacity = descs + 2 * numa_range_count;
+	for (size_t i = 0; i < capacity + 1; i++) {
+		fuzz_regions[i] = (MemRegion){ .base = 0xDEAD0000, .pages = 0xDEAD };
+	}
+	size_t out = mem_regions_build(fuzz_map, descs * desc_size, desc_size, fuzz_regions, capacity);
+
+	if (out > capacity) {
+		fail("region count past capacity", out);
+	}
+	if (fuzz_regions[capacity].base != 0xDEAD0000 || fuzz_regions[capacity].pages != 0xDEAD) {
+		fail("wrote past capacity", capacity);
+	}
+
+	// The split only falls back to tagging by base when the table is full,
+	// which the capacity above is supposed to rule out for disjoint ranges.
+	// Checked against the reference lookups, not the stub's own
+	uint64_t out_pages = 0;
+	for (size_t i = 0; i < out; i++) {
+		MemRegion *r = &fuzz_regions[i];
+		uint64_t end = r->base + r->pages * EFI_PAGE_SIZE;
+		if (r->pages == 0) {
+			fail("empty region", i);
+		}
+		if (i > 0 && fuzz_regions[i - 1].base + fuzz_regions[i - 1].pages * EFI_PAGE_SIZE > r->base) {
+			fail("regions out of order or overlapping", i);
+		}
+		if (r->node != ref_node_at(r->base)) {
+			fail("wrong node", i);
+		}
+		if (ref_straddles(r->base, end)) {
+			fail("region straddles a NUMA boundary", i);
+		}
+		if (numa_range_count == 0 && i > 0) {
+			MemRegion *prev = &fuzz_regions[i - 1];
+			if (prev->type == r->type && prev->base + prev->pages * EFI_PAGE_SIZE == r->base) {
+				fail("mergeable neighbours", i);
+			}
+		}
+		out_pages += r->pages;
+	}
+	if (out_pages != in_pages) {
+		fail("pages not conserved", out);
+	}
+	return 0;
+}
+
+#ifndef FUZZ_LIBFUZZER
+static uint64_t xorshift(uint64_t *s) {
+	*s ^= *s << 13;
+	*s ^= *s >> 7;
+	*s ^= *s << 17;
+	return *s;
+}
+
+// Random bytes mostly, but gaps and lengths are often small so neighbours touch
+static size_t random_input(uint8_t *buf, uint64_t *rng) {
+	size_t size = 2 + xorshift(rng) % (FUZZ_MAX_INPUT - 2);
+	if (xorshift(rng) & 1) {
+		size %= 4096;
+	}
+	for (size_t i = 0; i < size; i++) {
+		uint64_t r = xorshift(rng);
+		buf[i] = (r & 0x300) ? (uint8_t)(r & 3) : (uint8_t)r;
+	}
+	return size;
+}
+
+int main(int argc, char **argv) {
+	uint64_t iterations = 10000, seed = 1;
+	int opt;
+	while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+		switch (opt) {
+			case 'n': iterations = strtoull(optarg, NULL, 0); break;
+			case 's': seed = strtoull(optarg, NULL, 0); break;
+			default:
+				fprintf(stderr, "usage: %s [-n iterations] [-s seed] [input files...]\n", argv[0]);
+				return 1;
+		}
+	}
+
+	static uint8_t buf[FUZZ_MAX_INPUT];
+	if (optind < argc) {
+		for (int i = optind; i < argc; i++) {
+			FILE *f = fopen(argv[i], "rb");
+			if (!f) {
+				perror(argv[i]);
+				return 1;
+			}
+			size_t size = fread(buf, 1, sizeof(buf), f);
+			fclose(f);
+			LLVMFuzzerTestOneInput(buf, size);
+		}
+		printf("fuzz_memmap: %d inputs ok\n", argc - optind);
+		return 0;
+	}
+
+	uint64_t rng = seed | 1;
+	for (uint64_t i = 0; i < iterations; i++) {
+		LLVMFuzzerTestOneInput(buf, random_input(buf, &rng));
+	}
+	printf("fuzz_memmap: %lu inputs ok\n", iterations);
+	return 0;
+}
+#endif
@@ -0,0 +1,177 @@
+// Interrupt descriptor table, shared by every CPU. All 256 vectors enter through
+// small stubs that push a uniform frame and fall into one common path, which
+// saves the general registers and calls interrupt_dispatch. The extended state
+// is saved too, but only when the interrupted code was inside a simd_begin
+// bracket (see simd.c). Handlers are plain C functions registered per vector.
+
+#include "kernel.h"
+#include "cpu.h"
+
+#define IDT_ENTRIES 256
+#define IDT_GATE_INTERRUPT 0x8E
+#define IDT_STUB_SIZE 16
+
+// Must match the code64 entry of the GDT in loader.s
+#define KERNEL_CS 0x08
+
+#define VECTOR_EXCEPTIONS 32
+
+#define IDT_STR_(x) #x
+#define IDT_STR(x) IDT_STR_(x)
+
+typedef struct {
+	uint64_t r15, r14, r13, r12, r11, r10, r9, r8;
+	uint64_t rbp, rdi, rsi, rdx, rcx, rbx, rax;
+	uint64_t vector;
+	// Zero for vectors without one
+	uint64_t error;
+	uint64_t rip, cs, rflags, rsp, ss;
+} InterruptFrame;
+
+typedef void (*InterruptHandler)(InterruptFrame *frame);
+
+typedef struct {
+	uint16_t offset_lo;
+	uint16_t selector;
+	uint8_t ist;
+	uint8_t type;
+	uint16_t offset_mid;
+	uint32_t offset_hi;
+	uint32_t reserved;
+} __attribute__((packed)) IdtEntry;
+
+typedef struct {
+	uint16_t limit;
+	uint64_t base;
+} __attribute__((packed)) IdtPointer;
+
+IdtEntry idt[IDT_ENTRIES] __attribute__((aligned(16)));
+InterruptHandler interrupt_handlers[IDT_ENTRIES];
+
+extern char interrupt_stubs[];
+
+// One 16 byte stub per vector. The CPU pushes an error code for 8, 10-14, 17,
+// 21, 29 and 30, every other stub pushes a zero in its place
+__asm__(
+	".pushsection .text\n"
+	".balign 16\n"
+	"interrupt_stubs:\n"
+	".set idt_vector, 0\n"
+	".rept 256\n"
+	"	.balign 16\n"
+	"	.if !(idt_vector == 8 || (idt_vector >= 10 && idt_vector <= 14) || idt_vector == 17 || idt_vector == 21 || idt_vector == 29 || idt_vector == 30)\n"
+	"	pushq $0\n"
+	"	.endif\n"
+	"	pushq $idt_vector\n"
+	"	jmp interrupt_common\n"
+	"	.set idt_vector, idt_vector + 1\n"
+	".endr\n"
+	"\n"
+	"interrupt_common:\n"
+	"	push %rax\n"
+	"	push %rbx\n"
+	"	push %rcx\n"
+	"	push %rdx\n"
+	"	push %rsi\n"
+	"	push %rdi\n"
+	"	push %rbp\n"
+	"	push %r8\n"
+	"	push %r9\n"
+	"	push %r10\n"
+	"	push %r11\n"
+	"	push %r12\n"
+	"	push %r13\n"
+	"	push %r14\n"
+	"	push %r15\n"
+	// rbp and rbx are callee-saved, so they hold the frame and the save area
+	// across the calls
+	"	mov %rsp, %rbp\n"
+	"	and $-16, %rsp\n"
+	"	cld\n"
+	"	xor %ebx, %ebx\n"
+	"	cmpl $0, %gs:" IDT_STR(PERCPU_SIMD_DEPTH) "\n"
+	"	je 1f\n"
+	"	call simd_save\n"
+	"	mov %rax, %rbx\n"
+	"1:\n"
+	"	mov %rbp, %rdi\n"
+	"	call interrupt_dispatch\n"
+	"	test %rbx, %rbx\n"
+	"	jz 2f\n"
+	"	mov %rbx, %rdi\n"
+	"	call simd_restore\n"
+	"2:\n"
+	"	mov %rbp, %rsp\n"
+	"	pop %r15\n"
+	"	pop %r14\n"
+	"	pop %r13\n"
+	"	pop %r12\n"
+	"	pop %r11\n"
+	"	pop %r10\n"
+	"	pop %r9\n"
+	"	pop %r8\n"
+	"	pop %rbp\n"
+	"	pop %rdi\n"
+	"	pop %rsi\n"
+	"	pop %rdx\n"
+	"	pop %rcx\n"
+	"	pop %rbx\n"
+	"	pop %rax\n"
+	// Vector and error code
+	"	add $16, %rsp\n"
+	"	iretq\n"
+	".popsection\n"
+);
+
+static const char *exception_names[VECTOR_EXCEPTIONS] = {
+	"divide error", "debug", "nmi", "breakpoint", "overflow", "bound range", "invalid opcode", "device not available",
+	"double fault", "coprocessor overrun", "invalid tss", "segment not present", "stack fault", "general protection", "page fault", "reserved",
+	"x87 fault", "alignment check", "machine check", "simd fault", "virtualization", "control protection", "reserved", "reserved",
+	"reserved", "reserved", "reserved", "reserved", "hypervisor injection", "vmm communication", "security", "reserved",
+};
+
+void interrupt_dispatch(InterruptFrame *frame) {
+	InterruptHandler handler = interrupt_handlers[frame->vector];
+	if (handler) {
+		handler(frame);
+		return;
+	}
+
+	if (frame->vector < VECTOR_EXCEPTIONS) {
+		uint64_t cr2;
+		__asm__ volatile ("mov %%cr2, %0" : "=r"(cr2));
+		kprintf("lunk: %s (vector %lu, error %lx) at %p, cr2 %p\n",
+			exception_names[frame->vector], frame->vector, frame->error, (void *)frame->rip, (void *)cr2);
+		halt_forever();
+	}
+
+	// Nobody asked for this one, acknowledge it so the LAPIC keeps delivering.
+	// Spurious interrupts are the exception, they never set an ISR bit
+	if (frame->vector != LAPIC_SPURIOUS_VECTOR) {
+		lapic_eoi();
+	}
+}
+
+void idt_set_handler(uint8_t vector, InterruptHandler handler) {
+	__atomic_store_n(&interrupt_handlers[vector], handler, __ATOMIC_RELEASE);
+}
+
+// Loads the shared table on the calling CPU
+void idt_load(void) {
+	IdtPointer ptr = { .limit = sizeof(idt) - 1, .base = (uint64_t)idt };
+	__asm__ volatile ("lidt %0" :: "m"(ptr));
+}
+
+void idt_init(void) {
+	for (uint32_t i = 0; i < IDT_ENTRIES; i++) {
+		uint64_t stub = (uint64_t)interrupt_stubs + i * IDT_STUB_SIZE;
+		idt[i] = (IdtEntry){
+			.offset_lo = stub & 0xFFFF,
+			.selector = KERNEL_CS,
+			.type = IDT_GATE_INTERRUPT,
+			.offset_mid = (stub >> 16) & 0xFFFF,
+			.offset_hi = stub >> 32,
+		};
+	}
+	idt_load();
+}
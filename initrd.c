@@ -0,0 +1,372 @@
+// Read-only view of the initrd archive. The headers are walked once to build an
+// open-addressed hash index, after which lookups hand out pointers straight into
+// the image: names and contents are never copied. Both cpio newc and ustar/GNU
+// tar archives are understood.
+
+#include "kernel.h"
+#include "boot_info.h"
+
+typedef enum {
+	InitrdFileRegular,
+	InitrdFileDirectory,
+	InitrdFileSymlink,
+	InitrdFileOther,
+} InitrdFileType;
+
+typedef struct {
+	// Not NUL terminated. tar's ustar prefix, when present, is a separate piece
+	// joined to name with a '/'
+	const char *prefix;
+	const char *name;
+	uint32_t prefix_len;
+	uint32_t name_len;
+
+	const void *data;
+	uint64_t size;
+	uint32_t type;
+	uint32_t mode;
+} InitrdFile;
+
+typedef struct {
+	const uint8_t *base;
+	uint64_t size;
+
+	InitrdFile *files;
+	uint32_t file_count;
+
+	// Indices into files, 0 is empty and everything else is index + 1
+	uint32_t *slots;
+	uint32_t slot_mask;
+} Initrd;
+
+Initrd initrd;
+
+#define CPIO_HEADER_SIZE 110
+#define TAR_BLOCK_SIZE 512
+
+#define S_IFMT   0170000
+#define S_IFDIR  0040000
+#define S_IFREG  0100000
+#define S_IFLNK  0120000
+
+#define FNV_OFFSET 0xCBF29CE484222325ULL
+#define FNV_PRIME  0x100000001B3ULL
+
+static uint64_t fnv1a(uint64_t h, const char *s, size_t len) {
+	for (size_t i = 0; i < len; i++) {
+		h = (h ^ (uint8_t)s[i]) * FNV_PRIME;
+	}
+	return h;
+}
+
+// Archive names come as "./a/b", "/a/b", "a/b/" and so on, index them all as "a/b"
+static void initrd_trim(const char **s, uint32_t *len) {
+	while (*len && (**s == '/' || (**s == '.' && (*len == 1 || (*s)[1] == '/')))) {
+		(*s)++;
+		(*len)--;
+	}
+	while (*len && (*s)[*len - 1] == '/') {
+		(*len)--;
+	}
+}
+
+static uint64_t initrd_file_hash(InitrdFile *f) {
+	uint64_t h = FNV_OFFSET;
+	if (f->prefix_len) {
+		h = fnv1a(h, f->prefix, f->prefix_len);
+		h = fnv1a(h, "/", 1);
+	}
+	return fnv1a(h, f->name, f->name_len);
+}
+
+static bool initrd_file_matches(InitrdFile *f, const char *path, uint32_t len) {
+	if (f->prefix_len) {
+		if (len != f->prefix_len + 1 + f->name_len || path[f->prefix_len] != '/') {
+			return false;
+		}
+		return memcmp(path, f->prefix, f->prefix_len) == 0 && memcmp(path + f->prefix_len + 1, f->name, f->name_len) == 0;
+	}
+	return len == f->name_len && memcmp(path, f->name, len) == 0;
+}
+
+static bool initrd_file_same_path(InitrdFile *a, InitrdFile *b) {
+	if (!b->prefix_len) {
+		return initrd_file_matches(a, b->name, b->name_len);
+	}
+	if (!a->prefix_len) {
+		return initrd_file_matches(b, a->name, a->name_len);
+	}
+	// Two ustar names only compare equal here when they were split the same way
+	return a->prefix_len == b->prefix_len && a->name_len == b->name_len &&
+		memcmp(a->prefix, b->prefix, a->prefix_len) == 0 && memcmp(a->name, b->name, a->name_len) == 0;
+}
+
+static uint64_t parse_number(const char *s, size_t len, uint32_t base, bool *ok) {
+	uint64_t v = 0;
+	for (size_t i = 0; i < len; i++) {
+		char c = s[i];
+		uint32_t digit;
+		if (c >= '0' && c <= '9') {
+			digit = c - '0';
+		} else if (base == 16 && c >= 'a' && c <= 'f') {
+			digit = c - 'a' + 10;
+		} else if (base == 16 && c >= 'A' && c <= 'F') {
+			digit = c - 'A' + 10;
+		} else if (base == 8 && (c == ' ' || c == '\0')) {
+			// tar fields are NUL or space terminated
+			break;
+		} else {
+			*ok = false;
+			return 0;
+		}
+		if (digit >= base) {
+			*ok = false;
+			return 0;
+		}
+		v = v * base + digit;
+	}
+	return v;
+}
+
+static uint32_t initrd_type_from_mode(uint32_t mode) {
+	switch (mode & S_IFMT) {
+		case S_IFREG: return InitrdFileRegular;
+		case S_IFDIR: return InitrdFileDirectory;
+		case S_IFLNK: return InitrdFileSymlink;
+		default:      return InitrdFileOther;
+	}
+}
+
+// Walks the archive. With files == NULL only counts, so the caller can size the
+// table first. Returns false if the archive is malformed
+static bool initrd_walk_cpio(Initrd *rd, InitrdFile *files, uint32_t *count) {
+	uint64_t off = 0;
+	*count = 0;
+	while (off + CPIO_HEADER_SIZE <= rd->size) {
+		const char *h = (const char *)rd->base + off;
+		if (memcmp(h, "07070", 5) != 0 || (h[5] != '1' && h[5] != '2')) {
+			return false;
+		}
+
+		bool ok = true;
+		uint32_t mode = parse_number(h + 14, 8, 16, &ok);
+		uint64_t file_size = parse_number(h + 54, 8, 16, &ok);
+		uint32_t name_size = parse_number(h + 94, 8, 16, &ok);
+		if (!ok || name_size == 0) {
+			return false;
+		}
+
+		uint64_t name_off = off + CPIO_HEADER_SIZE;
+		uint64_t data_off = (name_off + name_size + 3) & ~3ULL;
+		if (data_off > rd->size || file_size > rd->size - data_off) {
+			return false;
+		}
+
+		const char *name = (const char *)rd->base + name_off;
+		uint32_t name_len = name_size - 1;
+		if (name_len == 10 && memcmp(name, "TRAILER!!!", 10) == 0) {
+			return true;
+		}
+
+		initrd_trim(&name, &name_len);
+		if (name_len) {
+			if (files) {
+				files[*count] = (InitrdFile){
+					.name = name,
+					.name_len = name_len,
+					.data = rd->base + data_off,
+					.size = file_size,
+					.type = initrd_type_from_mode(mode),
+					.mode = mode & ~S_IFMT,
+				};
+			}
+			*count += 1;
+		}
+
+		off = (data_off + file_size + 3) & ~3ULL;
+	}
+	// Ran off the end without a trailer
+	return false;
+}
+
+static size_t bounded_strlen(const char *s, size_t max) {
+	size_t n = 0;
+	while (n < max && s[n]) {
+		n++;
+	}
+	return n;
+}
+
+static bool initrd_walk_tar(Initrd *rd, InitrdFile *files, uint32_t *count) {
+	uint64_t off = 0;
+	*count = 0;
+
+	// GNU long names arrive as a separate 'L' record ahead of the header they belong to
+	const char *long_name = NULL;
+	uint32_t long_name_len = 0;
+
+	while (off + TAR_BLOCK_SIZE <= rd->size) {
+		const char *h = (const char *)rd->base + off;
+		if (h[0] == '\0') {
+			// A zero block ends the archive
+			return true;
+		}
+
+		uint32_t sum = 0;
+		for (size_t i = 0; i < TAR_BLOCK_SIZE; i++) {
+			sum += (i >= 148 && i < 156) ? ' ' : (uint8_t)h[i];
+		}
+		bool ok = true;
+		uint64_t file_size = parse_number(h + 124, 12, 8, &ok);
+		uint32_t mode = parse_number(h + 100, 8, 8, &ok);
+		if (!ok || parse_number(h + 148, 8, 8, &ok) != sum || !ok) {
+			return false;
+		}
+
+		uint64_t data_off = off + TAR_BLOCK_SIZE;
+		if (file_size > rd->size - data_off) {
+			return false;
+		}
+		off = data_off + ((file_size + TAR_BLOCK_SIZE - 1) & ~(uint64_t)(TAR_BLOCK_SIZE - 1));
+
+		char flag = h[156];
+		if (flag == 'L') {
+			long_name = (const char *)rd->base + data_off;
+			long_name_len = bounded_strlen(long_name, file_size);
+			continue;
+		}
+
+		InitrdFile f = {
+			.data = rd->base + data_off,
+			.size = file_size,
+			.mode = mode & ~S_IFMT,
+		};
+		switch (flag) {
+			case '0':
+			case '\0':
+			case '7': f.type = InitrdFileRegular; break;
+			case '5': f.type = InitrdFileDirectory; break;
+			case '2': f.type = InitrdFileSymlink; break;
+			default:  f.type = InitrdFileOther; break;
+		}
+
+		// cpio stores link targets as file data, tar in the header. Serve both the same way
+		if (f.type == InitrdFileSymlink && file_size == 0) {
+			f.data = h + 157;
+			f.size = bounded_strlen(h + 157, 100);
+		}
+
+		if (long_name) {
+			f.name = long_name;
+			f.name_len = long_name_len;
+			long_name = NULL;
+		} else {
+			f.name = h;
+			f.name_len = bounded_strlen(h, 100);
+			// Only POSIX ustar has a prefix field, GNU tar keeps timestamps there
+			if (memcmp(h + 257, "ustar\0", 6) == 0 && h[345]) {
+				f.prefix = h + 345;
+				f.prefix_len = bounded_strlen(h + 345, 155);
+				initrd_trim(&f.prefix, &f.prefix_len);
+			}
+		}
+
+		if (f.prefix_len) {
+			while (f.name_len && f.name[f.name_len - 1] == '/') {
+				f.name_len--;
+			}
+		} else {
+			initrd_trim(&f.name, &f.name_len);
+		}
+
+		if (f.name_len) {
+			if (files) {
+				files[*count] = f;
+			}
+			*count += 1;
+		}
+	}
+	return false;
+}
+
+static bool initrd_is_tar(Initrd *rd) {
+	return rd->size >= TAR_BLOCK_SIZE && memcmp(rd->base + 257, "ustar", 5) == 0;
+}
+
+static bool initrd_walk(Initrd *rd, InitrdFile *files, uint32_t *count) {
+	return initrd_is_tar(rd) ? initrd_walk_tar(rd, files, count) : initrd_walk_cpio(rd, files, count);
+}
+
+bool initrd_init(BootInfo *info) {
+	Initrd *rd = &initrd;
+	if (!info->initrd_size) {
+		return false;
+	}
+	rd->base = (const uint8_t *)phys_to_virt(info->initrd_base);
+	rd->size = info->initrd_size;
+
+	uint32_t count;
+	if (!initrd_walk(rd, NULL, &count)) {
+		return false;
+	}
+
+	// Load factor at most 1/2
+	uint32_t slots = 16;
+	while (slots < count * 2) {
+		slots <<= 1;
+	}
+
+	uint64_t bytes = count * sizeof(InitrdFile) + slots * sizeof(uint32_t);
+	uint64_t phys = pmm_alloc(pmm_order_for(bytes));
+	if (!phys) {
+		return false;
+	}
+	rd->files = (InitrdFile *)phys_to_virt(phys);
+	rd->slots = (uint32_t *)(rd->files + count);
+	rd->slot_mask = slots - 1;
+	memset(rd->slots, 0, slots * sizeof(uint32_t));
+
+	initrd_walk(rd, rd->files, &rd->file_count);
+
+	// Later entries win, an archive can override its own earlier files
+	for (uint32_t i = 0; i < rd->file_count; i++) {
+		InitrdFile *f = &rd->files[i];
+		uint32_t slot = initrd_file_hash(f) & rd->slot_mask;
+		for (;;) {
+			uint32_t cur = rd->slots[slot];
+			if (cur == 0) {
+				rd->slots[slot] = i + 1;
+				break;
+			}
+
+			if (initrd_file_same_path(&rd->files[cur - 1], f)) {
+				rd->slots[slot] = i + 1;
+				break;
+			}
+			slot = (slot + 1) & rd->slot_mask;
+		}
+	}
+	return true;
+}
+
+// NULL when the path isn't in the archive. The returned file points into the image
+InitrdFile *initrd_lookup(const char *path) {
+	Initrd *rd = &initrd;
+	if (!rd->slots) {
+		return NULL;
+	}
+
+	uint32_t len = strlen(path);
+	initrd_trim(&path, &len);
+	uint32_t slot = fnv1a(FNV_OFFSET, path, len) & rd->slot_mask;
+	for (;;) {
+		uint32_t cur = rd->slots[slot];
+		if (cur == 0) {
+			return NULL;
+		}
+		if (initrd_file_matches(&rd->files[cur - 1], path, len)) {
+			return &rd->files[cur - 1];
+		}
+		slot = (slot + 1) & rd->slot_mask;
+	}
+}
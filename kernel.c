@@ -1,6 +1,128 @@
-typedef struct {
-} BootInfo;
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "kernel.h"
+#include "boot_info.h"
+#include "mem.c"
+#include "pmm.c"
+#include "slab.c"
+#include "time.c"
+#include "lapic.c"
+#include "font.c"
+#include "serial.c"
+#include "console.c"
+#include "idt.c"
+#include "simd.c"
+#include "timer.c"
+#include "smp.c"
+#include "log.c"
+#include "sched.c"
+#include "vm.c"
+#include "trace.c"
+#include "initrd.c"
+#include "kexec.c"
+
+// Dead weight for load benchmarks, so the stub has a multi-MB image to read
+#ifdef KERNEL_PAD_BYTES
+__attribute__((used)) const char kernel_pad[KERNEL_PAD_BYTES] = { 1 };
+#endif
 
 void kernel_main(BootInfo *info) {
+	smp_set_gs(&boot_cpu);
+	boot_trace = &info->trace;
+	boot_log = &info->log;
+	trace_point(TraceKernelEntry, 0);
+
+	mem_init();
+
+	if (!pmm_init(info)) {
+		halt_forever();
+	}
+	trace_point(TracePmmInit, 0);
+
+	// Headless boots carry on without output
+	serial_init();
+	console_init(info);
+	trace_point(TraceConsoleInit, 0);
+	PmmStats pmm;
+	pmm_stats(&pmm);
+	if (info->kexec_count) {
+		kprintf("lunk: warm reboot %u\n", info->kexec_count);
+	}
+	kprintf("lunk: %lu MiB free\n", pmm.free_pages >> (20 - PAGE_SHIFT));
+	if (pmm_node_count > 1) {
+		for (uint32_t node = 0; node < pmm_node_count; node++) {
+			kprintf("lunk: node %u: %lu MiB free\n", node, pmm_node_free_pages(node) >> (20 - PAGE_SHIFT));
+		}
+	}
+
+	// Before smp_init, APs load the same table as they come up
+	idt_init();
+	if (!simd_init()) {
+		kprintf("lunk: SIMD init failed\n");
+		halt_forever();
+	}
+	kprintf("lunk: SIMD state %s, %u byte areas (xcr0 %lx)\n", simd_mode_names[simd_mode], simd_area_size, simd_xcr0);
+	if (!vm_init(info)) {
+		kprintf("lunk: VM init failed\n");
+		halt_forever();
+	}
+	kprintf("lunk: PCID %s, INVPCID %s\n", vm_pcid ? "on" : "off", vm_invpcid ? "on" : "off");
+
+	if (initrd_init(info)) {
+		kprintf("lunk: initrd %lu KiB, %u files\n", info->initrd_size >> 10, initrd.file_count);
+	}
+
+	if (!smp_init(info)) {
+		kprintf("lunk: SMP init failed\n");
+		halt_forever();
+	}
+	trace_point(TraceSmpInit, cpus_online);
+	kprintf("lunk: %u of %u CPUs online\n", cpus_online, info->cpu_count);
+	if (!log_init()) {
+		kprintf("lunk: log init failed\n");
+		halt_forever();
+	}
+
+	if (!heap_init(cpu_count)) {
+		kprintf("lunk: heap init failed\n");
+		halt_forever();
+	}
+	trace_point(TraceHeapInit, 0);
+
+	tsc_calibrate();
+	kprintf("lunk: TSC %lu MHz (%s%s)\n", tsc_hz / 1000000, tsc_source, tsc_invariant ? ", invariant" : "");
+	if (!timer_init(cpu_count)) {
+		kprintf("lunk: timer init failed\n");
+		halt_forever();
+	}
+	trace_point(TraceTimerInit, 0);
+	trace_dump();
+#ifdef TIMER_BENCH
+	timer_bench();
+#endif
+
+	if (!sched_init(cpu_count)) {
+		kprintf("lunk: scheduler init failed\n");
+		halt_forever();
+	}
+#ifdef SCHED_BENCH
+	sched_bench();
+#endif
+#ifdef LOG_BENCH
+	log_bench();
+#endif
+#ifdef PMM_BENCH
+	pmm_bench();
+#endif
+#ifdef VM_BENCH
+	vm_bench();
+#endif
+#ifdef KEXEC_BENCH
+	kexec_bench(info);
+#endif
 
+	// The BSP becomes just another worker
+	sched_worker();
 }
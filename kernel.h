@@ -0,0 +1,89 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "paging.h"
+
+#define PAGE_SIZE 0x1000
+#define PAGE_SHIFT 12
+
+static inline void *phys_to_virt(uint64_t phys) {
+	return (void *)(phys + PHYS_MAP_BASE);
+}
+
+static inline uint64_t virt_to_phys(void *virt) {
+	return (uint64_t)virt - PHYS_MAP_BASE;
+}
+
+typedef struct {
+	volatile uint32_t locked;
+} Spinlock;
+
+static inline void spin_lock(Spinlock *lock) {
+	while (__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE)) {
+		while (__atomic_load_n(&lock->locked, __ATOMIC_RELAXED)) {
+			__asm__ volatile ("pause");
+		}
+	}
+}
+
+static inline bool spin_trylock(Spinlock *lock) {
+	return !__atomic_load_n(&lock->locked, __ATOMIC_RELAXED) && !__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE);
+}
+
+static inline void spin_unlock(Spinlock *lock) {
+	__atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+}
+
+static inline void halt_forever(void) {
+	for (;;) {
+		__asm__ volatile ("cli; hlt");
+	}
+}
+
+#define CACHE_LINE_SIZE 64
+
+// One per CPU, reached through the GS base. self comes first so this_cpu() is a single load
+typedef struct PerCpu {
+	struct PerCpu *self;
+	uint32_t index;
+	uint32_t apic_id;
+	uint64_t stack_top;
+	// NUMA node, pmm_alloc prefers its memory
+	uint32_t node;
+	// Open simd_begin brackets, interrupt_common reads it at PERCPU_SIMD_DEPTH
+	uint32_t simd_depth;
+	// Interrupts currently holding a save area, and the areas themselves (simd.c)
+	uint32_t simd_nest;
+	uint8_t *simd_area;
+	// Log ring and drain state (log.c)
+	struct LogCpu *log;
+	// Loaded address space, PCID slots and shootdown queue (vm.c)
+	struct VmCpu *vm;
+} __attribute__((aligned(CACHE_LINE_SIZE))) PerCpu;
+
+#define PERCPU_SIMD_DEPTH 28
+_Static_assert(offsetof(PerCpu, simd_depth) == PERCPU_SIMD_DEPTH, "interrupt_common reads simd_depth at a fixed offset");
+
+static inline PerCpu *this_cpu(void) {
+	PerCpu *cpu;
+	__asm__ volatile ("mov %%gs:0, %0" : "=r"(cpu));
+	return cpu;
+}
+
+// The kernel is built without SIMD, so vector registers only hold anything
+// live between these two. Interrupts landing in between preserve the extended
+// state, everywhere else they skip it. Brackets nest
+static inline void simd_begin(void) {
+	__asm__ volatile ("incl %%gs:%c0" :: "i"(PERCPU_SIMD_DEPTH) : "memory");
+}
+
+static inline void simd_end(void) {
+	__asm__ volatile ("decl %%gs:%c0" :: "i"(PERCPU_SIMD_DEPTH) : "memory");
+}
+
+// mem.c's vector paths
+#define MEM_SIMD_BEGIN() simd_begin()
+#define MEM_SIMD_END() simd_end()
@@ -0,0 +1,367 @@
+// Warm reboot into a new kernel without going back through firmware. The
+// replacement image is an ELF or an LZ4 frame of one, the same as the stub reads.
+// kexec_load places it in frames from the buddy allocator, relocates it, and
+// gives it a stack, page tables and a BootInfo laid out the way the stub would
+// have built them. kexec_reboot then stops the other CPUs with an NMI and takes
+// the BSP back into loader.bin. loader.bin switches to the new tables and calls
+// the new kernel_main, and that kernel starts the APs again with INIT-SIPI.
+//
+// ACPI, the framebuffer and the CPU and NUMA tables carry over unchanged. The
+// new region table marks the loader, the initrd and everything kexec_load
+// allocated as MemRegionBoot. Every other page the old kernel owned is handed
+// back as usable, including what the stub reserved for the first boot.
+
+#include "kernel.h"
+#include "boot_info.h"
+#include "cpu.h"
+#include "elf.h"
+#include "lz4.h"
+
+// Same as the stub's
+#define KEXEC_STACK_SIZE (64 * 1024)
+#define KEXEC_KERNEL_ALIGN (2 * 1024 * 1024)
+
+// BootInfo is reached through the identity map by loader.bin before its CR3
+// switch, and APs load CR3 while still in 32-bit mode
+#define KEXEC_LOW_LIMIT IDENTITY_MAP_SIZE
+
+// Image, stack, BootInfo, page tables and region table
+#define KEXEC_MAX_ALLOCS 5
+// Those, the loader and the initrd
+#define KEXEC_MAX_RANGES (KEXEC_MAX_ALLOCS + 2)
+
+#define KEXEC_STOP_TIMEOUT_US 100000
+#define KEXEC_POLL_US 10
+
+#define VECTOR_NMI 2
+
+typedef struct {
+	uint64_t base, end;
+} KexecRange;
+
+typedef struct {
+	uint64_t phys;
+	uint32_t order;
+} KexecAlloc;
+
+typedef struct {
+	// Physical and direct mapped
+	uint64_t info_phys;
+	BootInfo *info;
+
+	// Everything kexec_load allocated, given back by kexec_unload
+	KexecAlloc allocs[KEXEC_MAX_ALLOCS];
+	uint32_t alloc_count;
+	bool loaded;
+} Kexec;
+
+Kexec kexec;
+volatile uint32_t kexec_stopped;
+
+typedef struct {
+	uint64_t next, end;
+} KexecTablePool;
+
+static uint64_t kexec_table_alloc(void *ctx) {
+	KexecTablePool *pool = (KexecTablePool *)ctx;
+	if (pool->next >= pool->end) {
+		return 0;
+	}
+
+	uint64_t page = pool->next;
+	pool->next += PAGE_SIZE;
+	memset(phys_to_virt(page), 0, PAGE_SIZE);
+	return page;
+}
+
+static uint64_t kexec_alloc(uint64_t size, bool low) {
+	if (kexec.alloc_count == KEXEC_MAX_ALLOCS) {
+		return 0;
+	}
+	uint32_t order = pmm_order_for(size);
+	uint64_t phys = low ? pmm_alloc_below(order, KEXEC_LOW_LIMIT) : pmm_alloc(order);
+	if (phys) {
+		kexec.allocs[kexec.alloc_count++] = (KexecAlloc){ .phys = phys, .order = order };
+	}
+	return phys;
+}
+
+// Drops a staged image
+void kexec_unload(void) {
+	for (uint32_t i = 0; i < kexec.alloc_count; i++) {
+		pmm_free(kexec.allocs[i].phys, kexec.allocs[i].order);
+	}
+	kexec.alloc_count = 0;
+	kexec.loaded = false;
+}
+
+// The new table. Pages in a boot range become MemRegionBoot, whatever the
+// current boot reserved becomes usable, and everything else keeps its type.
+// Ranges are disjoint, so each adds at most two regions by splitting one.
+// Neighbours that come out alike are merged again
+static size_t kexec_regions_build(MemRegion *old, size_t count, KexecRange *ranges, uint32_t range_count, MemRegion *out) {
+	size_t n = 0;
+	for (size_t i = 0; i < count; i++) {
+		uint64_t base = old[i].base, end = old[i].base + old[i].pages * PAGE_SIZE;
+		while (base < end) {
+			uint64_t piece_end = end;
+			bool boot = false;
+			for (uint32_t r = 0; r < range_count; r++) {
+				if (ranges[r].base <= base && base < ranges[r].end) {
+					boot = true;
+					if (ranges[r].end < piece_end) {
+						piece_end = ranges[r].end;
+					}
+				} else if (ranges[r].base > base && ranges[r].base < piece_end) {
+					piece_end = ranges[r].base;
+				}
+			}
+
+			uint32_t type = old[i].type;
+			if (boot) {
+				type = MemRegionBoot;
+			} else if (type == MemRegionBoot) {
+				type = MemRegionUsable;
+			}
+
+			MemRegion *prev = n ? &out[n - 1] : NULL;
+			if (prev && prev->type == type && prev->node == old[i].node && prev->flags == old[i].flags &&
+				prev->base + prev->pages * PAGE_SIZE == base) {
+				prev->pages += (piece_end - base) / PAGE_SIZE;
+			} else {
+				out[n++] = (MemRegion){
+					.base = base,
+					.pages = (piece_end - base) / PAGE_SIZE,
+					.type = type,
+					.flags = old[i].flags,
+					.node = old[i].node,
+				};
+			}
+			base = piece_end;
+		}
+	}
+	return n;
+}
+
+static bool kexec_stage(BootInfo *current, const uint8_t *elf, uint64_t elf_size, uint64_t start_tsc) {
+	Elf64_Ehdr ehdr;
+	Elf64_Phdr phdrs[ELF_MAX_PHDRS];
+	if (elf_size < sizeof(ehdr)) {
+		return false;
+	}
+	memcpy(&ehdr, elf, sizeof(ehdr));
+	// The kernel always runs at KERNEL_VIRT_BASE, so it has to be relocatable
+	if (!elf_check_header(&ehdr) || ehdr.e_type != ET_DYN) {
+		return false;
+	}
+	size_t phdrs_size = ehdr.e_phnum * sizeof(Elf64_Phdr);
+	if (ehdr.e_phoff > elf_size || phdrs_size > elf_size - ehdr.e_phoff) {
+		return false;
+	}
+	memcpy(phdrs, elf + ehdr.e_phoff, phdrs_size);
+
+	uint64_t min_vaddr, max_vaddr;
+	if (!elf_image_span(phdrs, ehdr.e_phnum, &min_vaddr, &max_vaddr)) {
+		return false;
+	}
+	uint64_t span = max_vaddr - min_vaddr;
+	for (size_t i = 0; i < ehdr.e_phnum; i++) {
+		Elf64_Phdr *ph = &phdrs[i];
+		if (ph->p_type == PT_LOAD && (ph->p_offset > elf_size || ph->p_filesz > elf_size - ph->p_offset)) {
+			return false;
+		}
+	}
+
+	// Buddy blocks are naturally aligned, so this also gets the stub's 2 MiB alignment
+	uint64_t image_phys = kexec_alloc(span > KEXEC_KERNEL_ALIGN ? span : KEXEC_KERNEL_ALIGN, false);
+	if (!image_phys) {
+		return false;
+	}
+	char *image = (char *)phys_to_virt(image_phys);
+	for (size_t i = 0; i < ehdr.e_phnum; i++) {
+		Elf64_Phdr *ph = &phdrs[i];
+		if (ph->p_type != PT_LOAD || ph->p_memsz == 0) {
+			continue;
+		}
+		char *dest = image + (ph->p_vaddr - min_vaddr);
+		memcpy(dest, elf + ph->p_offset, ph->p_filesz);
+		memset(dest + ph->p_filesz, 0, ph->p_memsz - ph->p_filesz);
+	}
+	if (!elf_relocate(phdrs, ehdr.e_phnum, min_vaddr, span, image, KERNEL_VIRT_BASE)) {
+		return false;
+	}
+
+	uint64_t stack_phys = kexec_alloc(KEXEC_STACK_SIZE, false);
+	uint64_t info_phys = kexec_alloc(sizeof(BootInfo), true);
+	if (!stack_phys || !info_phys) {
+		return false;
+	}
+
+	bool huge_1g;
+	uint64_t nx;
+	pt_boot_features(&huge_1g, &nx);
+	uint64_t table_bytes = pt_boot_table_count(current->phys_map_size, span, huge_1g) * PAGE_SIZE;
+	uint64_t tables_phys = kexec_alloc(table_bytes, true);
+	if (!tables_phys) {
+		return false;
+	}
+	KexecTablePool pool = { .next = tables_phys, .end = tables_phys + table_bytes };
+	PageMapper m = { .table_offset = PHYS_MAP_BASE, .alloc = kexec_table_alloc, .ctx = &pool };
+	m.root = kexec_table_alloc(&pool);
+	if (!pt_build_boot(&m, current->phys_map_size, huge_1g, nx, phdrs, ehdr.e_phnum, min_vaddr, image_phys)) {
+		return false;
+	}
+
+	size_t capacity = current->mem_region_count + 2 * KEXEC_MAX_RANGES;
+	uint64_t regions_phys = kexec_alloc(capacity * sizeof(MemRegion), false);
+	if (!regions_phys) {
+		return false;
+	}
+
+	KexecRange ranges[KEXEC_MAX_RANGES];
+	uint32_t range_count = 0;
+	// loader.bin is two pages, the second is the AP trampoline
+	ranges[range_count++] = (KexecRange){ LOADER_BASE, AP_TRAMPOLINE + PAGE_SIZE };
+	if (current->initrd_size) {
+		uint64_t end = (current->initrd_base + current->initrd_size + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+		ranges[range_count++] = (KexecRange){ current->initrd_base, end };
+	}
+	for (uint32_t i = 0; i < kexec.alloc_count; i++) {
+		uint64_t base = kexec.allocs[i].phys;
+		ranges[range_count++] = (KexecRange){ base, base + (PAGE_SIZE << kexec.allocs[i].order) };
+	}
+
+	// Everything the stub filled in that isn't about the kernel itself stays
+	BootInfo *info = (BootInfo *)phys_to_virt(info_phys);
+	memcpy(info, current, sizeof(BootInfo));
+	info->kernel_entry = KERNEL_VIRT_BASE + (ehdr.e_entry - min_vaddr);
+	info->stack_top = PHYS_MAP_BASE + stack_phys + KEXEC_STACK_SIZE;
+	info->page_table_root = m.root;
+	info->kernel_phys_base = image_phys;
+	info->kernel_virt_base = KERNEL_VIRT_BASE;
+	info->kernel_size = span;
+	info->mem_regions = regions_phys;
+	info->mem_region_count = kexec_regions_build((MemRegion *)phys_to_virt(current->mem_regions), current->mem_region_count,
+		ranges, range_count, (MemRegion *)phys_to_virt(regions_phys));
+	info->kexec_count = current->kexec_count + 1;
+
+	// The new kernel's trace starts here rather than at efi_main, and its log
+	// starts empty, this kernel drains its own before the reboot
+	memset(&info->trace, 0, sizeof(info->trace));
+	memset(&info->log, 0, sizeof(info->log));
+	trace_record(&info->trace, start_tsc, TraceKexecLoad, info->kexec_count);
+
+	kexec.info_phys = info_phys;
+	kexec.info = info;
+	return true;
+}
+
+// Stages image, size bytes of ELF or LZ4 frame, to replace the running kernel
+// on the next kexec_reboot. current is the BootInfo this kernel was started
+// with. The image is copied, so it can go once this returns
+bool kexec_load(BootInfo *current, const void *image, uint64_t size) {
+	uint64_t start_tsc = rdtsc();
+	kexec_unload();
+
+	const uint8_t *elf = (const uint8_t *)image;
+	uint64_t elf_size = size;
+	uint64_t scratch = 0;
+	uint32_t scratch_order = 0;
+
+	Lz4FrameHeader header;
+	if (lz4_parse_header(elf, size, &header) > 0) {
+		scratch_order = pmm_order_for(header.content_size);
+		scratch = pmm_alloc(scratch_order);
+		if (!scratch) {
+			return false;
+		}
+
+		Lz4Stream stream;
+		lz4_stream_init(&stream, phys_to_virt(scratch), header.content_size);
+		if (!lz4_stream_feed(&stream, image, size) || !lz4_stream_complete(&stream)) {
+			pmm_free(scratch, scratch_order);
+			return false;
+		}
+		elf = (const uint8_t *)phys_to_virt(scratch);
+		elf_size = header.content_size;
+	}
+
+	kexec.loaded = kexec_stage(current, elf, elf_size, start_tsc);
+	if (kexec.loaded) {
+		LOG(LogKexecStaged, elf_size, kexec.info->kernel_phys_base);
+	}
+	if (scratch) {
+		pmm_free(scratch, scratch_order);
+	}
+	if (!kexec.loaded) {
+		kexec_unload();
+	}
+	return kexec.loaded;
+}
+
+// Parks a CPU for good. NMIs stay blocked since this never returns
+static void kexec_stop_handler(InterruptFrame *frame) {
+	__atomic_add_fetch(&kexec_stopped, 1, __ATOMIC_RELEASE);
+	halt_forever();
+}
+
+// Enters the staged kernel. Has to run on the BSP, since an INIT from the new
+// kernel would send the BSP back to firmware rather than wait for a SIPI. Only
+// returns when nothing is staged or it's called anywhere else
+bool kexec_reboot(void) {
+	if (!kexec.loaded || this_cpu()->index != 0) {
+		return false;
+	}
+	// Before the other CPUs stop, one halted mid-drain would hold the drain and
+	// serial locks for good
+	log_flush();
+	irq_save();
+
+	// The NMI reaches CPUs busy with interrupts off too. A CPU that never
+	// answers is still reset by the new kernel's INIT
+	idt_set_handler(VECTOR_NMI, kexec_stop_handler);
+	__atomic_store_n(&kexec_stopped, 0, __ATOMIC_RELEASE);
+	for (uint32_t i = 1; i < cpu_count; i++) {
+		lapic_send_nmi(cpus[i]->apic_id);
+	}
+	for (uint64_t waited = 0; __atomic_load_n(&kexec_stopped, __ATOMIC_ACQUIRE) < cpu_count - 1 && waited < KEXEC_STOP_TIMEOUT_US; waited += KEXEC_POLL_US) {
+		pit_delay_us(KEXEC_POLL_US);
+	}
+	trace_record(&kexec.info->trace, rdtsc(), TraceKexecStop, kexec_stopped);
+
+	// Nothing of the old kernel should fire once the new one enables interrupts
+	lapic_timer_disarm();
+
+	// loader.bin's entry takes the physical BootInfo in rcx, and the loader,
+	// BootInfo and this stack are mapped the same in both address spaces
+	__asm__ volatile ("jmp *%0" :: "r"((uint64_t)LOADER_BASE), "c"(kexec.info_phys) : "memory");
+	__builtin_unreachable();
+}
+
+#ifdef KEXEC_BENCH
+// Warm reboots into the initrd's kernel.elf(.lz4), KEXEC_BENCH_ROUNDS times in a row.
+// Every new kernel's trace dump then starts at kexec_load, bench_kexec.sh collects them
+#define KEXEC_BENCH_ROUNDS 10
+
+void kexec_bench(BootInfo *info) {
+	if (info->kexec_count >= KEXEC_BENCH_ROUNDS) {
+		kprintf("kexec_bench end\n");
+		return;
+	}
+
+	InitrdFile *file = initrd_lookup("kernel.elf.lz4");
+	if (!file) {
+		file = initrd_lookup("kernel.elf");
+	}
+	if (!file) {
+		kprintf("kexec_bench: no kernel.elf in the initrd\n");
+		return;
+	}
+	if (!kexec_load(info, file->data, file->size)) {
+		kprintf("kexec_bench: load failed\n");
+		return;
+	}
+	kexec_reboot();
+	kprintf("kexec_bench: reboot failed\n");
+}
+#endif
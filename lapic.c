@@ -0,0 +1,165 @@
+// Local APIC in xAPIC mode, through the direct map
+
+#include "kernel.h"
+#include "cpu.h"
+
+#define LAPIC_ID     0x020
+#define LAPIC_EOI    0x0B0
+#define LAPIC_SVR    0x0F0
+#define LAPIC_ICR_LO 0x300
+#define LAPIC_ICR_HI 0x310
+#define LAPIC_LVT_TIMER  0x320
+#define LAPIC_TIMER_INIT 0x380
+#define LAPIC_TIMER_CUR  0x390
+#define LAPIC_TIMER_DIV  0x3E0
+
+#define LAPIC_SVR_ENABLE (1 << 8)
+#define LAPIC_SPURIOUS_VECTOR 0xFF
+
+#define ICR_FIXED    (0 << 8)
+#define ICR_NMI      (4 << 8)
+#define ICR_INIT     (5 << 8)
+#define ICR_STARTUP  (6 << 8)
+#define ICR_PENDING  (1 << 12)
+#define ICR_ASSERT   (1 << 14)
+
+#define LVT_MASKED         (1 << 16)
+#define LVT_TIMER_ONESHOT  (0 << 17)
+#define LVT_TIMER_DEADLINE (2 << 17)
+
+// Divide the bus clock by 16 in one-shot mode
+#define LAPIC_TIMER_DIV_16 0x3
+
+#define MSR_TSC_DEADLINE 0x6E0
+
+// xAPIC destinations are 8 bits and 0xFF is broadcast
+#define LAPIC_MAX_XAPIC_ID 0xFE
+
+volatile uint32_t *lapic_regs;
+
+static inline uint32_t lapic_read(uint32_t reg) {
+	return lapic_regs[reg / 4];
+}
+
+static inline void lapic_write(uint32_t reg, uint32_t value) {
+	lapic_regs[reg / 4] = value;
+}
+
+uint32_t lapic_id(void) {
+	return lapic_read(LAPIC_ID) >> 24;
+}
+
+// Software-enables the calling CPU's LAPIC
+void lapic_enable(void) {
+	lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+}
+
+void lapic_init(uint64_t base) {
+	lapic_regs = (volatile uint32_t *)phys_to_virt(base);
+	lapic_enable();
+}
+
+void lapic_eoi(void) {
+	lapic_write(LAPIC_EOI, 0);
+}
+
+void lapic_send_ipi(uint32_t apic_id, uint32_t icr) {
+	lapic_write(LAPIC_ICR_HI, apic_id << 24);
+	lapic_write(LAPIC_ICR_LO, icr);
+	while (lapic_read(LAPIC_ICR_LO) & ICR_PENDING) {
+		cpu_pause();
+	}
+}
+
+void lapic_send_fixed(uint32_t apic_id, uint8_t vector) {
+	lapic_send_ipi(apic_id, ICR_FIXED | ICR_ASSERT | vector);
+}
+
+// Taken even with interrupts off
+void lapic_send_nmi(uint32_t apic_id) {
+	lapic_send_ipi(apic_id, ICR_NMI | ICR_ASSERT);
+}
+
+void lapic_send_init(uint32_t apic_id) {
+	lapic_send_ipi(apic_id, ICR_INIT | ICR_ASSERT);
+}
+
+// The AP starts in real mode at vector << 12
+void lapic_send_startup(uint32_t apic_id, uint32_t vector) {
+	lapic_send_ipi(apic_id, ICR_STARTUP | ICR_ASSERT | (vector & 0xFF));
+}
+
+// One-shot fallback for CPUs without TSC-deadline mode, with its count rate
+// relative to the TSC in 32.32 fixed point
+bool lapic_tsc_deadline;
+uint64_t lapic_ticks_per_tsc;
+
+// Longest one-shot interval in TSC ticks, keeps the count math in 64 bits.
+// A longer wait just fires early and gets rearmed
+#define LAPIC_ONESHOT_MAX_TSC 0xFFFFFFFFULL
+
+// Measures the one-shot count rate against the TSC, so needs tsc_calibrate first
+static void lapic_timer_calibrate(void) {
+	lapic_write(LAPIC_TIMER_DIV, LAPIC_TIMER_DIV_16);
+	lapic_write(LAPIC_LVT_TIMER, LVT_MASKED | LVT_TIMER_ONESHOT);
+
+	uint64_t window = tsc_hz / 100;
+	lapic_write(LAPIC_TIMER_INIT, 0xFFFFFFFF);
+	uint64_t start = rdtsc();
+	while (rdtsc() - start < window) {
+		cpu_pause();
+	}
+	uint32_t elapsed = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_CUR);
+	lapic_write(LAPIC_TIMER_INIT, 0);
+
+	lapic_ticks_per_tsc = window ? ((uint64_t)elapsed << 32) / window : 0;
+}
+
+// Picks the timer mode once, on the BSP
+void lapic_timer_init(void) {
+	lapic_tsc_deadline = (cpuid(1, 0).ecx >> 24) & 1;
+	if (!lapic_tsc_deadline) {
+		lapic_timer_calibrate();
+	}
+}
+
+// Points the calling CPU's timer at vector, disarmed
+void lapic_timer_setup(uint8_t vector) {
+	if (lapic_tsc_deadline) {
+		lapic_write(LAPIC_LVT_TIMER, LVT_TIMER_DEADLINE | vector);
+		// The SDM wants the LVT write ordered before the first deadline write
+		__asm__ volatile ("mfence" ::: "memory");
+		wrmsr(MSR_TSC_DEADLINE, 0);
+	} else {
+		lapic_write(LAPIC_TIMER_DIV, LAPIC_TIMER_DIV_16);
+		lapic_write(LAPIC_LVT_TIMER, LVT_TIMER_ONESHOT | vector);
+		lapic_write(LAPIC_TIMER_INIT, 0);
+	}
+}
+
+// Fires once at the given TSC value, or right away when it has already passed
+void lapic_timer_arm(uint64_t deadline) {
+	if (lapic_tsc_deadline) {
+		wrmsr(MSR_TSC_DEADLINE, deadline);
+		return;
+	}
+
+	uint64_t now = rdtsc();
+	uint64_t delta = deadline > now ? deadline - now : 0;
+	if (delta > LAPIC_ONESHOT_MAX_TSC) {
+		delta = LAPIC_ONESHOT_MAX_TSC;
+	}
+	uint64_t count = (delta * lapic_ticks_per_tsc) >> 32;
+	if (count > 0xFFFFFFFF) {
+		count = 0xFFFFFFFF;
+	}
+	lapic_write(LAPIC_TIMER_INIT, count ? (uint32_t)count : 1);
+}
+
+void lapic_timer_disarm(void) {
+	if (lapic_tsc_deadline) {
+		wrmsr(MSR_TSC_DEADLINE, 0);
+	} else {
+		lapic_write(LAPIC_TIMER_INIT, 0);
+	}
+}
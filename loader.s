@@ -2,16 +2,312 @@
 [org 0x18000]
 [section .text]
 
+%define PHYS_MAP_BASE 0xFFFF800000000000
+
+%define MSR_EFER 0xC0000080
+%define EFER_NXE 11
+%define EFER_LME 8
+%define CR0_PE 0
+%define CR0_MP 1
+%define CR0_EM 2
+%define CR0_WP 16
+%define CR0_PG 31
+%define CR4_PAE 5
+%define CR4_PGE 7
+%define CR4_OSFXSR 9
+%define CR4_OSXMMEXCPT 10
+%define CR4_OSXSAVE 18
+
+; x87, SSE, AVX and the three AVX-512 components, whichever the CPU has.
+; AMX needs more than an XCR0 bit, it's left off
+%define XCR0_WANTED 0xE7
+
+; Must match AP_TRAMPOLINE in boot_info.h
+%define AP_TRAMPOLINE 0x19000
+
+; Must match trace.h
+%define TRACE_RING_SIZE 128
+%define TRACE_LOADER_ENTRY 12
+%define TRACE_LOADER_EXIT 13
+
+; Must match log.h
+%define LOG_RING_WORDS 1024
+%define LOG_LOADER_ENTRY 1
+%define LOG_LOADER_EXIT 2
+
+; Mirrors the head of BootInfo in boot_info.h
+struc BootInfo
+	.kernel_entry:    resq 1
+	.stack_top:       resq 1
+	.page_table_root: resq 1
+	.trace_head:      resd 1
+	.trace_reserved:  resd 1
+	.trace_events:    resq 2 * TRACE_RING_SIZE
+	.log_head:        resq 1
+	.log_dropped:     resd 1
+	.log_reserved:    resd 1
+	                  resq 6
+	.log_tail:        resq 1
+	                  resq 7
+	.log_words:       resq LOG_RING_WORDS
+endstruc
+
+; Appends a trace event to the BootInfo at %1, clobbers rax and rdx
+%macro trace 2
+	rdtsc
+	shl rdx, 32
+	or rdx, rax
+	mov eax, 1
+	lock xadd [%1 + BootInfo.trace_head], eax
+	and eax, TRACE_RING_SIZE - 1
+	shl eax, 4
+	mov [%1 + BootInfo.trace_events + rax], rdx
+	mov dword [%1 + BootInfo.trace_events + rax + 8], %2
+	mov dword [%1 + BootInfo.trace_events + rax + 12], 0
+%endmacro
+
+; Appends a log record with the one argument %3 to the BootInfo at %1, or
+; counts it as dropped when the ring is full. The loader is the ring's only
+; writer while it runs. %3 can't be rax, rdx or r8, which are clobbered
+%macro log 3
+	mov r8, [%1 + BootInfo.log_head]
+	mov rax, r8
+	sub rax, [%1 + BootInfo.log_tail]
+	cmp rax, LOG_RING_WORDS - 3
+	ja %%full
+	mov eax, r8d
+	and eax, LOG_RING_WORDS - 1
+	mov qword [%1 + BootInfo.log_words + rax * 8], %2 | (1 << 16)
+	rdtsc
+	shl rdx, 32
+	or rdx, rax
+	lea eax, [r8 + 1]
+	and eax, LOG_RING_WORDS - 1
+	mov [%1 + BootInfo.log_words + rax * 8], rdx
+	lea eax, [r8 + 2]
+	and eax, LOG_RING_WORDS - 1
+	mov [%1 + BootInfo.log_words + rax * 8], %3
+	add r8, 3
+	mov [%1 + BootInfo.log_head], r8
+	jmp %%done
+%%full:
+	inc dword [%1 + BootInfo.log_dropped]
+%%done:
+%endmacro
+
+; Entered from efi_main with the physical BootInfo pointer in rcx (ms abi),
+; still on the firmware's identity mapped page tables
 start:
-	jmp start
+	cli
+	mov r12, rcx
+	trace r12, TRACE_LOADER_ENTRY
+	log r12, LOG_LOADER_ENTRY, r12
+
+	; The stub only sets NX bits in its tables when the CPU has them
+	mov eax, 0x80000001
+	cpuid
+	bt edx, 20
+	jnc .no_nx
+	mov ecx, MSR_EFER
+	rdmsr
+	bts eax, EFER_NXE
+	wrmsr
+.no_nx:
+
+	; Read-only kernel segments have to hold for ring 0 writes too
+	mov rax, cr0
+	bts rax, CR0_WP
+	mov cr0, rax
+
+	call enable_simd
+
+	; Pull everything out of BootInfo now, it isn't necessarily identity mapped after the switch
+	mov r13, [r12 + BootInfo.kernel_entry]
+	mov r14, [r12 + BootInfo.stack_top]
+	mov rax, [r12 + BootInfo.page_table_root]
+
+	; Global entries survive a CR3 load, and on a warm reboot the old kernel's
+	; are still cached for the addresses the new one is about to use
+	mov rdx, cr4
+	btr rdx, CR4_PGE
+	mov cr4, rdx
+
+	lgdt [gdt_ptr]
+	mov cr3, rax
+
+	mov rax, cr4
+	bts rax, CR4_PGE
+	mov cr4, rax
+
+	mov ax, gdt_data.data - gdt_data
+	mov ds, ax
+	mov es, ax
+	mov fs, ax
+	mov gs, ax
+	mov ss, ax
+
+	push gdt_data.code - gdt_data
+	lea rax, [rel .reload_cs]
+	push rax
+	retfq
+.reload_cs:
+
+	; Into the kernel on its own stack, with BootInfo through the direct map (sysv abi)
+	mov rdi, PHYS_MAP_BASE
+	add rdi, r12
+	trace rdi, TRACE_LOADER_EXIT
+	log rdi, LOG_LOADER_EXIT, r13
+	mov rsp, r14
+	xor rbp, rbp
+	call r13
+
+hang:
+	cli
+	hlt
+	jmp hang
+
+; Hands FPU/SSE state to the OS, and AVX and up through XSAVE when the CPU has
+; it. Same on every CPU, the kernel sizes its save areas from the BSP's XCR0.
+; Clobbers rax, rbx, rcx and rdx
+enable_simd:
+	mov rax, cr0
+	btr rax, CR0_EM
+	bts rax, CR0_MP
+	mov cr0, rax
+	fninit
+
+	mov rax, cr4
+	bts rax, CR4_OSFXSR
+	bts rax, CR4_OSXMMEXCPT
+	mov cr4, rax
 
+	mov eax, 1
+	cpuid
+	bt ecx, 26
+	jnc .done
+	mov rax, cr4
+	bts rax, CR4_OSXSAVE
+	mov cr4, rax
+
+	; Leaf 0xD lists the components XCR0 may enable
+	mov eax, 0xD
+	xor ecx, ecx
+	cpuid
+	and eax, XCR0_WANTED
+	xor edx, edx
+	xor ecx, ecx
+	xsetbv
+.done:
+	ret
+
+align 8
 gdt_data:
 	.null:	dq 0
+	; Long mode code, L set and D clear
 	.code: 	dd 0xFFFF
 			db 0
-			dw 0xCF9A
+			dw 0xAF9A
 			db 0
 	.data: 	dd 0xFFFF
 			db 0
 			dw 0xCF92
 			db 0
+	; Flat 32-bit code, only used by the AP trampoline on its way to long mode
+	.code32: dd 0xFFFF
+			db 0
+			dw 0xCF9A
+			db 0
+gdt_end:
+
+gdt_ptr:
+	dw gdt_end - gdt_data - 1
+	dq gdt_data
+
+; Application processors start here in real mode with cs = AP_TRAMPOLINE >> 4, ip = 0.
+; The kernel fills ap_params before each SIPI and waits for ready, so they come up one at a time
+times (AP_TRAMPOLINE - 0x18000) - ($ - $$) db 0
+[bits 16]
+ap_trampoline:
+	jmp short ap_real
+
+; Mirrors ApParams in boot_info.h, AP_PARAMS = AP_TRAMPOLINE + 8
+align 8, db 0
+ap_params:
+	.cr3:       dq 0
+	.stack_top: dq 0
+	.entry:     dq 0
+	.arg:       dq 0
+	.ready:     dd 0
+
+; gdt_ptr sits below the trampoline's segment, so it gets its own copy
+align 8, db 0
+ap_gdt_ptr:
+	dw gdt_end - gdt_data - 1
+	dd gdt_data
+
+ap_real:
+	cli
+	cld
+	mov ax, cs
+	mov ds, ax
+
+	lgdt [ap_gdt_ptr - ap_trampoline]
+	mov eax, cr0
+	bts eax, CR0_PE
+	mov cr0, eax
+	jmp dword (gdt_data.code32 - gdt_data):ap_protected
+
+[bits 32]
+ap_protected:
+	mov ax, gdt_data.data - gdt_data
+	mov ds, ax
+	mov es, ax
+	mov ss, ax
+
+	mov eax, cr4
+	bts eax, CR4_PAE
+	bts eax, CR4_PGE
+	mov cr4, eax
+
+	; The stub keeps its page tables below 4 GiB for exactly this
+	mov eax, [ap_params.cr3]
+	mov cr3, eax
+
+	mov eax, 0x80000001
+	cpuid
+	mov ebx, edx
+	mov ecx, MSR_EFER
+	rdmsr
+	bts eax, EFER_LME
+	bt ebx, 20
+	jnc .no_nx
+	bts eax, EFER_NXE
+.no_nx:
+	wrmsr
+
+	mov eax, cr0
+	bts eax, CR0_PG
+	bts eax, CR0_WP
+	mov cr0, eax
+	jmp (gdt_data.code - gdt_data):ap_long
+
+[bits 64]
+ap_long:
+	mov ax, gdt_data.data - gdt_data
+	mov ds, ax
+	mov es, ax
+	mov fs, ax
+	mov gs, ax
+	mov ss, ax
+
+	mov rsp, [ap_params.stack_top]
+	call enable_simd
+	mov rdi, [ap_params.arg]
+	mov rax, [ap_params.entry]
+
+	; Everything is in registers, the kernel can reuse ap_params for the next AP
+	mov dword [ap_params.ready], 1
+
+	xor rbp, rbp
+	call rax
+	jmp hang
@@ -0,0 +1,174 @@
+// Kernel side of the binary log (log.h). Every CPU writes into a ring of its
+// own, with interrupts held off for the few stores a record takes, and the BSP
+// keeps using BootInfo's ring behind the stub's and loader's records until
+// log_init. An idle CPU drains all of them into serial.c's transmit queue as
+// wire frames for logdecode, or as text with -DLOG_TEXT, then kicks the UART.
+// Whatever its FIFO couldn't take yet goes out from a timer on that CPU.
+
+#include "kernel.h"
+#include "cpu.h"
+#include "log.h"
+
+// About as long as a 16 byte FIFO takes to empty at 115200 baud
+#define LOG_RETRY_NS 1500000
+
+typedef struct LogCpu {
+	LogRing ring;
+	Timer retry;
+	// The consumer's copy of ring.dropped, the difference is reported
+	uint32_t dropped_seen;
+} LogCpu;
+
+typedef struct {
+	// One CPU drains at a time, the others skip it
+	volatile uint32_t draining;
+	uint32_t boot_dropped_seen;
+	uint64_t frames;
+} Log;
+
+Log klog;
+LogRing *boot_log;
+
+#ifdef LOG_TEXT
+const char *log_formats[] = {
+	LOG_FORMATS(LOG_FORMAT_STRING)
+};
+#endif
+
+// Returns a zeroed ring near node, or NULL
+LogCpu *log_alloc(uint32_t node) {
+	uint64_t phys = pmm_alloc_zeroed_node(pmm_order_for(sizeof(LogCpu)), node);
+	return phys ? (LogCpu *)phys_to_virt(phys) : NULL;
+}
+
+// After smp_init, which gives the APs their rings. The BSP moves off the boot ring here
+bool log_init(void) {
+	PerCpu *cpu = this_cpu();
+	LogCpu *lc = log_alloc(cpu->node);
+	if (!lc) {
+		return false;
+	}
+	__atomic_store_n(&cpu->log, lc, __ATOMIC_RELEASE);
+	return true;
+}
+
+void log_write(uint32_t id, uint32_t argc, const uint64_t *args) {
+	uint64_t flags = irq_save();
+	LogCpu *lc = this_cpu()->log;
+	LogRing *ring = lc ? &lc->ring : boot_log;
+	if (ring) {
+		log_record(ring, rdtsc(), id, argc, args);
+	}
+	irq_restore(flags);
+}
+
+// Queues one record for the UART, false when the queue can't take it yet
+static bool log_emit(uint32_t cpu, uint64_t tsc, uint32_t id, uint32_t argc, const uint64_t *args) {
+#ifdef LOG_TEXT
+	char line[LOG_LINE_MAX];
+	size_t len = log_line(line, sizeof(line) - 2, cpu, tsc_to_ns(tsc), id, id < LogCount ? log_formats[id] : NULL, args, argc);
+	line[len++] = '\r';
+	line[len++] = '\n';
+	bool queued = serial_queue(line, len);
+#else
+	uint8_t frame[LOG_WIRE_MAX];
+	bool queued = serial_queue(frame, log_encode(frame, cpu, tsc_to_ns(tsc), id, argc, args));
+#endif
+	if (queued) {
+		klog.frames++;
+	}
+	return queued;
+}
+
+// Moves records out of ring until it's empty or the transmit queue is full.
+// Returns false in the second case
+static bool log_drain_ring(LogRing *ring, uint32_t cpu, uint32_t *dropped_seen) {
+	uint32_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+	if (dropped != *dropped_seen) {
+		uint64_t lost = dropped - *dropped_seen;
+		if (!log_emit(cpu, rdtsc(), LogDropped, 1, &lost)) {
+			return false;
+		}
+		*dropped_seen = dropped;
+	}
+
+	uint64_t tail = ring->tail;
+	while (tail != __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+		uint64_t header = ring->words[tail & (LOG_RING_WORDS - 1)];
+		uint64_t tsc = ring->words[(tail + 1) & (LOG_RING_WORDS - 1)];
+		uint32_t argc = (header >> 16) & 0xFF;
+		uint64_t args[LOG_MAX_ARGS];
+		for (uint32_t i = 0; i < argc && i < LOG_MAX_ARGS; i++) {
+			args[i] = ring->words[(tail + LOG_HEADER_WORDS + i) & (LOG_RING_WORDS - 1)];
+		}
+
+		if (!log_emit(cpu, tsc, header & 0xFFFF, argc < LOG_MAX_ARGS ? argc : LOG_MAX_ARGS, args)) {
+			return false;
+		}
+		tail += LOG_HEADER_WORDS + argc;
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+	}
+	return true;
+}
+
+static void log_retry(void *arg);
+
+// Called by idle CPUs and the retry timer, returns whether everything made it
+// out to the UART. Safe in interrupts, nothing in here waits
+bool log_drain(void) {
+	if (__atomic_exchange_n(&klog.draining, 1, __ATOMIC_ACQUIRE)) {
+		return false;
+	}
+
+	bool drained = !boot_log || log_drain_ring(boot_log, 0, &klog.boot_dropped_seen);
+	for (uint32_t i = 0; drained && i < cpu_count; i++) {
+		LogCpu *lc = __atomic_load_n(&cpus[i]->log, __ATOMIC_ACQUIRE);
+		if (lc) {
+			drained = log_drain_ring(&lc->ring, i, &lc->dropped_seen);
+		}
+	}
+	drained = !serial_kick() && drained;
+	__atomic_store_n(&klog.draining, 0, __ATOMIC_RELEASE);
+
+	LogCpu *self = this_cpu()->log;
+	if (!drained && self && timer_wheels && !self->retry.pending) {
+		timer_start_ns(&self->retry, LOG_RETRY_NS, log_retry, NULL);
+	}
+	return drained;
+}
+
+static void log_retry(void *arg) {
+	log_drain();
+}
+
+// Drains everything and waits for the UART to take it, for the BSP before it
+// reports a benchmark or stops the machine
+void log_flush(void) {
+	while (!log_drain()) {
+		cpu_pause();
+	}
+}
+
+#ifdef LOG_BENCH
+// Writer-side cost of a record: the BSP logs LOG_BENCH_BURST records that just
+// fit its ring, then flushes them, LOG_BENCH_ROUNDS times. bench_log.sh checks
+// that logdecode gets every one of them back out of the capture
+#define LOG_BENCH_ROUNDS 8
+#define LOG_BENCH_BURST (LOG_RING_WORDS / (LOG_HEADER_WORDS + 2))
+
+void log_bench(void) {
+	log_flush();
+	for (uint32_t round = 0; round < LOG_BENCH_ROUNDS; round++) {
+		uint64_t start = rdtsc();
+		for (uint32_t i = 0; i < LOG_BENCH_BURST; i++) {
+			LOG(LogBench, round, i);
+		}
+		uint64_t written = rdtsc();
+		log_flush();
+		uint64_t flushed = rdtsc();
+		kprintf("log_bench round %u: %u records, %lu ns writing, %lu ns flushing\n", round, LOG_BENCH_BURST,
+			tsc_to_ns(written - start), tsc_to_ns(flushed - written));
+	}
+	kprintf("log_bench end (%lu frames, FIFO %u bytes)\n", klog.frames, serial_fifo_size);
+}
+#endif
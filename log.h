@@ -0,0 +1,220 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Binary log records. A call site stores a format id and its raw arguments and
+// nothing is formatted on the way in. Shared by the stub, loader.s, the kernel,
+// which drains the rings out over serial (log.c), and logdecode, which turns a
+// capture of that back into text.
+//
+// Formats take kprintf's integer conversions only, %d %u %x %p %c and %%, with
+// an optional l and a width, 0 padded if it starts with one. Every argument
+// travels as 64 bits, strings can't be logged
+#define LOG_FORMATS(X) \
+	X(LogDropped,       "log: %u records dropped") \
+	X(LogLoaderEntry,   "loader: BootInfo at %lx") \
+	X(LogLoaderExit,    "loader: entering the kernel at %lx") \
+	X(LogStubKernel,    "stub: kernel %lu bytes at %lx from %u load jobs") \
+	X(LogStubAcpi,      "stub: %u CPUs on %u NUMA nodes, RSDP at %lx") \
+	X(LogStubGop,       "stub: framebuffer %ux%u at %lx") \
+	X(LogStubMemoryMap, "stub: %lu memory regions, boot services exited on try %u") \
+	X(LogSmpStarted,    "smp: CPU %u is APIC %u on node %u") \
+	X(LogKexecStaged,   "kexec: %lu byte image staged at %lx") \
+	X(LogBench,         "log_bench: burst %u record %u")
+
+#define LOG_ENUM(id, fmt) id,
+typedef enum {
+	LOG_FORMATS(LOG_ENUM)
+	LogCount,
+} LogId;
+#undef LOG_ENUM
+
+// Expands to one table entry, each side that formats keeps its own table
+#define LOG_FORMAT_STRING(id, fmt) fmt,
+
+// loader.s writes these by number
+_Static_assert(LogLoaderEntry == 1 && LogLoaderExit == 2, "update LOG_LOADER_* in loader.s");
+
+// Power of two. A record is LOG_HEADER_WORDS plus a word per argument
+#define LOG_RING_WORDS 1024
+#define LOG_HEADER_WORDS 2
+#define LOG_MAX_ARGS 6
+
+// Single producer, single consumer. The producer owns head and dropped, the
+// consumer owns tail, on a cache line of its own. Both count words ever
+// written, head - tail are waiting. The copy inside BootInfo is written by the
+// stub, then loader.s, then the kernel's BSP, never two of them at once.
+// loader.s mirrors the layout
+typedef struct {
+	uint64_t head;
+	uint32_t dropped;
+	uint32_t reserved;
+	uint64_t pad0[6];
+	uint64_t tail;
+	uint64_t pad1[7];
+	// Each record is id | argc << 16, then the TSC, then the arguments
+	uint64_t words[LOG_RING_WORDS];
+} LogRing;
+
+static inline bool log_record(LogRing *ring, uint64_t tsc, uint32_t id, uint32_t argc, const uint64_t *args) {
+	if (argc > LOG_MAX_ARGS) {
+		argc = LOG_MAX_ARGS;
+	}
+	uint64_t head = ring->head;
+	uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	if (head + LOG_HEADER_WORDS + argc - tail > LOG_RING_WORDS) {
+		__atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+		return false;
+	}
+
+	ring->words[head & (LOG_RING_WORDS - 1)] = id | (uint64_t)argc << 16;
+	ring->words[(head + 1) & (LOG_RING_WORDS - 1)] = tsc;
+	for (uint32_t i = 0; i < argc; i++) {
+		ring->words[(head + LOG_HEADER_WORDS + i) & (LOG_RING_WORDS - 1)] = args[i];
+	}
+	__atomic_store_n(&ring->head, head + LOG_HEADER_WORDS + argc, __ATOMIC_RELEASE);
+	return true;
+}
+
+// Each side picks the ring for the calling CPU and timestamps the record
+void log_write(uint32_t id, uint32_t argc, const uint64_t *args);
+
+// LOG(LogSmpStarted, index, apic_id, node). Arguments are converted to
+// uint64_t, pointers need a cast
+#define LOG(id, ...) log_write((id), sizeof((uint64_t[]){ 0, __VA_ARGS__ }) / sizeof(uint64_t) - 1, \
+	(const uint64_t[]){ 0, __VA_ARGS__ } + 1)
+
+// On the wire a record is LOG_WIRE_MAGIC followed by the CPU, id, argument
+// count, nanoseconds since reset and the arguments, each as an unsigned LEB128,
+// then a newline. kprintf's text is plain ASCII, the magic byte never shows up
+// in it, and the newline keeps its lines at line starts for grep and awk
+#define LOG_WIRE_MAGIC 0xF5
+#define LOG_WIRE_MAX (2 + 10 * (4 + LOG_MAX_ARGS))
+
+// Longest line log_line writes, the rest is cut off
+#define LOG_LINE_MAX 160
+
+static inline uint8_t *log_put_varint(uint8_t *p, uint64_t value) {
+	while (value >= 0x80) {
+		*p++ = (uint8_t)value | 0x80;
+		value >>= 7;
+	}
+	*p++ = (uint8_t)value;
+	return p;
+}
+
+static inline size_t log_encode(uint8_t *buf, uint32_t cpu, uint64_t ns, uint32_t id, uint32_t argc, const uint64_t *args) {
+	uint8_t *p = buf;
+	*p++ = LOG_WIRE_MAGIC;
+	p = log_put_varint(p, cpu);
+	p = log_put_varint(p, id);
+	p = log_put_varint(p, argc);
+	p = log_put_varint(p, ns);
+	for (uint32_t i = 0; i < argc; i++) {
+		p = log_put_varint(p, args[i]);
+	}
+	*p++ = '\n';
+	return p - buf;
+}
+
+// Formats into buf, cap includes room for a terminating 0. Missing arguments read as 0
+static inline size_t log_format(char *buf, size_t cap, const char *fmt, const uint64_t *args, uint32_t argc) {
+	size_t len = 0;
+	uint32_t next = 0;
+	for (const char *p = fmt; *p && len < cap - 1; p++) {
+		if (*p != '%') {
+			buf[len++] = *p;
+			continue;
+		}
+
+		p++;
+		char pad = ' ';
+		if (*p == '0') {
+			pad = '0';
+			p++;
+		}
+		uint32_t width = 0;
+		while (*p >= '0' && *p <= '9') {
+			width = width * 10 + (*p++ - '0');
+		}
+		bool is_long = false;
+		if (*p == 'l') {
+			is_long = true;
+			p++;
+		}
+
+		char num[24];
+		size_t num_len = 0;
+		switch (*p) {
+			case 'c': {
+				num[num_len++] = (char)(next < argc ? args[next] : 0);
+				next++;
+			} break;
+			case 'd':
+			case 'u':
+			case 'x':
+			case 'p': {
+				uint64_t value = next < argc ? args[next] : 0;
+				next++;
+				bool negative = false;
+				if (*p == 'd') {
+					int64_t v = is_long ? (int64_t)value : (int32_t)value;
+					negative = v < 0;
+					value = negative ? -(uint64_t)v : (uint64_t)v;
+				} else if (!is_long && *p != 'p') {
+					value = (uint32_t)value;
+				}
+
+				uint32_t base = (*p == 'x' || *p == 'p') ? 16 : 10;
+				char digits[24];
+				size_t n = 0;
+				do {
+					digits[n++] = "0123456789abcdef"[value % base];
+					value /= base;
+				} while (value);
+
+				if (negative) num[num_len++] = '-';
+				if (*p == 'p') {
+					num[num_len++] = '0';
+					num[num_len++] = 'x';
+				}
+				while (n) {
+					num[num_len++] = digits[--n];
+				}
+			} break;
+			case '%': {
+				num[num_len++] = '%';
+			} break;
+			default: {
+				// Unknown or truncated conversion, drop it
+				if (!*p) p--;
+				continue;
+			}
+		}
+
+		for (size_t i = num_len; i < width && len < cap - 1; i++) {
+			buf[len++] = pad;
+		}
+		for (size_t i = 0; i < num_len && len < cap - 1; i++) {
+			buf[len++] = num[i];
+		}
+	}
+	buf[len] = 0;
+	return len;
+}
+
+// One line per record, the way the kernel prints it with -DLOG_TEXT and
+// logdecode prints it off the wire. fmt is NULL for an id this side doesn't know
+static inline size_t log_line(char *buf, size_t cap, uint32_t cpu, uint64_t ns, uint32_t id, const char *fmt, const uint64_t *args, uint32_t argc) {
+	uint64_t prefix[] = { ns / 1000000000, ns / 1000 % 1000000, cpu };
+	size_t len = log_format(buf, cap, "[%5lu.%06lu] cpu%u ", prefix, 3);
+	if (fmt) {
+		len += log_format(buf + len, cap - len, fmt, args, argc);
+	} else {
+		uint64_t unknown = id;
+		len += log_format(buf + len, cap - len, "unknown record %u", &unknown, 1);
+	}
+	return len;
+}
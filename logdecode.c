@@ -0,0 +1,87 @@
+// Host-side decoder for a serial capture: kprintf's text passes through as is,
+// and each binary log frame (log.h) is replaced by the line the kernel would
+// have printed with -DLOG_TEXT. Reads as a stream, so it can sit behind a
+// pipe from qemu's -serial stdio. Frames cut off by the end of the capture are
+// dropped with a note on stderr, and so is everything after a malformed one.
+//
+// Usage: logdecode [capture]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+
+static const char *log_formats[] = {
+	LOG_FORMATS(LOG_FORMAT_STRING)
+};
+
+static int get_varint(FILE *in, uint64_t *value) {
+	*value = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		int ch = getc(in);
+		if (ch == EOF) {
+			return 0;
+		}
+		*value |= (uint64_t)(ch & 0x7F) << shift;
+		if (!(ch & 0x80)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Reads the rest of a frame after its magic byte and prints it
+static int decode_frame(FILE *in, FILE *out) {
+	uint64_t cpu, id, argc, ns;
+	if (!get_varint(in, &cpu) || !get_varint(in, &id) || !get_varint(in, &argc) || argc > LOG_MAX_ARGS || !get_varint(in, &ns)) {
+		return 0;
+	}
+	uint64_t args[LOG_MAX_ARGS];
+	for (uint64_t i = 0; i < argc; i++) {
+		if (!get_varint(in, &args[i])) {
+			return 0;
+		}
+	}
+	if (getc(in) != '\n') {
+		return 0;
+	}
+
+	char line[LOG_LINE_MAX];
+	log_line(line, sizeof(line), (uint32_t)cpu, ns, (uint32_t)id, id < LogCount ? log_formats[id] : NULL, args, (uint32_t)argc);
+	fprintf(out, "%s\n", line);
+	return 1;
+}
+
+int main(int argc, char **argv) {
+	if (argc > 2) {
+		fprintf(stderr, "usage: %s [capture]\n", argv[0]);
+		return 1;
+	}
+
+	FILE *in = stdin;
+	if (argc == 2 && strcmp(argv[1], "-") != 0) {
+		in = fopen(argv[1], "rb");
+		if (!in) {
+			perror(argv[1]);
+			return 1;
+		}
+	}
+	// Line buffered so a live capture shows up as it arrives
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	unsigned long frames = 0;
+	int ch;
+	while ((ch = getc(in)) != EOF) {
+		if (ch != LOG_WIRE_MAGIC) {
+			putchar(ch);
+			continue;
+		}
+		if (!decode_frame(in, stdout)) {
+			fprintf(stderr, "logdecode: truncated frame after %lu\n", frames);
+			break;
+		}
+		frames++;
+	}
+	return 0;
+}
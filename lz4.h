@@ -0,0 +1,281 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// LZ4 frame format, shared by the stub (decoding) and lz4pack (encoding and
+// round-trip checks). Only what the boot files need: content size is required
+// so the stub can size its buffers up front, dictionaries aren't supported.
+// memcpy comes from whoever includes this, mem.c in the stub and libc on the host
+
+#define LZ4_MAGIC 0x184D2204
+
+#define LZ4_FLG_VERSION          0x40
+#define LZ4_FLG_VERSION_MASK     0xC0
+#define LZ4_FLG_BLOCK_INDEP      0x20
+#define LZ4_FLG_BLOCK_CHECKSUM   0x10
+#define LZ4_FLG_CONTENT_SIZE     0x08
+#define LZ4_FLG_CONTENT_CHECKSUM 0x04
+#define LZ4_FLG_DICT_ID          0x01
+
+// Block max size code in BD bits 4-6, 4 = 64 KiB up to 7 = 4 MiB
+#define LZ4_BD_SHIFT 4
+#define LZ4_BLOCK_SIZE_CODE 5
+#define LZ4_BLOCK_SIZE (1 << (8 + 2 * LZ4_BLOCK_SIZE_CODE))
+
+#define LZ4_BLOCK_UNCOMPRESSED 0x80000000U
+
+// Magic, FLG, BD, content size and header checksum, the only layout accepted
+#define LZ4_HEADER_SIZE (4 + 2 + 8 + 1)
+
+// Sequence rules from the block format spec
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MF_LIMIT 12
+#define LZ4_MAX_OFFSET 65535
+
+static inline uint32_t lz4_read32(const uint8_t *p) {
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint64_t lz4_read64(const uint8_t *p) {
+	return (uint64_t)lz4_read32(p) | ((uint64_t)lz4_read32(p + 4) << 32);
+}
+
+static inline uint32_t lz4_rotl32(uint32_t x, uint32_t r) {
+	return (x << r) | (x >> (32 - r));
+}
+
+#define XXH_PRIME32_1 2654435761U
+#define XXH_PRIME32_2 2246822519U
+#define XXH_PRIME32_3 3266489917U
+#define XXH_PRIME32_4 668265263U
+#define XXH_PRIME32_5 374761393U
+
+static inline uint32_t xxh32_round(uint32_t acc, uint32_t input) {
+	return lz4_rotl32(acc + input * XXH_PRIME32_2, 13) * XXH_PRIME32_1;
+}
+
+static uint32_t xxh32(const void *data, size_t len, uint32_t seed) {
+	const uint8_t *p = (const uint8_t *)data;
+	const uint8_t *end = p + len;
+	uint32_t h;
+
+	if (len >= 16) {
+		uint32_t v1 = seed + XXH_PRIME32_1 + XXH_PRIME32_2;
+		uint32_t v2 = seed + XXH_PRIME32_2;
+		uint32_t v3 = seed;
+		uint32_t v4 = seed - XXH_PRIME32_1;
+		for (; p + 16 <= end; p += 16) {
+			v1 = xxh32_round(v1, lz4_read32(p));
+			v2 = xxh32_round(v2, lz4_read32(p + 4));
+			v3 = xxh32_round(v3, lz4_read32(p + 8));
+			v4 = xxh32_round(v4, lz4_read32(p + 12));
+		}
+		h = lz4_rotl32(v1, 1) + lz4_rotl32(v2, 7) + lz4_rotl32(v3, 12) + lz4_rotl32(v4, 18);
+	} else {
+		h = seed + XXH_PRIME32_5;
+	}
+	h += (uint32_t)len;
+
+	for (; p + 4 <= end; p += 4) {
+		h = lz4_rotl32(h + lz4_read32(p) * XXH_PRIME32_3, 17) * XXH_PRIME32_4;
+	}
+	for (; p < end; p++) {
+		h = lz4_rotl32(h + *p * XXH_PRIME32_5, 11) * XXH_PRIME32_1;
+	}
+
+	h ^= h >> 15;
+	h *= XXH_PRIME32_2;
+	h ^= h >> 13;
+	h *= XXH_PRIME32_3;
+	h ^= h >> 16;
+	return h;
+}
+
+typedef struct {
+	uint8_t flags;
+	uint64_t content_size;
+	size_t header_size;
+	size_t block_max;
+} Lz4FrameHeader;
+
+// 0 when more input is needed, -1 when it isn't a usable frame, else the header size
+static int lz4_parse_header(const uint8_t *src, size_t len, Lz4FrameHeader *hdr) {
+	if (len < 6) {
+		return 0;
+	}
+	if (lz4_read32(src) != LZ4_MAGIC) {
+		return -1;
+	}
+
+	uint8_t flg = src[4], bd = src[5];
+	if ((flg & LZ4_FLG_VERSION_MASK) != LZ4_FLG_VERSION || !(flg & LZ4_FLG_CONTENT_SIZE) || (flg & LZ4_FLG_DICT_ID)) {
+		return -1;
+	}
+
+	size_t size = LZ4_HEADER_SIZE;
+	if (len < size) {
+		return 0;
+	}
+	if (((xxh32(src + 4, size - 5, 0) >> 8) & 0xFF) != src[size - 1]) {
+		return -1;
+	}
+
+	uint32_t code = (bd >> LZ4_BD_SHIFT) & 7;
+	if (code < 4) {
+		return -1;
+	}
+
+	hdr->flags = flg;
+	hdr->content_size = lz4_read64(src + 6);
+	hdr->header_size = size;
+	hdr->block_max = (size_t)1 << (8 + 2 * code);
+	return (int)size;
+}
+
+// Decodes one compressed block to out + *out_pos. Matches may reach back into
+// earlier blocks already in `out`, which covers linked-block frames too
+static bool lz4_decode_block(const uint8_t *src, size_t src_len, uint8_t *out, size_t *out_pos, size_t out_capacity) {
+	const uint8_t *ip = src, *ip_end = src + src_len;
+	uint8_t *op = out + *out_pos, *op_end = out + out_capacity;
+
+	while (ip < ip_end) {
+		uint8_t token = *ip++;
+
+		size_t literals = token >> 4;
+		if (literals == 15) {
+			uint8_t b;
+			do {
+				if (ip >= ip_end) return false;
+				b = *ip++;
+				literals += b;
+			} while (b == 255);
+		}
+		if (literals > (size_t)(ip_end - ip) || literals > (size_t)(op_end - op)) {
+			return false;
+		}
+		memcpy(op, ip, literals);
+		ip += literals;
+		op += literals;
+
+		// The last sequence is literals only
+		if (ip == ip_end) {
+			break;
+		}
+
+		if (ip_end - ip < 2) {
+			return false;
+		}
+		size_t offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > (size_t)(op - out)) {
+			return false;
+		}
+
+		size_t match = token & 15;
+		if (match == 15) {
+			uint8_t b;
+			do {
+				if (ip >= ip_end) return false;
+				b = *ip++;
+				match += b;
+			} while (b == 255);
+		}
+		match += LZ4_MIN_MATCH;
+		if (match > (size_t)(op_end - op)) {
+			return false;
+		}
+
+		uint8_t *from = op - offset;
+		if (offset >= match) {
+			memcpy(op, from, match);
+			op += match;
+		} else {
+			// Overlapping copy repeats the last `offset` bytes
+			for (size_t i = 0; i < match; i++) {
+				*op++ = *from++;
+			}
+		}
+	}
+
+	*out_pos = op - out;
+	return true;
+}
+
+// Incremental frame decoder. The compressed frame is fed as a growing prefix,
+// each call decodes every block that has fully arrived since the last one
+typedef struct {
+	uint8_t *out;
+	size_t out_capacity;
+	size_t out_len;
+
+	// Next unparsed byte of the frame
+	size_t pos;
+	Lz4FrameHeader header;
+	bool have_header;
+	bool done;
+} Lz4Stream;
+
+static void lz4_stream_init(Lz4Stream *s, void *out, size_t out_capacity) {
+	s->out = (uint8_t *)out;
+	s->out_capacity = out_capacity;
+	s->out_len = 0;
+	s->pos = 0;
+	s->have_header = false;
+	s->done = false;
+}
+
+// `src` holds the first `avail` bytes of the frame. False on a corrupt frame
+static bool lz4_stream_feed(Lz4Stream *s, const void *src, size_t avail) {
+	const uint8_t *in = (const uint8_t *)src;
+
+	if (!s->have_header) {
+		int size = lz4_parse_header(in, avail, &s->header);
+		if (size < 0 || (size > 0 && s->header.content_size > s->out_capacity)) {
+			return false;
+		}
+		if (size == 0) {
+			return true;
+		}
+		s->pos = size;
+		s->have_header = true;
+	}
+
+	size_t block_checksum = (s->header.flags & LZ4_FLG_BLOCK_CHECKSUM) ? 4 : 0;
+	while (!s->done && avail - s->pos >= 4) {
+		uint32_t word = lz4_read32(in + s->pos);
+		if (word == 0) {
+			// Trailing content checksum, if any, isn't checked
+			s->done = true;
+			s->pos += 4;
+			break;
+		}
+
+		size_t size = word & ~LZ4_BLOCK_UNCOMPRESSED;
+		if (size > s->header.block_max) {
+			return false;
+		}
+		if (avail - s->pos < 4 + size + block_checksum) {
+			break;
+		}
+
+		const uint8_t *block = in + s->pos + 4;
+		if (word & LZ4_BLOCK_UNCOMPRESSED) {
+			if (size > s->out_capacity - s->out_len) {
+				return false;
+			}
+			memcpy(s->out + s->out_len, block, size);
+			s->out_len += size;
+		} else if (!lz4_decode_block(block, size, s->out, &s->out_len, s->out_capacity)) {
+			return false;
+		}
+		s->pos += 4 + size + block_checksum;
+	}
+	return true;
+}
+
+static inline bool lz4_stream_complete(Lz4Stream *s) {
+	return s->done && s->out_len == s->header.content_size;
+}
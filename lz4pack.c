@@ -0,0 +1,165 @@
+// Host-side packer: wraps a boot file in an LZ4 frame the stub can stream.
+// Independent 256 KiB blocks, content size always present, no checksums past
+// the header's. Every frame is decoded again before it's written out.
+//
+// Usage: lz4pack <input> <output>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lz4.h"
+
+#define HASH_LOG 16
+
+static uint32_t hash_seq(uint32_t seq) {
+	return (seq * 2654435761U) >> (32 - HASH_LOG);
+}
+
+static uint8_t *put_length(uint8_t *op, size_t len) {
+	for (; len >= 255; len -= 255) {
+		*op++ = 255;
+	}
+	*op++ = (uint8_t)len;
+	return op;
+}
+
+static uint8_t *put_sequence(uint8_t *op, const uint8_t *literals, size_t lit_len, size_t offset, size_t match_len) {
+	uint8_t *token = op++;
+	*token = (uint8_t)((lit_len >= 15 ? 15 : lit_len) << 4);
+	if (lit_len >= 15) {
+		op = put_length(op, lit_len - 15);
+	}
+	memcpy(op, literals, lit_len);
+	op += lit_len;
+
+	// match_len 0 marks the final literals-only sequence
+	if (match_len) {
+		*op++ = offset & 0xFF;
+		*op++ = offset >> 8;
+		size_t m = match_len - LZ4_MIN_MATCH;
+		*token |= (m >= 15 ? 15 : m);
+		if (m >= 15) {
+			op = put_length(op, m - 15);
+		}
+	}
+	return op;
+}
+
+// Greedy single-probe matcher, returns the compressed size written to dst
+static size_t compress_block(const uint8_t *src, size_t len, uint8_t *dst) {
+	static uint32_t table[1 << HASH_LOG];
+	memset(table, 0xFF, sizeof(table));
+
+	uint8_t *op = dst;
+	size_t anchor = 0, ip = 0;
+	if (len > LZ4_MF_LIMIT) {
+		size_t match_limit = len - LZ4_MF_LIMIT;
+		while (ip < match_limit) {
+			uint32_t seq = lz4_read32(src + ip);
+			uint32_t h = hash_seq(seq);
+			uint32_t cand = table[h];
+			table[h] = (uint32_t)ip;
+
+			if (cand == UINT32_MAX || ip - cand > LZ4_MAX_OFFSET || lz4_read32(src + cand) != seq) {
+				ip++;
+				continue;
+			}
+
+			size_t match_end = len - LZ4_LAST_LITERALS;
+			size_t m = LZ4_MIN_MATCH;
+			while (ip + m < match_end && src[cand + m] == src[ip + m]) {
+				m++;
+			}
+
+			op = put_sequence(op, src + anchor, ip - anchor, ip - cand, m);
+			ip += m;
+			anchor = ip;
+		}
+	}
+	op = put_sequence(op, src + anchor, len - anchor, 0, 0);
+	return op - dst;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+int main(int argc, char **argv) {
+	if (argc != 3) {
+		fprintf(stderr, "usage: %s <input> <output>\n", argv[0]);
+		return 1;
+	}
+
+	FILE *in = fopen(argv[1], "rb");
+	if (!in) {
+		perror(argv[1]);
+		return 1;
+	}
+	fseek(in, 0, SEEK_END);
+	size_t size = ftell(in);
+	fseek(in, 0, SEEK_SET);
+
+	uint8_t *src = malloc(size + 1);
+	if (!src || fread(src, 1, size, in) != size) {
+		fprintf(stderr, "%s: read failed\n", argv[1]);
+		return 1;
+	}
+	fclose(in);
+
+	// Worst case is every block stored raw, plus framing
+	size_t blocks = (size + LZ4_BLOCK_SIZE - 1) / LZ4_BLOCK_SIZE;
+	uint8_t *frame = malloc(LZ4_HEADER_SIZE + blocks * (4 + LZ4_BLOCK_SIZE + LZ4_BLOCK_SIZE / 255 + 16) + 4);
+	uint8_t *scratch = malloc(LZ4_BLOCK_SIZE + LZ4_BLOCK_SIZE / 255 + 16);
+	if (!frame || !scratch) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	uint8_t *op = frame;
+	put32(op, LZ4_MAGIC);
+	op[4] = LZ4_FLG_VERSION | LZ4_FLG_BLOCK_INDEP | LZ4_FLG_CONTENT_SIZE;
+	op[5] = LZ4_BLOCK_SIZE_CODE << LZ4_BD_SHIFT;
+	put32(op + 6, (uint32_t)size);
+	put32(op + 10, (uint32_t)((uint64_t)size >> 32));
+	op[14] = (xxh32(op + 4, 10, 0) >> 8) & 0xFF;
+	op += LZ4_HEADER_SIZE;
+
+	for (size_t off = 0; off < size; off += LZ4_BLOCK_SIZE) {
+		size_t len = size - off < LZ4_BLOCK_SIZE ? size - off : LZ4_BLOCK_SIZE;
+		size_t packed = compress_block(src + off, len, scratch);
+		if (packed < len) {
+			put32(op, (uint32_t)packed);
+			memcpy(op + 4, scratch, packed);
+			op += 4 + packed;
+		} else {
+			put32(op, (uint32_t)len | LZ4_BLOCK_UNCOMPRESSED);
+			memcpy(op + 4, src + off, len);
+			op += 4 + len;
+		}
+	}
+	put32(op, 0);
+	op += 4;
+	size_t frame_size = op - frame;
+
+	// Round trip through the same decoder the stub uses
+	Lz4Stream stream;
+	uint8_t *check = malloc(size + 1);
+	lz4_stream_init(&stream, check, size);
+	if (!check || !lz4_stream_feed(&stream, frame, frame_size) || !lz4_stream_complete(&stream) || memcmp(check, src, size) != 0) {
+		fprintf(stderr, "%s: round trip failed\n", argv[1]);
+		return 1;
+	}
+
+	FILE *out = fopen(argv[2], "wb");
+	if (!out || fwrite(frame, 1, frame_size, out) != frame_size || fclose(out) != 0) {
+		perror(argv[2]);
+		return 1;
+	}
+
+	printf("%s: %zu -> %zu bytes\n", argv[2], size, frame_size);
+	return 0;
+}
@@ -1,13 +1,41 @@
 set -x -o pipefail
 
-dd if=/dev/zero of=bin/efi.img bs=1k count=1440
-mformat -i bin/efi.img -f 1440 ::
+# Compressed boot files are used when build.sh produced them, RAW=1 ships the plain ones
+boot_files=""
+for f in kernel.elf loader.bin initrd.img; do
+	if [ ! -f bin/$f ]; then
+		continue
+	fi
+	if [ -z "$RAW" ] && [ -f bin/$f.lz4 ]; then
+		boot_files="$boot_files bin/$f.lz4"
+	else
+		boot_files="$boot_files bin/$f"
+	fi
+done
+
+# Size the ESP to its contents, images can outgrow a floppy
+payload_kb=$(du -ck bin/BOOTX64.EFI $boot_files | tail -1 | cut -f1)
+img_kb=$(( payload_kb + payload_kb / 8 + 1024 ))
+if [ "$img_kb" -le 1440 ]; then
+	dd if=/dev/zero of=bin/efi.img bs=1k count=1440
+	mformat -i bin/efi.img -f 1440 ::
+else
+	dd if=/dev/zero of=bin/efi.img bs=1k count=$img_kb
+	mformat -i bin/efi.img -T $(( img_kb * 2 )) -h 64 -s 32 ::
+fi
 mmd -i bin/efi.img ::/EFI
 mmd -i bin/efi.img ::/EFI/BOOT
 mcopy -i bin/efi.img bin/BOOTX64.EFI ::/EFI/BOOT
 mcopy -i bin/efi.img startup.nsh ::/
-mcopy -i bin/efi.img bin/kernel.o ::/
-mcopy -i bin/efi.img bin/loader.bin ::/
+for f in $boot_files; do
+	mcopy -i bin/efi.img $f ::/
+done
+
+# The stub refuses any boot file that doesn't match its line here, NOVERIFY=1 leaves it out
+if [ -z "$NOVERIFY" ]; then
+	bin/manifest bin/manifest.txt $boot_files
+	mcopy -i bin/efi.img bin/manifest.txt ::/
+fi
 
 rm -rf bin/iso bin/cdimage.iso
 mkdir bin/iso
@@ -0,0 +1,61 @@
+// Host-side manifest writer: one "crc32c size name" line per boot file, the
+// format the stub checks its reads against (see manifest_parse in efi_stub.c).
+// Names are the files' basenames, since everything sits in the ESP's root.
+//
+// Usage: manifest <output> <files...>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "crc32c.h"
+
+int main(int argc, char **argv) {
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s <output> <files...>\n", argv[0]);
+		return 1;
+	}
+	crc32c_init();
+
+	FILE *out = fopen(argv[1], "w");
+	if (!out) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	static char buffer[1 << 20];
+	for (int i = 2; i < argc; i++) {
+		FILE *f = fopen(argv[i], "rb");
+		if (!f) {
+			perror(argv[i]);
+			return 1;
+		}
+
+		uint32_t crc = 0;
+		uint64_t size = 0;
+		size_t n;
+		while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+			crc = crc32c_update(crc, buffer, n);
+			size += n;
+		}
+		if (ferror(f)) {
+			perror(argv[i]);
+			return 1;
+		}
+		fclose(f);
+
+		const char *name = strrchr(argv[i], '/');
+		name = name ? name + 1 : argv[i];
+		if (strlen(name) >= 32) {
+			fprintf(stderr, "%s: name too long for the stub\n", name);
+			return 1;
+		}
+		fprintf(out, "%08x %lu %s\n", crc, (unsigned long)size, name);
+	}
+
+	if (fclose(out) != 0) {
+		perror(argv[1]);
+		return 1;
+	}
+	return 0;
+}
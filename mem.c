@@ -0,0 +1,404 @@
+// Freestanding memcpy/memset/memmove shared by the stub and the kernel.
+// mem_init() picks the widest vector implementation the CPU supports, everything
+// starts out on the SSE2 path since that's baseline for x86_64. Both vector
+// paths hand mid-sized runs to rep movsb/stosb when the CPU reports ERMS.
+// The kernel brackets every call into them with MEM_SIMD_BEGIN/END so its
+// interrupts know when vector state is live, the stub leaves them empty.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <immintrin.h>
+
+#include "cpu.h"
+
+// At and above this size ERMS rep movsb/stosb outruns the vector loops
+#define MEM_REP_THRESHOLD (2 * 1024)
+
+// Past this size the destination won't survive in cache anyway, so stream it
+#define MEM_NT_THRESHOLD (1 * 1024 * 1024)
+
+#ifndef MEM_SIMD_BEGIN
+#define MEM_SIMD_BEGIN()
+#define MEM_SIMD_END()
+#endif
+
+typedef void *(*MemCopyFn)(void *dest, const void *src, size_t n);
+typedef void *(*MemSetFn)(void *dest, int c, size_t n);
+typedef void (*MemZeroFn)(void *dest, size_t n);
+
+bool mem_has_erms;
+
+static inline void mem_rep_movsb(void *dest, const void *src, size_t n) {
+	__asm__ volatile ("rep movsb" : "+D"(dest), "+S"(src), "+c"(n) :: "memory");
+}
+
+static inline void mem_rep_stosb(void *dest, uint8_t c, size_t n) {
+	__asm__ volatile ("rep stosb" : "+D"(dest), "+c"(n) : "a"(c) : "memory");
+}
+
+// Covers n < 16 with at most two overlapping moves, no loops for the
+// compiler to turn back into a memcpy call
+static inline void mem_copy_small(uint8_t *d, const uint8_t *s, size_t n) {
+	if (n >= 8) {
+		uint64_t a, b;
+		__builtin_memcpy(&a, s, 8);
+		__builtin_memcpy(&b, s + n - 8, 8);
+		__builtin_memcpy(d, &a, 8);
+		__builtin_memcpy(d + n - 8, &b, 8);
+	} else if (n >= 4) {
+		uint32_t a, b;
+		__builtin_memcpy(&a, s, 4);
+		__builtin_memcpy(&b, s + n - 4, 4);
+		__builtin_memcpy(d, &a, 4);
+		__builtin_memcpy(d + n - 4, &b, 4);
+	} else if (n >= 2) {
+		uint16_t a, b;
+		__builtin_memcpy(&a, s, 2);
+		__builtin_memcpy(&b, s + n - 2, 2);
+		__builtin_memcpy(d, &a, 2);
+		__builtin_memcpy(d + n - 2, &b, 2);
+	} else if (n == 1) {
+		d[0] = s[0];
+	}
+}
+
+static inline void mem_set_small(uint8_t *d, uint8_t c, size_t n) {
+	uint64_t v = 0x0101010101010101ULL * c;
+	if (n >= 8) {
+		__builtin_memcpy(d, &v, 8);
+		__builtin_memcpy(d + n - 8, &v, 8);
+	} else if (n >= 4) {
+		__builtin_memcpy(d, &v, 4);
+		__builtin_memcpy(d + n - 4, &v, 4);
+	} else if (n >= 2) {
+		__builtin_memcpy(d, &v, 2);
+		__builtin_memcpy(d + n - 2, &v, 2);
+	} else if (n == 1) {
+		d[0] = c;
+	}
+}
+
+// The unaligned head and tail are written up front as whole vectors, the body
+// then runs on an aligned destination and may overlap them
+__attribute__((target("sse2")))
+void *mem_copy_sse2(void *dest, const void *src, size_t n) {
+	uint8_t *d = (uint8_t *)dest;
+	const uint8_t *s = (const uint8_t *)src;
+
+	if (n < 16) {
+		mem_copy_small(d, s, n);
+		return dest;
+	}
+	if (n <= 32) {
+		__m128i a = _mm_loadu_si128((const __m128i *)s);
+		__m128i b = _mm_loadu_si128((const __m128i *)(s + n - 16));
+		_mm_storeu_si128((__m128i *)d, a);
+		_mm_storeu_si128((__m128i *)(d + n - 16), b);
+		return dest;
+	}
+	if (mem_has_erms && n >= MEM_REP_THRESHOLD && n < MEM_NT_THRESHOLD) {
+		mem_rep_movsb(d, s, n);
+		return dest;
+	}
+
+	__m128i head = _mm_loadu_si128((const __m128i *)s);
+	__m128i tail = _mm_loadu_si128((const __m128i *)(s + n - 16));
+	uint8_t *end = d + n - 16;
+
+	size_t skew = 16 - ((uintptr_t)d & 15);
+	_mm_storeu_si128((__m128i *)d, head);
+	d += skew;
+	s += skew;
+
+	if (n >= MEM_NT_THRESHOLD) {
+		for (; d + 64 <= end; d += 64, s += 64) {
+			__m128i v0 = _mm_loadu_si128((const __m128i *)(s + 0));
+			__m128i v1 = _mm_loadu_si128((const __m128i *)(s + 16));
+			__m128i v2 = _mm_loadu_si128((const __m128i *)(s + 32));
+			__m128i v3 = _mm_loadu_si128((const __m128i *)(s + 48));
+			_mm_stream_si128((__m128i *)(d + 0), v0);
+			_mm_stream_si128((__m128i *)(d + 16), v1);
+			_mm_stream_si128((__m128i *)(d + 32), v2);
+			_mm_stream_si128((__m128i *)(d + 48), v3);
+		}
+		_mm_sfence();
+	} else {
+		for (; d + 64 <= end; d += 64, s += 64) {
+			__m128i v0 = _mm_loadu_si128((const __m128i *)(s + 0));
+			__m128i v1 = _mm_loadu_si128((const __m128i *)(s + 16));
+			__m128i v2 = _mm_loadu_si128((const __m128i *)(s + 32));
+			__m128i v3 = _mm_loadu_si128((const __m128i *)(s + 48));
+			_mm_store_si128((__m128i *)(d + 0), v0);
+			_mm_store_si128((__m128i *)(d + 16), v1);
+			_mm_store_si128((__m128i *)(d + 32), v2);
+			_mm_store_si128((__m128i *)(d + 48), v3);
+		}
+	}
+	for (; d < end; d += 16, s += 16) {
+		_mm_store_si128((__m128i *)d, _mm_loadu_si128((const __m128i *)s));
+	}
+
+	_mm_storeu_si128((__m128i *)end, tail);
+	return dest;
+}
+
+__attribute__((target("sse2")))
+void *mem_set_sse2(void *dest, int c, size_t n) {
+	uint8_t *d = (uint8_t *)dest;
+
+	if (n < 16) {
+		mem_set_small(d, (uint8_t)c, n);
+		return dest;
+	}
+
+	__m128i v = _mm_set1_epi8((char)c);
+	if (n <= 32) {
+		_mm_storeu_si128((__m128i *)d, v);
+		_mm_storeu_si128((__m128i *)(d + n - 16), v);
+		return dest;
+	}
+	if (mem_has_erms && n >= MEM_REP_THRESHOLD && n < MEM_NT_THRESHOLD) {
+		mem_rep_stosb(d, (uint8_t)c, n);
+		return dest;
+	}
+
+	uint8_t *end = d + n - 16;
+	_mm_storeu_si128((__m128i *)d, v);
+	_mm_storeu_si128((__m128i *)end, v);
+	d += 16 - ((uintptr_t)d & 15);
+
+	if (n >= MEM_NT_THRESHOLD) {
+		for (; d + 64 <= end; d += 64) {
+			_mm_stream_si128((__m128i *)(d + 0), v);
+			_mm_stream_si128((__m128i *)(d + 16), v);
+			_mm_stream_si128((__m128i *)(d + 32), v);
+			_mm_stream_si128((__m128i *)(d + 48), v);
+		}
+		_mm_sfence();
+	}
+	for (; d < end; d += 16) {
+		_mm_store_si128((__m128i *)d, v);
+	}
+	return dest;
+}
+
+__attribute__((target("avx2")))
+void *mem_copy_avx2(void *dest, const void *src, size_t n) {
+	uint8_t *d = (uint8_t *)dest;
+	const uint8_t *s = (const uint8_t *)src;
+
+	if (n < 16) {
+		mem_copy_small(d, s, n);
+		return dest;
+	}
+	if (n <= 32) {
+		__m128i a = _mm_loadu_si128((const __m128i *)s);
+		__m128i b = _mm_loadu_si128((const __m128i *)(s + n - 16));
+		_mm_storeu_si128((__m128i *)d, a);
+		_mm_storeu_si128((__m128i *)(d + n - 16), b);
+		return dest;
+	}
+	if (n <= 64) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)s);
+		__m256i b = _mm256_loadu_si256((const __m256i *)(s + n - 32));
+		_mm256_storeu_si256((__m256i *)d, a);
+		_mm256_storeu_si256((__m256i *)(d + n - 32), b);
+		_mm256_zeroupper();
+		return dest;
+	}
+	if (mem_has_erms && n >= MEM_REP_THRESHOLD && n < MEM_NT_THRESHOLD) {
+		mem_rep_movsb(d, s, n);
+		return dest;
+	}
+
+	__m256i head = _mm256_loadu_si256((const __m256i *)s);
+	__m256i tail = _mm256_loadu_si256((const __m256i *)(s + n - 32));
+	uint8_t *end = d + n - 32;
+
+	size_t skew = 32 - ((uintptr_t)d & 31);
+	_mm256_storeu_si256((__m256i *)d, head);
+	d += skew;
+	s += skew;
+
+	if (n >= MEM_NT_THRESHOLD) {
+		for (; d + 128 <= end; d += 128, s += 128) {
+			__m256i v0 = _mm256_loadu_si256((const __m256i *)(s + 0));
+			__m256i v1 = _mm256_loadu_si256((const __m256i *)(s + 32));
+			__m256i v2 = _mm256_loadu_si256((const __m256i *)(s + 64));
+			__m256i v3 = _mm256_loadu_si256((const __m256i *)(s + 96));
+			_mm256_stream_si256((__m256i *)(d + 0), v0);
+			_mm256_stream_si256((__m256i *)(d + 32), v1);
+			_mm256_stream_si256((__m256i *)(d + 64), v2);
+			_mm256_stream_si256((__m256i *)(d + 96), v3);
+		}
+		_mm_sfence();
+	} else {
+		for (; d + 128 <= end; d += 128, s += 128) {
+			__m256i v0 = _mm256_loadu_si256((const __m256i *)(s + 0));
+			__m256i v1 = _mm256_loadu_si256((const __m256i *)(s + 32));
+			__m256i v2 = _mm256_loadu_si256((const __m256i *)(s + 64));
+			__m256i v3 = _mm256_loadu_si256((const __m256i *)(s + 96));
+			_mm256_store_si256((__m256i *)(d + 0), v0);
+			_mm256_store_si256((__m256i *)(d + 32), v1);
+			_mm256_store_si256((__m256i *)(d + 64), v2);
+			_mm256_store_si256((__m256i *)(d + 96), v3);
+		}
+	}
+	for (; d < end; d += 32, s += 32) {
+		_mm256_store_si256((__m256i *)d, _mm256_loadu_si256((const __m256i *)s));
+	}
+
+	_mm256_storeu_si256((__m256i *)end, tail);
+	_mm256_zeroupper();
+	return dest;
+}
+
+__attribute__((target("avx2")))
+void *mem_set_avx2(void *dest, int c, size_t n) {
+	uint8_t *d = (uint8_t *)dest;
+
+	if (n < 16) {
+		mem_set_small(d, (uint8_t)c, n);
+		return dest;
+	}
+	if (n <= 32) {
+		__m128i v = _mm_set1_epi8((char)c);
+		_mm_storeu_si128((__m128i *)d, v);
+		_mm_storeu_si128((__m128i *)(d + n - 16), v);
+		return dest;
+	}
+	if (mem_has_erms && n >= MEM_REP_THRESHOLD && n < MEM_NT_THRESHOLD) {
+		mem_rep_stosb(d, (uint8_t)c, n);
+		return dest;
+	}
+
+	__m256i v = _mm256_set1_epi8((char)c);
+	uint8_t *end = d + n - 32;
+	_mm256_storeu_si256((__m256i *)d, v);
+	_mm256_storeu_si256((__m256i *)end, v);
+	d += 32 - ((uintptr_t)d & 31);
+
+	if (n >= MEM_NT_THRESHOLD) {
+		for (; d + 128 <= end; d += 128) {
+			_mm256_stream_si256((__m256i *)(d + 0), v);
+			_mm256_stream_si256((__m256i *)(d + 32), v);
+			_mm256_stream_si256((__m256i *)(d + 64), v);
+			_mm256_stream_si256((__m256i *)(d + 96), v);
+		}
+		_mm_sfence();
+	}
+	for (; d < end; d += 32) {
+		_mm256_store_si256((__m256i *)d, v);
+	}
+	_mm256_zeroupper();
+	return dest;
+}
+
+// Whole aligned runs only, no head or tail handling
+__attribute__((target("sse2")))
+void mem_zero_stream_sse2(void *dest, size_t n) {
+	__m128i v = _mm_setzero_si128();
+	for (uint8_t *d = (uint8_t *)dest, *end = d + n; d < end; d += 64) {
+		_mm_stream_si128((__m128i *)(d + 0), v);
+		_mm_stream_si128((__m128i *)(d + 16), v);
+		_mm_stream_si128((__m128i *)(d + 32), v);
+		_mm_stream_si128((__m128i *)(d + 48), v);
+	}
+	_mm_sfence();
+}
+
+__attribute__((target("avx2")))
+void mem_zero_stream_avx2(void *dest, size_t n) {
+	__m256i v = _mm256_setzero_si256();
+	for (uint8_t *d = (uint8_t *)dest, *end = d + n; d < end; d += 128) {
+		_mm256_stream_si256((__m256i *)(d + 0), v);
+		_mm256_stream_si256((__m256i *)(d + 32), v);
+		_mm256_stream_si256((__m256i *)(d + 64), v);
+		_mm256_stream_si256((__m256i *)(d + 96), v);
+	}
+	_mm_sfence();
+	_mm256_zeroupper();
+}
+
+MemCopyFn mem_copy_impl = mem_copy_sse2;
+MemSetFn mem_set_impl = mem_set_sse2;
+MemZeroFn mem_zero_stream_impl = mem_zero_stream_sse2;
+
+void *memcpy(void *dest, const void *src, size_t n) {
+	MEM_SIMD_BEGIN();
+	mem_copy_impl(dest, src, n);
+	MEM_SIMD_END();
+	return dest;
+}
+
+void *memset(void *dest, int c, size_t n) {
+	MEM_SIMD_BEGIN();
+	mem_set_impl(dest, c, n);
+	MEM_SIMD_END();
+	return dest;
+}
+
+// Clears memory that isn't about to be read, past the caches so it doesn't
+// evict anything. dest is 32-byte aligned and n a multiple of 128, whole pages
+// always are
+void mem_zero_stream(void *dest, size_t n) {
+	MEM_SIMD_BEGIN();
+	mem_zero_stream_impl(dest, n);
+	MEM_SIMD_END();
+}
+
+// Only the forward-overlapping case can't go through memcpy, the head/tail
+// stores in the vector paths would clobber source bytes they haven't read yet
+void *memmove(void *dest, const void *src, size_t n) {
+	uintptr_t d = (uintptr_t)dest, s = (uintptr_t)src;
+	if (d + n <= s || s + n <= d) {
+		return memcpy(dest, src, n);
+	}
+
+	if (d < s) {
+		mem_rep_movsb(dest, src, n);
+	} else if (d > s) {
+		uint8_t *dl = (uint8_t *)dest + n - 1;
+		const uint8_t *sl = (const uint8_t *)src + n - 1;
+		__asm__ volatile ("std\n\trep movsb\n\tcld" : "+D"(dl), "+S"(sl), "+c"(n) :: "memory");
+	}
+	return dest;
+}
+
+int memcmp(const void *a, const void *b, size_t n) {
+	const uint8_t *x = (const uint8_t *)a, *y = (const uint8_t *)b;
+	for (size_t i = 0; i < n; i++) {
+		if (x[i] != y[i]) {
+			return x[i] - y[i];
+		}
+	}
+	return 0;
+}
+
+size_t strlen(const char *s) {
+	size_t n = 0;
+	while (s[n]) {
+		n++;
+	}
+	return n;
+}
+
+void mem_init(void) {
+	CpuidRegs leaf1 = cpuid(1, 0);
+	CpuidRegs leaf7 = cpuid(0, 0).eax >= 7 ? cpuid(7, 0) : (CpuidRegs){0};
+
+	mem_has_erms = (leaf7.ebx >> 9) & 1;
+
+	// AVX2 also needs the OS (or firmware) to have enabled YMM state in XCR0
+	bool osxsave = (leaf1.ecx >> 27) & 1;
+	bool avx = (leaf1.ecx >> 28) & 1;
+	bool avx2 = (leaf7.ebx >> 5) & 1;
+	bool ymm_enabled = osxsave && (xgetbv(0) & 0x6) == 0x6;
+
+	if (avx && avx2 && ymm_enabled) {
+		mem_copy_impl = mem_copy_avx2;
+		mem_set_impl = mem_set_avx2;
+		mem_zero_stream_impl = mem_zero_stream_avx2;
+	}
+}
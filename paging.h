@@ -0,0 +1,149 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "cpu.h"
+#include "elf.h"
+
+// 4-level x86_64 page table helpers, shared by the stub (which builds the boot
+// address space) and the kernel (which edits it later, and builds another one
+// for a warm reboot)
+
+#define PTE_PRESENT (1ULL << 0)
+#define PTE_WRITE   (1ULL << 1)
+#define PTE_USER    (1ULL << 2)
+#define PTE_PWT     (1ULL << 3)
+#define PTE_PCD     (1ULL << 4)
+#define PTE_HUGE    (1ULL << 7)
+#define PTE_GLOBAL  (1ULL << 8)
+#define PTE_NX      (1ULL << 63)
+#define PTE_ADDR_MASK 0x000FFFFFFFFFF000ULL
+
+#define PT_ENTRIES 512
+
+#define PAGE_SIZE_4K (1ULL << 12)
+#define PAGE_SIZE_2M (1ULL << 21)
+#define PAGE_SIZE_1G (1ULL << 30)
+
+// Boot address space layout:
+//   [0, 4 GiB)                                identity, so the loader and AP trampoline survive the CR3 switch
+//   PHYS_MAP_BASE + [0, phys_map_size)        every physical byte, 1 GiB or 2 MiB pages, NX
+//   KERNEL_VIRT_BASE + [0, kernel_size)       the kernel image with per-segment permissions
+#define IDENTITY_MAP_SIZE (4ULL << 30)
+#define PHYS_MAP_BASE 0xFFFF800000000000ULL
+#define KERNEL_VIRT_BASE 0xFFFFFFFF80000000ULL
+
+typedef struct {
+	// Physical address of the PML4
+	uint64_t root;
+	// Tables are touched at phys + table_offset (0 in the stub, PHYS_MAP_BASE in the kernel)
+	uint64_t table_offset;
+	// Returns the physical address of a zeroed page, 0 when out of memory
+	uint64_t (*alloc)(void *ctx);
+	void *ctx;
+} PageMapper;
+
+static inline uint64_t *pt_table(PageMapper *m, uint64_t phys) {
+	return (uint64_t *)(phys + m->table_offset);
+}
+
+static inline uint32_t pt_index(uint64_t virt, uint32_t level) {
+	return (virt >> (12 + 9 * (level - 1))) & (PT_ENTRIES - 1);
+}
+
+// Returns the entry for `virt` at `level` (1 = PT, 2 = PD, 3 = PDPT), building
+// intermediate tables as needed. NULL if an allocation failed or a huge page is in the way
+static uint64_t *pt_entry(PageMapper *m, uint64_t virt, uint32_t level) {
+	uint64_t *table = pt_table(m, m->root);
+	for (uint32_t l = 4; l > level; l--) {
+		uint64_t *entry = &table[pt_index(virt, l)];
+		if (!(*entry & PTE_PRESENT)) {
+			uint64_t page = m->alloc(m->ctx);
+			if (!page) {
+				return NULL;
+			}
+			// Leaf entries carry the real permissions, intermediates stay permissive
+			*entry = page | PTE_PRESENT | PTE_WRITE;
+		} else if (*entry & PTE_HUGE) {
+			return NULL;
+		}
+		table = pt_table(m, *entry & PTE_ADDR_MASK);
+	}
+	return &table[pt_index(virt, level)];
+}
+
+// Maps [virt, virt + size) to [phys, phys + size), using the largest page size
+// up to `max_page` that alignment allows at each step
+static bool pt_map(PageMapper *m, uint64_t virt, uint64_t phys, uint64_t size, uint64_t max_page, uint64_t flags) {
+	uint64_t end = virt + size;
+	while (virt < end) {
+		uint64_t page = PAGE_SIZE_4K;
+		uint32_t level = 1;
+		if (max_page >= PAGE_SIZE_1G && !((virt | phys) & (PAGE_SIZE_1G - 1)) && end - virt >= PAGE_SIZE_1G) {
+			page = PAGE_SIZE_1G;
+			level = 3;
+		} else if (max_page >= PAGE_SIZE_2M && !((virt | phys) & (PAGE_SIZE_2M - 1)) && end - virt >= PAGE_SIZE_2M) {
+			page = PAGE_SIZE_2M;
+			level = 2;
+		}
+
+		uint64_t *entry = pt_entry(m, virt, level);
+		if (!entry) {
+			return false;
+		}
+		*entry = phys | flags | PTE_PRESENT | (level > 1 ? PTE_HUGE : 0);
+
+		virt += page;
+		phys += page;
+	}
+	return true;
+}
+
+// 1 GiB pages and NX, both optional
+static void pt_boot_features(bool *huge_1g, uint64_t *nx) {
+	CpuidRegs ext = cpuid(0x80000000, 0).eax >= 0x80000001 ? cpuid(0x80000001, 0) : (CpuidRegs){0};
+	*huge_1g = (ext.edx >> 26) & 1;
+	*nx = ((ext.edx >> 20) & 1) ? PTE_NX : 0;
+}
+
+// Worst case table count for pt_build_boot: PML4, identity and direct map PDPTs
+// (+ PDs without 1 GiB pages), and a PDPT, PDs and PTs for 4 KiB mappings of the kernel
+static size_t pt_boot_table_count(uint64_t phys_top, uint64_t kernel_span, bool huge_1g) {
+	uint64_t gigs = phys_top / PAGE_SIZE_1G;
+	size_t pages = 1;
+	pages += 1 + (huge_1g ? 0 : IDENTITY_MAP_SIZE / PAGE_SIZE_1G);
+	pages += (gigs + PT_ENTRIES - 1) / PT_ENTRIES + (huge_1g ? 0 : gigs);
+	pages += 1 + (kernel_span / PAGE_SIZE_1G + 2) + (kernel_span / PAGE_SIZE_2M + 2);
+	return pages;
+}
+
+// Lays out the boot address space in m, whose root is empty. phys_top is 1 GiB
+// aligned, and the kernel's PT_LOAD segments sit at image_phys + (p_vaddr - min_vaddr)
+static bool pt_build_boot(PageMapper *m, uint64_t phys_top, bool huge_1g, uint64_t nx,
+	Elf64_Phdr *phdrs, size_t phnum, uint64_t min_vaddr, uint64_t image_phys) {
+	uint64_t max_page = huge_1g ? PAGE_SIZE_1G : PAGE_SIZE_2M;
+	if (!pt_map(m, 0, 0, IDENTITY_MAP_SIZE, max_page, PTE_WRITE) ||
+		!pt_map(m, PHYS_MAP_BASE, 0, phys_top, max_page, PTE_WRITE | nx)) {
+		return false;
+	}
+
+	for (size_t i = 0; i < phnum; i++) {
+		Elf64_Phdr *ph = &phdrs[i];
+		if (ph->p_type != PT_LOAD || ph->p_memsz == 0) {
+			continue;
+		}
+
+		uint64_t start = (ph->p_vaddr - min_vaddr) & ~(PAGE_SIZE_4K - 1);
+		uint64_t end = (ph->p_vaddr - min_vaddr + ph->p_memsz + PAGE_SIZE_4K - 1) & ~(PAGE_SIZE_4K - 1);
+		uint64_t flags = PTE_GLOBAL;
+		if (ph->p_flags & PF_W) flags |= PTE_WRITE;
+		if (!(ph->p_flags & PF_X)) flags |= nx;
+
+		if (!pt_map(m, KERNEL_VIRT_BASE + start, image_phys + start, end - start, PAGE_SIZE_2M, flags)) {
+			return false;
+		}
+	}
+	return true;
+}
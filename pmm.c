@@ -0,0 +1,702 @@
+// Binary buddy allocator for physical frames, seeded from the BootInfo region table.
+// Each order keeps an intrusive doubly linked free list threaded through the free
+// blocks themselves, plus one bit per buddy pair holding (A free) ^ (B free), so a
+// free can tell whether to coalesce with a single toggle.
+//
+// There is one zone per NUMA node, built from the regions tagged with it.
+// Allocations try the calling CPU's node first and then the others nearest
+// first by SLIT distance. Frees find their zone through the region table.
+//
+// Each zone also keeps a pool of pre-zeroed blocks for pmm_alloc_zeroed. Idle
+// CPUs take free blocks off their own node's buddy lists, clear them with
+// streaming stores and file them on clean lists, one per order up to 2 MiB.
+// A zeroed allocation splits the smallest clean block that fits and only
+// clears memory itself when the pool is dry. Ordinary allocations fall back
+// to the clean lists once the buddy lists run out, so pooled memory is never
+// stranded.
+
+#include "kernel.h"
+#include "boot_info.h"
+
+// 4 KiB << 18 = 1 GiB
+#define PMM_MAX_ORDER 18
+#define PMM_ORDERS (PMM_MAX_ORDER + 1)
+
+// Left alone for SMP trampolines and the like
+#define PMM_LOW_MEMORY 0x100000
+
+// 4 KiB << 9 = 2 MiB, the largest block the pool clears and keeps
+#define PMM_ZERO_MAX_ORDER 9
+#define PMM_ZERO_ORDERS (PMM_ZERO_MAX_ORDER + 1)
+// The pool holds up to a sixteenth of a zone, and no more than 32 MiB of it
+#define PMM_ZERO_POOL_SHIFT 4
+#define PMM_ZERO_POOL_MAX_PAGES 8192
+// Background clearing checks for other work this often
+#define PMM_ZERO_SLICE (64 * 1024)
+
+typedef struct PmmBlock {
+	struct PmmBlock *next, *prev;
+} PmmBlock;
+
+typedef struct {
+	// Aligned down to a max-order block so buddies are found by xor on the pfn
+	uint64_t base_pfn;
+	uint64_t end_pfn;
+
+	PmmBlock free_lists[PMM_ORDERS];
+	uint64_t free_blocks[PMM_ORDERS];
+	uint64_t *pair_bits[PMM_MAX_ORDER];
+
+	uint64_t total_pages;
+	// Buddy lists only, clean_pages are free as well
+	uint64_t free_pages;
+
+	// Zero except for the list links in their first 16 bytes
+	PmmBlock clean_lists[PMM_ZERO_ORDERS];
+	uint64_t clean_blocks[PMM_ZERO_ORDERS];
+	uint64_t clean_pages;
+	// Taken off the buddy lists by an idle CPU and still being cleared
+	uint64_t zeroing_pages;
+	uint64_t zero_target;
+	uint64_t zero_hits;
+	uint64_t zero_misses;
+	uint64_t zeroed_pages;
+	uint64_t zero_ticks;
+	Spinlock lock;
+} PmmZone;
+
+typedef struct {
+	uint64_t total_pages;
+	uint64_t free_pages;
+	uint64_t free_blocks[PMM_ORDERS];
+	// 100 - largest free block * 100 / buddy pages: how much of the free memory
+	// lies outside the single largest block any one allocation could get
+	uint32_t fragmentation_pct;
+	uint32_t largest_free_order;
+
+	// Pre-zeroed pool, part of free_pages
+	uint64_t clean_pages;
+	// pmm_alloc_zeroed calls served from the pool, and ones that cleared memory themselves
+	uint64_t zero_hits;
+	uint64_t zero_misses;
+	// Cleared in the background, and the TSC ticks that took
+	uint64_t zeroed_pages;
+	uint64_t zero_ticks;
+} PmmStats;
+
+PmmZone pmm_zones[MAX_NUMA_NODES];
+uint32_t pmm_node_count;
+// Every node once per row, nearest first, so each row starts with its own node
+uint8_t pmm_fallback[MAX_NUMA_NODES][MAX_NUMA_NODES];
+
+// The BootInfo table, sorted by base, looked up on every free
+MemRegion *pmm_regions;
+size_t pmm_region_count;
+
+// Set by smp_init once this_cpu() works, allocations before that come from node 0
+extern bool percpu_ready;
+
+static inline PmmBlock *pmm_block(uint64_t pfn) {
+	return (PmmBlock *)phys_to_virt(pfn << PAGE_SHIFT);
+}
+
+static inline uint64_t pmm_block_pfn(PmmBlock *block) {
+	return virt_to_phys(block) >> PAGE_SHIFT;
+}
+
+static void pmm_link(PmmBlock *head, PmmBlock *block) {
+	block->next = head->next;
+	block->prev = head;
+	head->next->prev = block;
+	head->next = block;
+}
+
+static void pmm_unlink(PmmBlock *block) {
+	block->prev->next = block->next;
+	block->next->prev = block->prev;
+}
+
+static void pmm_list_push(PmmZone *z, uint64_t pfn, uint32_t order) {
+	pmm_link(&z->free_lists[order], pmm_block(pfn));
+	z->free_blocks[order]++;
+}
+
+static void pmm_list_remove(PmmZone *z, PmmBlock *block, uint32_t order) {
+	pmm_unlink(block);
+	z->free_blocks[order]--;
+}
+
+static void pmm_clean_push(PmmZone *z, uint64_t pfn, uint32_t order) {
+	pmm_link(&z->clean_lists[order], pmm_block(pfn));
+	z->clean_blocks[order]++;
+}
+
+// Takes the smallest clean block of at least order and splits it down, the
+// halves left over stay clean. Returns 0 when there's none big enough
+static uint64_t pmm_clean_take(PmmZone *z, uint32_t order) {
+	uint32_t k = order;
+	while (k <= PMM_ZERO_MAX_ORDER && z->clean_blocks[k] == 0) {
+		k++;
+	}
+	if (k > PMM_ZERO_MAX_ORDER) {
+		return 0;
+	}
+
+	PmmBlock *block = z->clean_lists[k].next;
+	pmm_unlink(block);
+	z->clean_blocks[k]--;
+	uint64_t pfn = pmm_block_pfn(block);
+	while (k > order) {
+		k--;
+		pmm_clean_push(z, pfn + (1ULL << k), k);
+	}
+	z->clean_pages -= 1ULL << order;
+	return pfn;
+}
+
+// Returns the pair bit's new value, 0 means both halves now agree
+static inline bool pmm_toggle(PmmZone *z, uint64_t pfn, uint32_t order) {
+	uint64_t pair = (pfn - z->base_pfn) >> (order + 1);
+	uint64_t mask = 1ULL << (pair & 63);
+	z->pair_bits[order][pair >> 6] ^= mask;
+	return (z->pair_bits[order][pair >> 6] & mask) != 0;
+}
+
+static void pmm_free_block(PmmZone *z, uint64_t pfn, uint32_t order) {
+	z->free_pages += 1ULL << order;
+
+	for (; order < PMM_MAX_ORDER; order++) {
+		// Buddy still busy, the pair bit now records that we're free
+		if (pmm_toggle(z, pfn, order)) {
+			break;
+		}
+
+		uint64_t buddy = pfn ^ (1ULL << order);
+		pmm_list_remove(z, pmm_block(buddy), order);
+		pfn &= ~(1ULL << order);
+	}
+	pmm_list_push(z, pfn, order);
+}
+
+// Takes a free block of order k off its list and splits it down to order
+static uint64_t pmm_take_block(PmmZone *z, PmmBlock *block, uint32_t k, uint32_t order) {
+	pmm_list_remove(z, block, k);
+	uint64_t pfn = pmm_block_pfn(block);
+	if (k < PMM_MAX_ORDER) {
+		pmm_toggle(z, pfn, k);
+	}
+
+	// Keep the low half, hand the high halves back one order at a time
+	while (k > order) {
+		k--;
+		uint64_t buddy = pfn + (1ULL << k);
+		pmm_toggle(z, buddy, k);
+		pmm_list_push(z, buddy, k);
+	}
+
+	z->free_pages -= 1ULL << order;
+	return pfn;
+}
+
+static uint64_t pmm_alloc_block(PmmZone *z, uint32_t order) {
+	uint32_t k = order;
+	while (k <= PMM_MAX_ORDER && z->free_blocks[k] == 0) {
+		k++;
+	}
+	if (k > PMM_MAX_ORDER) {
+		return 0;
+	}
+	return pmm_take_block(z, z->free_lists[k].next, k, order);
+}
+
+// Same, but only blocks that end at or below limit_pfn will do. Walks the
+// free lists, so it's for the odd allocation rather than the fast path
+static uint64_t pmm_alloc_block_below(PmmZone *z, uint32_t order, uint64_t limit_pfn) {
+	for (uint32_t k = order; k <= PMM_MAX_ORDER; k++) {
+		PmmBlock *head = &z->free_lists[k];
+		for (PmmBlock *block = head->next; block != head; block = block->next) {
+			if (pmm_block_pfn(block) + (1ULL << k) <= limit_pfn) {
+				return pmm_take_block(z, block, k, order);
+			}
+		}
+	}
+	return 0;
+}
+
+// Frees the largest naturally aligned blocks that tile [start, end)
+static void pmm_add_range(PmmZone *z, uint64_t start, uint64_t end) {
+	while (start < end) {
+		uint32_t order = start ? __builtin_ctzll(start) : PMM_MAX_ORDER;
+		if (order > PMM_MAX_ORDER) {
+			order = PMM_MAX_ORDER;
+		}
+		while ((1ULL << order) > end - start) {
+			order--;
+		}
+
+		z->total_pages += 1ULL << order;
+		pmm_free_block(z, start, order);
+		start += 1ULL << order;
+	}
+}
+
+// Reclaimable memory is fair game, the kernel runs on its own stack and page tables
+static bool pmm_region_usable(MemRegion *r) {
+	return r->type == MemRegionUsable || r->type == MemRegionReclaimable;
+}
+
+// Clips a region to the frames the allocator is allowed to own
+static bool pmm_region_range(MemRegion *r, uint64_t *start, uint64_t *end) {
+	uint64_t base = r->base, limit = r->base + r->pages * PAGE_SIZE;
+	if (base < PMM_LOW_MEMORY) {
+		base = PMM_LOW_MEMORY;
+	}
+	if (base >= limit) {
+		return false;
+	}
+
+	*start = base >> PAGE_SHIFT;
+	*end = limit >> PAGE_SHIFT;
+	return true;
+}
+
+static bool pmm_zone_init(PmmZone *z, MemRegion *regions, size_t count, uint32_t node, uint64_t lo, uint64_t hi) {
+	uint64_t max_block = 1ULL << PMM_MAX_ORDER;
+	z->base_pfn = lo & ~(max_block - 1);
+	z->end_pfn = hi;
+
+	for (uint32_t k = 0; k < PMM_ORDERS; k++) {
+		z->free_lists[k].next = z->free_lists[k].prev = &z->free_lists[k];
+	}
+	for (uint32_t k = 0; k < PMM_ZERO_ORDERS; k++) {
+		z->clean_lists[k].next = z->clean_lists[k].prev = &z->clean_lists[k];
+	}
+
+	// About one bit per page across all orders
+	uint64_t span = z->end_pfn - z->base_pfn;
+	uint64_t words[PMM_MAX_ORDER], total_words = 0;
+	for (uint32_t k = 0; k < PMM_MAX_ORDER; k++) {
+		words[k] = ((span >> (k + 1)) + 1 + 63) / 64;
+		total_words += words[k];
+	}
+	uint64_t bitmap_pages = (total_words * sizeof(uint64_t) + PAGE_SIZE - 1) / PAGE_SIZE;
+
+	// The bitmap comes off the front of the first zone range big enough to hold it
+	uint64_t bitmap_pfn = 0;
+	for (size_t i = 0; i < count && !bitmap_pfn; i++) {
+		uint64_t start, end;
+		if (regions[i].node == node && pmm_region_usable(&regions[i]) && pmm_region_range(&regions[i], &start, &end) &&
+			start >= lo && end <= hi && end - start >= bitmap_pages) {
+			bitmap_pfn = start;
+		}
+	}
+	if (!bitmap_pfn) {
+		return false;
+	}
+
+	uint64_t *bits = (uint64_t *)phys_to_virt(bitmap_pfn << PAGE_SHIFT);
+	memset(bits, 0, total_words * sizeof(uint64_t));
+	for (uint32_t k = 0; k < PMM_MAX_ORDER; k++) {
+		z->pair_bits[k] = bits;
+		bits += words[k];
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		uint64_t start, end;
+		if (regions[i].node != node || !pmm_region_usable(&regions[i]) || !pmm_region_range(&regions[i], &start, &end)) {
+			continue;
+		}
+		if (start < lo) start = lo;
+		if (end > hi) end = hi;
+
+		if (bitmap_pfn >= start && bitmap_pfn < end) {
+			start = bitmap_pfn + bitmap_pages;
+		}
+		if (start < end) {
+			pmm_add_range(z, start, end);
+		}
+	}
+
+	z->zero_target = z->total_pages >> PMM_ZERO_POOL_SHIFT;
+	if (z->zero_target > PMM_ZERO_POOL_MAX_PAGES) {
+		z->zero_target = PMM_ZERO_POOL_MAX_PAGES;
+	}
+	return true;
+}
+
+// Orders every node by distance from each one, ties going to the lower id
+static void pmm_build_fallback(BootInfo *info) {
+	for (uint32_t node = 0; node < pmm_node_count; node++) {
+		uint8_t *row = pmm_fallback[node];
+		for (uint32_t i = 0; i < pmm_node_count; i++) {
+			uint32_t j = i;
+			for (; j > 0 && info->numa_distance[node][row[j - 1]] > info->numa_distance[node][i]; j--) {
+				row[j] = row[j - 1];
+			}
+			row[j] = (uint8_t)i;
+		}
+
+		// Distances can be bogus, the home node goes first regardless
+		for (uint32_t i = 0; row[0] != node; i++) {
+			if (row[i] == node) {
+				row[i] = row[0];
+				row[0] = (uint8_t)node;
+			}
+		}
+	}
+}
+
+bool pmm_init(BootInfo *info) {
+	MemRegion *regions = (MemRegion *)phys_to_virt(info->mem_regions);
+	size_t count = info->mem_region_count;
+	pmm_regions = regions;
+	pmm_region_count = count;
+
+	pmm_node_count = info->numa_node_count;
+	if (pmm_node_count == 0 || pmm_node_count > MAX_NUMA_NODES) {
+		pmm_node_count = 1;
+	}
+
+	// Nodes without memory of their own keep an empty zone and always fall back
+	bool any = false;
+	for (uint32_t node = 0; node < pmm_node_count; node++) {
+		uint64_t lo = UINT64_MAX, hi = 0;
+		for (size_t i = 0; i < count; i++) {
+			uint64_t start, end;
+			if (regions[i].node == node && pmm_region_usable(&regions[i]) && pmm_region_range(&regions[i], &start, &end)) {
+				if (start < lo) lo = start;
+				if (end > hi) hi = end;
+			}
+		}
+		if (lo >= hi) {
+			continue;
+		}
+
+		if (!pmm_zone_init(&pmm_zones[node], regions, count, node, lo, hi)) {
+			return false;
+		}
+		any = true;
+	}
+	if (!any) {
+		return false;
+	}
+
+	pmm_build_fallback(info);
+	return true;
+}
+
+// Smallest order whose block holds size bytes. Anything bigger than the
+// largest block comes back as PMM_MAX_ORDER + 1, which every allocator turns down
+uint32_t pmm_order_for(uint64_t size) {
+	uint32_t order = 0;
+	while (order <= PMM_MAX_ORDER && ((uint64_t)PAGE_SIZE << order) < size) {
+		order++;
+	}
+	return order;
+}
+
+// The calling CPU's node, node 0 until per-CPU data is up
+static inline uint32_t pmm_home_node(void) {
+	return percpu_ready ? this_cpu()->node : 0;
+}
+
+// Owner of a frame, found by binary search over the sorted region table
+static uint32_t pmm_node_of(uint64_t phys) {
+	size_t lo = 0, hi = pmm_region_count;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		MemRegion *r = &pmm_regions[mid];
+		if (phys < r->base) {
+			hi = mid;
+		} else if (phys >= r->base + r->pages * PAGE_SIZE) {
+			lo = mid + 1;
+		} else {
+			return r->node < pmm_node_count ? r->node : 0;
+		}
+	}
+	return 0;
+}
+
+// Like pmm_alloc, but starting from the given node's memory
+uint64_t pmm_alloc_node(uint32_t order, uint32_t node) {
+	if (order > PMM_MAX_ORDER) {
+		return 0;
+	}
+	if (node >= pmm_node_count) {
+		node = 0;
+	}
+
+	for (uint32_t i = 0; i < pmm_node_count; i++) {
+		PmmZone *z = &pmm_zones[pmm_fallback[node][i]];
+		// Unlocked peek, skips empty and exhausted nodes without touching their lock
+		if (z->free_pages + z->clean_pages < (1ULL << order)) {
+			continue;
+		}
+
+		spin_lock(&z->lock);
+		uint64_t pfn = pmm_alloc_block(z, order);
+		if (!pfn && order <= PMM_ZERO_MAX_ORDER) {
+			// The buddy lists are out, clean blocks do just as well
+			pfn = pmm_clean_take(z, order);
+		}
+		spin_unlock(&z->lock);
+		if (pfn) {
+			return pfn << PAGE_SHIFT;
+		}
+	}
+	return 0;
+}
+
+// Like pmm_alloc_node, for memory that has to start out zeroed. Each node,
+// nearest first, serves it from its pool when it can and clears a block from
+// its buddy lists on the spot otherwise
+uint64_t pmm_alloc_zeroed_node(uint32_t order, uint32_t node) {
+	if (order > PMM_MAX_ORDER) {
+		return 0;
+	}
+	if (node >= pmm_node_count) {
+		node = 0;
+	}
+
+	for (uint32_t i = 0; i < pmm_node_count; i++) {
+		PmmZone *z = &pmm_zones[pmm_fallback[node][i]];
+		if (z->free_pages + z->clean_pages < (1ULL << order)) {
+			continue;
+		}
+
+		spin_lock(&z->lock);
+		bool clean = true;
+		uint64_t pfn = order <= PMM_ZERO_MAX_ORDER ? pmm_clean_take(z, order) : 0;
+		if (pfn) {
+			z->zero_hits++;
+		} else {
+			clean = false;
+			pfn = pmm_alloc_block(z, order);
+			if (pfn) {
+				z->zero_misses++;
+			}
+		}
+		spin_unlock(&z->lock);
+		if (!pfn) {
+			continue;
+		}
+
+		void *block = phys_to_virt(pfn << PAGE_SHIFT);
+		memset(block, 0, clean ? sizeof(PmmBlock) : PAGE_SIZE << order);
+		return pfn << PAGE_SHIFT;
+	}
+	return 0;
+}
+
+// Like pmm_alloc, for memory that has to sit below limit, e.g. to be reachable
+// through the identity map. Nodes are tried nearest first all the same
+uint64_t pmm_alloc_below(uint32_t order, uint64_t limit) {
+	if (order > PMM_MAX_ORDER) {
+		return 0;
+	}
+
+	uint32_t node = pmm_home_node();
+	for (uint32_t i = 0; i < pmm_node_count; i++) {
+		PmmZone *z = &pmm_zones[pmm_fallback[node][i]];
+		if (z->free_pages < (1ULL << order) || z->base_pfn >= limit >> PAGE_SHIFT) {
+			continue;
+		}
+
+		spin_lock(&z->lock);
+		uint64_t pfn = pmm_alloc_block_below(z, order, limit >> PAGE_SHIFT);
+		spin_unlock(&z->lock);
+		if (pfn) {
+			return pfn << PAGE_SHIFT;
+		}
+	}
+	return 0;
+}
+
+// Returns the physical address of a naturally aligned 4 KiB << order block, 0 when
+// out of memory. Comes from the calling CPU's node when it has any to spare
+uint64_t pmm_alloc(uint32_t order) {
+	return pmm_alloc_node(order, pmm_home_node());
+}
+
+uint64_t pmm_alloc_zeroed(uint32_t order) {
+	return pmm_alloc_zeroed_node(order, pmm_home_node());
+}
+
+// Idle CPUs call this to top up their node's pool. Clears one free block, the
+// largest that fits under the target, PMM_ZERO_SLICE at a time and checking
+// busy in between; a block cut short goes back to the buddy lists. Returns
+// false when there was nothing to do, the pool being full or the node empty
+bool pmm_zero_idle(bool (*busy)(void)) {
+	PmmZone *z = &pmm_zones[pmm_home_node()];
+	if (z->clean_pages + z->zeroing_pages >= z->zero_target) {
+		return false;
+	}
+
+	spin_lock(&z->lock);
+	uint64_t room = z->zero_target - z->clean_pages - z->zeroing_pages;
+	uint32_t order = PMM_MAX_ORDER;
+	while (order > 0 && z->free_blocks[order] == 0) {
+		order--;
+	}
+	if (order > PMM_ZERO_MAX_ORDER) {
+		order = PMM_ZERO_MAX_ORDER;
+	}
+	while (order > 0 && (1ULL << order) > room) {
+		order--;
+	}
+	uint64_t pfn = room < (1ULL << order) ? 0 : pmm_alloc_block(z, order);
+	if (pfn) {
+		z->zeroing_pages += 1ULL << order;
+	}
+	spin_unlock(&z->lock);
+	if (!pfn) {
+		return false;
+	}
+
+	uint8_t *block = (uint8_t *)phys_to_virt(pfn << PAGE_SHIFT);
+	uint64_t size = PAGE_SIZE << order;
+	uint64_t done = 0;
+	uint64_t start = rdtsc();
+	while (done < size && !(done && busy && busy())) {
+		uint64_t n = size - done < PMM_ZERO_SLICE ? size - done : PMM_ZERO_SLICE;
+		mem_zero_stream(block + done, n);
+		done += n;
+	}
+	uint64_t ticks = rdtsc() - start;
+
+	spin_lock(&z->lock);
+	z->zeroing_pages -= 1ULL << order;
+	z->zeroed_pages += done >> PAGE_SHIFT;
+	z->zero_ticks += ticks;
+	if (done == size) {
+		pmm_clean_push(z, pfn, order);
+		z->clean_pages += 1ULL << order;
+	} else {
+		pmm_free_block(z, pfn, order);
+	}
+	spin_unlock(&z->lock);
+	return true;
+}
+
+void pmm_free(uint64_t phys, uint32_t order) {
+	PmmZone *z = &pmm_zones[pmm_node_of(phys)];
+	spin_lock(&z->lock);
+	pmm_free_block(z, phys >> PAGE_SHIFT, order);
+	spin_unlock(&z->lock);
+}
+
+uint64_t pmm_node_free_pages(uint32_t node) {
+	if (node >= pmm_node_count) {
+		return 0;
+	}
+	PmmZone *z = &pmm_zones[node];
+	return __atomic_load_n(&z->free_pages, __ATOMIC_RELAXED) + __atomic_load_n(&z->clean_pages, __ATOMIC_RELAXED);
+}
+
+// Totals across every node. The largest free block is the largest on any one node
+void pmm_stats(PmmStats *stats) {
+	memset(stats, 0, sizeof(*stats));
+
+	uint64_t buddy_pages = 0;
+	for (uint32_t node = 0; node < pmm_node_count; node++) {
+		PmmZone *z = &pmm_zones[node];
+		spin_lock(&z->lock);
+		stats->total_pages += z->total_pages;
+		stats->free_pages += z->free_pages + z->clean_pages;
+		buddy_pages += z->free_pages;
+		stats->clean_pages += z->clean_pages;
+		stats->zero_hits += z->zero_hits;
+		stats->zero_misses += z->zero_misses;
+		stats->zeroed_pages += z->zeroed_pages;
+		stats->zero_ticks += z->zero_ticks;
+		for (uint32_t k = 0; k < PMM_ORDERS; k++) {
+			stats->free_blocks[k] += z->free_blocks[k];
+			if (z->free_blocks[k] && k > stats->largest_free_order) {
+				stats->largest_free_order = k;
+			}
+		}
+		spin_unlock(&z->lock);
+	}
+
+	if (buddy_pages) {
+		uint64_t largest = 1ULL << stats->largest_free_order;
+		stats->fragmentation_pct = (uint32_t)(100 - (largest * 100) / buddy_pages);
+	}
+}
+
+#ifdef PMM_BENCH
+// Zeroed allocation latency for a few sizes, clearing on the spot against
+// taking from a warm pool, then the pool's counters. APs fill the pool from
+// sched_idle while the BSP waits, and the BSP tops it up itself in case there
+// are none. bench_pmm.sh collects the lines from serial
+#define PMM_BENCH_ALLOCS 8
+#define PMM_BENCH_WARM_US 500000
+#define PMM_BENCH_POLL_US 1000
+
+void kprintf(const char *fmt, ...);
+uint64_t tsc_to_ns(uint64_t ticks);
+void pit_delay_us(uint64_t us);
+
+static const uint32_t pmm_bench_orders[] = { 0, 4, 9 };
+
+static void pmm_bench_warm(void) {
+	PmmZone *z = &pmm_zones[pmm_home_node()];
+	for (uint64_t waited = 0; waited < PMM_BENCH_WARM_US; waited += PMM_BENCH_POLL_US) {
+		if (z->clean_pages >= z->zero_target) {
+			break;
+		}
+		pit_delay_us(PMM_BENCH_POLL_US);
+	}
+	while (pmm_zero_idle(NULL)) {
+	}
+}
+
+// Mean and worst ns per allocation, pool or not
+static uint64_t pmm_bench_round(uint32_t order, bool pool, uint64_t *max_ns) {
+	uint64_t blocks[PMM_BENCH_ALLOCS];
+	uint64_t total = 0;
+	*max_ns = 0;
+	for (uint32_t i = 0; i < PMM_BENCH_ALLOCS; i++) {
+		uint64_t start = rdtsc();
+		if (pool) {
+			blocks[i] = pmm_alloc_zeroed(order);
+		} else {
+			blocks[i] = pmm_alloc(order);
+			if (blocks[i]) {
+				memset(phys_to_virt(blocks[i]), 0, PAGE_SIZE << order);
+			}
+		}
+		uint64_t ns = tsc_to_ns(rdtsc() - start);
+		total += ns;
+		if (ns > *max_ns) {
+			*max_ns = ns;
+		}
+	}
+
+	for (uint32_t i = 0; i < PMM_BENCH_ALLOCS; i++) {
+		if (blocks[i]) {
+			pmm_free(blocks[i], order);
+		}
+	}
+	return total / PMM_BENCH_ALLOCS;
+}
+
+void pmm_bench(void) {
+	for (uint32_t i = 0; i < sizeof(pmm_bench_orders) / sizeof(pmm_bench_orders[0]); i++) {
+		uint32_t order = pmm_bench_orders[i];
+		uint64_t sync_max, pool_max;
+		uint64_t sync_ns = pmm_bench_round(order, false, &sync_max);
+		pmm_bench_warm();
+		uint64_t pool_ns = pmm_bench_round(order, true, &pool_max);
+		kprintf("pmm_bench order %u sync %lu max %lu pool %lu max %lu\n", order, sync_ns, sync_max, pool_ns, pool_max);
+	}
+
+	PmmStats stats;
+	pmm_stats(&stats);
+	uint64_t ns = tsc_to_ns(stats.zero_ticks);
+	uint64_t bytes = stats.zeroed_pages << PAGE_SHIFT;
+	kprintf("pmm_bench pool hits %lu misses %lu clean %lu cleared %lu MB/s %lu\n", stats.zero_hits, stats.zero_misses,
+		stats.clean_pages, stats.zeroed_pages, ns ? bytes * 1000 / ns : 0);
+	kprintf("pmm_bench end\n");
+}
+#endif
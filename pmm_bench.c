@@ -0,0 +1,578 @@
+// Host-side stress test and benchmark for the kernel's frame allocator:
+// pmm.c built for Linux, over a fake region table whose "physical" memory is
+// a lazily backed mmap. Each run builds a random layout (ragged usable and
+// reclaimable ranges, reserved holes and gaps, split across NUMA nodes) and
+// replays a random alloc/free trace against it twice with the same seed:
+//   timed    nothing but the trace, for ops/sec and the fragmentation
+//            pmm_stats reports once the live set has settled
+//   checked  every block is checked on the way out (aligned, below the limit
+//            for pmm_alloc_below, all usable memory, owned by nobody else,
+//            zero for pmm_alloc_zeroed) and tagged until it comes back. The
+//            zones are walked at checkpoints and after the run: free and
+//            clean lists well linked and disjoint, per-order counts and
+//            free_pages matching the lists, every pair bit equal to its two
+//            halves' free state with no pair left unmerged, and free plus
+//            live pages adding up to total_pages
+// Even runs only allocate and free, so once everything is freed the zones
+// must be back to exactly their initial free lists. Odd runs mix in zeroed
+// allocations and pmm_zero_idle, which parks memory in the clean pool, and
+// their ns/op is mostly that clearing. frag % and order are pmm_stats'
+// fragmentation_pct and largest_free_order at the end of the trace.
+//
+// Usage: pmm_bench [runs] [ops per run] [MiB] [nodes]
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "paging.h"
+
+// pmm.c reaches frames through the physical map, here that's the arena
+#undef PHYS_MAP_BASE
+#define PHYS_MAP_BASE host_phys_map
+uint64_t host_phys_map;
+
+bool percpu_ready;
+
+// pmm_zero_idle's clearing, the pool doesn't care how
+static void mem_zero_stream(void *dest, size_t n) {
+	memset(dest, 0, n);
+}
+
+#include "pmm.c"
+
+#define MAX_REGIONS 4096
+// Live set the trace steers towards, as a share of total pages
+#define FILL_PCT 75
+#define CHECKPOINTS 8
+#define ZERO_IDLE_EVERY 256
+#define BELOW_LIMIT (4ULL << 30)
+#define TAG_MAGIC 0x7A6B5C4D3E2F1A0BULL
+#define MAX_REPORTS 20
+
+typedef struct {
+	uint64_t phys;
+	uint32_t order;
+} Live;
+
+typedef struct {
+	uint64_t ops;
+	uint64_t failed;
+	uint64_t peak_live_pages;
+	PmmStats settled;
+	double ns;
+} RunResult;
+
+MemRegion regions[MAX_REGIONS];
+size_t region_count;
+BootInfo boot_info;
+uint8_t *arena;
+size_t arena_size;
+uint64_t phys_pages;
+
+// One bit per frame: usable by the allocator, handed out, and seen during a zone walk
+uint64_t *usable_bits, *owned_bits, *seen_bits;
+// One bit per block per order while a zone is walked
+uint64_t *free_at[PMM_ORDERS];
+// Initial free lists for each zone, what an even run has to return to
+uint64_t initial_blocks[MAX_NUMA_NODES][PMM_ORDERS];
+
+Live *live;
+uint64_t live_count, live_pages;
+uint64_t zone_live_pages[MAX_NUMA_NODES];
+uint64_t errors;
+
+static inline uint64_t xorshift(uint64_t *s) {
+	*s ^= *s << 13;
+	*s ^= *s >> 7;
+	*s ^= *s << 17;
+	return *s;
+}
+
+static double now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+__attribute__((format(printf, 1, 2)))
+static void fail(const char *fmt, ...) {
+	if (errors++ < MAX_REPORTS) {
+		va_list ap;
+		va_start(ap, fmt);
+		printf("  FAIL ");
+		vprintf(fmt, ap);
+		printf("\n");
+		va_end(ap);
+	}
+}
+
+static inline bool bit_test(const uint64_t *bits, uint64_t i) {
+	return (bits[i >> 6] >> (i & 63)) & 1;
+}
+
+static inline void bit_put(uint64_t *bits, uint64_t i, bool value) {
+	if (value) {
+		bits[i >> 6] |= 1ULL << (i & 63);
+	} else {
+		bits[i >> 6] &= ~(1ULL << (i & 63));
+	}
+}
+
+// Whether every bit of [start, start + n) equals value
+static bool bits_all(const uint64_t *bits, uint64_t start, uint64_t n, bool value) {
+	for (uint64_t i = start; i < start + n; i++) {
+		if ((i & 63) == 0 && i + 64 <= start + n) {
+			if (bits[i >> 6] != (value ? ~0ULL : 0)) {
+				return false;
+			}
+			i += 63;
+		} else if (bit_test(bits, i) != value) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static void bits_put(uint64_t *bits, uint64_t start, uint64_t n, bool value) {
+	for (uint64_t i = start; i < start + n; i++) {
+		bit_put(bits, i, value);
+	}
+}
+
+static uint64_t *bits_alloc(uint64_t n) {
+	return calloc((n + 63) / 64, sizeof(uint64_t));
+}
+
+static void region_add(uint64_t base_pfn, uint64_t pages, uint32_t type, uint32_t node) {
+	MemRegion *last = region_count ? &regions[region_count - 1] : NULL;
+	// The stub merges adjacent regions of the same type, so does this
+	if (last && last->type == type && last->node == node && last->base + last->pages * PAGE_SIZE == base_pfn << PAGE_SHIFT) {
+		last->pages += pages;
+		return;
+	}
+	if (region_count < MAX_REGIONS) {
+		regions[region_count++] = (MemRegion){ .base = base_pfn << PAGE_SHIFT, .pages = pages, .type = type, .node = node };
+	}
+}
+
+// Low memory the way firmware leaves it, then each node's share of total
+// pages in ranges of random length. Between ranges there's a firmware region,
+// a gap with no region at all, or nothing
+static uint64_t build_layout(uint64_t total_pages, uint32_t nodes, uint64_t *rng) {
+	static const uint32_t holes[] = {
+		MemRegionBoot, MemRegionAcpiReclaim, MemRegionAcpiNvs, MemRegionRuntime, MemRegionReserved,
+	};
+	region_count = 0;
+	region_add(0, 0x9F, MemRegionUsable, 0);
+	region_add(0x9F, 0x61, MemRegionReserved, 0);
+
+	uint64_t pfn = PMM_LOW_MEMORY >> PAGE_SHIFT;
+	for (uint32_t node = 0; node < nodes; node++) {
+		uint64_t budget = total_pages / nodes;
+		while (budget) {
+			uint64_t r = xorshift(rng);
+			uint64_t len = (r & 3) == 0 ? 1 + (r >> 8) % 64 : 1 + (r >> 8) % (budget / 2 + 1);
+			if (len > budget) {
+				len = budget;
+			}
+			region_add(pfn, len, (r >> 4) % 5 == 0 ? MemRegionReclaimable : MemRegionUsable, node);
+			pfn += len;
+			budget -= len;
+
+			r = xorshift(rng);
+			if (r % 3 == 1) {
+				uint64_t hole = 1 + (r >> 8) % 256;
+				region_add(pfn, hole, holes[(r >> 4) % 5], node);
+				pfn += hole;
+			} else if (r % 3 == 2) {
+				pfn += 1 + (r >> 8) % 1024;
+			}
+		}
+	}
+
+	boot_info.mem_regions = virt_to_phys(regions);
+	boot_info.mem_region_count = region_count;
+	boot_info.numa_node_count = nodes;
+	for (uint32_t i = 0; i < nodes; i++) {
+		for (uint32_t j = 0; j < nodes; j++) {
+			boot_info.numa_distance[i][j] = i == j ? 10 : 20 + (i ^ j);
+		}
+	}
+	return pfn;
+}
+
+// Fresh zones over the current layout. The pair bitmaps come out of usable
+// memory, so those frames are off limits to every block from here on
+static bool pmm_reset(void) {
+	memset(pmm_zones, 0, sizeof(pmm_zones));
+	memset(pmm_fallback, 0, sizeof(pmm_fallback));
+	if (!pmm_init(&boot_info)) {
+		return false;
+	}
+
+	memset(usable_bits, 0, (phys_pages + 63) / 64 * sizeof(uint64_t));
+	for (size_t i = 0; i < region_count; i++) {
+		uint64_t start, end;
+		if (pmm_region_usable(&regions[i]) && pmm_region_range(&regions[i], &start, &end)) {
+			bits_put(usable_bits, start, end - start, true);
+		}
+	}
+	for (uint32_t node = 0; node < pmm_node_count; node++) {
+		PmmZone *z = &pmm_zones[node];
+		if (!z->total_pages) {
+			continue;
+		}
+		uint64_t span = z->end_pfn - z->base_pfn, words = 0;
+		for (uint32_t k = 0; k < PMM_MAX_ORDER; k++) {
+			words += ((span >> (k + 1)) + 1 + 63) / 64;
+		}
+		uint64_t bitmap_pfn = virt_to_phys(z->pair_bits[0]) >> PAGE_SHIFT;
+		bits_put(usable_bits, bitmap_pfn, (words * sizeof(uint64_t) + PAGE_SIZE - 1) / PAGE_SIZE, false);
+	}
+	return true;
+}
+
+// Walks one list, every block on it must be free memory nobody else claims.
+// Blocks are marked in free_at[order] unless it's NULL
+static uint64_t check_list(PmmZone *z, uint32_t node, PmmBlock *head, uint32_t order, const char *what, uint64_t *free_at,
+	uint64_t *pages) {
+	uint64_t count = 0;
+	uint64_t limit = z->total_pages + 1;
+	for (PmmBlock *block = head->next; block != head; block = block->next) {
+		if (block->next->prev != block || block->prev->next != block) {
+			fail("node %u %s order %u: broken links at %p", node, what, order, (void *)block);
+			return count;
+		}
+		if (++count > limit) {
+			fail("node %u %s order %u: list doesn't end", node, what, order);
+			return count;
+		}
+
+		uint64_t pfn = pmm_block_pfn(block), n = 1ULL << order;
+		if (pfn & (n - 1) || pfn < z->base_pfn || pfn + n > z->end_pfn) {
+			fail("node %u %s order %u: block at pfn %#lx misplaced", node, what, order, pfn);
+			continue;
+		}
+		if (!bits_all(usable_bits, pfn, n, true) || !bits_all(owned_bits, pfn, n, false) || !bits_all(seen_bits, pfn, n, false)) {
+			fail("node %u %s order %u: block at pfn %#lx overlaps unusable, live or other free memory", node, what, order, pfn);
+			continue;
+		}
+		bits_put(seen_bits, pfn, n, true);
+		if (free_at) {
+			bit_put(free_at, (pfn - z->base_pfn) >> order, true);
+		}
+		*pages += n;
+	}
+	return count;
+}
+
+static void check_zones(const char *when) {
+	for (uint32_t node = 0; node < pmm_node_count; node++) {
+		PmmZone *z = &pmm_zones[node];
+		if (!z->total_pages) {
+			continue;
+		}
+		uint64_t span = z->end_pfn - z->base_pfn;
+		memset(seen_bits, 0, (phys_pages + 63) / 64 * sizeof(uint64_t));
+		for (uint32_t k = 0; k < PMM_ORDERS; k++) {
+			memset(free_at[k], 0, ((span >> k) + 2 + 63) / 64 * sizeof(uint64_t));
+		}
+
+		uint64_t free_pages = 0, clean_pages = 0;
+		for (uint32_t k = 0; k < PMM_ORDERS; k++) {
+			uint64_t count = check_list(z, node, &z->free_lists[k], k, "free list", free_at[k], &free_pages);
+			if (count != z->free_blocks[k]) {
+				fail("%s: node %u order %u has %lu free blocks listed, %lu counted", when, node, k, count, z->free_blocks[k]);
+			}
+		}
+		if (free_pages != z->free_pages) {
+			fail("%s: node %u free lists hold %lu pages, free_pages says %lu", when, node, free_pages, z->free_pages);
+		}
+
+		// Clean blocks are allocated as far as the buddy lists and pair bits go
+		for (uint32_t k = 0; k < PMM_ZERO_ORDERS; k++) {
+			uint64_t count = check_list(z, node, &z->clean_lists[k], k, "clean list", NULL, &clean_pages);
+			if (count != z->clean_blocks[k]) {
+				fail("%s: node %u order %u has %lu clean blocks listed, %lu counted", when, node, k, count, z->clean_blocks[k]);
+			}
+		}
+		if (clean_pages != z->clean_pages) {
+			fail("%s: node %u clean lists hold %lu pages, clean_pages says %lu", when, node, clean_pages, z->clean_pages);
+		}
+
+		for (uint32_t k = 0; k < PMM_MAX_ORDER; k++) {
+			for (uint64_t pair = 0; pair <= span >> (k + 1); pair++) {
+				bool a = bit_test(free_at[k], pair * 2), b = bit_test(free_at[k], pair * 2 + 1);
+				bool bit = (z->pair_bits[k][pair >> 6] >> (pair & 63)) & 1;
+				if (a && b) {
+					fail("%s: node %u order %u: both halves of pair %lu free and unmerged", when, node, k, pair);
+				} else if (bit != (a ^ b)) {
+					fail("%s: node %u order %u: pair bit %lu is %u, halves free %u/%u", when, node, k, pair, bit, a, b);
+				}
+			}
+		}
+
+		uint64_t accounted = z->free_pages + z->clean_pages + z->zeroing_pages + zone_live_pages[node];
+		if (accounted != z->total_pages) {
+			fail("%s: node %u free %lu + clean %lu + live %lu != total %lu", when, node, z->free_pages, z->clean_pages,
+				zone_live_pages[node], z->total_pages);
+		}
+	}
+}
+
+// Mostly single pages, a long tail out to 1 GiB
+static uint32_t pick_order(uint64_t *rng) {
+	uint64_t r = xorshift(rng);
+	uint32_t bucket = r % 100;
+	r >>= 8;
+	if (bucket < 50) return 0;
+	if (bucket < 70) return 1 + r % 2;
+	if (bucket < 85) return 3 + r % 3;
+	if (bucket < 95) return 6 + r % 4;
+	if (bucket < 99) return 10 + r % 4;
+	return 14 + r % 5;
+}
+
+static inline uint64_t block_tag(uint64_t phys, uint32_t order) {
+	return phys ^ order ^ TAG_MAGIC;
+}
+
+// Tags sit past the free list links and in the block's last word
+static void tag_block(uint64_t phys, uint32_t order, bool set) {
+	uint8_t *p = phys_to_virt(phys);
+	uint64_t size = PAGE_SIZE << order, tag = block_tag(phys, order);
+	if (set) {
+		memcpy(p + sizeof(PmmBlock), &tag, sizeof(tag));
+		memcpy(p + size - sizeof(tag), &tag, sizeof(tag));
+		return;
+	}
+	uint64_t head, tail;
+	memcpy(&head, p + sizeof(PmmBlock), sizeof(head));
+	memcpy(&tail, p + size - sizeof(tail), sizeof(tail));
+	if (head != tag || tail != tag) {
+		fail("block at %#lx order %u was written while live", phys, order);
+	}
+}
+
+static bool is_zero(const uint8_t *p, uint64_t n) {
+	uint64_t acc = 0;
+	for (uint64_t i = 0; i < n; i += sizeof(uint64_t)) {
+		uint64_t v;
+		memcpy(&v, p + i, sizeof(v));
+		acc |= v;
+	}
+	return acc == 0;
+}
+
+static void check_alloc(uint64_t phys, uint32_t order, bool zeroed, uint64_t limit) {
+	uint64_t pfn = phys >> PAGE_SHIFT, n = 1ULL << order;
+	if (phys & ((PAGE_SIZE << order) - 1)) {
+		fail("order %u block at %#lx misaligned", order, phys);
+		return;
+	}
+	if (limit && phys + (PAGE_SIZE << order) > limit) {
+		fail("order %u block at %#lx ends past %#lx", order, phys, limit);
+	}
+	if (pfn + n > phys_pages || !bits_all(usable_bits, pfn, n, true)) {
+		fail("order %u block at %#lx isn't all usable memory", order, phys);
+		return;
+	}
+	if (!bits_all(owned_bits, pfn, n, false)) {
+		fail("order %u block at %#lx overlaps a live block", order, phys);
+		return;
+	}
+	if (zeroed && !is_zero(phys_to_virt(phys), PAGE_SIZE << order)) {
+		fail("zeroed order %u block at %#lx isn't zero", order, phys);
+	}
+	bits_put(owned_bits, pfn, n, true);
+	tag_block(phys, order, true);
+}
+
+static void live_add(uint64_t phys, uint32_t order) {
+	live[live_count++] = (Live){ phys, order };
+	live_pages += 1ULL << order;
+	zone_live_pages[pmm_node_of(phys)] += 1ULL << order;
+}
+
+static void live_free(uint64_t i, bool checked) {
+	Live block = live[i];
+	live[i] = live[--live_count];
+	live_pages -= 1ULL << block.order;
+	zone_live_pages[pmm_node_of(block.phys)] -= 1ULL << block.order;
+	if (checked) {
+		tag_block(block.phys, block.order, false);
+		bits_put(owned_bits, block.phys >> PAGE_SHIFT, 1ULL << block.order, false);
+	}
+	pmm_free(block.phys, block.order);
+}
+
+// One trace, the seed decides everything. Allocations outnumber frees until
+// the live set reaches FILL_PCT of memory and frees win past it
+static void replay(uint64_t seed, uint64_t ops, bool pool, bool checked, RunResult *result) {
+	uint64_t rng = seed;
+	uint64_t target = 0;
+	for (uint32_t node = 0; node < pmm_node_count; node++) {
+		target += pmm_zones[node].total_pages;
+	}
+	target = target * FILL_PCT / 100;
+	memset(result, 0, sizeof(*result));
+
+	double start = now_ns();
+	for (uint64_t op = 0; op < ops; op++) {
+		uint64_t r = xorshift(&rng);
+		bool alloc = live_count == 0 || (live_pages < target ? (r & 3) != 0 : (r & 3) == 0);
+
+		if (!alloc) {
+			live_free((r >> 8) % live_count, checked);
+		} else {
+			uint32_t order = pick_order(&rng);
+			uint32_t kind = (r >> 8) % 100;
+			uint64_t limit = 0, phys;
+			bool zeroed = false;
+			if (pool && kind < 15) {
+				// Zeroed blocks are kept to what a kernel would actually clear
+				if (order > PMM_ZERO_MAX_ORDER) {
+					order = PMM_ZERO_MAX_ORDER;
+				}
+				zeroed = true;
+				phys = pmm_alloc_zeroed_node(order, (r >> 16) % pmm_node_count);
+			} else if (kind < 25) {
+				phys = pmm_alloc_node(order, (r >> 16) % pmm_node_count);
+			} else if (kind < 30) {
+				limit = BELOW_LIMIT;
+				phys = pmm_alloc_below(order, limit);
+			} else {
+				phys = pmm_alloc(order);
+			}
+
+			if (!phys) {
+				result->failed++;
+			} else {
+				if (checked) {
+					check_alloc(phys, order, zeroed, limit);
+				}
+				live_add(phys, order);
+			}
+		}
+
+		if (pool && op % ZERO_IDLE_EVERY == 0) {
+			pmm_zero_idle(NULL);
+		}
+		if (live_pages > result->peak_live_pages) {
+			result->peak_live_pages = live_pages;
+		}
+		if (checked && (op + 1) % (ops / CHECKPOINTS + 1) == 0) {
+			char when[48];
+			snprintf(when, sizeof(when), "op %lu", op + 1);
+			check_zones(when);
+		}
+	}
+	result->ns = now_ns() - start;
+	result->ops = ops;
+	pmm_stats(&result->settled);
+
+	while (live_count) {
+		live_free(live_count - 1, checked);
+	}
+}
+
+static void check_drained(bool pool) {
+	check_zones("drained");
+	for (uint32_t node = 0; node < pmm_node_count; node++) {
+		PmmZone *z = &pmm_zones[node];
+		if (z->free_pages + z->clean_pages != z->total_pages) {
+			fail("drained: node %u has %lu of %lu pages free", node, z->free_pages + z->clean_pages, z->total_pages);
+		}
+		// Every block merged back, unless some of it is sitting in the pool
+		if (pool && z->clean_pages) {
+			continue;
+		}
+		for (uint32_t k = 0; k < PMM_ORDERS; k++) {
+			if (z->free_blocks[k] != initial_blocks[node][k]) {
+				fail("drained: node %u order %u has %lu free blocks, %lu after init", node, k, z->free_blocks[k],
+					initial_blocks[node][k]);
+			}
+		}
+	}
+}
+
+int main(int argc, char **argv) {
+	uint32_t runs = argc > 1 ? (uint32_t)atoi(argv[1]) : 4;
+	uint64_t ops = argc > 2 ? strtoull(argv[2], NULL, 0) : 1000000;
+	uint64_t mib = argc > 3 ? strtoull(argv[3], NULL, 0) : 4096;
+	uint32_t nodes = argc > 4 ? (uint32_t)atoi(argv[4]) : 2;
+	if (nodes == 0 || nodes > MAX_NUMA_NODES) {
+		nodes = 1;
+	}
+	uint64_t total_pages = mib << (20 - PAGE_SHIFT);
+	// Failures should make it out even if a broken allocator crashes the run
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	// Holes and gaps add at most a page of padding per page of memory, and
+	// only the frames the allocator writes to are ever backed
+	phys_pages = 2 * total_pages + (PMM_LOW_MEMORY >> PAGE_SHIFT) + (MAX_REGIONS << 10);
+	arena_size = phys_pages << PAGE_SHIFT;
+	arena = mmap(NULL, arena_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (arena == MAP_FAILED) {
+		fprintf(stderr, "can't map %lu MiB of fake physical memory\n", arena_size >> 20);
+		return 1;
+	}
+	host_phys_map = (uint64_t)arena;
+
+	usable_bits = bits_alloc(phys_pages);
+	owned_bits = bits_alloc(phys_pages);
+	seen_bits = bits_alloc(phys_pages);
+	for (uint32_t k = 0; k < PMM_ORDERS; k++) {
+		free_at[k] = bits_alloc((phys_pages >> k) + 2);
+	}
+	live = calloc(total_pages, sizeof(Live));
+
+	printf("%-4s %-6s %8s %6s %10s %10s %8s %8s %8s %7s %6s\n", "run", "trace", "regions", "nodes", "ops", "failed",
+		"ns/op", "Mops/s", "peak %", "frag %", "order");
+	for (uint32_t run = 0; run < runs; run++) {
+		uint64_t rng = 0x9E3779B97F4A7C15ULL * (run + 1);
+		uint64_t end_pfn = build_layout(total_pages, nodes, &rng);
+		if (end_pfn > phys_pages) {
+			fprintf(stderr, "layout runs past the arena\n");
+			return 1;
+		}
+		uint64_t seed = xorshift(&rng);
+		bool pool = run & 1;
+
+		// Checked first, a broken allocator is reported before it can crash the timed pass
+		RunResult timed, checked;
+		if (!pmm_reset()) {
+			fprintf(stderr, "pmm_init failed\n");
+			return 1;
+		}
+		uint64_t before = errors, total = 0;
+		for (uint32_t node = 0; node < pmm_node_count; node++) {
+			memcpy(initial_blocks[node], pmm_zones[node].free_blocks, sizeof(initial_blocks[node]));
+			total += pmm_zones[node].total_pages;
+		}
+		check_zones("init");
+		replay(seed, ops, pool, true, &checked);
+		check_drained(pool);
+
+		pmm_reset();
+		replay(seed, ops, pool, false, &timed);
+		if (checked.failed != timed.failed) {
+			fail("run %u: %lu failed allocations checked, %lu timed", run, checked.failed, timed.failed);
+		}
+
+		printf("%-4u %-6s %8zu %6u %10lu %10lu %8.1f %8.2f %8lu %7u %6u%s\n", run, pool ? "pool" : "plain", region_count,
+			pmm_node_count, timed.ops, timed.failed, timed.ns / timed.ops, timed.ops / timed.ns * 1e3,
+			timed.peak_live_pages * 100 / total, timed.settled.fragmentation_pct, timed.settled.largest_free_order,
+			errors != before ? "  FAILED" : "");
+	}
+
+	if (errors) {
+		printf("%lu invariant violations\n", errors);
+		return 1;
+	}
+	return 0;
+}
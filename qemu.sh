@@ -0,0 +1,10 @@
+set -x
+
+# Usage: ./qemu.sh [cpus] [extra qemu args...]
+# OVMF points at the firmware image, distros put it in different places.
+# Serial output goes through logdecode, which expands the kernel's log frames
+cpus=${1:-4}
+[ $# -gt 0 ] && shift
+OVMF=${OVMF:-/usr/share/ovmf/OVMF.fd}
+
+qemu-system-x86_64 -bios "$OVMF" -cdrom bin/cdimage.iso -m 512M -smp "$cpus" -net none -serial stdio "$@" | bin/logdecode
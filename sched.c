@@ -0,0 +1,393 @@
+// Fork-join task runtime. Every CPU owns a Chase-Lev deque: it pushes and pops
+// tasks at the bottom without locks, and idle CPUs steal from the top of a
+// randomly picked victim's deque. A CPU with nothing to run or steal sleeps in
+// mwait on a shared wakeup word, or in hlt until a wakeup IPI when the CPU has
+// no MONITOR/MWAIT. Tasks come from the slab heap.
+
+#include "kernel.h"
+#include "cpu.h"
+
+#define SCHED_DEQUE_SIZE 1024
+#define SCHED_WAKE_VECTOR 0xF0
+// Victims tried before a CPU decides there's nothing to steal
+#define SCHED_STEAL_ROUNDS 2
+
+void vm_poll(void);
+
+typedef void (*TaskFn)(void *arg, uint64_t lo, uint64_t hi);
+
+typedef struct {
+	volatile uint32_t pending;
+} TaskGroup;
+
+typedef struct {
+	TaskFn fn;
+	void *arg;
+	uint64_t lo, hi;
+	TaskGroup *group;
+} Task;
+
+// Lê et al.'s C11 formulation. top is where thieves take from, bottom is the
+// owner's end, and they sit on separate cache lines since different CPUs write them
+typedef struct {
+	volatile int64_t top __attribute__((aligned(CACHE_LINE_SIZE)));
+	volatile int64_t bottom __attribute__((aligned(CACHE_LINE_SIZE)));
+	Task **buffer;
+} TaskDeque;
+
+typedef struct {
+	TaskDeque deque;
+	uint64_t rng;
+	// Set by the CPU before it sleeps, cleared by whoever claims it for a wakeup
+	volatile uint32_t sleeping;
+
+	uint64_t executed;
+	uint64_t stolen;
+	uint64_t steal_failures;
+	uint64_t sleeps;
+} __attribute__((aligned(CACHE_LINE_SIZE))) SchedCpu;
+
+typedef struct {
+	SchedCpu *cpus;
+	uint32_t cpu_count;
+	// Only CPUs below this index run tasks, the benchmark uses it to scale up one CPU at a time
+	volatile uint32_t active;
+	volatile uint32_t started;
+	bool use_mwait;
+
+	// Sleepers count and wakeup word, written only when someone is asleep
+	volatile uint32_t sleepers __attribute__((aligned(CACHE_LINE_SIZE)));
+	volatile uint64_t wake_epoch __attribute__((aligned(CACHE_LINE_SIZE)));
+} Scheduler;
+
+Scheduler sched;
+
+static bool deque_push(TaskDeque *d, Task *task) {
+	int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+	int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+	if (b - t >= SCHED_DEQUE_SIZE) {
+		return false;
+	}
+	__atomic_store_n(&d->buffer[b & (SCHED_DEQUE_SIZE - 1)], task, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+	return true;
+}
+
+static Task *deque_pop(TaskDeque *d) {
+	int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+	__atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	int64_t t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+
+	if (t > b) {
+		__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	Task *task = __atomic_load_n(&d->buffer[b & (SCHED_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+	if (t == b) {
+		// Last one, race any thief for it
+		if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+			task = NULL;
+		}
+		__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+	}
+	return task;
+}
+
+static Task *deque_steal(TaskDeque *d) {
+	int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+	if (t >= b) {
+		return NULL;
+	}
+
+	Task *task = __atomic_load_n(&d->buffer[t & (SCHED_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+	if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+		return NULL;
+	}
+	return task;
+}
+
+static inline uint64_t sched_random(SchedCpu *sc) {
+	sc->rng ^= sc->rng << 13;
+	sc->rng ^= sc->rng >> 7;
+	sc->rng ^= sc->rng << 17;
+	return sc->rng;
+}
+
+static inline SchedCpu *sched_this_cpu(void) {
+	return &sched.cpus[this_cpu()->index];
+}
+
+static Task *sched_find_work(SchedCpu *sc, uint32_t self) {
+	Task *task = deque_pop(&sc->deque);
+	if (task || self >= sched.active) {
+		return task;
+	}
+
+	uint32_t active = sched.active;
+	if (active < 2) {
+		return NULL;
+	}
+	for (uint32_t i = 0; i < active * SCHED_STEAL_ROUNDS; i++) {
+		uint32_t victim = sched_random(sc) % active;
+		if (victim == self) {
+			continue;
+		}
+		task = deque_steal(&sched.cpus[victim].deque);
+		if (task) {
+			sc->stolen++;
+			return task;
+		}
+		sc->steal_failures++;
+	}
+	return NULL;
+}
+
+static void sched_run_task(SchedCpu *sc, Task *task) {
+	TaskGroup *group = task->group;
+	task->fn(task->arg, task->lo, task->hi);
+	kfree(task);
+	sc->executed++;
+	__atomic_sub_fetch(&group->pending, 1, __ATOMIC_RELEASE);
+}
+
+static bool sched_any_work(void) {
+	for (uint32_t i = 0; i < sched.active; i++) {
+		TaskDeque *d = &sched.cpus[i].deque;
+		if (__atomic_load_n(&d->top, __ATOMIC_ACQUIRE) < __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Between the slices of a block being zeroed. TLB shootdowns can't wait for
+// the whole block
+static bool sched_idle_busy(void) {
+	vm_poll();
+	return sched_any_work();
+}
+
+// Pairs with sched_wake: either this CPU sees the new work on its recheck, or
+// the pusher sees it counted as a sleeper and wakes it. Pending log records
+// go out first, then the CPU clears a block for the zeroed page pool and
+// comes back to look for work rather than sleep, until the pool is full
+static void sched_idle(SchedCpu *sc, uint32_t self) {
+	log_drain();
+	if (pmm_zero_idle(sched_idle_busy)) {
+		return;
+	}
+	__atomic_store_n(&sc->sleeping, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&sched.sleepers, 1, __ATOMIC_SEQ_CST);
+
+	if (sched.use_mwait) {
+		cpu_monitor(&sched.wake_epoch);
+		if (!(self < sched.active && sched_any_work())) {
+			cpu_sti_mwait(0);
+		}
+	} else if (!(self < sched.active && sched_any_work()) && __atomic_load_n(&sc->sleeping, __ATOMIC_ACQUIRE)) {
+		cpu_sti_halt();
+	}
+
+	__atomic_store_n(&sc->sleeping, 0, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&sched.sleepers, 1, __ATOMIC_SEQ_CST);
+	sc->sleeps++;
+}
+
+static void sched_wake(void) {
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&sched.sleepers, __ATOMIC_RELAXED)) {
+		return;
+	}
+
+	if (sched.use_mwait) {
+		// Every sleeper is monitoring this line, one store wakes them all
+		__atomic_add_fetch(&sched.wake_epoch, 1, __ATOMIC_RELEASE);
+		return;
+	}
+
+	// One IPI is enough, whoever wakes steals and the wave spreads from there
+	for (uint32_t i = 0; i < sched.active; i++) {
+		uint32_t expected = 1;
+		if (__atomic_compare_exchange_n(&sched.cpus[i].sleeping, &expected, 0, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+			lapic_send_fixed(cpus[i]->apic_id, SCHED_WAKE_VECTOR);
+			return;
+		}
+	}
+}
+
+static void sched_wake_handler(InterruptFrame *frame) {
+	lapic_eoi();
+}
+
+static void sched_spawn_range(TaskGroup *group, TaskFn fn, void *arg, uint64_t lo, uint64_t hi) {
+	SchedCpu *sc = sched_this_cpu();
+	__atomic_add_fetch(&group->pending, 1, __ATOMIC_RELAXED);
+
+	Task *task = (Task *)kmalloc(sizeof(Task));
+	if (task) {
+		*task = (Task){ .fn = fn, .arg = arg, .lo = lo, .hi = hi, .group = group };
+		if (deque_push(&sc->deque, task)) {
+			sched_wake();
+			return;
+		}
+		kfree(task);
+	}
+
+	// Out of memory or deque space, run it right here instead
+	fn(arg, lo, hi);
+	__atomic_sub_fetch(&group->pending, 1, __ATOMIC_RELEASE);
+}
+
+// Queues fn(arg, 0, 0) on the calling CPU, where any idle CPU can steal it
+void sched_spawn(TaskGroup *group, TaskFn fn, void *arg) {
+	sched_spawn_range(group, fn, arg, 0, 0);
+}
+
+// Runs tasks, local or stolen, until everything spawned into the group has finished
+void sched_wait(TaskGroup *group) {
+	SchedCpu *sc = sched_this_cpu();
+	uint32_t self = this_cpu()->index;
+	while (__atomic_load_n(&group->pending, __ATOMIC_ACQUIRE)) {
+		Task *task = sched_find_work(sc, self);
+		if (task) {
+			sched_run_task(sc, task);
+		} else {
+			// The task being waited on may be waiting on this CPU's shootdowns
+			vm_poll();
+			cpu_pause();
+		}
+	}
+}
+
+typedef struct {
+	TaskFn body;
+	void *arg;
+	uint64_t grain;
+	TaskGroup group;
+} ParallelFor;
+
+// Splits in half until the range is grain sized, leaving the upper halves for thieves
+static void parallel_range(void *arg, uint64_t lo, uint64_t hi) {
+	ParallelFor *pf = (ParallelFor *)arg;
+	while (hi - lo > pf->grain) {
+		uint64_t mid = lo + (hi - lo) / 2;
+		sched_spawn_range(&pf->group, parallel_range, pf, mid, hi);
+		hi = mid;
+	}
+	pf->body(pf->arg, lo, hi);
+}
+
+// Calls body(arg, lo, hi) over disjoint pieces of [begin, end) no bigger than
+// grain, spread across the CPUs, and returns once all of them have run
+void parallel_for(uint64_t begin, uint64_t end, uint64_t grain, TaskFn body, void *arg) {
+	if (begin >= end) {
+		return;
+	}
+	ParallelFor pf = { .body = body, .arg = arg, .grain = grain ? grain : 1 };
+	parallel_range(&pf, begin, end);
+	sched_wait(&pf.group);
+}
+
+// Every CPU ends up here for good, the BSP once kernel_main is done with it.
+// APs wait for sched_init, which has to come after the heap
+void sched_worker(void) {
+	while (!__atomic_load_n(&sched.started, __ATOMIC_ACQUIRE)) {
+		cpu_pause();
+	}
+
+	uint32_t self = this_cpu()->index;
+	SchedCpu *sc = &sched.cpus[self];
+	for (;;) {
+		// Interrupts stay off while tasks keep coming
+		vm_poll();
+		Task *task = sched_find_work(sc, self);
+		if (task) {
+			sched_run_task(sc, task);
+		} else {
+			sched_idle(sc, self);
+		}
+	}
+}
+
+bool sched_init(uint32_t count) {
+	sched.cpu_count = count;
+	sched.active = count;
+	sched.use_mwait = (cpuid(1, 0).ecx >> 3) & 1;
+
+	uint64_t phys = pmm_alloc_zeroed(pmm_order_for(count * sizeof(SchedCpu)));
+	if (!phys) {
+		return false;
+	}
+	sched.cpus = (SchedCpu *)phys_to_virt(phys);
+
+	for (uint32_t i = 0; i < count; i++) {
+		SchedCpu *sc = &sched.cpus[i];
+		sc->deque.buffer = (Task **)kmalloc(SCHED_DEQUE_SIZE * sizeof(Task *));
+		if (!sc->deque.buffer) {
+			return false;
+		}
+		sc->rng = 0x9E3779B97F4A7C15ULL * (i + 1);
+	}
+
+	idt_set_handler(SCHED_WAKE_VECTOR, sched_wake_handler);
+	__atomic_store_n(&sched.started, 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+#ifdef SCHED_BENCH
+// Fork-join scaling benchmark: zeroes the same block of pages with 1..N CPUs
+// taking part and reports the best of a few runs for each. bench_sched.sh
+// collects the lines from serial
+#define SCHED_BENCH_ORDER 14
+#define SCHED_BENCH_GRAIN 16
+#define SCHED_BENCH_RUNS 5
+
+static void sched_bench_zero(void *arg, uint64_t lo, uint64_t hi) {
+	memset((char *)arg + lo * PAGE_SIZE, 0, (hi - lo) * PAGE_SIZE);
+}
+
+void sched_bench(void) {
+	uint64_t phys = pmm_alloc(SCHED_BENCH_ORDER);
+	if (!phys) {
+		kprintf("sched_bench: no memory\n");
+		return;
+	}
+	void *pages = phys_to_virt(phys);
+	uint64_t count = 1ULL << SCHED_BENCH_ORDER;
+
+	uint64_t base_ns = 0;
+	for (uint32_t k = 1; k <= sched.cpu_count; k++) {
+		sched.active = k;
+		uint64_t best = ~0ULL;
+		for (uint32_t run = 0; run < SCHED_BENCH_RUNS; run++) {
+			uint64_t start = rdtsc();
+			parallel_for(0, count, SCHED_BENCH_GRAIN, sched_bench_zero, pages);
+			uint64_t ticks = rdtsc() - start;
+			if (ticks < best) {
+				best = ticks;
+			}
+		}
+
+		uint64_t ns = tsc_to_ns(best);
+		if (k == 1) {
+			base_ns = ns;
+		}
+		uint64_t speedup = ns ? base_ns * 100 / ns : 0;
+		kprintf("sched_bench cpus %u ns %lu speedup %lu.%02lu\n", k, ns, speedup / 100, speedup % 100);
+	}
+	sched.active = sched.cpu_count;
+
+	for (uint32_t i = 0; i < sched.cpu_count; i++) {
+		SchedCpu *sc = &sched.cpus[i];
+		kprintf("sched_bench cpu %u executed %lu stolen %lu failed %lu sleeps %lu\n",
+			i, sc->executed, sc->stolen, sc->steal_failures, sc->sleeps);
+	}
+	kprintf("sched_bench end (%s idle)\n", sched.use_mwait ? "mwait" : "hlt");
+	pmm_free(phys, SCHED_BENCH_ORDER);
+}
+#endif
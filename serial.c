@@ -0,0 +1,144 @@
+// Polled 16550 on COM1, 115200 8N1. Everything kprintf prints is mirrored here
+// synchronously, waiting on the transmitter once per FIFO's worth rather than
+// per byte. Background output (log.c) goes through a transmit queue instead,
+// which serial_kick feeds to the UART as far as its FIFO has room and never
+// waits on. Queued bytes come in units that synchronous output doesn't split:
+// serial_write first finishes whichever unit is half sent
+
+#include "kernel.h"
+#include "cpu.h"
+
+#define COM1 0x3F8
+
+#define UART_DATA 0
+#define UART_IER  1
+#define UART_FCR  2
+#define UART_IIR  2
+#define UART_LCR  3
+#define UART_MCR  4
+#define UART_LSR  5
+
+#define UART_LCR_DLAB  0x80
+#define UART_LCR_8N1   0x03
+#define UART_LSR_THRE  0x20
+// Both bits read back set once the FCR write took, on a 16550A or later
+#define UART_IIR_FIFO  0xC0
+#define UART_FIFO_SIZE 16
+
+// Power of two
+#define SERIAL_QUEUE_SIZE 4096
+
+typedef struct {
+	// Each unit is a length byte followed by that many bytes
+	uint8_t buf[SERIAL_QUEUE_SIZE];
+	// Free-running
+	uint32_t head, tail;
+	// Bytes of the unit at tail that haven't gone out yet
+	uint32_t unit_left;
+} SerialQueue;
+
+Spinlock serial_lock;
+SerialQueue serial_tx;
+// Bytes the transmitter takes once THRE is set, 1 without a working FIFO
+uint32_t serial_fifo_size = 1;
+
+void serial_init(void) {
+	outb(COM1 + UART_IER, 0x00);
+	outb(COM1 + UART_LCR, UART_LCR_DLAB);
+	// Divisor 1 off the 115200 Hz base clock
+	outb(COM1 + UART_DATA, 0x01);
+	outb(COM1 + UART_IER, 0x00);
+	outb(COM1 + UART_LCR, UART_LCR_8N1);
+	// FIFOs on and cleared
+	outb(COM1 + UART_FCR, 0xC7);
+	// DTR + RTS
+	outb(COM1 + UART_MCR, 0x03);
+
+	serial_fifo_size = (inb(COM1 + UART_IIR) & UART_IIR_FIFO) == UART_IIR_FIFO ? UART_FIFO_SIZE : 1;
+}
+
+static bool serial_ready(void) {
+	return inb(COM1 + UART_LSR) & UART_LSR_THRE;
+}
+
+// room is what's left of the FIFO since the transmitter was last seen empty
+static void serial_putc(uint32_t *room, uint8_t ch) {
+	if (!*room) {
+		while (!serial_ready()) {
+			cpu_pause();
+		}
+		*room = serial_fifo_size;
+	}
+	outb(COM1 + UART_DATA, ch);
+	(*room)--;
+}
+
+static uint8_t serial_queue_pop(SerialQueue *q) {
+	if (!q->unit_left) {
+		q->unit_left = q->buf[q->tail++ & (SERIAL_QUEUE_SIZE - 1)];
+	}
+	q->unit_left--;
+	return q->buf[q->tail++ & (SERIAL_QUEUE_SIZE - 1)];
+}
+
+void serial_write(const char *str, size_t len) {
+	spin_lock(&serial_lock);
+	uint32_t room = 0;
+	SerialQueue *q = &serial_tx;
+	while (q->unit_left) {
+		serial_putc(&room, serial_queue_pop(q));
+	}
+	for (size_t i = 0; i < len; i++) {
+		if (str[i] == '\n') {
+			serial_putc(&room, '\r');
+		}
+		serial_putc(&room, str[i]);
+	}
+	spin_unlock(&serial_lock);
+}
+
+// Appends one unit of 1 to 255 bytes for serial_kick to send. Safe from
+// interrupts, and gives up rather than wait: returns false without queueing
+// anything when the queue is full or someone else holds the port
+bool serial_queue(const void *data, size_t len) {
+	uint64_t flags = irq_save();
+	if (!spin_trylock(&serial_lock)) {
+		irq_restore(flags);
+		return false;
+	}
+
+	SerialQueue *q = &serial_tx;
+	bool fits = len > 0 && len <= 0xFF && SERIAL_QUEUE_SIZE - (q->head - q->tail) >= len + 1;
+	if (fits) {
+		q->buf[q->head++ & (SERIAL_QUEUE_SIZE - 1)] = (uint8_t)len;
+		for (size_t i = 0; i < len; i++) {
+			q->buf[q->head++ & (SERIAL_QUEUE_SIZE - 1)] = ((const uint8_t *)data)[i];
+		}
+	}
+
+	spin_unlock(&serial_lock);
+	irq_restore(flags);
+	return fits;
+}
+
+// Moves queued bytes into the UART for as long as its FIFO keeps emptying.
+// Returns whether anything is still queued
+bool serial_kick(void) {
+	uint64_t flags = irq_save();
+	if (!spin_trylock(&serial_lock)) {
+		irq_restore(flags);
+		return true;
+	}
+
+	SerialQueue *q = &serial_tx;
+	while (q->tail != q->head && serial_ready()) {
+		for (uint32_t n = 0; n < serial_fifo_size && q->tail != q->head; n++) {
+			outb(COM1 + UART_DATA, serial_queue_pop(q));
+		}
+	}
+	bool pending = q->tail != q->head;
+
+	spin_unlock(&serial_lock);
+	irq_restore(flags);
+	return pending;
+}
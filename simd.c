@@ -0,0 +1,120 @@
+// Extended (FPU/SSE/AVX) register state. The kernel is compiled without SIMD,
+// so ordinary code never leaves anything live in those registers, only the
+// vector routines between simd_begin and simd_end do. interrupt_common calls
+// simd_save only when it lands inside such a bracket, every other interrupt
+// skips the save entirely, and a handler is free to use vector code of its own.
+//
+// Each CPU saves into one of a few fixed areas, picked by interrupt nesting
+// depth. Because an area is reused at the same address, XSAVEOPT and XSAVES
+// can leave out components that have not changed since the last restore from
+// it. They also leave out components in their init state, so YMM uppers
+// cleared by vzeroupper cost nothing. XSAVES additionally packs the area.
+
+#include "kernel.h"
+#include "cpu.h"
+
+// Areas per CPU: an interrupt, an exception raised by its handler, then NMI
+// and machine check on top. Interrupt gates rule out anything deeper
+#define SIMD_SAVE_LEVELS 4
+
+#define SIMD_FXSAVE_SIZE 512
+#define SIMD_AREA_ALIGN 64
+
+// CPUID leaf 0xD subleaf 1, eax
+#define XSAVE_HAS_XSAVEOPT (1 << 0)
+#define XSAVE_HAS_XSAVES (1 << 3)
+
+typedef enum {
+	SimdFxsave,
+	SimdXsave,
+	SimdXsaveopt,
+	SimdXsaves,
+} SimdMode;
+
+static const char *simd_mode_names[] = { "fxsave", "xsave", "xsaveopt", "xsaves" };
+
+SimdMode simd_mode;
+uint32_t simd_area_size;
+// Components the loader enabled, all of them are saved
+uint64_t simd_xcr0;
+
+// Returns the virtual address of a zeroed set of save areas near node, or NULL.
+// XRSTOR rejects a header with reserved bytes set, zeroing covers the first save
+uint8_t *simd_alloc(uint32_t node) {
+	uint64_t size = (uint64_t)simd_area_size * SIMD_SAVE_LEVELS;
+	uint64_t phys = pmm_alloc_zeroed_node(pmm_order_for(size), node);
+	return phys ? (uint8_t *)phys_to_virt(phys) : NULL;
+}
+
+// Picks the save instruction from what the loader turned on, and gives the
+// calling CPU its areas. Until this runs interrupts don't save anything
+bool simd_init(void) {
+	if (!((cpuid(1, 0).ecx >> 27) & 1)) {
+		// No OSXSAVE, so only x87 and SSE are enabled
+		simd_mode = SimdFxsave;
+		simd_area_size = SIMD_FXSAVE_SIZE;
+	} else {
+		simd_xcr0 = xgetbv(0);
+		CpuidRegs features = cpuid(0xD, 1);
+		// IA32_XSS is left at its reset value of 0, so XSAVES covers exactly
+		// XCR0 and the compacted size in ebx is for those components alone
+		if (features.eax & XSAVE_HAS_XSAVES) {
+			simd_mode = SimdXsaves;
+			simd_area_size = features.ebx;
+		} else {
+			simd_mode = (features.eax & XSAVE_HAS_XSAVEOPT) ? SimdXsaveopt : SimdXsave;
+			simd_area_size = cpuid(0xD, 0).ebx;
+		}
+	}
+	simd_area_size = (simd_area_size + SIMD_AREA_ALIGN - 1) & ~(SIMD_AREA_ALIGN - 1);
+
+	PerCpu *cpu = this_cpu();
+	cpu->simd_area = simd_alloc(cpu->node);
+	return cpu->simd_area != NULL;
+}
+
+// Called by interrupt_common when it interrupted an open simd_begin bracket.
+// Returns the area to hand back to simd_restore, NULL if nothing was saved
+void *simd_save(void) {
+	PerCpu *cpu = this_cpu();
+	if (!cpu->simd_area) {
+		return NULL;
+	}
+	if (cpu->simd_nest >= SIMD_SAVE_LEVELS) {
+		kprintf("lunk: SIMD save areas exhausted on CPU %u\n", cpu->index);
+		halt_forever();
+	}
+
+	uint8_t *area = cpu->simd_area + cpu->simd_nest++ * simd_area_size;
+	switch (simd_mode) {
+		case SimdXsaves:
+			__asm__ volatile ("xsaves64 (%0)" :: "r"(area), "a"(~0U), "d"(~0U) : "memory");
+			break;
+		case SimdXsaveopt:
+			__asm__ volatile ("xsaveopt64 (%0)" :: "r"(area), "a"(~0U), "d"(~0U) : "memory");
+			break;
+		case SimdXsave:
+			__asm__ volatile ("xsave64 (%0)" :: "r"(area), "a"(~0U), "d"(~0U) : "memory");
+			break;
+		case SimdFxsave:
+			__asm__ volatile ("fxsave64 (%0)" :: "r"(area) : "memory");
+			break;
+	}
+	return area;
+}
+
+void simd_restore(void *area) {
+	switch (simd_mode) {
+		case SimdXsaves:
+			__asm__ volatile ("xrstors64 (%0)" :: "r"(area), "a"(~0U), "d"(~0U) : "memory");
+			break;
+		case SimdXsaveopt:
+		case SimdXsave:
+			__asm__ volatile ("xrstor64 (%0)" :: "r"(area), "a"(~0U), "d"(~0U) : "memory");
+			break;
+		case SimdFxsave:
+			__asm__ volatile ("fxrstor64 (%0)" :: "r"(area) : "memory");
+			break;
+	}
+	this_cpu()->simd_nest--;
+}
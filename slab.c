@@ -0,0 +1,54 @@
+// Kernel heap: the slab allocator from slab.h on top of the buddy allocator.
+// kmalloc serves 16 B to 8 KiB, anything bigger should go to pmm_alloc directly.
+// Interrupts are held off around each call since the magazines belong to
+// whichever CPU is running, and a handler on the same CPU would share them.
+
+#include "kernel.h"
+#include "cpu.h"
+#include "slab.h"
+
+SlabAllocator heap;
+
+static void *heap_page_alloc(void *ctx, uint32_t order) {
+	uint64_t phys = pmm_alloc(order);
+	return phys ? phys_to_virt(phys) : NULL;
+}
+
+static void heap_page_free(void *ctx, void *pages, uint32_t order) {
+	pmm_free(virt_to_phys(pages), order);
+}
+
+// Needs GS set up on every CPU that will allocate, so this comes after smp_init
+bool heap_init(uint32_t cpus) {
+	SlabPageSource pages = {
+		.alloc = heap_page_alloc,
+		.free = heap_page_free,
+	};
+	return slab_init(&heap, pages, cpus);
+}
+
+// NULL when out of memory or past SLAB_MAX_SIZE. Always 16 byte aligned
+void *kmalloc(size_t size) {
+	uint64_t flags = irq_save();
+	void *obj = slab_alloc(&heap, this_cpu()->index, size);
+	irq_restore(flags);
+	return obj;
+}
+
+void *kzalloc(size_t size) {
+	void *obj = kmalloc(size);
+	if (obj) {
+		memset(obj, 0, size);
+	}
+	return obj;
+}
+
+void kfree(void *obj) {
+	uint64_t flags = irq_save();
+	slab_free(&heap, this_cpu()->index, obj);
+	irq_restore(flags);
+}
+
+void heap_stats(SlabStats *stats) {
+	slab_stats(&heap, stats);
+}
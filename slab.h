@@ -0,0 +1,453 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "kernel.h"
+
+// Small-object allocator, shared by the kernel heap (slab.c) and the host
+// benchmark (slab_bench.c). Objects from 16 B to 8 KiB are carved out of
+// naturally aligned 64 KiB slabs, so free() finds an object's slab by masking
+// the pointer. In front of the slabs sit Bonwick-style magazines: every CPU has
+// a loaded and a previous magazine per size class, and allocs and frees that
+// hit them touch nothing shared. Only swapping magazines with the class's depot
+// or falling through to the slabs takes the class lock.
+// The caller supplies pages and its CPU index, memset comes from whoever includes this
+
+#define SLAB_ORDER 4
+#define SLAB_SIZE (PAGE_SIZE << SLAB_ORDER)
+
+#define SLAB_MIN_SIZE 16
+#define SLAB_MAX_SIZE 8192
+#define SLAB_CLASSES 18
+
+// A magazine is exactly 256 bytes, one of the size classes
+#define SLAB_MAG_SIZE 30
+// Big classes use only part of each magazine, so no magazine parks more than this
+#define SLAB_MAG_MAX_BYTES (32 * 1024)
+#define SLAB_MAG_MIN_FILL 4
+// Full magazines parked per class before frees start going back to the slabs
+#define SLAB_DEPOT_MAX 8
+
+typedef struct {
+	// PAGE_SIZE << order bytes aligned to their own size, NULL when out of memory
+	void *(*alloc)(void *ctx, uint32_t order);
+	void (*free)(void *ctx, void *pages, uint32_t order);
+	void *ctx;
+} SlabPageSource;
+
+typedef struct SlabObject {
+	struct SlabObject *next;
+} SlabObject;
+
+struct SlabClass;
+
+// Lives at the start of its slab, the first object starts on the next cache line
+typedef struct Slab {
+	// Only slabs with free objects are on their class's list, full ones have next == NULL
+	struct Slab *next, *prev;
+	struct SlabClass *cls;
+	SlabObject *free;
+	// Offset of the first object never handed out, new slabs aren't threaded up front
+	uint32_t fresh;
+	uint32_t in_use;
+} __attribute__((aligned(CACHE_LINE_SIZE))) Slab;
+
+typedef struct SlabMagazine {
+	struct SlabMagazine *next;
+	uint32_t count;
+	void *objs[SLAB_MAG_SIZE];
+} SlabMagazine;
+
+_Static_assert(sizeof(SlabMagazine) == 256, "magazines are allocated from the 256 byte class");
+
+typedef struct SlabClass {
+	uint32_t size;
+	uint32_t capacity;
+	uint32_t mag_capacity;
+	Spinlock lock;
+
+	Slab partial;
+	// One completely free slab is kept back so a class sitting at a slab
+	// boundary doesn't bounce pages off the page source
+	Slab *spare;
+	uint64_t slabs;
+
+	// The depot: magazines not loaded on any CPU
+	SlabMagazine *full_mags;
+	SlabMagazine *empty_mags;
+	uint32_t full_mag_count;
+	uint32_t empty_mag_count;
+} __attribute__((aligned(CACHE_LINE_SIZE))) SlabClass;
+
+typedef struct {
+	SlabMagazine *loaded;
+	SlabMagazine *previous;
+	uint64_t allocs;
+	uint64_t frees;
+	// Trips past the magazines, to the depot or the slabs
+	uint64_t misses;
+} SlabCpuCache;
+
+typedef struct {
+	SlabCpuCache classes[SLAB_CLASSES];
+} __attribute__((aligned(CACHE_LINE_SIZE))) SlabCpu;
+
+typedef struct {
+	SlabPageSource pages;
+	SlabClass classes[SLAB_CLASSES];
+	SlabCpu *cpus;
+	uint32_t cpu_count;
+	uint32_t cpus_order;
+	// Magazines come out of the class with this index
+	uint32_t mag_class;
+	// Class for each size rounded up to 16 bytes
+	uint8_t class_index[SLAB_MAX_SIZE / SLAB_MIN_SIZE + 1];
+} SlabAllocator;
+
+typedef struct {
+	uint32_t size;
+	uint32_t objects_per_slab;
+	uint64_t slabs;
+	uint64_t allocs;
+	uint64_t frees;
+	uint64_t misses;
+	// Objects parked in magazines, free but not back in their slabs
+	uint64_t cached;
+} SlabClassStats;
+
+typedef struct {
+	SlabClassStats classes[SLAB_CLASSES];
+	uint64_t slab_bytes;
+	uint64_t magazines;
+	// Live objects times their class size
+	uint64_t in_use_bytes;
+} SlabStats;
+
+static const uint32_t slab_class_sizes[SLAB_CLASSES] = {
+	16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3072, 4096, 6144, 8192,
+};
+
+static inline Slab *slab_of(void *obj) {
+	return (Slab *)((uintptr_t)obj & ~(uintptr_t)(SLAB_SIZE - 1));
+}
+
+static inline void slab_list_push(Slab *head, Slab *slab) {
+	slab->next = head->next;
+	slab->prev = head;
+	head->next->prev = slab;
+	head->next = slab;
+}
+
+static inline void slab_list_remove(Slab *slab) {
+	slab->prev->next = slab->next;
+	slab->next->prev = slab->prev;
+	slab->next = slab->prev = NULL;
+}
+
+// Everything below up to slab_alloc runs with the class lock held
+
+static Slab *slab_new(SlabAllocator *a, SlabClass *cls) {
+	Slab *slab = (Slab *)a->pages.alloc(a->pages.ctx, SLAB_ORDER);
+	if (!slab) {
+		return NULL;
+	}
+	slab->cls = cls;
+	slab->free = NULL;
+	slab->fresh = sizeof(Slab);
+	slab->in_use = 0;
+	cls->slabs++;
+	return slab;
+}
+
+static void *slab_class_alloc(SlabAllocator *a, SlabClass *cls) {
+	Slab *slab = cls->partial.next;
+	if (slab == &cls->partial) {
+		slab = cls->spare;
+		cls->spare = NULL;
+		if (!slab && !(slab = slab_new(a, cls))) {
+			return NULL;
+		}
+		slab_list_push(&cls->partial, slab);
+	}
+
+	void *obj;
+	if (slab->free) {
+		obj = slab->free;
+		slab->free = slab->free->next;
+	} else {
+		obj = (char *)slab + slab->fresh;
+		slab->fresh += cls->size;
+	}
+
+	if (++slab->in_use == cls->capacity) {
+		slab_list_remove(slab);
+	}
+	return obj;
+}
+
+static void slab_class_free(SlabAllocator *a, SlabClass *cls, void *obj) {
+	Slab *slab = slab_of(obj);
+	SlabObject *o = (SlabObject *)obj;
+	o->next = slab->free;
+	slab->free = o;
+
+	if (slab->in_use-- == cls->capacity) {
+		slab_list_push(&cls->partial, slab);
+	}
+	if (slab->in_use) {
+		return;
+	}
+
+	// Fully free, keep one around and hand the rest back
+	slab_list_remove(slab);
+	if (!cls->spare) {
+		cls->spare = slab;
+		return;
+	}
+	cls->slabs--;
+	a->pages.free(a->pages.ctx, slab, SLAB_ORDER);
+}
+
+// Magazines never go back to the page source, there are only ever a few per CPU and class
+static SlabMagazine *slab_magazine_new(SlabAllocator *a) {
+	SlabClass *cls = &a->classes[a->mag_class];
+	spin_lock(&cls->lock);
+	SlabMagazine *mag = (SlabMagazine *)slab_class_alloc(a, cls);
+	spin_unlock(&cls->lock);
+	if (mag) {
+		mag->next = NULL;
+		mag->count = 0;
+	}
+	return mag;
+}
+
+// Both magazines are empty (or missing). Swaps in a full one from the depot, or
+// failing that fills the loaded magazine straight from the slabs in one go
+static bool slab_reload(SlabAllocator *a, SlabClass *cls, SlabCpuCache *cc) {
+	spin_lock(&cls->lock);
+	if (cls->full_mags) {
+		SlabMagazine *full = cls->full_mags;
+		cls->full_mags = full->next;
+		cls->full_mag_count--;
+
+		if (cc->previous) {
+			cc->previous->next = cls->empty_mags;
+			cls->empty_mags = cc->previous;
+			cls->empty_mag_count++;
+		}
+		cc->previous = cc->loaded;
+		cc->loaded = full;
+		spin_unlock(&cls->lock);
+		return true;
+	}
+
+	if (!cc->loaded && cls->empty_mags) {
+		cc->loaded = cls->empty_mags;
+		cls->empty_mags = cc->loaded->next;
+		cls->empty_mag_count--;
+	}
+	spin_unlock(&cls->lock);
+
+	if (!cc->loaded && !(cc->loaded = slab_magazine_new(a))) {
+		return false;
+	}
+
+	// Half full, so a free straight after doesn't immediately need another swap
+	SlabMagazine *mag = cc->loaded;
+	spin_lock(&cls->lock);
+	while (mag->count < cls->mag_capacity / 2) {
+		void *obj = slab_class_alloc(a, cls);
+		if (!obj) {
+			break;
+		}
+		mag->objs[mag->count++] = obj;
+	}
+	spin_unlock(&cls->lock);
+	return mag->count > 0;
+}
+
+// Both magazines are full (or missing). Parks the previous one in the depot and
+// loads an empty one, once the depot is at its cap the previous one is emptied
+// back into the slabs instead so free memory can make it back to the page source
+static bool slab_unload(SlabAllocator *a, SlabClass *cls, SlabCpuCache *cc) {
+	spin_lock(&cls->lock);
+	SlabMagazine *empty = NULL;
+	if (cc->previous && cls->full_mag_count >= SLAB_DEPOT_MAX) {
+		empty = cc->previous;
+		for (uint32_t i = 0; i < empty->count; i++) {
+			slab_class_free(a, cls, empty->objs[i]);
+		}
+		empty->count = 0;
+		cc->previous = NULL;
+	} else if (cls->empty_mags) {
+		empty = cls->empty_mags;
+		cls->empty_mags = empty->next;
+		cls->empty_mag_count--;
+	}
+	spin_unlock(&cls->lock);
+
+	if (!empty && !(empty = slab_magazine_new(a))) {
+		return false;
+	}
+
+	spin_lock(&cls->lock);
+	if (cc->previous) {
+		cc->previous->next = cls->full_mags;
+		cls->full_mags = cc->previous;
+		cls->full_mag_count++;
+	}
+	cc->previous = cc->loaded;
+	cc->loaded = empty;
+	spin_unlock(&cls->lock);
+	return true;
+}
+
+static bool slab_init(SlabAllocator *a, SlabPageSource pages, uint32_t cpu_count) {
+	memset(a, 0, sizeof(*a));
+	a->pages = pages;
+	a->cpu_count = cpu_count ? cpu_count : 1;
+
+	uint32_t c = 0;
+	for (uint32_t i = 0; i < SLAB_CLASSES; i++) {
+		SlabClass *cls = &a->classes[i];
+		cls->size = slab_class_sizes[i];
+		cls->capacity = (SLAB_SIZE - sizeof(Slab)) / cls->size;
+		cls->partial.next = cls->partial.prev = &cls->partial;
+
+		cls->mag_capacity = SLAB_MAG_MAX_BYTES / cls->size;
+		if (cls->mag_capacity > SLAB_MAG_SIZE) {
+			cls->mag_capacity = SLAB_MAG_SIZE;
+		} else if (cls->mag_capacity < SLAB_MAG_MIN_FILL) {
+			cls->mag_capacity = SLAB_MAG_MIN_FILL;
+		}
+
+		for (; c * SLAB_MIN_SIZE <= cls->size; c++) {
+			a->class_index[c] = i;
+		}
+		if (cls->size == sizeof(SlabMagazine)) {
+			a->mag_class = i;
+		}
+	}
+
+	size_t cpus_size = a->cpu_count * sizeof(SlabCpu);
+	while (((uint64_t)PAGE_SIZE << a->cpus_order) < cpus_size) {
+		a->cpus_order++;
+	}
+	a->cpus = (SlabCpu *)pages.alloc(pages.ctx, a->cpus_order);
+	if (!a->cpus) {
+		return false;
+	}
+	memset(a->cpus, 0, cpus_size);
+	return true;
+}
+
+// `cpu` picks the magazines, it must be the caller's own and stay that way until this returns
+static void *slab_alloc(SlabAllocator *a, uint32_t cpu, size_t size) {
+	if (size > SLAB_MAX_SIZE) {
+		return NULL;
+	}
+	uint32_t index = a->class_index[(size + SLAB_MIN_SIZE - 1) / SLAB_MIN_SIZE];
+	SlabCpuCache *cc = &a->cpus[cpu].classes[index];
+
+	for (;;) {
+		SlabMagazine *mag = cc->loaded;
+		if (mag && mag->count) {
+			cc->allocs++;
+			return mag->objs[--mag->count];
+		}
+		if (cc->previous && cc->previous->count) {
+			cc->loaded = cc->previous;
+			cc->previous = mag;
+			continue;
+		}
+
+		cc->misses++;
+		if (!slab_reload(a, &a->classes[index], cc)) {
+			break;
+		}
+	}
+
+	// No magazine to be had, take one object straight from the slabs
+	SlabClass *cls = &a->classes[index];
+	spin_lock(&cls->lock);
+	void *obj = slab_class_alloc(a, cls);
+	spin_unlock(&cls->lock);
+	if (obj) {
+		cc->allocs++;
+	}
+	return obj;
+}
+
+static void slab_free(SlabAllocator *a, uint32_t cpu, void *obj) {
+	if (!obj) {
+		return;
+	}
+	SlabClass *cls = slab_of(obj)->cls;
+	SlabCpuCache *cc = &a->cpus[cpu].classes[cls - a->classes];
+	cc->frees++;
+
+	for (;;) {
+		SlabMagazine *mag = cc->loaded;
+		if (mag && mag->count < cls->mag_capacity) {
+			mag->objs[mag->count++] = obj;
+			return;
+		}
+		if (cc->previous && cc->previous->count < cls->mag_capacity) {
+			cc->loaded = cc->previous;
+			cc->previous = mag;
+			continue;
+		}
+
+		cc->misses++;
+		if (!slab_unload(a, cls, cc)) {
+			break;
+		}
+	}
+
+	spin_lock(&cls->lock);
+	slab_class_free(a, cls, obj);
+	spin_unlock(&cls->lock);
+}
+
+// Per-CPU counters are read without stopping their owners, so the totals are a
+// snapshot that can be a few operations stale
+static void slab_stats(SlabAllocator *a, SlabStats *stats) {
+	memset(stats, 0, sizeof(*stats));
+	for (uint32_t i = 0; i < SLAB_CLASSES; i++) {
+		SlabClass *cls = &a->classes[i];
+		SlabClassStats *s = &stats->classes[i];
+		s->size = cls->size;
+		s->objects_per_slab = cls->capacity;
+
+		spin_lock(&cls->lock);
+		s->slabs = cls->slabs;
+		s->cached = (uint64_t)cls->full_mag_count * cls->mag_capacity;
+		stats->magazines += cls->full_mag_count + cls->empty_mag_count;
+		spin_unlock(&cls->lock);
+
+		for (uint32_t c = 0; c < a->cpu_count; c++) {
+			SlabCpuCache *cc = &a->cpus[c].classes[i];
+			s->allocs += __atomic_load_n(&cc->allocs, __ATOMIC_RELAXED);
+			s->frees += __atomic_load_n(&cc->frees, __ATOMIC_RELAXED);
+			s->misses += __atomic_load_n(&cc->misses, __ATOMIC_RELAXED);
+
+			SlabMagazine *loaded = __atomic_load_n(&cc->loaded, __ATOMIC_RELAXED);
+			SlabMagazine *previous = __atomic_load_n(&cc->previous, __ATOMIC_RELAXED);
+			if (loaded) {
+				s->cached += __atomic_load_n(&loaded->count, __ATOMIC_RELAXED);
+				stats->magazines++;
+			}
+			if (previous) {
+				s->cached += __atomic_load_n(&previous->count, __ATOMIC_RELAXED);
+				stats->magazines++;
+			}
+		}
+
+		stats->slab_bytes += s->slabs * SLAB_SIZE;
+		if (s->allocs > s->frees) {
+			stats->in_use_bytes += (s->allocs - s->frees) * s->size;
+		}
+	}
+}
@@ -0,0 +1,199 @@
+// Host-side microbenchmark: the kernel's slab allocator (slab.h) against the C
+// library's malloc, with one thread standing in for each CPU. Two workloads:
+// "batch" allocates runs of objects and frees them newest first, which the
+// magazines should absorb entirely, and "random" replaces random slots of a
+// large live set, which keeps slabs partially full and exercises the depot.
+// Every object is tagged on alloc and checked on free.
+//
+// Usage: slab_bench [threads] [ops per thread]
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "slab.h"
+
+#define BATCH 64
+#define LIVE_SET 4096
+
+typedef enum {
+	AllocSlab,
+	AllocMalloc,
+} AllocKind;
+
+typedef enum {
+	WorkBatch,
+	WorkRandom,
+} WorkKind;
+
+typedef struct {
+	pthread_t thread;
+	uint32_t cpu;
+	uint64_t ops;
+	AllocKind alloc;
+	WorkKind work;
+	uint64_t errors;
+} Worker;
+
+SlabAllocator bench_slab;
+pthread_barrier_t bench_start;
+
+static void *host_page_alloc(void *ctx, uint32_t order) {
+	size_t size = (size_t)PAGE_SIZE << order;
+	return aligned_alloc(size, size);
+}
+
+static void host_page_free(void *ctx, void *pages, uint32_t order) {
+	free(pages);
+}
+
+static inline uint64_t xorshift(uint64_t *s) {
+	*s ^= *s << 13;
+	*s ^= *s >> 7;
+	*s ^= *s << 17;
+	return *s;
+}
+
+// Mostly small objects with a tail out to the largest class, roughly what a kernel sees
+static inline size_t pick_size(uint64_t *rng) {
+	uint64_t r = xorshift(rng);
+	if ((r & 7) != 0) {
+		return (r >> 8) % 256 + 16;
+	}
+	return (r >> 8) % (SLAB_MAX_SIZE - 16) + 16;
+}
+
+static inline void *bench_alloc(Worker *w, size_t size) {
+	void *p = w->alloc == AllocSlab ? slab_alloc(&bench_slab, w->cpu, size) : malloc(size);
+	// Tag the first and last word with the owner, an overlapping object would clobber one
+	uint64_t tag = (uint64_t)p ^ size;
+	memcpy(p, &tag, sizeof(tag));
+	memcpy((char *)p + size - sizeof(tag), &tag, sizeof(tag));
+	return p;
+}
+
+static inline void bench_free(Worker *w, void *p, size_t size) {
+	uint64_t head, tail, tag = (uint64_t)p ^ size;
+	memcpy(&head, p, sizeof(head));
+	memcpy(&tail, (char *)p + size - sizeof(tail), sizeof(tail));
+	if (head != tag || tail != tag) {
+		w->errors++;
+	}
+	if (w->alloc == AllocSlab) {
+		slab_free(&bench_slab, w->cpu, p);
+	} else {
+		free(p);
+	}
+}
+
+static void *worker_main(void *arg) {
+	Worker *w = (Worker *)arg;
+	uint64_t rng = 0x9E3779B97F4A7C15ULL * (w->cpu + 1);
+	pthread_barrier_wait(&bench_start);
+
+	if (w->work == WorkBatch) {
+		void *objs[BATCH];
+		size_t sizes[BATCH];
+		for (uint64_t done = 0; done < w->ops; done += BATCH) {
+			for (size_t i = 0; i < BATCH; i++) {
+				sizes[i] = pick_size(&rng);
+				objs[i] = bench_alloc(w, sizes[i]);
+			}
+			for (size_t i = BATCH; i-- > 0;) {
+				bench_free(w, objs[i], sizes[i]);
+			}
+		}
+	} else {
+		void **objs = calloc(LIVE_SET, sizeof(void *));
+		size_t *sizes = calloc(LIVE_SET, sizeof(size_t));
+		for (uint64_t done = 0; done < w->ops; done++) {
+			size_t slot = xorshift(&rng) % LIVE_SET;
+			if (objs[slot]) {
+				bench_free(w, objs[slot], sizes[slot]);
+			}
+			sizes[slot] = pick_size(&rng);
+			objs[slot] = bench_alloc(w, sizes[slot]);
+		}
+		for (size_t i = 0; i < LIVE_SET; i++) {
+			if (objs[i]) {
+				bench_free(w, objs[i], sizes[i]);
+			}
+		}
+		free(objs);
+		free(sizes);
+	}
+	return NULL;
+}
+
+static double now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Wall time per alloc+free pair on each thread
+static double run(AllocKind alloc, WorkKind work, uint32_t threads, uint64_t ops, uint64_t *errors) {
+	Worker *workers = calloc(threads, sizeof(Worker));
+	pthread_barrier_init(&bench_start, NULL, threads + 1);
+	for (uint32_t i = 0; i < threads; i++) {
+		workers[i] = (Worker){ .cpu = i, .ops = ops, .alloc = alloc, .work = work };
+		pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+	}
+
+	pthread_barrier_wait(&bench_start);
+	double start = now_ns();
+	for (uint32_t i = 0; i < threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		*errors += workers[i].errors;
+	}
+	double elapsed = now_ns() - start;
+
+	pthread_barrier_destroy(&bench_start);
+	free(workers);
+	return elapsed / ops;
+}
+
+int main(int argc, char **argv) {
+	uint32_t max_threads = argc > 1 ? (uint32_t)atoi(argv[1]) : 4;
+	uint64_t ops = argc > 2 ? strtoull(argv[2], NULL, 0) : 4000000;
+	if (max_threads == 0) {
+		max_threads = 1;
+	}
+
+	SlabPageSource pages = {
+		.alloc = host_page_alloc,
+		.free = host_page_free,
+	};
+	if (!slab_init(&bench_slab, pages, max_threads)) {
+		fprintf(stderr, "slab_init failed\n");
+		return 1;
+	}
+
+	static const char *work_names[] = { "batch", "random" };
+	uint64_t errors = 0;
+	printf("%-8s %8s %14s %14s %8s\n", "work", "threads", "slab ns/op", "malloc ns/op", "speedup");
+	for (WorkKind work = WorkBatch; work <= WorkRandom; work++) {
+		for (uint32_t threads = 1; threads <= max_threads; threads *= 2) {
+			double slab = run(AllocSlab, work, threads, ops, &errors);
+			double libc = run(AllocMalloc, work, threads, ops, &errors);
+			printf("%-8s %8u %14.1f %14.1f %7.2fx\n", work_names[work], threads, slab, libc, libc / slab);
+		}
+	}
+
+	SlabStats stats;
+	slab_stats(&bench_slab, &stats);
+	printf("\n%-6s %8s %12s %12s %10s %8s\n", "class", "slabs", "allocs", "frees", "misses", "cached");
+	for (uint32_t i = 0; i < SLAB_CLASSES; i++) {
+		SlabClassStats *s = &stats.classes[i];
+		printf("%-6u %8lu %12lu %12lu %10lu %8lu\n", s->size, s->slabs, s->allocs, s->frees, s->misses, s->cached);
+	}
+	printf("slab memory %lu KiB, %lu magazines, %lu bytes live\n", stats.slab_bytes >> 10, stats.magazines, stats.in_use_bytes);
+
+	if (errors) {
+		printf("%lu corrupted objects\n", errors);
+		return 1;
+	}
+	return 0;
+}
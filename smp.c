@@ -0,0 +1,169 @@
+// Application processor bring-up. Each AP is started with INIT-SIPI-SIPI into the
+// real-mode trampoline in loader.bin, which switches to long mode on the kernel's
+// page tables and calls ap_main on a stack allocated here. APs come up one at a
+// time since they all share the single ApParams block.
+//
+// An AP that misses its start is sent INIT, which parks it in wait-for-SIPI
+// for good. It may have read ApParams already, so its PerCpu, stack and
+// per-CPU areas stay allocated and are never handed to another CPU.
+
+#include "kernel.h"
+#include "boot_info.h"
+#include "cpu.h"
+
+// 16 KiB per AP
+#define SMP_STACK_ORDER 2
+
+// Intel's MP spec delays
+#define SMP_INIT_DELAY_US  10000
+#define SMP_SIPI_DELAY_US  200
+#define SMP_START_TIMEOUT_US 100000
+#define SMP_POLL_US 100
+
+// Each CPU's PerCpu is allocated near it, the online ones are [0, cpu_count)
+PerCpu **cpus;
+uint32_t cpu_count;
+volatile uint32_t cpus_online;
+bool percpu_ready;
+
+// Stands in for cpus[0] until smp_init, so the GS base is valid for simd_begin
+// from kernel_main's first line
+PerCpu boot_cpu = { .self = &boot_cpu };
+
+void sched_worker(void);
+struct LogCpu *log_alloc(uint32_t node);
+struct VmCpu *vm_cpu_alloc(uint32_t node);
+void vm_cpu_init(void);
+
+void smp_set_gs(PerCpu *cpu) {
+	wrmsr(MSR_GS_BASE, (uint64_t)cpu);
+}
+
+void ap_main(PerCpu *cpu) {
+	smp_set_gs(cpu);
+	idt_load();
+	vm_cpu_init();
+	lapic_enable();
+	__atomic_add_fetch(&cpus_online, 1, __ATOMIC_RELEASE);
+
+	sched_worker();
+}
+
+// Waits up to timeout_us for *flag to become nonzero
+static bool smp_wait(volatile uint32_t *flag, uint64_t timeout_us) {
+	for (uint64_t waited = 0; waited < timeout_us; waited += SMP_POLL_US) {
+		if (__atomic_load_n(flag, __ATOMIC_ACQUIRE)) {
+			return true;
+		}
+		pit_delay_us(SMP_POLL_US);
+	}
+	return __atomic_load_n(flag, __ATOMIC_ACQUIRE) != 0;
+}
+
+static PerCpu *smp_alloc_cpu(uint32_t node) {
+	uint64_t phys = pmm_alloc_zeroed_node(pmm_order_for(sizeof(PerCpu)), node);
+	if (!phys) {
+		return NULL;
+	}
+	PerCpu *cpu = (PerCpu *)phys_to_virt(phys);
+	cpu->self = cpu;
+	cpu->node = node;
+	return cpu;
+}
+
+static bool smp_start_ap(BootInfo *info, PerCpu *cpu) {
+	cpu->simd_area = simd_alloc(cpu->node);
+	cpu->log = log_alloc(cpu->node);
+	cpu->vm = vm_cpu_alloc(cpu->node);
+	if (!cpu->simd_area || !cpu->log || !cpu->vm) {
+		return false;
+	}
+	uint64_t stack = pmm_alloc_node(SMP_STACK_ORDER, cpu->node);
+	if (!stack) {
+		return false;
+	}
+	cpu->stack_top = (uint64_t)phys_to_virt(stack) + (PAGE_SIZE << SMP_STACK_ORDER);
+
+	ApParams *params = (ApParams *)phys_to_virt(AP_PARAMS);
+	params->cr3 = info->page_table_root;
+	params->stack_top = cpu->stack_top;
+	params->entry = (uint64_t)ap_main;
+	params->arg = (uint64_t)cpu;
+	__atomic_store_n(&params->ready, 0, __ATOMIC_RELEASE);
+
+	lapic_send_init(cpu->apic_id);
+	pit_delay_us(SMP_INIT_DELAY_US);
+	lapic_send_startup(cpu->apic_id, AP_TRAMPOLINE >> 12);
+	pit_delay_us(SMP_SIPI_DELAY_US);
+	if (!__atomic_load_n(&params->ready, __ATOMIC_ACQUIRE)) {
+		lapic_send_startup(cpu->apic_id, AP_TRAMPOLINE >> 12);
+	}
+
+	if (smp_wait(&params->ready, SMP_START_TIMEOUT_US)) {
+		return true;
+	}
+	// Back to wait-for-SIPI before params is rewritten for the next AP. It
+	// could still have read this one's, so cpu and the stack stay its own
+	lapic_send_init(cpu->apic_id);
+	pit_delay_us(SMP_INIT_DELAY_US);
+	return false;
+}
+
+// Starts every enabled CPU from BootInfo. The BSP is always cpus[0]
+bool smp_init(BootInfo *info) {
+	lapic_init(info->lapic_base);
+	uint32_t bsp_id = lapic_id();
+
+	uint32_t max = info->cpu_count ? info->cpu_count : 1;
+	uint64_t phys = pmm_alloc_zeroed(pmm_order_for(max * sizeof(PerCpu *)));
+	if (!phys) {
+		return false;
+	}
+	cpus = (PerCpu **)phys_to_virt(phys);
+
+	uint32_t bsp_node = 0;
+	for (uint32_t i = 0; i < info->cpu_count; i++) {
+		if (info->cpu_apic_ids[i] == bsp_id) {
+			bsp_node = info->cpu_nodes[i];
+		}
+	}
+	PerCpu *bsp = smp_alloc_cpu(bsp_node);
+	if (!bsp) {
+		return false;
+	}
+	bsp->index = 0;
+	bsp->apic_id = bsp_id;
+	bsp->stack_top = info->stack_top;
+	bsp->simd_area = boot_cpu.simd_area;
+	bsp->vm = boot_cpu.vm;
+	cpus[0] = bsp;
+	smp_set_gs(bsp);
+	percpu_ready = true;
+	cpu_count = 1;
+	cpus_online = 1;
+
+	for (uint32_t i = 0; i < info->cpu_count; i++) {
+		uint32_t apic_id = info->cpu_apic_ids[i];
+		if (apic_id == bsp_id || apic_id > LAPIC_MAX_XAPIC_ID) {
+			continue;
+		}
+
+		PerCpu *cpu = smp_alloc_cpu(info->cpu_nodes[i]);
+		if (!cpu) {
+			break;
+		}
+		cpu->index = cpu_count;
+		cpu->apic_id = apic_id;
+		if (smp_start_ap(info, cpu)) {
+			cpus[cpu_count] = cpu;
+			LOG(LogSmpStarted, cpu_count, apic_id, cpu->node);
+			cpu_count++;
+		}
+	}
+
+	// Started APs have consumed their params, give them a moment to check in
+	for (uint64_t waited = 0; cpus_online < cpu_count && waited < SMP_START_TIMEOUT_US; waited += SMP_POLL_US) {
+		pit_delay_us(SMP_POLL_US);
+	}
+	return true;
+}
@@ -0,0 +1,399 @@
+// Host-side benchmark for the stub: efi_stub.c built for Linux and run against
+// the mock firmware in efi_mock.c. Three sections:
+//   phases  full efi_main runs, p50/p99 per boot phase from the trace ring
+//   memmap  mem_regions_build over synthetic maps, sorted and shuffled
+//   mem     mem.c's copy and set paths across sizes
+//   crc     CRC32C throughput, SSE4.2 and table paths, against memcpy of the same size
+// Boot files come from -d, so `./build.sh && bin/stub_bench` measures the
+// images that were just built. A failing run (-R/-A injection) is reported
+// with the status efi_main returned.
+//
+// Usage: stub_bench [-d dir] [-F fat.img] [-r runs] [-m MiB] [-c cpus] [-n nodes]
+//                   [-e extra descs] [-f fragments] [-s] [-l latency us] [-b MB/s]
+//                   [-S] [-x stale exits] [-R fail read] [-A fail alloc] [-v]
+//                   [-t phases,memmap,mem,crc]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include "efi_stub.c"
+#include "efi_mock.c"
+
+#define MAX_RUNS 1000
+#define MAX_PHASES 64
+#define PHASE_NAME 40
+
+#define TRACE_NAME(id, name) name,
+const char *trace_names[] = {
+	TRACE_POINTS(TRACE_NAME)
+};
+#undef TRACE_NAME
+
+typedef struct {
+	char name[PHASE_NAME];
+	size_t count;
+	uint64_t samples[MAX_RUNS];
+} Phase;
+
+Phase phases[MAX_PHASES];
+size_t phase_count;
+
+BootInfo handed_over;
+bool loader_reached;
+double tsc_per_ns;
+
+EFI_STATUS host_loader_entry(BootInfo *info) {
+	handed_over = *info;
+	loader_reached = true;
+	return 0;
+}
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void tsc_calibrate_host(void) {
+	uint64_t t0 = now_ns(), c0 = rdtsc();
+	while (now_ns() - t0 < 50000000) {
+	}
+	uint64_t t1 = now_ns(), c1 = rdtsc();
+	tsc_per_ns = (double)(c1 - c0) / (t1 - t0);
+}
+
+static double tsc_us(uint64_t tsc) {
+	return tsc / tsc_per_ns / 1000.0;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+// Nearest rank, same as bench_boot.sh
+static uint64_t percentile(uint64_t *sorted, size_t n, double p) {
+	size_t rank = (size_t)(n * p + 0.999999);
+	return sorted[rank ? rank - 1 : 0];
+}
+
+static void phase_add(const char *name, uint64_t tsc) {
+	size_t i = 0;
+	for (; i < phase_count && strcmp(phases[i].name, name) != 0; i++) {
+	}
+	if (i == phase_count) {
+		if (phase_count == MAX_PHASES) {
+			return;
+		}
+		snprintf(phases[phase_count++].name, PHASE_NAME, "%s", name);
+	}
+	if (phases[i].count < MAX_RUNS) {
+		phases[i].samples[phases[i].count++] = tsc;
+	}
+}
+
+// Each trace point ends a phase, named like bench_boot.sh's "point[arg]"
+static void phases_record(TraceRing *ring) {
+	uint32_t head = ring->head;
+	uint32_t first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+	if (head == first) {
+		return;
+	}
+
+	TraceEvent *start = &ring->events[first & (TRACE_RING_SIZE - 1)];
+	uint64_t prev = start->tsc;
+	for (uint32_t i = first + 1; i < head; i++) {
+		TraceEvent *e = &ring->events[i & (TRACE_RING_SIZE - 1)];
+		char name[PHASE_NAME];
+		snprintf(name, sizeof(name), "%s[%u]", e->id < TraceCount ? trace_names[e->id] : "unknown", e->arg);
+		phase_add(name, e->tsc - prev);
+		prev = e->tsc;
+	}
+	phase_add("total", prev - start->tsc);
+}
+
+static void bench_phases(size_t runs) {
+	size_t ok = 0;
+	uint64_t reads = 0, bytes = 0, max_inflight = 0, wait_ns = 0, allocs = 0, exits = 0, after_exit = 0;
+	for (size_t r = 0; r < runs; r++) {
+		mock_reset();
+		loader_reached = false;
+		EFI_STATUS status = efi_main(mock_image_handle(), mock_system_table());
+		if (status != 0 || !loader_reached) {
+			printf("run %zu: efi_main returned %#lx after %lu reads, %lu allocations\n", r, status, mock_stats.reads, mock_stats.allocs);
+			continue;
+		}
+		if (handed_over.mem_region_count == 0 || handed_over.kernel_entry == 0) {
+			printf("run %zu: boot info incomplete\n", r);
+			continue;
+		}
+
+		phases_record(&handed_over.trace);
+		ok++;
+		reads += mock_stats.reads;
+		bytes += mock_stats.read_bytes;
+		allocs += mock_stats.allocs;
+		exits += mock_stats.exit_calls;
+		wait_ns += mock_stats.wait_ns;
+		after_exit += mock_stats.calls_after_exit;
+		if (mock_stats.max_inflight > max_inflight) {
+			max_inflight = mock_stats.max_inflight;
+		}
+	}
+	if (ok == 0) {
+		printf("phases: no run reached the loader\n");
+		return;
+	}
+
+	printf("phases: %zu/%zu runs, %lu regions, %u cpus, %u nodes\n", ok, runs, handed_over.mem_region_count, handed_over.cpu_count, handed_over.numa_node_count);
+	printf("  per run: %lu reads, %.1f KiB, %lu page allocations, %lu ExitBootServices calls, %.1f us waiting, peak %lu in flight\n",
+		reads / ok, bytes / ok / 1024.0, allocs / ok, exits / ok, wait_ns / ok / 1000.0, max_inflight);
+	if (after_exit) {
+		printf("  %lu boot services calls after ExitBootServices!\n", after_exit);
+	}
+
+	printf("  %-28s %12s %12s %6s\n", "phase", "p50 us", "p99 us", "runs");
+	for (size_t i = 0; i < phase_count; i++) {
+		Phase *p = &phases[i];
+		qsort(p->samples, p->count, sizeof(uint64_t), cmp_u64);
+		printf("  %-28s %12.1f %12.1f %6zu\n", p->name, tsc_us(percentile(p->samples, p->count, 0.50)), tsc_us(percentile(p->samples, p->count, 0.99)), p->count);
+	}
+}
+
+// A firmware-looking map: contiguous runs with a realistic type mix, so some
+// neighbours merge and most don't
+static void memmap_fill(char *map, size_t count, size_t desc_size, bool shuffle, uint64_t *rng) {
+	static const uint32_t types[] = {
+		EfiConventionalMemory, EfiBootServicesData, EfiBootServicesCode, EfiConventionalMemory,
+		EfiLoaderData, EfiRuntimeServicesData, EfiACPIReclaimMemory, EfiLunkBootData,
+	};
+	uint64_t at = 0x100000;
+	for (size_t i = 0; i < count; i++) {
+		uint64_t pages = 1 + mock_rand(rng) % 64;
+		EFI_MEMORY_DESCRIPTOR *d = (EFI_MEMORY_DESCRIPTOR *)(map + i * desc_size);
+		*d = (EFI_MEMORY_DESCRIPTOR){ .Type = types[mock_rand(rng) % 8], .PhysicalStart = at, .NumberOfPages = pages };
+		at += pages * EFI_PAGE_SIZE;
+	}
+
+	if (shuffle) {
+		char tmp[256];
+		for (size_t i = count; i > 1; i--) {
+			size_t j = mock_rand(rng) % i;
+			memcpy(tmp, map + (i - 1) * desc_size, desc_size);
+			memcpy(map + (i - 1) * desc_size, map + j * desc_size, desc_size);
+			memcpy(map + j * desc_size, tmp, desc_size);
+		}
+	}
+}
+
+static void bench_memmap(void) {
+	const size_t desc_size = 48;
+	const size_t sizes[] = { 256, 1024, 4096, 16384 };
+	const uint32_t nodes[] = { 0, 4 };
+
+	printf("memmap: mem_regions_build, median of 15 batches\n");
+	printf("  %8s %9s %6s %12s %10s %8s\n", "descs", "order", "nodes", "ns/call", "ns/desc", "regions");
+	uint64_t rng = 0x9E3779B97F4A7C15ULL;
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		size_t count = sizes[s];
+		char *map = malloc(count * desc_size);
+		for (int shuffle = 0; shuffle < 2; shuffle++) {
+			memmap_fill(map, count, desc_size, shuffle, &rng);
+			uint64_t end = ((EFI_MEMORY_DESCRIPTOR *)map)->PhysicalStart;
+			for (size_t i = 0; i < count; i++) {
+				EFI_MEMORY_DESCRIPTOR *d = (EFI_MEMORY_DESCRIPTOR *)(map + i * desc_size);
+				uint64_t e = d->PhysicalStart + d->NumberOfPages * EFI_PAGE_SIZE;
+				end = e > end ? e : end;
+			}
+
+			for (size_t n = 0; n < sizeof(nodes) / sizeof(nodes[0]); n++) {
+				// Equal slices of the map's span, like an SRAT would give
+				numa_range_count = nodes[n];
+				uint64_t slice = ((end - 0x100000) / (nodes[n] ? nodes[n] : 1)) & ~(uint64_t)(EFI_PAGE_SIZE - 1);
+				for (uint32_t i = 0; i < nodes[n]; i++) {
+					numa_ranges[i] = (NumaRange){ .base = 0x100000 + i * slice, .limit = i + 1 == nodes[n] ? end : 0x100000 + (i + 1) * slice, .node = i };
+				}
+
+				size_t capacity = count + 2 * numa_range_count;
+				MemRegion *regions = malloc(capacity * sizeof(MemRegion));
+				size_t produced = 0;
+
+				// Batches long enough to be well above clock resolution. Insertion
+				// goes quadratic on shuffled maps, so those get far fewer reps
+				size_t reps = shuffle ? 1 + 200000000 / (count * count) : 1 + 2000000 / count;
+				uint64_t samples[15];
+				for (size_t b = 0; b < 15; b++) {
+					uint64_t t0 = rdtsc();
+					for (size_t r = 0; r < reps; r++) {
+						produced = mem_regions_build(map, count * desc_size, desc_size, regions, capacity);
+					}
+					samples[b] = (rdtsc() - t0) / reps;
+				}
+				qsort(samples, 15, sizeof(uint64_t), cmp_u64);
+				double ns = samples[7] / tsc_per_ns;
+				printf("  %8zu %9s %6u %12.0f %10.2f %8zu\n", count, shuffle ? "shuffled" : "sorted", nodes[n], ns, ns / count, produced);
+				free(regions);
+			}
+		}
+		free(map);
+	}
+	numa_range_count = 0;
+}
+
+typedef void *(*CopyFn)(void *, const void *, size_t);
+typedef void *(*SetFn)(void *, int, size_t);
+
+static void bench_mem(void) {
+	const size_t sizes[] = { 64, 256, 4096, 64 * 1024, 1024 * 1024, 16 * 1024 * 1024, 64 * 1024 * 1024 };
+	size_t max = sizes[sizeof(sizes) / sizeof(sizes[0]) - 1];
+	char *src = aligned_alloc(4096, max + 4096);
+	char *dst = aligned_alloc(4096, max + 4096);
+	for (size_t i = 0; i < max + 4096; i++) {
+		src[i] = (char)i;
+		dst[i] = 0;
+	}
+
+	// mem_init only picks AVX2 when the CPU and OS both allow it
+	bool avx2 = mem_copy_impl == mem_copy_avx2;
+	struct { const char *name; CopyFn copy; SetFn set; } impls[] = {
+		{ "sse2", mem_copy_sse2, mem_set_sse2 },
+		{ "avx2", mem_copy_avx2, mem_set_avx2 },
+	};
+
+	printf("mem: GB/s, dest offset 0 and 1%s%s\n", mem_has_erms ? ", erms" : "", avx2 ? "" : ", no avx2");
+	printf("  %10s %6s %10s %10s %10s %10s\n", "bytes", "impl", "copy", "copy+1", "set", "set+1");
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		size_t n = sizes[s];
+		size_t reps = 1 + (256ULL << 20) / n;
+		for (size_t k = 0; k < (avx2 ? 2 : 1); k++) {
+			double gbs[4];
+			for (int op = 0; op < 4; op++) {
+				size_t off = op & 1;
+				uint64_t t0 = rdtsc();
+				for (size_t r = 0; r < reps; r++) {
+					if (op < 2) {
+						impls[k].copy(dst + off, src, n);
+					} else {
+						impls[k].set(dst + off, (int)r, n);
+					}
+					__asm__ volatile ("" ::: "memory");
+				}
+				gbs[op] = (double)n * reps / ((rdtsc() - t0) / tsc_per_ns);
+			}
+			printf("  %10zu %6s %10.2f %10.2f %10.2f %10.2f\n", n, impls[k].name, gbs[0], gbs[1], gbs[2], gbs[3]);
+		}
+	}
+	free(src);
+	free(dst);
+}
+
+// Verification has to keep up with reads landing, one LOAD_CHUNK_SIZE at a time
+static void bench_crc(void) {
+	const size_t sizes[] = { 64, 4096, LOAD_CHUNK_SIZE, 16 * 1024 * 1024 };
+	size_t max = sizes[sizeof(sizes) / sizeof(sizes[0]) - 1];
+	char *buf = aligned_alloc(4096, max);
+	char *dst = aligned_alloc(4096, max);
+	for (size_t i = 0; i < max; i++) {
+		buf[i] = (char)(i * 7);
+	}
+
+	printf("crc: GB/s%s\n", crc32c_has_sse42 ? "" : ", no sse4.2");
+	printf("  %10s %10s %10s %10s\n", "bytes", "sse4.2", "table", "memcpy");
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		size_t n = sizes[s];
+		size_t reps = 1 + (256ULL << 20) / n;
+		double gbs[3] = {0};
+		for (int k = 0; k < 3; k++) {
+			if (k == 0 && !crc32c_has_sse42) {
+				continue;
+			}
+			volatile uint32_t sink = 0;
+			uint64_t t0 = rdtsc();
+			for (size_t r = 0; r < reps; r++) {
+				if (k == 2) {
+					memcpy(dst, buf, n);
+					__asm__ volatile ("" ::: "memory");
+				} else {
+					sink = (k == 0 ? crc32c_hw : crc32c_sw)(sink, buf, n);
+				}
+			}
+			gbs[k] = (double)n * reps / ((rdtsc() - t0) / tsc_per_ns);
+		}
+		printf("  %10zu %10.2f %10.2f %10.2f\n", n, gbs[0], gbs[1], gbs[2]);
+	}
+	free(buf);
+	free(dst);
+}
+
+// `list` is comma separated
+static bool section_on(const char *list, const char *name) {
+	size_t len = strlen(name);
+	for (const char *p = list; *p;) {
+		const char *end = strchr(p, ',');
+		size_t n = end ? (size_t)(end - p) : strlen(p);
+		if (n == len && memcmp(p, name, n) == 0) {
+			return true;
+		}
+		p += end ? n + 1 : n;
+	}
+	return false;
+}
+
+int main(int argc, char **argv) {
+	MockConfig config = { .dir = "bin", .cpus = 1, .seed = 1 };
+	size_t runs = 20;
+	const char *sections = "phases,memmap,mem,crc";
+
+	int opt;
+	while ((opt = getopt(argc, argv, "d:F:r:m:c:n:e:f:sl:b:Sx:R:A:vt:")) != -1) {
+		switch (opt) {
+			case 'd': config.dir = optarg; break;
+			case 'F': config.fat_image = optarg; break;
+			case 'r': runs = strtoul(optarg, NULL, 0); break;
+			case 'm': config.mem_size = strtoull(optarg, NULL, 0) << 20; break;
+			case 'c': config.cpus = strtoul(optarg, NULL, 0); break;
+			case 'n': config.numa_nodes = strtoul(optarg, NULL, 0); break;
+			case 'e': config.extra_descs = strtoul(optarg, NULL, 0); break;
+			case 'f': config.fragments = strtoul(optarg, NULL, 0); break;
+			case 's': config.shuffle = true; break;
+			case 'l': config.latency_ns = strtoull(optarg, NULL, 0) * 1000; break;
+			case 'b': config.bandwidth_mbs = strtoull(optarg, NULL, 0); break;
+			case 'S': config.sync_only = true; break;
+			case 'x': config.stale_exits = strtoul(optarg, NULL, 0); break;
+			case 'R': config.fail_read = strtoull(optarg, NULL, 0); break;
+			case 'A': config.fail_alloc = strtoull(optarg, NULL, 0); break;
+			case 'v': config.verbose = true; break;
+			case 't': sections = optarg; break;
+			default:
+				fprintf(stderr, "usage: %s [-d dir] [-F fat.img] [-r runs] [-m MiB] [-c cpus] [-n nodes] [-e extra descs] [-f fragments] [-s] "
+					"[-l latency us] [-b MB/s] [-S] [-x stale exits] [-R fail read] [-A fail alloc] [-v] [-t phases,memmap,mem,crc]\n", argv[0]);
+				return 1;
+		}
+	}
+	if (runs > MAX_RUNS) {
+		runs = MAX_RUNS;
+	}
+
+	tsc_calibrate_host();
+	mem_init();
+	crc32c_init();
+
+	if (section_on(sections, "phases")) {
+		if (!mock_init(&config)) {
+			return 1;
+		}
+		bench_phases(runs);
+	}
+	if (section_on(sections, "memmap")) {
+		bench_memmap();
+	}
+	if (section_on(sections, "mem")) {
+		bench_mem();
+	}
+	if (section_on(sections, "crc")) {
+		bench_crc();
+	}
+	return 0;
+}
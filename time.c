@@ -0,0 +1,112 @@
+// Legacy timers, used for delays before anything better has been calibrated,
+// and TSC frequency discovery
+
+#include "kernel.h"
+#include "cpu.h"
+
+#define PIT_HZ 1193182
+#define PIT_CMD 0x43
+#define PIT_CH2 0x42
+#define PIT_GATE_PORT 0x61
+
+#define PIT_GATE_CH2  0x01
+#define PIT_SPEAKER   0x02
+#define PIT_OUT_CH2   0x20
+
+// Busy-waits on PIT channel 2 in one-shot mode, the speaker stays off
+void pit_delay_us(uint64_t us) {
+	uint64_t ticks = (us * PIT_HZ) / 1000000;
+	if (ticks == 0) {
+		ticks = 1;
+	}
+
+	while (ticks) {
+		uint16_t count = ticks > 0xFFFF ? 0xFFFF : (uint16_t)ticks;
+
+		// Gate low while the count is loaded, the countdown starts when it goes high
+		uint8_t gate = inb(PIT_GATE_PORT) & ~(PIT_GATE_CH2 | PIT_SPEAKER);
+		outb(PIT_GATE_PORT, gate);
+
+		// Channel 2, lobyte/hibyte, mode 0 (interrupt on terminal count)
+		outb(PIT_CMD, 0xB0);
+		outb(PIT_CH2, count & 0xFF);
+		outb(PIT_CH2, count >> 8);
+
+		outb(PIT_GATE_PORT, gate | PIT_GATE_CH2);
+		while (!(inb(PIT_GATE_PORT) & PIT_OUT_CH2)) {
+			cpu_pause();
+		}
+
+		ticks -= count;
+	}
+}
+
+uint64_t tsc_hz;
+const char *tsc_source = "none";
+bool tsc_invariant;
+
+#define TSC_PIT_WINDOW_US 10000
+#define TSC_PIT_RUNS 3
+
+// Crystal clock ratio from leaf 0x15, with the nominal frequency from leaf 0x16
+// standing in when the crystal rate isn't enumerated. 0 when neither is there
+static uint64_t tsc_hz_from_cpuid(void) {
+	uint32_t max_leaf = cpuid(0, 0).eax;
+	if (max_leaf < 0x15) {
+		return 0;
+	}
+
+	CpuidRegs r = cpuid(0x15, 0);
+	if (r.eax && r.ebx) {
+		if (r.ecx) {
+			return (uint64_t)r.ecx * r.ebx / r.eax;
+		}
+		if (max_leaf >= 0x16) {
+			uint32_t base_mhz = cpuid(0x16, 0).eax & 0xFFFF;
+			if (base_mhz) {
+				return (uint64_t)base_mhz * 1000000;
+			}
+		}
+	}
+	return 0;
+}
+
+// Best of a few PIT windows, a window stretched by an SMI or a vCPU preemption only reads high
+static uint64_t tsc_hz_from_pit(void) {
+	uint64_t best = ~0ULL;
+	for (uint32_t i = 0; i < TSC_PIT_RUNS; i++) {
+		uint64_t start = rdtsc();
+		pit_delay_us(TSC_PIT_WINDOW_US);
+		uint64_t ticks = rdtsc() - start;
+		if (ticks < best) {
+			best = ticks;
+		}
+	}
+	return best * (1000000 / TSC_PIT_WINDOW_US);
+}
+
+// Prefers the architectural rate from CPUID and measures against the PIT otherwise
+void tsc_calibrate(void) {
+	CpuidRegs ext = cpuid(0x80000000, 0);
+	tsc_invariant = ext.eax >= 0x80000007 && ((cpuid(0x80000007, 0).edx >> 8) & 1);
+
+	tsc_hz = tsc_hz_from_cpuid();
+	if (tsc_hz) {
+		tsc_source = "cpuid";
+		return;
+	}
+	tsc_hz = tsc_hz_from_pit();
+	tsc_source = "pit";
+}
+
+// Split so ticks * 1e9 can't overflow for long intervals
+uint64_t tsc_to_ns(uint64_t ticks) {
+	if (!tsc_hz) {
+		return 0;
+	}
+	return (ticks / tsc_hz) * 1000000000ULL + ((ticks % tsc_hz) * 1000000000ULL) / tsc_hz;
+}
+
+uint64_t ns_to_tsc(uint64_t ns) {
+	return (ns / 1000000000ULL) * tsc_hz + ((ns % 1000000000ULL) * tsc_hz) / 1000000000ULL;
+}
@@ -0,0 +1,463 @@
+// Tickless one-shot timers. Every CPU keeps a hierarchical timing wheel keyed by
+// the TSC and arms its LAPIC timer for the next expiry only, so a CPU with no
+// timers pending never takes a timer interrupt at all.
+//
+// Each level has 64 slots, each slot spanning 64 times what a slot one level
+// down does. A timer sits in the lowest level where its expiry agrees with the
+// wheel's clock on every higher slot index, so the earliest expiry is always in
+// the first occupied slot of the lowest occupied level, found with one ctz on
+// that level's bitmap. Moving the clock to a slot re-sorts its timers into lower
+// levels, and empty slots are never stepped through. Level 0 timers keep their
+// exact deadlines, the hardware is armed for the earliest of those rather than
+// the slot boundary.
+//
+// Timers belong to the CPU that started them, and only that CPU may restart or
+// cancel one. Callbacks run in the timer interrupt with interrupts off.
+
+#include "kernel.h"
+#include "cpu.h"
+
+#define TIMER_VECTOR 0xEF
+
+// A wheel tick is 1024 TSC ticks, a few hundred ns on current parts
+#define TIMER_TICK_SHIFT 10
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+#define TIMER_LEVELS 6
+// Wheel ticks the levels cover between them. Expiries further out than the
+// clock's current range wait on the overflow list
+#define TIMER_RANGE_BITS (TIMER_SLOT_BITS * TIMER_LEVELS)
+
+// Power of two latency buckets in ns, the last one takes everything above
+#define TIMER_HIST_BUCKETS 24
+
+typedef void (*TimerFn)(void *arg);
+
+typedef struct TimerLink {
+	struct TimerLink *next, *prev;
+} TimerLink;
+
+typedef struct {
+	// First, so a list entry is the timer
+	TimerLink link;
+	// TSC value the timer is due at
+	uint64_t deadline;
+	TimerFn fn;
+	void *arg;
+	uint32_t cpu;
+	// TIMER_LEVELS for the overflow list
+	uint8_t level;
+	uint8_t slot;
+	bool pending;
+} Timer;
+
+typedef struct {
+	TimerLink slots[TIMER_LEVELS][TIMER_SLOTS];
+	uint64_t occupied[TIMER_LEVELS];
+	TimerLink overflow;
+	// In wheel ticks, never ahead of the TSC or any pending timer
+	uint64_t clock;
+	uint64_t pending;
+	// The deadline the LAPIC is set for, 0 when disarmed
+	uint64_t armed;
+	// The LVT is programmed on each CPU's first timer_start
+	bool ready;
+
+	uint64_t fired;
+	uint64_t interrupts;
+	uint64_t cascaded;
+	// Deadline to callback, in ns
+	uint64_t latency_min;
+	uint64_t latency_max;
+	uint64_t latency_sum;
+	uint64_t latency_sq_sum;
+	uint64_t latency_hist[TIMER_HIST_BUCKETS];
+} __attribute__((aligned(CACHE_LINE_SIZE))) TimerWheel;
+
+typedef struct {
+	uint64_t fired;
+	uint64_t interrupts;
+	uint64_t cascaded;
+	uint64_t latency_min_ns;
+	uint64_t latency_max_ns;
+	uint64_t latency_mean_ns;
+	// Jitter, the standard deviation of the latency
+	uint64_t latency_stddev_ns;
+	// Bucket k counts latencies in [2^(k-1), 2^k) ns, bucket 0 is exactly 0
+	uint64_t latency_hist[TIMER_HIST_BUCKETS];
+} TimerStats;
+
+TimerWheel *timer_wheels;
+uint32_t timer_wheel_count;
+
+static inline void timer_list_init(TimerLink *head) {
+	head->next = head->prev = head;
+}
+
+static inline bool timer_list_empty(TimerLink *head) {
+	return head->next == head;
+}
+
+static inline void timer_list_push(TimerLink *head, TimerLink *link) {
+	link->prev = head->prev;
+	link->next = head;
+	head->prev->next = link;
+	head->prev = link;
+}
+
+static inline void timer_list_remove(TimerLink *link) {
+	link->prev->next = link->next;
+	link->next->prev = link->prev;
+}
+
+// Moves every entry of from onto the empty list to
+static void timer_list_take(TimerLink *from, TimerLink *to) {
+	timer_list_init(to);
+	if (timer_list_empty(from)) {
+		return;
+	}
+	to->next = from->next;
+	to->prev = from->prev;
+	to->next->prev = to;
+	to->prev->next = to;
+	timer_list_init(from);
+}
+
+static inline TimerWheel *timer_this_wheel(void) {
+	return &timer_wheels[this_cpu()->index];
+}
+
+static void timer_place(TimerWheel *w, Timer *t) {
+	uint64_t tick = t->deadline >> TIMER_TICK_SHIFT;
+	if (tick < w->clock) {
+		tick = w->clock;
+	}
+
+	uint64_t diff = tick ^ w->clock;
+	if (diff >> TIMER_RANGE_BITS) {
+		t->level = TIMER_LEVELS;
+		timer_list_push(&w->overflow, &t->link);
+		return;
+	}
+
+	uint32_t level = diff ? (63 - __builtin_clzll(diff)) / TIMER_SLOT_BITS : 0;
+	uint32_t slot = (tick >> (level * TIMER_SLOT_BITS)) & (TIMER_SLOTS - 1);
+	t->level = level;
+	t->slot = slot;
+	timer_list_push(&w->slots[level][slot], &t->link);
+	w->occupied[level] |= 1ULL << slot;
+}
+
+static void timer_unplace(TimerWheel *w, Timer *t) {
+	timer_list_remove(&t->link);
+	if (t->level < TIMER_LEVELS && timer_list_empty(&w->slots[t->level][t->slot])) {
+		w->occupied[t->level] &= ~(1ULL << t->slot);
+	}
+}
+
+// Wheel tick at which the next slot comes due, UINT64_MAX when nothing is pending.
+// The overflow list comes due when the clock rolls into the next range
+static uint64_t timer_next_tick(TimerWheel *w, uint32_t *level_out, uint32_t *slot_out) {
+	for (uint32_t level = 0; level < TIMER_LEVELS; level++) {
+		uint32_t shift = level * TIMER_SLOT_BITS;
+		uint32_t index = (w->clock >> shift) & (TIMER_SLOTS - 1);
+		// Slots behind the clock's index are always empty
+		uint64_t bits = w->occupied[level] & (~0ULL << index);
+		if (!bits) {
+			continue;
+		}
+
+		uint32_t slot = __builtin_ctzll(bits);
+		uint64_t start = ((w->clock >> (shift + TIMER_SLOT_BITS)) << (shift + TIMER_SLOT_BITS)) + ((uint64_t)slot << shift);
+		*level_out = level;
+		*slot_out = slot;
+		return start > w->clock ? start : w->clock;
+	}
+
+	if (!timer_list_empty(&w->overflow)) {
+		*level_out = TIMER_LEVELS;
+		*slot_out = 0;
+		return ((w->clock >> TIMER_RANGE_BITS) + 1) << TIMER_RANGE_BITS;
+	}
+	return UINT64_MAX;
+}
+
+// Programs the LAPIC for the earliest expiry, or leaves it quiet when there is none
+static void timer_rearm(TimerWheel *w) {
+	uint32_t level, slot;
+	uint64_t tick = timer_next_tick(w, &level, &slot);
+
+	// 0 means disarmed to the hardware
+	uint64_t deadline = 0;
+	if (tick != UINT64_MAX && level == 0) {
+		deadline = UINT64_MAX;
+		TimerLink *head = &w->slots[0][slot];
+		for (TimerLink *l = head->next; l != head; l = l->next) {
+			Timer *t = (Timer *)l;
+			if (t->deadline < deadline) {
+				deadline = t->deadline;
+			}
+		}
+		if (deadline == 0) {
+			deadline = 1;
+		}
+	} else if (tick != UINT64_MAX) {
+		deadline = tick << TIMER_TICK_SHIFT;
+	}
+
+	if (deadline == w->armed) {
+		return;
+	}
+	w->armed = deadline;
+	if (deadline) {
+		lapic_timer_arm(deadline);
+	} else {
+		lapic_timer_disarm();
+	}
+}
+
+static void timer_record_latency(TimerWheel *w, uint64_t ticks) {
+	uint64_t ns = tsc_to_ns(ticks);
+	if (w->fired == 0 || ns < w->latency_min) {
+		w->latency_min = ns;
+	}
+	if (ns > w->latency_max) {
+		w->latency_max = ns;
+	}
+	w->latency_sum += ns;
+	w->latency_sq_sum += ns * ns;
+
+	uint32_t bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+	if (bucket >= TIMER_HIST_BUCKETS) {
+		bucket = TIMER_HIST_BUCKETS - 1;
+	}
+	w->latency_hist[bucket]++;
+	w->fired++;
+}
+
+// Fires everything that is due, re-sorting each slot the clock passes
+static void timer_run(TimerWheel *w) {
+	for (;;) {
+		uint64_t now = rdtsc();
+		uint32_t level, slot;
+		uint64_t tick = timer_next_tick(w, &level, &slot);
+		if (tick == UINT64_MAX || tick > (now >> TIMER_TICK_SHIFT)) {
+			break;
+		}
+		w->clock = tick;
+
+		TimerLink taken;
+		if (level == TIMER_LEVELS) {
+			timer_list_take(&w->overflow, &taken);
+		} else if (level > 0) {
+			timer_list_take(&w->slots[level][slot], &taken);
+			w->occupied[level] &= ~(1ULL << slot);
+		} else {
+			// Only the ones whose exact deadline has passed, the rest stay for the rearm
+			timer_list_init(&taken);
+			TimerLink *head = &w->slots[0][slot];
+			for (TimerLink *l = head->next, *next; l != head; l = next) {
+				next = l->next;
+				if (((Timer *)l)->deadline <= now) {
+					timer_unplace(w, (Timer *)l);
+					timer_list_push(&taken, l);
+				}
+			}
+			if (timer_list_empty(&taken)) {
+				break;
+			}
+
+			// Unlinked before any callback runs, so each may start timers again, itself included
+			while (!timer_list_empty(&taken)) {
+				Timer *t = (Timer *)taken.next;
+				timer_list_remove(&t->link);
+				t->pending = false;
+				w->pending--;
+				timer_record_latency(w, rdtsc() - t->deadline);
+				t->fn(t->arg);
+			}
+			continue;
+		}
+
+		while (!timer_list_empty(&taken)) {
+			Timer *t = (Timer *)taken.next;
+			timer_list_remove(&t->link);
+			timer_place(w, t);
+			w->cascaded++;
+		}
+	}
+	timer_rearm(w);
+}
+
+static void timer_interrupt(InterruptFrame *frame) {
+	TimerWheel *w = timer_this_wheel();
+	lapic_eoi();
+	// One-shot, whatever was armed is spent
+	w->armed = 0;
+	w->interrupts++;
+	timer_run(w);
+}
+
+// Arms t to call fn(arg) on this CPU once the TSC reaches deadline. Restarting
+// a pending timer moves it, a deadline in the past fires on the next interrupt
+void timer_start(Timer *t, uint64_t deadline, TimerFn fn, void *arg) {
+	uint64_t flags = irq_save();
+	TimerWheel *w = timer_this_wheel();
+	if (!w->ready) {
+		lapic_timer_setup(TIMER_VECTOR);
+		w->ready = true;
+	}
+
+	if (t->pending) {
+		timer_unplace(w, t);
+		w->pending--;
+	}
+	// Nothing holds the clock back, catch it up so the timer lands in a low level
+	if (w->pending == 0) {
+		w->clock = rdtsc() >> TIMER_TICK_SHIFT;
+	}
+
+	t->deadline = deadline;
+	t->fn = fn;
+	t->arg = arg;
+	t->cpu = this_cpu()->index;
+	t->pending = true;
+	timer_place(w, t);
+	w->pending++;
+	timer_rearm(w);
+	irq_restore(flags);
+}
+
+void timer_start_ns(Timer *t, uint64_t ns, TimerFn fn, void *arg) {
+	timer_start(t, rdtsc() + ns_to_tsc(ns), fn, arg);
+}
+
+// Returns whether t was still pending. The hardware stays armed, an early
+// interrupt finds nothing due and rearms for what is left
+bool timer_cancel(Timer *t) {
+	uint64_t flags = irq_save();
+	bool pending = t->pending;
+	if (pending) {
+		TimerWheel *w = timer_this_wheel();
+		timer_unplace(w, t);
+		t->pending = false;
+		w->pending--;
+	}
+	irq_restore(flags);
+	return pending;
+}
+
+static uint64_t timer_isqrt(uint64_t x) {
+	uint64_t r = x, y = (x + 1) / 2;
+	while (y < r) {
+		r = y;
+		y = (r + x / r) / 2;
+	}
+	return r;
+}
+
+// Sums every CPU's wheel. Counters are read without stopping anyone, so a
+// snapshot taken under load can be slightly torn
+void timer_stats(TimerStats *stats) {
+	memset(stats, 0, sizeof(*stats));
+
+	uint64_t sum = 0, sq_sum = 0;
+	for (uint32_t i = 0; i < timer_wheel_count; i++) {
+		TimerWheel *w = &timer_wheels[i];
+		if (!w->fired) {
+			continue;
+		}
+		if (stats->fired == 0 || w->latency_min < stats->latency_min_ns) {
+			stats->latency_min_ns = w->latency_min;
+		}
+		if (w->latency_max > stats->latency_max_ns) {
+			stats->latency_max_ns = w->latency_max;
+		}
+		stats->fired += w->fired;
+		stats->interrupts += w->interrupts;
+		stats->cascaded += w->cascaded;
+		sum += w->latency_sum;
+		sq_sum += w->latency_sq_sum;
+		for (uint32_t k = 0; k < TIMER_HIST_BUCKETS; k++) {
+			stats->latency_hist[k] += w->latency_hist[k];
+		}
+	}
+
+	if (stats->fired) {
+		uint64_t mean = sum / stats->fired;
+		uint64_t mean_sq = sq_sum / stats->fired;
+		stats->latency_mean_ns = mean;
+		stats->latency_stddev_ns = mean_sq > mean * mean ? timer_isqrt(mean_sq - mean * mean) : 0;
+	}
+}
+
+// Needs tsc_calibrate and the LAPIC mapped. Each CPU programs its own LVT the
+// first time it starts a timer
+bool timer_init(uint32_t count) {
+	uint64_t phys = pmm_alloc_zeroed(pmm_order_for(count * sizeof(TimerWheel)));
+	if (!phys) {
+		return false;
+	}
+	timer_wheels = (TimerWheel *)phys_to_virt(phys);
+	timer_wheel_count = count;
+
+	for (uint32_t i = 0; i < count; i++) {
+		TimerWheel *w = &timer_wheels[i];
+		for (uint32_t level = 0; level < TIMER_LEVELS; level++) {
+			for (uint32_t slot = 0; slot < TIMER_SLOTS; slot++) {
+				timer_list_init(&w->slots[level][slot]);
+			}
+		}
+		timer_list_init(&w->overflow);
+	}
+
+	lapic_timer_init();
+	idt_set_handler(TIMER_VECTOR, timer_interrupt);
+	return true;
+}
+
+#ifdef TIMER_BENCH
+// Wakeup precision: one timer on the BSP rearms itself at pseudo-random delays
+// while the CPU sleeps in hlt between shots, then the latency stats and
+// histogram are printed. bench_timer.sh collects the lines from serial
+#define TIMER_BENCH_SHOTS 2000
+#define TIMER_BENCH_MIN_NS 10000
+#define TIMER_BENCH_SPAN_NS 990000
+
+typedef struct {
+	Timer timer;
+	volatile uint32_t left;
+	uint64_t rng;
+} TimerBench;
+
+static void timer_bench_shot(void *arg) {
+	TimerBench *b = (TimerBench *)arg;
+	if (--b->left == 0) {
+		return;
+	}
+	b->rng ^= b->rng << 13;
+	b->rng ^= b->rng >> 7;
+	b->rng ^= b->rng << 17;
+	timer_start_ns(&b->timer, TIMER_BENCH_MIN_NS + b->rng % TIMER_BENCH_SPAN_NS, timer_bench_shot, b);
+}
+
+void timer_bench(void) {
+	TimerBench b = { .left = TIMER_BENCH_SHOTS, .rng = rdtsc() | 1 };
+	timer_start_ns(&b.timer, TIMER_BENCH_MIN_NS, timer_bench_shot, &b);
+	while (__atomic_load_n(&b.left, __ATOMIC_ACQUIRE)) {
+		cpu_sti_halt();
+	}
+
+	TimerStats stats;
+	timer_stats(&stats);
+	kprintf("timer_bench fired %lu interrupts %lu cascaded %lu\n", stats.fired, stats.interrupts, stats.cascaded);
+	kprintf("timer_bench latency min %lu mean %lu max %lu stddev %lu\n",
+		stats.latency_min_ns, stats.latency_mean_ns, stats.latency_max_ns, stats.latency_stddev_ns);
+	for (uint32_t k = 0; k < TIMER_HIST_BUCKETS; k++) {
+		if (stats.latency_hist[k]) {
+			kprintf("timer_bench hist %lu %lu\n", k ? 1ULL << (k - 1) : 0, stats.latency_hist[k]);
+		}
+	}
+	kprintf("timer_bench end (%s, tsc %s)\n", lapic_tsc_deadline ? "tsc-deadline" : "one-shot", tsc_source);
+}
+#endif
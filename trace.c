@@ -0,0 +1,31 @@
+// Kernel side of the boot trace ring that starts in the stub
+
+#include "kernel.h"
+#include "boot_info.h"
+#include "trace.h"
+
+TraceRing *boot_trace;
+
+#define TRACE_NAME(id, name) name,
+const char *trace_names[] = {
+	TRACE_POINTS(TRACE_NAME)
+};
+#undef TRACE_NAME
+
+// One line per event: name, arg, ns since efi_main, ns since the previous point.
+// bench_boot.sh parses this from the serial port, "trace end" marks the last line
+void trace_dump(void) {
+	TraceRing *ring = boot_trace;
+	uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	uint32_t first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+
+	uint64_t start = ring->events[first & (TRACE_RING_SIZE - 1)].tsc;
+	uint64_t prev = start;
+	for (uint32_t i = first; i < head; i++) {
+		TraceEvent *e = &ring->events[i & (TRACE_RING_SIZE - 1)];
+		const char *name = e->id < TraceCount ? trace_names[e->id] : "unknown";
+		kprintf("trace %s %u %lu %lu\n", name, e->arg, tsc_to_ns(e->tsc - start), tsc_to_ns(e->tsc - prev));
+		prev = e->tsc;
+	}
+	kprintf("trace end\n");
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "cpu.h"
+
+// Boot phase trace points. Each one marks the end of a phase, so a phase's
+// duration is the gap to the point before it. Shared by the stub, loader.s and
+// the kernel, which dumps the ring over serial once it's up.
+#define TRACE_POINTS(X) \
+	X(TraceEfiEntry,         "efi_entry") \
+	X(TraceBootAlloc,        "boot_alloc") \
+	X(TraceProtocolOpen,     "protocol_open") \
+	X(TraceVolumeOpen,       "volume_open") \
+	X(TraceFileOpen,         "file_open") \
+	X(TraceFileRead,         "file_read") \
+	X(TraceKernelReloc,      "kernel_reloc") \
+	X(TraceAcpi,             "acpi") \
+	X(TraceGop,              "gop") \
+	X(TracePageTables,       "page_tables") \
+	X(TraceMemoryMap,        "memory_map") \
+	X(TraceExitBootServices, "exit_boot_services") \
+	X(TraceLoaderEntry,      "loader_entry") \
+	X(TraceLoaderExit,       "loader_exit") \
+	X(TraceKernelEntry,      "kernel_entry") \
+	X(TracePmmInit,          "pmm_init") \
+	X(TraceConsoleInit,      "console_init") \
+	X(TraceSmpInit,          "smp_init") \
+	X(TraceHeapInit,         "heap_init") \
+	X(TraceTimerInit,        "timer_init") \
+	X(TraceVerify,           "verify") \
+	X(TraceKexecLoad,        "kexec_load") \
+	X(TraceKexecStop,        "kexec_stop")
+
+#define TRACE_ENUM(id, name) id,
+typedef enum {
+	TRACE_POINTS(TRACE_ENUM)
+	TraceCount,
+} TraceId;
+#undef TRACE_ENUM
+
+// loader.s writes these by number
+_Static_assert(TraceLoaderEntry == 12 && TraceLoaderExit == 13, "update TRACE_LOADER_* in loader.s");
+
+// Power of two, head wraps with a mask
+#define TRACE_RING_SIZE 128
+
+typedef struct {
+	uint64_t tsc;
+	uint32_t id;
+	uint32_t arg;
+} TraceEvent;
+
+// Lives inside BootInfo. head counts every event ever recorded, the newest
+// TRACE_RING_SIZE of them are kept
+typedef struct {
+	uint32_t head;
+	uint32_t reserved;
+	TraceEvent events[TRACE_RING_SIZE];
+} TraceRing;
+
+// Points at BootInfo's ring on each side, trace_point() is a no-op until then
+extern TraceRing *boot_trace;
+
+static inline void trace_record(TraceRing *ring, uint64_t tsc, uint32_t id, uint32_t arg) {
+	uint32_t slot = __atomic_fetch_add(&ring->head, 1, __ATOMIC_RELAXED) & (TRACE_RING_SIZE - 1);
+	ring->events[slot] = (TraceEvent){ .tsc = tsc, .id = id, .arg = arg };
+}
+
+static inline void trace_point(uint32_t id, uint32_t arg) {
+	if (boot_trace) {
+		trace_record(boot_trace, rdtsc(), id, arg);
+	}
+}
@@ -0,0 +1,617 @@
+// Address spaces. Each one has its own PML4 for the lower half and shares the
+// kernel's entries, identity map included, so kernel code runs the same on any
+// of them. An address space owns the frames mapped into it, 4 KiB at a time.
+//
+// With PCID, switching doesn't flush the TLB. Every CPU keeps a few PCID slots,
+// each one remembering which address space it last held and how far that
+// space's tlb_gen had got when its TLB entries were last known good. A switch
+// to a space still in a slot at its current generation loads CR3 with the
+// no-flush bit. Anything else reuses or refreshes a slot and lets the CR3 load
+// flush that PCID. Without PCID every switch is a plain CR3 load.
+//
+// Unmapping clears the entries, bumps tlb_gen, and puts the range in a
+// caller's VmBatch along with the frames. vm_batch_flush then invalidates the
+// range locally and queues it on every other CPU that has the space loaded,
+// with one IPI per CPU for the whole batch, however many pages it holds. It
+// frees the frames once all of them have answered. CPUs that merely keep the
+// space in a slot get nothing, their next switch to it sees the newer tlb_gen.
+//
+// Workers run with interrupts off, so a CPU answers its queue when it idles,
+// between tasks, and while it waits on a task group or on its own shootdowns.
+// A long task on an address space should call vm_poll now and then.
+
+#include "kernel.h"
+#include "cpu.h"
+
+#define VM_SHOOTDOWN_VECTOR 0xF1
+
+// PCIDs per CPU. The PCID is the slot index
+#define VM_PCID_SLOTS 8
+// Queued shootdowns per CPU. Each sender has at most one queued on a CPU, one
+// that finds the queue full answers its own while it waits for room
+#define VM_QUEUE_SIZE 16
+// Pages flushed one by one, a bigger range flushes the whole PCID
+#define VM_FLUSH_PAGES 32
+#define VM_BATCH_PAGES 128
+
+// The lower half from the second PML4 entry on, the first is the identity map
+#define VM_USER_BASE (1ULL << 39)
+#define VM_USER_END (1ULL << 47)
+
+typedef struct {
+	// PML4, physical
+	uint64_t root;
+	// Never reused, PCID slots name spaces by it
+	uint64_t id;
+	// Bumped after every unmap, see vm_load
+	volatile uint64_t tlb_gen;
+	// Taken for page table edits
+	Spinlock lock;
+} AddressSpace;
+
+typedef enum {
+	VmShootRange,
+	// Move off the space, it's about to be destroyed
+	VmShootLeave,
+} VmShootKind;
+
+typedef struct {
+	uint64_t as_id;
+	uint64_t start, end;
+	uint64_t gen;
+	VmShootKind kind;
+} VmShootdown;
+
+typedef struct {
+	uint64_t as_id;
+	// 0 when the slot's entries can't be trusted
+	uint64_t tlb_gen;
+} VmSlot;
+
+typedef struct VmCpu {
+	// Written before the space's tlb_gen is read, senders read it after bumping
+	AddressSpace *volatile current;
+	uint32_t current_slot;
+	uint32_t next_victim;
+	VmSlot slots[VM_PCID_SLOTS];
+
+	// Filled by other CPUs. Tickets count entries ever queued and answered
+	Spinlock lock __attribute__((aligned(CACHE_LINE_SIZE)));
+	uint64_t queued;
+	uint32_t count;
+	// An IPI is on its way and hasn't been answered yet
+	bool kicked;
+	VmShootdown queue[VM_QUEUE_SIZE];
+	volatile uint64_t done __attribute__((aligned(CACHE_LINE_SIZE)));
+
+	uint64_t switches;
+	uint64_t switch_flushes;
+	uint64_t ipis_sent;
+	uint64_t ipis_taken;
+	uint64_t shootdowns;
+} VmCpu;
+
+// Unmapped but possibly still cached, one space at a time. Starts zeroed
+typedef struct {
+	AddressSpace *as;
+	uint64_t start, end;
+	uint32_t count;
+	uint64_t frames[VM_BATCH_PAGES];
+} VmBatch;
+
+AddressSpace vm_kernel;
+bool vm_pcid;
+bool vm_invpcid;
+uint64_t vm_next_id = 1;
+
+static uint64_t vm_table_alloc(void *ctx) {
+	return pmm_alloc_zeroed(0);
+}
+
+static uint64_t vm_table_none(void *ctx) {
+	return 0;
+}
+
+// The leaf entry for virt, NULL when a table is missing and alloc is false
+static uint64_t *vm_pte(AddressSpace *as, uint64_t virt, bool alloc) {
+	PageMapper m = { .root = as->root, .table_offset = PHYS_MAP_BASE, .alloc = alloc ? vm_table_alloc : vm_table_none };
+	return pt_entry(&m, virt, 1);
+}
+
+// Returns a CPU's state with the kernel's space in slot 0, or NULL
+VmCpu *vm_cpu_alloc(uint32_t node) {
+	uint64_t phys = pmm_alloc_zeroed_node(pmm_order_for(sizeof(VmCpu)), node);
+	if (!phys) {
+		return NULL;
+	}
+	VmCpu *vc = (VmCpu *)phys_to_virt(phys);
+	vc->current = &vm_kernel;
+	vc->slots[0] = (VmSlot){ .as_id = vm_kernel.id, .tlb_gen = vm_kernel.tlb_gen };
+	vc->next_victim = 1;
+	return vc;
+}
+
+// On every CPU, CR3 still holds the boot tables with bits 11:0 clear as
+// setting PCIDE requires, so they become PCID 0
+void vm_cpu_init(void) {
+	if (vm_pcid) {
+		write_cr4(read_cr4() | CR4_PCIDE);
+	}
+}
+
+// Invalidates [start, end) in a slot of this CPU. False when only a switch can,
+// a slot other than the current one without INVPCID
+static bool vm_flush_slot(VmCpu *vc, uint32_t slot, uint64_t start, uint64_t end) {
+	bool all = (end - start) >> PAGE_SHIFT > VM_FLUSH_PAGES;
+	if (slot == vc->current_slot) {
+		if (!all) {
+			for (uint64_t virt = start; virt < end; virt += PAGE_SIZE) {
+				invlpg(virt);
+			}
+		} else if (vm_invpcid) {
+			invpcid(INVPCID_CONTEXT, slot, 0);
+		} else {
+			// Without the no-flush bit the load drops everything the PCID had
+			write_cr3(vc->current->root | (vm_pcid ? slot : 0));
+		}
+		return true;
+	}
+
+	if (!vm_invpcid) {
+		return false;
+	}
+	if (!all) {
+		for (uint64_t virt = start; virt < end; virt += PAGE_SIZE) {
+			invpcid(INVPCID_ADDRESS, slot, virt);
+		}
+	} else {
+		invpcid(INVPCID_CONTEXT, slot, 0);
+	}
+	return true;
+}
+
+static void vm_load(VmCpu *vc, AddressSpace *as, bool flush);
+
+// Applies one shootdown on this CPU, interrupts off
+static void vm_apply(VmCpu *vc, VmShootdown *sd) {
+	vc->shootdowns++;
+	if (sd->kind == VmShootLeave) {
+		if (vc->current->id == sd->as_id) {
+			vm_load(vc, &vm_kernel, false);
+		}
+		return;
+	}
+
+	for (uint32_t s = 0; s < VM_PCID_SLOTS; s++) {
+		VmSlot *slot = &vc->slots[s];
+		if (slot->as_id != sd->as_id || (!vm_pcid && s != vc->current_slot)) {
+			continue;
+		}
+		if (!vm_flush_slot(vc, s, sd->start, sd->end)) {
+			slot->tlb_gen = 0;
+		} else if (slot->tlb_gen + 1 == sd->gen) {
+			// Only when every earlier unmap is already accounted for
+			slot->tlb_gen = sd->gen;
+		}
+	}
+}
+
+// Answers whatever other CPUs queued here. Cheap when nothing is
+void vm_poll(void) {
+	VmCpu *vc = this_cpu()->vm;
+	if (!vc || __atomic_load_n(&vc->done, __ATOMIC_ACQUIRE) == __atomic_load_n(&vc->queued, __ATOMIC_ACQUIRE)) {
+		return;
+	}
+
+	uint64_t flags = irq_save();
+	VmShootdown taken[VM_QUEUE_SIZE];
+	spin_lock(&vc->lock);
+	uint32_t count = vc->count;
+	uint64_t ticket = vc->queued;
+	memcpy(taken, vc->queue, count * sizeof(VmShootdown));
+	vc->count = 0;
+	vc->kicked = false;
+	spin_unlock(&vc->lock);
+
+	for (uint32_t i = 0; i < count; i++) {
+		vm_apply(vc, &taken[i]);
+	}
+
+	__atomic_store_n(&vc->done, ticket, __ATOMIC_RELEASE);
+	irq_restore(flags);
+}
+
+static void vm_shootdown_handler(InterruptFrame *frame) {
+	lapic_eoi();
+	this_cpu()->vm->ipis_taken++;
+	vm_poll();
+}
+
+// Queues sd on every other CPU that has as loaded, interrupts the ones that
+// don't already have an IPI coming, then waits until all of them answered
+static void vm_shootdown(VmCpu *self, AddressSpace *as, VmShootdown *sd) {
+	uint64_t tickets[MAX_CPUS];
+	for (uint32_t i = 0; i < cpu_count; i++) {
+		VmCpu *vc = cpus[i]->vm;
+		tickets[i] = 0;
+		if (vc == self || __atomic_load_n(&vc->current, __ATOMIC_SEQ_CST) != as) {
+			continue;
+		}
+
+		spin_lock(&vc->lock);
+		while (vc->count == VM_QUEUE_SIZE) {
+			spin_unlock(&vc->lock);
+			vm_poll();
+			cpu_pause();
+			spin_lock(&vc->lock);
+		}
+		vc->queue[vc->count++] = *sd;
+		tickets[i] = ++vc->queued;
+		bool kick = !vc->kicked;
+		vc->kicked = true;
+		spin_unlock(&vc->lock);
+
+		if (kick) {
+			lapic_send_fixed(cpus[i]->apic_id, VM_SHOOTDOWN_VECTOR);
+			self->ipis_sent++;
+		}
+	}
+
+	// Answering our own queue meanwhile, whoever we wait on may be waiting on us
+	for (uint32_t i = 0; i < cpu_count; i++) {
+		while (tickets[i] && __atomic_load_n(&cpus[i]->vm->done, __ATOMIC_ACQUIRE) < tickets[i]) {
+			vm_poll();
+			cpu_pause();
+		}
+	}
+}
+
+// Loads as on this CPU, interrupts off. flush forces the PCID to start empty
+static void vm_load(VmCpu *vc, AddressSpace *as, bool flush) {
+	vc->switches++;
+	// Pairs with vm_batch_flush bumping tlb_gen, then vm_shootdown checking: either
+	// the unmapper sees this CPU on as, or this CPU sees the newer generation
+	__atomic_store_n(&vc->current, as, __ATOMIC_SEQ_CST);
+	uint64_t gen = __atomic_load_n(&as->tlb_gen, __ATOMIC_SEQ_CST);
+
+	if (!vm_pcid) {
+		vc->slots[0] = (VmSlot){ .as_id = as->id, .tlb_gen = gen };
+		vc->switch_flushes++;
+		write_cr3(as->root);
+		return;
+	}
+
+	uint32_t s = 0;
+	while (s < VM_PCID_SLOTS && vc->slots[s].as_id != as->id) {
+		s++;
+	}
+	if (s == VM_PCID_SLOTS) {
+		// Round robin over everything but the slot being left
+		s = vc->next_victim;
+		if (s == vc->current_slot) {
+			s = (s + 1) % VM_PCID_SLOTS;
+		}
+		vc->next_victim = (s + 1) % VM_PCID_SLOTS;
+		vc->slots[s] = (VmSlot){ .as_id = as->id };
+	}
+
+	flush = flush || vc->slots[s].tlb_gen != gen;
+	vc->slots[s].tlb_gen = gen;
+	vc->current_slot = s;
+	if (flush) {
+		vc->switch_flushes++;
+	}
+	write_cr3(as->root | s | (flush ? 0 : CR3_NOFLUSH));
+}
+
+// Makes as the calling CPU's address space, keeping it until the next switch
+void vm_switch(AddressSpace *as) {
+	uint64_t flags = irq_save();
+	VmCpu *vc = this_cpu()->vm;
+	if (vc->current != as) {
+		vm_load(vc, as, false);
+	}
+	irq_restore(flags);
+}
+
+// Invalidates everything in the batch on every CPU that might still use it,
+// then frees its frames and leaves it empty
+void vm_batch_flush(VmBatch *b) {
+	AddressSpace *as = b->as;
+	if (!as || b->start >= b->end) {
+		return;
+	}
+
+	uint64_t flags = irq_save();
+	VmCpu *self = this_cpu()->vm;
+	VmShootdown sd = {
+		.as_id = as->id,
+		.start = b->start,
+		.end = b->end,
+		.gen = __atomic_add_fetch(&as->tlb_gen, 1, __ATOMIC_SEQ_CST),
+		.kind = VmShootRange,
+	};
+	vm_apply(self, &sd);
+	vm_shootdown(self, as, &sd);
+	irq_restore(flags);
+
+	for (uint32_t i = 0; i < b->count; i++) {
+		pmm_free(b->frames[i], 0);
+	}
+	b->start = b->end = 0;
+	b->count = 0;
+}
+
+// Backs [virt, virt + size) with zeroed frames, page aligned and in the lower
+// half. Pages already mapped stay as they are. On failure what got mapped
+// stays mapped, for vm_unmap to take back
+bool vm_map_anon(AddressSpace *as, uint64_t virt, uint64_t size, uint64_t flags) {
+	if ((virt | size) & (PAGE_SIZE - 1) || virt < VM_USER_BASE || size > VM_USER_END - virt) {
+		return false;
+	}
+
+	bool ok = true;
+	spin_lock(&as->lock);
+	for (uint64_t end = virt + size; virt < end; virt += PAGE_SIZE) {
+		uint64_t *pte = vm_pte(as, virt, true);
+		if (!pte) {
+			ok = false;
+			break;
+		}
+		if (*pte & PTE_PRESENT) {
+			continue;
+		}
+		uint64_t frame = pmm_alloc_zeroed(0);
+		if (!frame) {
+			ok = false;
+			break;
+		}
+		*pte = frame | flags | PTE_PRESENT;
+	}
+	spin_unlock(&as->lock);
+	return ok;
+}
+
+// Unmaps [virt, virt + size) into b, which takes the frames and the range until
+// vm_batch_flush. A full batch, or one for another space, is flushed first
+void vm_unmap(VmBatch *b, AddressSpace *as, uint64_t virt, uint64_t size) {
+	if (b->as != as) {
+		vm_batch_flush(b);
+		b->as = as;
+	}
+
+	uint64_t end = virt + size;
+	while (virt < end) {
+		// Not held across a flush, a CPU we'd wait on could be spinning on it
+		spin_lock(&as->lock);
+		for (; virt < end && b->count < VM_BATCH_PAGES; virt += PAGE_SIZE) {
+			uint64_t *pte = vm_pte(as, virt, false);
+			if (!pte || !(*pte & PTE_PRESENT)) {
+				continue;
+			}
+			b->frames[b->count++] = *pte & PTE_ADDR_MASK;
+			*pte = 0;
+			if (b->start >= b->end) {
+				b->start = virt;
+				b->end = virt + PAGE_SIZE;
+			} else {
+				b->start = virt < b->start ? virt : b->start;
+				b->end = virt + PAGE_SIZE > b->end ? virt + PAGE_SIZE : b->end;
+			}
+		}
+		spin_unlock(&as->lock);
+		if (b->count == VM_BATCH_PAGES) {
+			vm_batch_flush(b);
+		}
+	}
+}
+
+// An empty space, or NULL. Needs the heap
+AddressSpace *vm_create(void) {
+	AddressSpace *as = (AddressSpace *)kzalloc(sizeof(AddressSpace));
+	uint64_t root = pmm_alloc_zeroed(0);
+	if (!as || !root) {
+		kfree(as);
+		if (root) {
+			pmm_free(root, 0);
+		}
+		return NULL;
+	}
+
+	uint64_t *table = (uint64_t *)phys_to_virt(root);
+	uint64_t *kernel = (uint64_t *)phys_to_virt(vm_kernel.root);
+	table[0] = kernel[0];
+	for (uint32_t i = PT_ENTRIES / 2; i < PT_ENTRIES; i++) {
+		table[i] = kernel[i];
+	}
+	as->root = root;
+	as->id = __atomic_add_fetch(&vm_next_id, 1, __ATOMIC_RELAXED);
+	as->tlb_gen = 1;
+	return as;
+}
+
+static void vm_free_table(uint64_t phys, uint32_t level) {
+	uint64_t *table = (uint64_t *)phys_to_virt(phys);
+	for (uint32_t i = 0; i < PT_ENTRIES; i++) {
+		if (!(table[i] & PTE_PRESENT)) {
+			continue;
+		}
+		if (level > 1) {
+			vm_free_table(table[i] & PTE_ADDR_MASK, level - 1);
+		} else {
+			pmm_free(table[i] & PTE_ADDR_MASK, 0);
+		}
+	}
+	pmm_free(phys, 0);
+}
+
+// Moves every CPU still on as back to the kernel's space, then frees as with
+// all its tables and frames. Nothing may be using its lower half any more
+void vm_destroy(AddressSpace *as) {
+	uint64_t flags = irq_save();
+	VmCpu *self = this_cpu()->vm;
+	VmShootdown sd = { .as_id = as->id, .kind = VmShootLeave };
+	vm_apply(self, &sd);
+	vm_shootdown(self, as, &sd);
+	irq_restore(flags);
+
+	uint64_t *table = (uint64_t *)phys_to_virt(as->root);
+	for (uint32_t i = pt_index(VM_USER_BASE, 4); i < PT_ENTRIES / 2; i++) {
+		if (table[i] & PTE_PRESENT) {
+			vm_free_table(table[i] & PTE_ADDR_MASK, 3);
+		}
+	}
+	pmm_free(as->root, 0);
+	kfree(as);
+}
+
+// On the BSP before smp_init, which hands the state on to cpus[0] and starts
+// the APs with vm_cpu_init
+bool vm_init(BootInfo *info) {
+	CpuidRegs leaf1 = cpuid(1, 0);
+	vm_pcid = (leaf1.ecx >> 17) & 1;
+	vm_invpcid = vm_pcid && cpuid(0, 0).eax >= 7 && ((cpuid(7, 0).ebx >> 10) & 1);
+	vm_kernel = (AddressSpace){ .root = info->page_table_root, .id = vm_next_id, .tlb_gen = 1 };
+
+	PerCpu *cpu = this_cpu();
+	cpu->vm = vm_cpu_alloc(cpu->node);
+	if (!cpu->vm) {
+		return false;
+	}
+	vm_cpu_init();
+	idt_set_handler(VM_SHOOTDOWN_VECTOR, vm_shootdown_handler);
+	return true;
+}
+
+#ifdef VM_BENCH
+// Switch cost: the BSP cycles through VM_BENCH_SPACES spaces, reading
+// VM_BENCH_TOUCH pages in each after the switch, with PCID tags kept and with
+// every switch flushing. Unmap cost: every other CPU loads one space and goes
+// back to idle on it, then the BSP maps and unmaps VM_BENCH_CHUNK pages at a
+// time, once flushing the whole chunk as one batch and once page by page.
+// bench_vm.sh collects the lines from serial
+#define VM_BENCH_SPACES 4
+#define VM_BENCH_TOUCH 64
+#define VM_BENCH_SWITCHES 20000
+#define VM_BENCH_CHUNK 64
+#define VM_BENCH_ROUNDS 200
+#define VM_BENCH_JOIN_TIMEOUT_US 1000000
+
+typedef struct {
+	AddressSpace *as;
+	volatile uint32_t joined;
+} VmBenchJoin;
+
+static uint64_t vm_bench_switch(AddressSpace **spaces, bool flush) {
+	uint64_t flags = irq_save();
+	VmCpu *vc = this_cpu()->vm;
+	uint64_t start = rdtsc();
+	for (uint32_t i = 0; i < VM_BENCH_SWITCHES; i++) {
+		vm_load(vc, spaces[i % VM_BENCH_SPACES], flush);
+		for (uint32_t p = 0; p < VM_BENCH_TOUCH; p++) {
+			(void)*(volatile uint8_t *)(VM_USER_BASE + p * PAGE_SIZE);
+		}
+	}
+	uint64_t ticks = rdtsc() - start;
+	vm_load(vc, &vm_kernel, false);
+	irq_restore(flags);
+	return tsc_to_ns(ticks) / VM_BENCH_SWITCHES;
+}
+
+// Loads the space and waits for the rest, so each CPU gets exactly one. The CPU
+// then idles with the space still loaded
+static void vm_bench_join(void *arg, uint64_t lo, uint64_t hi) {
+	VmBenchJoin *join = (VmBenchJoin *)arg;
+	vm_switch(join->as);
+	__atomic_add_fetch(&join->joined, 1, __ATOMIC_ACQ_REL);
+	uint64_t start = rdtsc();
+	while (__atomic_load_n(&join->joined, __ATOMIC_ACQUIRE) < cpu_count - 1 &&
+		tsc_to_ns(rdtsc() - start) < VM_BENCH_JOIN_TIMEOUT_US * 1000) {
+		vm_poll();
+		cpu_pause();
+	}
+}
+
+static uint64_t vm_bench_ipis(void) {
+	uint64_t sent = 0;
+	for (uint32_t i = 0; i < cpu_count; i++) {
+		sent += cpus[i]->vm->ipis_sent;
+	}
+	return sent;
+}
+
+static void vm_bench_unmap(AddressSpace *as, bool batched) {
+	VmBatch b = { .as = as };
+	uint64_t ticks = 0;
+	uint64_t ipis = vm_bench_ipis();
+	for (uint32_t round = 0; round < VM_BENCH_ROUNDS; round++) {
+		if (!vm_map_anon(as, VM_USER_BASE, VM_BENCH_CHUNK * PAGE_SIZE, PTE_WRITE)) {
+			kprintf("vm_bench: no memory\n");
+			break;
+		}
+		uint64_t start = rdtsc();
+		for (uint32_t p = 0; p < VM_BENCH_CHUNK; p++) {
+			vm_unmap(&b, as, VM_USER_BASE + p * PAGE_SIZE, PAGE_SIZE);
+			if (!batched) {
+				vm_batch_flush(&b);
+			}
+		}
+		vm_batch_flush(&b);
+		ticks += rdtsc() - start;
+	}
+
+	uint64_t pages = (uint64_t)VM_BENCH_ROUNDS * VM_BENCH_CHUNK;
+	uint64_t sent = vm_bench_ipis() - ipis;
+	kprintf("vm_bench unmap %s ns_per_page %lu ipis %lu pages %lu\n", batched ? "batched" : "per_page",
+		tsc_to_ns(ticks) / pages, sent, pages);
+}
+
+void vm_bench(void) {
+	AddressSpace *spaces[VM_BENCH_SPACES];
+	for (uint32_t i = 0; i < VM_BENCH_SPACES; i++) {
+		spaces[i] = vm_create();
+		if (!spaces[i] || !vm_map_anon(spaces[i], VM_USER_BASE, VM_BENCH_TOUCH * PAGE_SIZE, 0)) {
+			kprintf("vm_bench: no memory\n");
+			return;
+		}
+	}
+
+	uint64_t tagged = vm_bench_switch(spaces, false);
+	uint64_t flushed = vm_bench_switch(spaces, true);
+	kprintf("vm_bench switch tagged %lu flushed %lu touch %u\n", tagged, flushed, VM_BENCH_TOUCH);
+
+	VmBenchJoin join = { .as = spaces[0] };
+	TaskGroup group = { 0 };
+	for (uint32_t i = 1; i < cpu_count; i++) {
+		sched_spawn(&group, vm_bench_join, &join);
+	}
+	// Stolen by the other CPUs, the BSP stays out of it
+	uint64_t start = rdtsc();
+	while (__atomic_load_n(&join.joined, __ATOMIC_ACQUIRE) < cpu_count - 1 &&
+		tsc_to_ns(rdtsc() - start) < VM_BENCH_JOIN_TIMEOUT_US * 1000) {
+		vm_poll();
+		cpu_pause();
+	}
+	sched_wait(&group);
+	vm_switch(spaces[0]);
+
+	vm_bench_unmap(spaces[0], true);
+	vm_bench_unmap(spaces[0], false);
+
+	vm_switch(&vm_kernel);
+	uint64_t switches = 0, switch_flushes = 0, shootdowns = 0, taken = 0;
+	for (uint32_t i = 0; i < cpu_count; i++) {
+		VmCpu *vc = cpus[i]->vm;
+		switches += vc->switches;
+		switch_flushes += vc->switch_flushes;
+		shootdowns += vc->shootdowns;
+		taken += vc->ipis_taken;
+	}
+	for (uint32_t i = 0; i < VM_BENCH_SPACES; i++) {
+		vm_destroy(spaces[i]);
+	}
+	kprintf("vm_bench switches %lu flushing %lu shootdowns %lu ipis_taken %lu\n", switches, switch_flushes, shootdowns, taken);
+	kprintf("vm_bench end (pcid %s, invpcid %s, %u CPUs on %u)\n", vm_pcid ? "on" : "off", vm_invpcid ? "on" : "off",
+		join.joined + 1, cpu_count);
+}
+#endif